@@ -0,0 +1,512 @@
+/*
+OBS Linux Vulkan/OpenGL game capture
+Copyright (C) 2021 David Rosca <nowrep@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+/* Stand-in for the OBS plugin, speaks the capture.h protocol to a single
+ * client and reports what capture costs it. Runs through the phases
+ *
+ *   idle -> capture -> reinit (downscaled) -> capture -> idle
+ *
+ * each lasting -t seconds. It listens on the same socket as the plugin,
+ * so OBS must not be running. */
+
+#define _GNU_SOURCE
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/dma-buf.h>
+
+enum phase {
+    PHASE_IDLE,
+    PHASE_CAPTURE,
+    PHASE_REINIT,
+    PHASE_CAPTURE_AGAIN,
+    PHASE_DONE,
+};
+
+static const char *phase_names[] = {
+    "idle", "capture", "reinit", "capture", "idle",
+};
+
+struct bench_slot {
+    int fds[4];
+    void *map;
+    size_t map_size;
+};
+
+static struct {
+    int sockfd;
+    int connfd;
+    bool map;
+    bool memfd;
+    int phase_seconds;
+
+    struct capture_client_data cdata;
+    struct capture_texture_data tdata;
+    struct bench_slot slots[CAPTURE_MAX_SLOTS];
+    int nslots;
+    uint8_t *readback;
+
+    struct capture_control_shm *control_shm;
+    struct capture_control_data control;
+    struct capture_alloc_hint hint;
+    struct capture_announce *announce;
+    int announce_index;
+
+    enum phase phase;
+    int64_t phase_start;
+    /* time the current request went out, 0 once its first frame arrived */
+    int64_t request_time;
+    bool texture_seen;
+
+    uint32_t frames;
+    /* present to arrival here, from capture_frame_data.present_time */
+    uint64_t latency_total;
+    uint64_t latency_max;
+    uint32_t latency_count;
+    uint64_t read_time;
+    uint32_t reads;
+    struct capture_stats_data stats;
+} bench;
+
+static int64_t clock_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static bool bench_listen()
+{
+    /* next to a running OBS the bench takes the next free socket */
+    struct sockaddr_un addr;
+    int index = 0;
+    bench.sockfd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    for (; index < CAPTURE_MAX_SERVERS; ++index) {
+        const socklen_t addr_len = capture_socket_addr(&addr, index);
+        if (bind(bench.sockfd, (const struct sockaddr *)&addr, addr_len) == 0) {
+            break;
+        }
+        if (errno != EADDRINUSE || index == CAPTURE_MAX_SERVERS - 1) {
+            fprintf(stderr, "Cannot bind socket %s\n", strerror(errno));
+            return false;
+        }
+    }
+    listen(bench.sockfd, 1);
+
+    /* wake clients that are dormant because no OBS is running */
+    int fd = open(CAPTURE_ANNOUNCE_PATH, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == getuid()) {
+        fchmod(fd, 0644);
+        if (st.st_size >= CAPTURE_ANNOUNCE_SIZE || ftruncate(fd, CAPTURE_ANNOUNCE_SIZE) == 0) {
+            void *map = mmap(NULL, CAPTURE_ANNOUNCE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                bench.announce = map;
+                bench.announce_index = index;
+                __atomic_store_n(&bench.announce->server_pid[index], (uint32_t)getpid(), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return true;
+}
+
+static void send_control(bool with_shm)
+{
+    if (bench.control_shm) {
+        capture_control_shm_write(bench.control_shm, &bench.control, &bench.hint);
+    }
+    if (!with_shm && bench.control_shm) {
+        return;
+    }
+
+    struct msghdr msg = {0};
+    struct iovec io = {
+        .iov_base = &bench.control,
+        .iov_len = CAPTURE_CONTROL_DATA_SIZE,
+    };
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    int fd = -1;
+    if (with_shm) {
+        fd = memfd_create("vkcapture-bench-control", MFD_CLOEXEC);
+        if (fd >= 0 && ftruncate(fd, CAPTURE_CONTROL_SHM_SIZE) == 0) {
+            void *map = mmap(NULL, CAPTURE_CONTROL_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                bench.control_shm = map;
+                capture_control_shm_write(bench.control_shm, &bench.control, &bench.hint);
+                msg.msg_control = cmsg_buf;
+                msg.msg_controllen = CMSG_SPACE(sizeof(int));
+                struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+            }
+        }
+    }
+
+    if (sendmsg(bench.connfd, &msg, MSG_NOSIGNAL) < 0) {
+        fprintf(stderr, "Socket sendmsg error %s\n", strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void close_slots()
+{
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        struct bench_slot *slot = &bench.slots[s];
+        if (slot->map) {
+            munmap(slot->map, slot->map_size);
+            slot->map = NULL;
+        }
+        for (int i = 0; i < 4; ++i) {
+            if (slot->fds[i] >= 0) {
+                close(slot->fds[i]);
+                slot->fds[i] = -1;
+            }
+        }
+    }
+    bench.nslots = 0;
+    free(bench.readback);
+    bench.readback = NULL;
+}
+
+static void enter_phase(enum phase phase)
+{
+    const int64_t now = clock_ns();
+    bench.phase = phase;
+    bench.phase_start = now;
+
+    const bool capturing = phase == PHASE_CAPTURE || phase == PHASE_REINIT ||
+        phase == PHASE_CAPTURE_AGAIN;
+    if (capturing != bench.control.capturing || phase == PHASE_REINIT ||
+            phase == PHASE_CAPTURE_AGAIN) {
+        bench.request_time = capturing ? now : 0;
+        bench.texture_seen = false;
+    }
+
+    bench.control.capturing = capturing;
+    bench.control.linear = bench.map;
+    bench.control.map_host = bench.map;
+    bench.control.memfd = bench.memfd;
+    bench.control.output_width = 0;
+    bench.control.output_height = 0;
+    if (phase == PHASE_REINIT && bench.tdata.width > 1 && bench.tdata.height > 1) {
+        bench.control.output_width = bench.tdata.width / 2;
+        bench.control.output_height = bench.tdata.height / 2;
+    }
+    if (!capturing) {
+        close_slots();
+    }
+
+    printf("--- %s\n", phase_names[phase]);
+    send_control(false);
+}
+
+static void handle_texture(const struct capture_texture_data *td, int *fds, size_t nfd)
+{
+    if (td->slot == 0) {
+        close_slots();
+        bench.tdata = *td;
+    }
+
+    struct bench_slot *slot = &bench.slots[td->slot];
+    for (size_t i = 0; i < 4; ++i) {
+        slot->fds[i] = i < nfd ? fds[i] : -1;
+    }
+    if (bench.map && slot->fds[0] >= 0) {
+        const off_t size = lseek(slot->fds[0], 0, SEEK_END);
+        const int prot = td->memfd ? PROT_READ | PROT_WRITE : PROT_READ;
+        void *map = size > 0 ? mmap(NULL, size, prot, MAP_SHARED, slot->fds[0], 0) : MAP_FAILED;
+        if (map != MAP_FAILED) {
+            slot->map = map;
+            slot->map_size = size;
+        }
+    }
+    if (td->slot == td->nslots - 1 || !td->nslots) {
+        bench.nslots = td->nslots ? td->nslots : 1;
+        bench.texture_seen = true;
+        printf("texture %dx%d (game %dx%d) format %.4s modifier 0x%" PRIx64 " slots %d%s\n",
+                td->width, td->height, td->source_width, td->source_height,
+                (const char *)&td->format, td->modifier, bench.nslots,
+                td->memfd ? " memfd" : "");
+        if (bench.map) {
+            bench.readback = malloc((size_t)td->strides[0] * td->height);
+        }
+    }
+}
+
+/* Reads the slot like the plugin's host mapped path does */
+static void read_slot(int s, uint64_t seq, int sync_fd)
+{
+    struct bench_slot *slot = &bench.slots[s];
+    if (!slot->map || !bench.readback) {
+        return;
+    }
+
+    const int64_t start = clock_ns();
+    if (sync_fd >= 0) {
+        struct pollfd pfd = {sync_fd, POLLIN, 0};
+        poll(&pfd, 1, 1000);
+    }
+    struct capture_memfd_header *header = bench.tdata.memfd ? slot->map : NULL;
+    if (header) {
+        __atomic_store_n(&header->reading, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->seq, __ATOMIC_SEQ_CST) != seq) {
+            __atomic_store_n(&header->reading, 0, __ATOMIC_SEQ_CST);
+            return;
+        }
+    }
+    struct dma_buf_sync sync = {DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ};
+    if (!header) {
+        ioctl(slot->fds[0], DMA_BUF_IOCTL_SYNC, &sync);
+    }
+    const size_t size = (size_t)bench.tdata.strides[0] * bench.tdata.height;
+    const size_t avail = slot->map_size - bench.tdata.offsets[0];
+    memcpy(bench.readback, (uint8_t *)slot->map + bench.tdata.offsets[0],
+            size < avail ? size : avail);
+    if (header) {
+        __atomic_store_n(&header->reading, 0, __ATOMIC_SEQ_CST);
+    } else {
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+        ioctl(slot->fds[0], DMA_BUF_IOCTL_SYNC, &sync);
+    }
+
+    bench.read_time += clock_ns() - start;
+    bench.reads++;
+}
+
+static void handle_frame(const struct capture_frame_data *frame, int sync_fd)
+{
+    if (frame->slot < bench.nslots) {
+        bench.frames++;
+        if (frame->present_time) {
+            const int64_t latency = clock_ns() - (int64_t)frame->present_time;
+            if (latency > 0) {
+                bench.latency_total += latency;
+                bench.latency_count++;
+                if ((uint64_t)latency > bench.latency_max) {
+                    bench.latency_max = latency;
+                }
+            }
+        }
+        if (bench.request_time && bench.texture_seen) {
+            const double ms = (clock_ns() - bench.request_time) / 1000000.0;
+            printf("%s: first frame after %.1f ms\n",
+                    bench.phase == PHASE_CAPTURE ? "start" : "reinit", ms);
+            bench.request_time = 0;
+        }
+        read_slot(frame->slot, frame->seq, sync_fd);
+    }
+    if (sync_fd >= 0) {
+        close(sync_fd);
+    }
+}
+
+/* Returns false when the client went away */
+static bool handle_messages()
+{
+    while (true) {
+        uint8_t buf[CAPTURE_TEXTURE_DATA_SIZE];
+        struct iovec io = {
+            .iov_base = buf,
+            .iov_len = sizeof(buf),
+        };
+        char cmsg_buf[CMSG_SPACE(sizeof(int) * 4)];
+        struct msghdr msg = {0};
+        msg.msg_iov = &io;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cmsg_buf;
+        msg.msg_controllen = sizeof(cmsg_buf);
+
+        const ssize_t n = recvmsg(bench.connfd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (n == 0) {
+            return false;
+        }
+
+        int fds[4];
+        size_t nfd = 0;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfd = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            nfd = nfd > 4 ? 4 : nfd;
+            memcpy(fds, CMSG_DATA(cmsg), nfd * sizeof(int));
+        }
+
+        if (n != 128) {
+            fprintf(stderr, "Unexpected message size %zd\n", n);
+        } else if (buf[0] == CAPTURE_CLIENT_DATA_TYPE) {
+            memcpy(&bench.cdata, buf, sizeof(bench.cdata));
+            printf("client %s\n", bench.cdata.exe);
+            if (bench.cdata.version != CAPTURE_PROTOCOL_VERSION) {
+                fprintf(stderr, "Client speaks protocol version %u, expected %u\n",
+                        bench.cdata.version, CAPTURE_PROTOCOL_VERSION);
+                return false;
+            }
+            if (bench.cdata.flags & CAPTURE_CLIENT_FLAG_CONTROL_SHM) {
+                send_control(true);
+            }
+            continue;
+        } else if (buf[0] == CAPTURE_TEXTURE_DATA_TYPE) {
+            const struct capture_texture_data *td = (const struct capture_texture_data *)buf;
+            if (td->slot < CAPTURE_MAX_SLOTS) {
+                handle_texture(td, fds, nfd);
+                continue;
+            }
+        } else if (buf[0] == CAPTURE_FRAME_DATA_TYPE) {
+            handle_frame((const struct capture_frame_data *)buf, nfd ? fds[0] : -1);
+            continue;
+        } else if (buf[0] == CAPTURE_STATS_DATA_TYPE) {
+            memcpy(&bench.stats, buf, sizeof(bench.stats));
+        }
+
+        for (size_t i = 0; i < nfd; ++i) {
+            close(fds[i]);
+        }
+    }
+}
+
+static void report()
+{
+    const struct capture_stats_data *st = &bench.stats;
+    printf("%-8s frames %4u", phase_names[bench.phase], bench.frames);
+    if (st->type == CAPTURE_STATS_DATA_TYPE && bench.control.capturing) {
+        printf(" | copied %u skipped %u | copy p50 %.3f p99 %.3f ms%s | present +%.3f p99 +%.3f ms | init %.1f ms",
+                st->frames_copied, st->frames_skipped,
+                st->copy_p50 / 1000.0, st->copy_p99 / 1000.0,
+                st->gpu_copy_time ? " (GPU)" : "",
+                st->present_p50 / 1000.0, st->present_p99 / 1000.0,
+                st->init_time / 1000.0);
+    }
+    if (bench.latency_count) {
+        printf(" | latency %.3f max %.3f ms",
+                bench.latency_total / 1000000.0 / bench.latency_count,
+                bench.latency_max / 1000000.0);
+    }
+    if (bench.reads) {
+        printf(" | read %.3f ms", bench.read_time / 1000000.0 / bench.reads);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    bench.frames = 0;
+    bench.latency_total = 0;
+    bench.latency_max = 0;
+    bench.latency_count = 0;
+    bench.reads = 0;
+    bench.read_time = 0;
+    memset(&bench.stats, 0, sizeof(bench.stats));
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-t seconds per phase] [-m] [-f]\n", name);
+    printf("  -m  request linear host mapped buffers and read every frame\n");
+    printf("  -f  request memfd slots in system memory and read every frame\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench.phase_seconds = 5;
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        memset(bench.slots[s].fds, -1, sizeof(bench.slots[s].fds));
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:mfh")) != -1) {
+        switch (opt) {
+        case 't':
+            bench.phase_seconds = atoi(optarg) > 0 ? atoi(optarg) : 1;
+            break;
+        case 'm':
+            bench.map = true;
+            break;
+        case 'f':
+            bench.map = true;
+            bench.memfd = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (!bench_listen()) {
+        return 1;
+    }
+
+    printf("Waiting for a client, start the benchmark app with OBS_VKCAPTURE=1\n");
+    bench.connfd = accept4(bench.sockfd, NULL, NULL, SOCK_CLOEXEC);
+    if (bench.connfd < 0) {
+        fprintf(stderr, "accept failed %s\n", strerror(errno));
+        return 1;
+    }
+
+    enter_phase(PHASE_IDLE);
+    int64_t last_report = clock_ns();
+
+    while (bench.phase != PHASE_DONE) {
+        struct pollfd pfd = {bench.connfd, POLLIN, 0};
+        poll(&pfd, 1, 100);
+        if (!handle_messages()) {
+            printf("Client disconnected\n");
+            break;
+        }
+
+        const int64_t now = clock_ns();
+        if (now - last_report >= 1000000000) {
+            report();
+            last_report = now;
+        }
+        if (now - bench.phase_start >= (int64_t)bench.phase_seconds * 1000000000) {
+            enter_phase(bench.phase + 1);
+        }
+    }
+
+    close_slots();
+    close(bench.connfd);
+    close(bench.sockfd);
+    if (bench.announce) {
+        __atomic_store_n(&bench.announce->server_pid[bench.announce_index], 0, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+OBS Linux Vulkan/OpenGL game capture
+Copyright (C) 2021 David Rosca <nowrep@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+/* OpenGL counterpart of vkcapture-bench. Clears an EGL pbuffer and calls
+ * eglSwapBuffers in a loop, printing frame times and the CPU time of the
+ * swap every second. Uses the Mesa surfaceless platform when available so
+ * no display server is needed. Run it through obs-gamecapture to measure
+ * the GL capture. */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+
+#define MAX_SAMPLES 4096
+
+static struct {
+    int width;
+    int height;
+    int rate;
+    int seconds;
+
+    EGLDisplay display;
+    EGLContext context;
+    EGLSurface surface;
+
+    int64_t frame_times[MAX_SAMPLES];
+    int64_t swap_times[MAX_SAMPLES];
+    uint32_t samples;
+} bench;
+
+static int64_t clock_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report()
+{
+    if (!bench.samples) {
+        return;
+    }
+    int64_t frame_total = 0;
+    int64_t swap_total = 0;
+    for (uint32_t i = 0; i < bench.samples; ++i) {
+        frame_total += bench.frame_times[i];
+        swap_total += bench.swap_times[i];
+    }
+    qsort(bench.frame_times, bench.samples, sizeof(int64_t), cmp_int64);
+    qsort(bench.swap_times, bench.samples, sizeof(int64_t), cmp_int64);
+    const uint32_t p99 = bench.samples * 99 / 100;
+
+    printf("fps %4u | frame %.3f p99 %.3f ms | swap %.3f p99 %.3f max %.3f ms\n",
+            bench.samples,
+            frame_total / 1000000.0 / bench.samples,
+            bench.frame_times[p99] / 1000000.0,
+            swap_total / 1000000.0 / bench.samples,
+            bench.swap_times[p99] / 1000000.0,
+            bench.swap_times[bench.samples - 1] / 1000000.0);
+    fflush(stdout);
+    bench.samples = 0;
+}
+
+static EGLDisplay get_display()
+{
+    const char *exts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (exts && strstr(exts, "EGL_MESA_platform_surfaceless")) {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (get_platform_display) {
+            EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+            if (display != EGL_NO_DISPLAY) {
+                return display;
+            }
+        }
+    }
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+static bool init_egl()
+{
+    bench.display = get_display();
+    if (bench.display == EGL_NO_DISPLAY || !eglInitialize(bench.display, NULL, NULL)) {
+        fprintf(stderr, "Failed to initialize EGL\n");
+        return false;
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        fprintf(stderr, "Failed to bind OpenGL API\n");
+        return false;
+    }
+
+    const EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_NONE,
+    };
+    EGLConfig config;
+    EGLint nconfigs = 0;
+    if (!eglChooseConfig(bench.display, config_attribs, &config, 1, &nconfigs) || !nconfigs) {
+        fprintf(stderr, "No EGL config with pbuffer support\n");
+        return false;
+    }
+
+    bench.context = eglCreateContext(bench.display, config, EGL_NO_CONTEXT, NULL);
+    if (bench.context == EGL_NO_CONTEXT) {
+        fprintf(stderr, "Failed to create EGL context\n");
+        return false;
+    }
+
+    const EGLint surface_attribs[] = {
+        EGL_WIDTH, bench.width,
+        EGL_HEIGHT, bench.height,
+        EGL_NONE,
+    };
+    bench.surface = eglCreatePbufferSurface(bench.display, config, surface_attribs);
+    if (bench.surface == EGL_NO_SURFACE) {
+        fprintf(stderr, "Failed to create pbuffer\n");
+        return false;
+    }
+
+    eglMakeCurrent(bench.display, bench.surface, bench.surface, bench.context);
+    printf("renderer %s, %dx%d\n", (const char *)glGetString(GL_RENDERER), bench.width, bench.height);
+    return true;
+}
+
+static void run()
+{
+    const int64_t interval = bench.rate > 0 ? 1000000000 / bench.rate : 0;
+    const int64_t start = clock_ns();
+    int64_t last_frame = start;
+    int64_t last_report = start;
+    int64_t deadline = start;
+
+    eglSwapInterval(bench.display, 0);
+    glViewport(0, 0, bench.width, bench.height);
+
+    for (uint64_t n = 0; ; ++n) {
+        /* Cycle the colour so every frame really differs */
+        const float t = (n % 256) / 255.0f;
+        glClearColor(t, 1.0f - t, 0.5f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        const int64_t swap_start = clock_ns();
+        eglSwapBuffers(bench.display, bench.surface);
+        const int64_t now = clock_ns();
+
+        if (bench.samples < MAX_SAMPLES) {
+            bench.frame_times[bench.samples] = now - last_frame;
+            bench.swap_times[bench.samples] = now - swap_start;
+            bench.samples++;
+        }
+        last_frame = now;
+
+        if (now - last_report >= 1000000000) {
+            report();
+            last_report = now;
+        }
+        if (bench.seconds && now - start >= (int64_t)bench.seconds * 1000000000) {
+            break;
+        }
+
+        if (interval) {
+            deadline += interval;
+            if (deadline < now) {
+                deadline = now;
+            }
+            struct timespec ts = {deadline / 1000000000, deadline % 1000000000};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+    }
+
+    glFinish();
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-w width] [-h height] [-r fps] [-n seconds]\n", name);
+    printf("  -r  frame rate limit, 0 for none (default 0)\n");
+    printf("  -n  run time in seconds, 0 for none (default 10)\n");
+}
+
+int main(int argc, char **argv)
+{
+    bench.width = 1920;
+    bench.height = 1080;
+    bench.seconds = 10;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:h:r:n:")) != -1) {
+        switch (opt) {
+        case 'w':
+            bench.width = atoi(optarg);
+            break;
+        case 'h':
+            bench.height = atoi(optarg);
+            break;
+        case 'r':
+            bench.rate = atoi(optarg);
+            break;
+        case 'n':
+            bench.seconds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (bench.width <= 0 || bench.height <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!init_egl()) {
+        return 1;
+    }
+    run();
+
+    eglMakeCurrent(bench.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroySurface(bench.display, bench.surface);
+    eglDestroyContext(bench.display, bench.context);
+    eglTerminate(bench.display);
+    return 0;
+}
@@ -0,0 +1,478 @@
+/*
+OBS Linux Vulkan/OpenGL game capture
+Copyright (C) 2021 David Rosca <nowrep@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+/* Minimal Vulkan "game" for measuring what the layer costs. Presents
+ * cleared frames to a headless surface, so it runs without a compositor,
+ * and prints frame times and the CPU time spent in vkQueuePresentKHR
+ * every second. Run once plain and once with OBS_VKCAPTURE=1 to compare,
+ * with OBS or vkcapture-benchserver on the other end. */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <vulkan/vulkan.h>
+
+#define FRAMES_IN_FLIGHT 2
+#define MAX_IMAGES 8
+#define MAX_SAMPLES 4096
+
+#define CHECK(x) \
+    do { \
+        VkResult res_ = (x); \
+        if (res_ != VK_SUCCESS) { \
+            fprintf(stderr, "%s failed: %d\n", #x, res_); \
+            exit(1); \
+        } \
+    } while (0)
+
+struct frame {
+    VkCommandBuffer cmd;
+    VkFence fence;
+    VkSemaphore acquired;
+    VkSemaphore rendered;
+};
+
+static struct {
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    VkPresentModeKHR present_mode;
+    int rate;
+    int seconds;
+
+    VkInstance inst;
+    VkPhysicalDevice phys;
+    VkDevice device;
+    uint32_t queue_family;
+    VkQueue queue;
+    VkSurfaceKHR surface;
+    VkSwapchainKHR swapchain;
+    VkImage images[MAX_IMAGES];
+    uint32_t image_count;
+    VkCommandPool pool;
+    struct frame frames[FRAMES_IN_FLIGHT];
+
+    int64_t frame_times[MAX_SAMPLES];
+    int64_t present_times[MAX_SAMPLES];
+    uint32_t samples;
+} bench;
+
+static int64_t clock_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report()
+{
+    if (!bench.samples) {
+        return;
+    }
+    int64_t frame_total = 0;
+    int64_t present_total = 0;
+    for (uint32_t i = 0; i < bench.samples; ++i) {
+        frame_total += bench.frame_times[i];
+        present_total += bench.present_times[i];
+    }
+    qsort(bench.frame_times, bench.samples, sizeof(int64_t), cmp_int64);
+    qsort(bench.present_times, bench.samples, sizeof(int64_t), cmp_int64);
+    const uint32_t p99 = bench.samples * 99 / 100;
+
+    printf("fps %4u | frame %.3f p99 %.3f ms | present %.3f p99 %.3f max %.3f ms\n",
+            bench.samples,
+            frame_total / 1000000.0 / bench.samples,
+            bench.frame_times[p99] / 1000000.0,
+            present_total / 1000000.0 / bench.samples,
+            bench.present_times[p99] / 1000000.0,
+            bench.present_times[bench.samples - 1] / 1000000.0);
+    fflush(stdout);
+    bench.samples = 0;
+}
+
+static void create_instance()
+{
+    const char *extensions[] = {
+        VK_KHR_SURFACE_EXTENSION_NAME,
+        VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME,
+    };
+    VkApplicationInfo app = {
+        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .pApplicationName = "vkcapture-bench",
+        .apiVersion = VK_API_VERSION_1_1,
+    };
+    VkInstanceCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pApplicationInfo = &app,
+        .enabledExtensionCount = sizeof(extensions) / sizeof(extensions[0]),
+        .ppEnabledExtensionNames = extensions,
+    };
+    CHECK(vkCreateInstance(&info, NULL, &bench.inst));
+
+    VkHeadlessSurfaceCreateInfoEXT surf_info = {
+        .sType = VK_STRUCTURE_TYPE_HEADLESS_SURFACE_CREATE_INFO_EXT,
+    };
+    CHECK(vkCreateHeadlessSurfaceEXT(bench.inst, &surf_info, NULL, &bench.surface));
+}
+
+static void create_device()
+{
+    VkPhysicalDevice devices[16];
+    uint32_t count = 16;
+    vkEnumeratePhysicalDevices(bench.inst, &count, devices);
+
+    for (uint32_t d = 0; d < count && !bench.phys; ++d) {
+        VkQueueFamilyProperties families[16];
+        uint32_t nfamilies = 16;
+        vkGetPhysicalDeviceQueueFamilyProperties(devices[d], &nfamilies, families);
+        for (uint32_t f = 0; f < nfamilies; ++f) {
+            VkBool32 supported = VK_FALSE;
+            vkGetPhysicalDeviceSurfaceSupportKHR(devices[d], f, bench.surface, &supported);
+            if ((families[f].queueFlags & VK_QUEUE_GRAPHICS_BIT) && supported) {
+                bench.phys = devices[d];
+                bench.queue_family = f;
+                break;
+            }
+        }
+    }
+    if (!bench.phys) {
+        fprintf(stderr, "No device can present to a headless surface\n");
+        exit(1);
+    }
+
+    VkPhysicalDeviceProperties props;
+    vkGetPhysicalDeviceProperties(bench.phys, &props);
+    printf("device %s\n", props.deviceName);
+
+    const float priority = 1.0f;
+    VkDeviceQueueCreateInfo queue_info = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = bench.queue_family,
+        .queueCount = 1,
+        .pQueuePriorities = &priority,
+    };
+    const char *extensions[] = {
+        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    };
+    VkDeviceCreateInfo info = {
+        .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .queueCreateInfoCount = 1,
+        .pQueueCreateInfos = &queue_info,
+        .enabledExtensionCount = 1,
+        .ppEnabledExtensionNames = extensions,
+    };
+    CHECK(vkCreateDevice(bench.phys, &info, NULL, &bench.device));
+    vkGetDeviceQueue(bench.device, bench.queue_family, 0, &bench.queue);
+}
+
+static void create_swapchain()
+{
+    VkSurfaceCapabilitiesKHR caps;
+    CHECK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(bench.phys, bench.surface, &caps));
+
+    VkSurfaceFormatKHR formats[64];
+    uint32_t nformats = 64;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(bench.phys, bench.surface, &nformats, formats);
+    VkSurfaceFormatKHR format = formats[0];
+    for (uint32_t i = 0; i < nformats; ++i) {
+        if (formats[i].format == bench.format) {
+            format = formats[i];
+            break;
+        }
+    }
+    if (format.format != bench.format) {
+        fprintf(stderr, "Format %d not supported, using %d\n", bench.format, format.format);
+    }
+
+    uint32_t image_count = caps.minImageCount > 3 ? caps.minImageCount : 3;
+    if (caps.maxImageCount && image_count > caps.maxImageCount) {
+        image_count = caps.maxImageCount;
+    }
+
+    VkSwapchainCreateInfoKHR info = {
+        .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+        .surface = bench.surface,
+        .minImageCount = image_count,
+        .imageFormat = format.format,
+        .imageColorSpace = format.colorSpace,
+        .imageExtent = {bench.width, bench.height},
+        .imageArrayLayers = 1,
+        .imageUsage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+        .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR,
+        .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
+        .presentMode = bench.present_mode,
+        .clipped = VK_TRUE,
+    };
+    CHECK(vkCreateSwapchainKHR(bench.device, &info, NULL, &bench.swapchain));
+
+    bench.image_count = MAX_IMAGES;
+    CHECK(vkGetSwapchainImagesKHR(bench.device, bench.swapchain, &bench.image_count, bench.images));
+    printf("swapchain %ux%u format %d images %u\n", bench.width, bench.height,
+            format.format, bench.image_count);
+}
+
+static void create_frames()
+{
+    VkCommandPoolCreateInfo pool_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = bench.queue_family,
+    };
+    CHECK(vkCreateCommandPool(bench.device, &pool_info, NULL, &bench.pool));
+
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+        struct frame *frame = &bench.frames[i];
+        VkCommandBufferAllocateInfo cmd_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = bench.pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+        CHECK(vkAllocateCommandBuffers(bench.device, &cmd_info, &frame->cmd));
+
+        VkFenceCreateInfo fence_info = {
+            .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+            .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+        };
+        CHECK(vkCreateFence(bench.device, &fence_info, NULL, &frame->fence));
+
+        VkSemaphoreCreateInfo sem_info = {
+            .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        };
+        CHECK(vkCreateSemaphore(bench.device, &sem_info, NULL, &frame->acquired));
+        CHECK(vkCreateSemaphore(bench.device, &sem_info, NULL, &frame->rendered));
+    }
+}
+
+static void record(struct frame *frame, VkImage image, uint64_t n)
+{
+    VkCommandBufferBeginInfo begin = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    vkBeginCommandBuffer(frame->cmd, &begin);
+
+    VkImageSubresourceRange range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .levelCount = 1,
+        .layerCount = 1,
+    };
+    VkImageMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange = range,
+    };
+    vkCmdPipelineBarrier(frame->cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+
+    /* Cycle the colour so every frame really differs */
+    const float t = (n % 256) / 255.0f;
+    VkClearColorValue color = {
+        .float32 = {t, 1.0f - t, 0.5f, 1.0f},
+    };
+    vkCmdClearColorImage(frame->cmd, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            &color, 1, &range);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = 0;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    vkCmdPipelineBarrier(frame->cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0, NULL, 1, &barrier);
+
+    vkEndCommandBuffer(frame->cmd);
+}
+
+static void run()
+{
+    const int64_t interval = bench.rate > 0 ? 1000000000 / bench.rate : 0;
+    const int64_t start = clock_ns();
+    int64_t last_frame = start;
+    int64_t last_report = start;
+    int64_t deadline = start;
+
+    for (uint64_t n = 0; ; ++n) {
+        struct frame *frame = &bench.frames[n % FRAMES_IN_FLIGHT];
+        vkWaitForFences(bench.device, 1, &frame->fence, VK_TRUE, UINT64_MAX);
+        vkResetFences(bench.device, 1, &frame->fence);
+
+        uint32_t index;
+        CHECK(vkAcquireNextImageKHR(bench.device, bench.swapchain, UINT64_MAX,
+                    frame->acquired, VK_NULL_HANDLE, &index));
+
+        record(frame, bench.images[index], n);
+
+        const VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        VkSubmitInfo submit = {
+            .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &frame->acquired,
+            .pWaitDstStageMask = &wait_stage,
+            .commandBufferCount = 1,
+            .pCommandBuffers = &frame->cmd,
+            .signalSemaphoreCount = 1,
+            .pSignalSemaphores = &frame->rendered,
+        };
+        CHECK(vkQueueSubmit(bench.queue, 1, &submit, frame->fence));
+
+        VkPresentInfoKHR present = {
+            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+            .waitSemaphoreCount = 1,
+            .pWaitSemaphores = &frame->rendered,
+            .swapchainCount = 1,
+            .pSwapchains = &bench.swapchain,
+            .pImageIndices = &index,
+        };
+        const int64_t present_start = clock_ns();
+        CHECK(vkQueuePresentKHR(bench.queue, &present));
+        const int64_t now = clock_ns();
+
+        if (bench.samples < MAX_SAMPLES) {
+            bench.frame_times[bench.samples] = now - last_frame;
+            bench.present_times[bench.samples] = now - present_start;
+            bench.samples++;
+        }
+        last_frame = now;
+
+        if (now - last_report >= 1000000000) {
+            report();
+            last_report = now;
+        }
+        if (bench.seconds && now - start >= (int64_t)bench.seconds * 1000000000) {
+            break;
+        }
+
+        if (interval) {
+            deadline += interval;
+            if (deadline < now) {
+                deadline = now;
+            }
+            struct timespec ts = {deadline / 1000000000, deadline % 1000000000};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+    }
+
+    vkDeviceWaitIdle(bench.device);
+}
+
+static void destroy()
+{
+    for (int i = 0; i < FRAMES_IN_FLIGHT; ++i) {
+        vkDestroySemaphore(bench.device, bench.frames[i].rendered, NULL);
+        vkDestroySemaphore(bench.device, bench.frames[i].acquired, NULL);
+        vkDestroyFence(bench.device, bench.frames[i].fence, NULL);
+    }
+    vkDestroyCommandPool(bench.device, bench.pool, NULL);
+    vkDestroySwapchainKHR(bench.device, bench.swapchain, NULL);
+    vkDestroyDevice(bench.device, NULL);
+    vkDestroySurfaceKHR(bench.inst, bench.surface, NULL);
+    vkDestroyInstance(bench.inst, NULL);
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-w width] [-h height] [-f format] [-r fps] [-n seconds] [-i]\n", name);
+    printf("  -f  bgra, rgba, srgb or rgb10a2 (default bgra)\n");
+    printf("  -r  frame rate limit, 0 for none (default 0)\n");
+    printf("  -n  run time in seconds, 0 for none (default 10)\n");
+    printf("  -i  present with IMMEDIATE instead of FIFO\n");
+}
+
+static bool parse_format(const char *name)
+{
+    if (!strcmp(name, "bgra")) {
+        bench.format = VK_FORMAT_B8G8R8A8_UNORM;
+    } else if (!strcmp(name, "rgba")) {
+        bench.format = VK_FORMAT_R8G8B8A8_UNORM;
+    } else if (!strcmp(name, "srgb")) {
+        bench.format = VK_FORMAT_B8G8R8A8_SRGB;
+    } else if (!strcmp(name, "rgb10a2")) {
+        bench.format = VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bench.width = 1920;
+    bench.height = 1080;
+    bench.format = VK_FORMAT_B8G8R8A8_UNORM;
+    bench.present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    bench.seconds = 10;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "w:h:f:r:n:i")) != -1) {
+        switch (opt) {
+        case 'w':
+            bench.width = atoi(optarg);
+            break;
+        case 'h':
+            bench.height = atoi(optarg);
+            break;
+        case 'f':
+            if (!parse_format(optarg)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            bench.rate = atoi(optarg);
+            break;
+        case 'n':
+            bench.seconds = atoi(optarg);
+            break;
+        case 'i':
+            bench.present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!bench.width || !bench.height) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    create_instance();
+    create_device();
+    create_swapchain();
+    create_frames();
+    run();
+    destroy();
+    return 0;
+}
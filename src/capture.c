@@ -20,26 +20,95 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include "utils.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <limits.h>
 #include <libgen.h>
+#include <fcntl.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 
+struct capture_stats_ring {
+    uint32_t samples[CAPTURE_STATS_SAMPLES];
+    uint32_t count;
+    uint32_t index;
+};
+
+/* One OBS instance */
+struct capture_conn {
+    int fd;
+    bool accepted;
+    struct capture_control_data control;
+    struct capture_control_shm *control_shm;
+    uint32_t control_seq;
+    struct capture_alloc_hint hint;
+    /* its ticks, from control, and the last one a frame was copied for */
+    int64_t frame_interval;
+    int64_t frame_time;
+    int64_t last_target;
+};
+
 static struct {
-    int connfd;
+    struct capture_conn conns[CAPTURE_MAX_SERVERS];
+    /* what the accepted connections asked for, merged */
+    int consumers;
     bool accepted;
     bool capturing;
     bool no_modifiers;
     bool linear;
     bool map_host;
+    bool memfd;
+    bool yuv;
     bool need_reinit;
     uint8_t device_uuid[16];
+    /* every consumer limits the rate, each to its own ticks */
+    bool limit_rate;
+    int64_t last_present;
+    int64_t present_interval;
+    uint32_t output_width;
+    uint32_t output_height;
+    uint8_t swapchain;
+    uint32_t winid;
+    struct capture_crop crop;
+    const struct capture_announce *announce;
+    uint32_t dormant_presents;
+    /* announced pids found alive at the last check, and left by a crash */
+    uint32_t live_pid[CAPTURE_MAX_SERVERS];
+    uint32_t stale_pid[CAPTURE_MAX_SERVERS];
+    uint8_t client_device_uuid[16];
+    uint32_t client_driver_version;
+    /* the images sent by capture_init_shtex, for consumers joining later */
+    struct capture_texture_data textures[CAPTURE_MAX_SLOTS];
+    int texture_fds[CAPTURE_MAX_SLOTS][4];
+    int texture_count;
+    struct {
+        uint32_t frames_copied;
+        uint32_t frames_skipped;
+        uint32_t init_time;
+        bool gpu_copy_time;
+        struct capture_stats_ring copy;
+        struct capture_stats_ring present;
+    } stats;
 } data;
 
+static inline bool capture_conn_consumes(const struct capture_conn *conn)
+{
+    return conn->fd >= 0 && conn->accepted;
+}
+
+static int64_t clock_monotonic_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * INT64_C(1000000000) + t.tv_nsec;
+}
+
 static bool get_wine_exe(char *buf, size_t bufsize)
 {
     FILE *f = fopen("/proc/self/comm", "r");
@@ -71,26 +140,26 @@ static bool get_exe(char *buf, size_t bufsize)
     return true;
 }
 
-static bool capture_try_connect()
+static bool capture_try_connect(struct capture_conn *conn, int index)
 {
-    const char sockname[] = "/com/obsproject/vkcapture";
-
     struct sockaddr_un addr;
-    addr.sun_family = PF_LOCAL;
-    addr.sun_path[0] = '\0'; // Abstract socket
-    memcpy(&addr.sun_path[1], sockname, sizeof(sockname) - 1);
+    const socklen_t addr_len = capture_socket_addr(&addr, index);
 
     int sock = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
-    int ret = connect(sock, (const struct sockaddr *)&addr, sizeof(addr.sun_family) + sizeof(sockname));
+    int ret = connect(sock, (const struct sockaddr *)&addr, addr_len);
     if (ret == -1) {
         close(sock);
         return false;
     }
 
-    data.connfd = sock;
+    conn->fd = sock;
 
-    struct capture_client_data cd;
+    struct capture_client_data cd = {0};
     cd.type = CAPTURE_CLIENT_DATA_TYPE;
+    cd.flags = CAPTURE_CLIENT_FLAG_CONTROL_SHM | CAPTURE_CLIENT_FLAG_SLOT_STATE;
+    memcpy(cd.device_uuid, data.client_device_uuid, 16);
+    cd.driver_version = data.client_driver_version;
+    cd.version = CAPTURE_PROTOCOL_VERSION;
     get_exe(cd.exe, sizeof(cd.exe));
 
     struct msghdr msg = {0};
@@ -101,48 +170,448 @@ static bool capture_try_connect()
     msg.msg_iov = &io;
     msg.msg_iovlen = 1;
 
-    const ssize_t sent = sendmsg(data.connfd, &msg, MSG_NOSIGNAL);
-    if (sent < 0) {
-        hlog("Socket sendmsg error %s", strerror(errno));
+    const ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    if (sent != CAPTURE_CLIENT_DATA_SIZE) {
+        if (sent < 0) {
+            hlog("Socket sendmsg error %s", strerror(errno));
+        }
+        close(sock);
+        conn->fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static const struct capture_announce *capture_map_announce()
+{
+    /* only the server creates it, the path is shared by all users */
+    int fd = open(CAPTURE_ANNOUNCE_PATH, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
     }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+            st.st_size < CAPTURE_ANNOUNCE_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, CAPTURE_ANNOUNCE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    return map != MAP_FAILED ? map : NULL;
+}
+
+static inline bool capture_server_announced(int index)
+{
+    const uint32_t pid = __atomic_load_n(&data.announce->server_pid[index], __ATOMIC_RELAXED);
+    return pid && pid != data.stale_pid[index];
+}
 
+/* Checks each announced pid once, and again every poll, so a crashed OBS
+ * does not keep the clients awake. EPERM means it runs as another user. */
+static bool capture_server_alive(int index, bool poll)
+{
+    const uint32_t pid = __atomic_load_n(&data.announce->server_pid[index], __ATOMIC_RELAXED);
+    if (!poll && pid == data.live_pid[index]) {
+        return true;
+    }
+    if (kill((pid_t)pid, 0) != 0 && errno == ESRCH) {
+        data.stale_pid[index] = pid;
+        return false;
+    }
+    data.live_pid[index] = pid;
     return true;
 }
 
 void capture_init()
 {
     memset(&data, 0, sizeof(data));
-    data.connfd = -1;
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        data.conns[i].fd = -1;
+    }
+    /* missing until an OBS has run, mapped again on every poll */
+    data.announce = capture_map_announce();
 }
 
-void capture_update_socket()
+bool capture_dormant()
 {
-    static int64_t last_check = 0;
-    const int64_t now = os_time_get_nano();
-    if (now - last_check < 1000000000) {
+    if (data.capturing) {
+        return false;
+    }
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        if (data.conns[i].fd >= 0) {
+            return false;
+        }
+    }
+
+    const bool poll = ++data.dormant_presents % CAPTURE_DORMANT_POLL == 0;
+    if (!data.announce) {
+        if (poll) {
+            data.announce = capture_map_announce();
+        }
+        return !poll;
+    }
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        if (capture_server_announced(i) && capture_server_alive(i, poll)) {
+            return false;
+        }
+    }
+    return !poll;
+}
+
+int capture_get_consumer_count()
+{
+    return data.consumers;
+}
+
+/* One set of export images has to do for every OBS that wants frames: the
+ * strictest transport, the highest rate, the largest size and the least
+ * cropped area. The window and swapchain policy come from the first one. */
+static void capture_merge_controls()
+{
+    uint8_t old_device_uuid[16];
+    memcpy(old_device_uuid, data.device_uuid, 16);
+    const bool old_no_modifiers = data.no_modifiers;
+    const bool old_linear = data.linear;
+    const bool old_map_host = data.map_host;
+    const bool old_memfd = data.memfd;
+    const bool old_yuv = data.yuv;
+    const uint32_t old_output_width = data.output_width;
+    const uint32_t old_output_height = data.output_height;
+    const struct capture_crop old_crop = data.crop;
+
+    data.consumers = 0;
+    data.no_modifiers = false;
+    data.linear = false;
+    data.map_host = false;
+    data.memfd = true;
+    data.yuv = true;
+    data.limit_rate = true;
+
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        struct capture_conn *conn = &data.conns[i];
+        if (!capture_conn_consumes(conn)) {
+            continue;
+        }
+        const struct capture_control_data *control = &conn->control;
+        conn->frame_interval = control->frame_interval;
+        conn->frame_time = (int64_t)control->frame_time;
+        /* 0 means every present */
+        data.limit_rate &= conn->frame_interval != 0;
+        if (!data.consumers) {
+            memcpy(data.device_uuid, control->device_uuid, 16);
+            data.output_width = control->output_width;
+            data.output_height = control->output_height;
+            data.swapchain = control->swapchain;
+            data.winid = control->winid;
+            data.crop = control->crop;
+        } else {
+            /* OBS on different GPUs, assume neither */
+            if (memcmp(data.device_uuid, control->device_uuid, 16)) {
+                memset(data.device_uuid, 0, 16);
+            }
+            /* 0x0 means the game size */
+            if (!control->output_width || !control->output_height ||
+                    !data.output_width || !data.output_height) {
+                data.output_width = 0;
+                data.output_height = 0;
+            } else {
+                if (control->output_width > data.output_width) {
+                    data.output_width = control->output_width;
+                }
+                if (control->output_height > data.output_height) {
+                    data.output_height = control->output_height;
+                }
+            }
+            if (control->crop.left < data.crop.left) {
+                data.crop.left = control->crop.left;
+            }
+            if (control->crop.top < data.crop.top) {
+                data.crop.top = control->crop.top;
+            }
+            if (control->crop.right < data.crop.right) {
+                data.crop.right = control->crop.right;
+            }
+            if (control->crop.bottom < data.crop.bottom) {
+                data.crop.bottom = control->crop.bottom;
+            }
+        }
+        data.no_modifiers |= control->no_modifiers == 1;
+        data.linear |= control->linear == 1;
+        data.map_host |= control->map_host == 1;
+        data.memfd &= control->memfd == 1;
+        data.yuv &= control->yuv == 1;
+        data.consumers++;
+    }
+
+    data.accepted = data.consumers > 0;
+    data.limit_rate &= data.accepted;
+    /* the memfd handshake has room for one reader */
+    data.memfd &= data.consumers == 1;
+    data.yuv &= data.accepted;
+
+    /* a new consumer is sent the current images instead, see
+     * capture_apply_control */
+    if (data.capturing && (memcmp(old_device_uuid, data.device_uuid, 16)
+        || old_no_modifiers != data.no_modifiers
+        || old_linear != data.linear
+        || old_map_host != data.map_host
+        || old_memfd != data.memfd
+        || old_yuv != data.yuv
+        || old_output_width != data.output_width
+        || old_output_height != data.output_height
+        || memcmp(&old_crop, &data.crop, sizeof(data.crop)))) {
+        data.need_reinit = true;
+    }
+}
+
+static void capture_map_control_shm(struct capture_conn *conn, int fd)
+{
+    if (conn->control_shm) {
+        munmap(conn->control_shm, CAPTURE_CONTROL_SHM_SIZE);
+        conn->control_shm = NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < CAPTURE_CONTROL_SHM_SIZE) {
+        hlog("Control mailbox has unexpected size");
+        close(fd);
         return;
     }
-    last_check = now;
+    /* writable only for the slot states */
+    void *map = mmap(NULL, CAPTURE_CONTROL_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        hlog("Failed to map control mailbox %s", strerror(errno));
+        return;
+    }
+    conn->control_shm = map;
+    conn->control_seq = 0;
+}
 
-    if (data.connfd < 0 && !capture_try_connect()) {
+static void capture_disconnect(struct capture_conn *conn)
+{
+    close(conn->fd);
+    conn->fd = -1;
+    conn->accepted = false;
+    if (conn->control_shm) {
+        munmap(conn->control_shm, CAPTURE_CONTROL_SHM_SIZE);
+        conn->control_shm = NULL;
+    }
+    memset(&conn->hint, 0, sizeof(conn->hint));
+    conn->last_target = 0;
+    capture_merge_controls();
+}
+
+/* A slow consumer is not waited for. Droppable messages are skipped when
+ * its socket is full. Anything else, and any short write, which leaves the
+ * stream mid-message, disconnects it. It connects again on a later update
+ * and gets the images then. Returns false if it was disconnected. */
+static bool capture_send_conn(struct capture_conn *conn,
+        const struct msghdr *msg, bool droppable)
+{
+    const ssize_t sent = sendmsg(conn->fd, msg, MSG_NOSIGNAL);
+    if (sent == (ssize_t)msg->msg_iov[0].iov_len) {
+        return true;
+    }
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        if (droppable) {
+            return true;
+        }
+        hlog("Socket full, reconnecting");
+    } else if (sent < 0) {
+        hlog("Socket sendmsg error %s", strerror(errno));
+    } else {
+        hlog("Socket short write, reconnecting");
+    }
+    capture_disconnect(conn);
+    return false;
+}
+
+/* Same message and fds to every consumer */
+static void capture_send_consumers(const struct msghdr *msg, bool droppable)
+{
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        struct capture_conn *conn = &data.conns[i];
+        if (capture_conn_consumes(conn)) {
+            capture_send_conn(conn, msg, droppable);
+        }
+    }
+}
+
+/* conn NULL sends it to every consumer */
+static void capture_send_texture(struct capture_conn *conn,
+        struct capture_texture_data *td, const int *fds)
+{
+    struct msghdr msg = {0};
+
+    struct iovec io = {
+        .iov_base = td,
+        .iov_len = CAPTURE_TEXTURE_DATA_SIZE,
+    };
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    char cmsg_buf[CMSG_SPACE(sizeof(int) * 4)];
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * td->nfd);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * td->nfd);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * td->nfd);
+
+    if (conn) {
+        capture_send_conn(conn, &msg, false);
+    } else {
+        capture_send_consumers(&msg, false);
+    }
+}
+
+static void capture_clear_textures()
+{
+    for (int i = 0; i < data.texture_count; ++i) {
+        for (int j = 0; j < data.textures[i].nfd; ++j) {
+            close(data.texture_fds[i][j]);
+        }
+    }
+    data.texture_count = 0;
+}
+
+static void capture_apply_control(struct capture_conn *conn,
+        const struct capture_control_data *control)
+{
+    const bool joined = !conn->accepted && control->capturing == 1;
+    conn->control = *control;
+    conn->accepted = control->capturing == 1;
+    capture_merge_controls();
+
+    /* the others keep their images, unless the merged ones change */
+    if (joined && data.capturing && !data.need_reinit) {
+        if (!data.texture_count || data.texture_count != data.textures[0].nslots) {
+            data.need_reinit = true;
+            return;
+        }
+        for (int i = 0; i < data.texture_count && conn->fd >= 0; ++i) {
+            capture_send_texture(conn, &data.textures[i], data.texture_fds[i]);
+        }
+    }
+}
+
+static void capture_stats_push(struct capture_stats_ring *ring, int64_t time)
+{
+    const int64_t us = time / 1000;
+    ring->samples[ring->index] = us > UINT32_MAX ? UINT32_MAX : us;
+    ring->index = (ring->index + 1) % CAPTURE_STATS_SAMPLES;
+    if (ring->count < CAPTURE_STATS_SAMPLES) {
+        ring->count++;
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void capture_stats_percentiles(const struct capture_stats_ring *ring,
+        uint32_t *p50, uint32_t *p99)
+{
+    if (!ring->count) {
+        *p50 = *p99 = 0;
         return;
     }
+    uint32_t sorted[CAPTURE_STATS_SAMPLES];
+    memcpy(sorted, ring->samples, ring->count * sizeof(uint32_t));
+    qsort(sorted, ring->count, sizeof(uint32_t), compare_u32);
+    *p50 = sorted[ring->count / 2];
+    *p99 = sorted[ring->count * 99 / 100];
+}
 
+static void capture_send_stats()
+{
+    struct capture_stats_data stats = {0};
+    stats.type = CAPTURE_STATS_DATA_TYPE;
+    stats.frames_copied = data.stats.frames_copied;
+    stats.frames_skipped = data.stats.frames_skipped;
+    stats.init_time = data.stats.init_time;
+    stats.gpu_copy_time = data.stats.gpu_copy_time;
+    uint32_t p50, p99;
+    capture_stats_percentiles(&data.stats.copy, &p50, &p99);
+    stats.copy_p50 = p50;
+    stats.copy_p99 = p99;
+    capture_stats_percentiles(&data.stats.present, &p50, &p99);
+    stats.present_p50 = p50;
+    stats.present_p99 = p99;
+
+    struct msghdr msg = {0};
+    struct iovec io = {
+        .iov_base = &stats,
+        .iov_len = CAPTURE_STATS_DATA_SIZE,
+    };
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    capture_send_consumers(&msg, true);
+}
+
+static void capture_read_socket(struct capture_conn *conn)
+{
     struct capture_control_data control;
-    ssize_t n = recv(data.connfd, &control, sizeof(control), 0);
-    if (n == sizeof(control)) {
-        const bool old_no_modifiers = data.no_modifiers;
-        const bool old_linear = data.linear;
-        const bool old_map_host = data.map_host;
-        data.accepted = control.capturing == 1;
-        data.no_modifiers = control.no_modifiers == 1;
-        data.linear = control.linear == 1;
-        data.map_host = control.map_host == 1;
-        memcpy(data.device_uuid, control.device_uuid, 16);
-        if (data.capturing && (old_no_modifiers != data.no_modifiers
-            || old_linear != data.linear
-            || old_map_host != data.map_host)) {
-            data.need_reinit = true;
+
+    struct msghdr msg = {0};
+    struct iovec io = {
+        .iov_base = &control,
+        .iov_len = sizeof(control),
+    };
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = cmsg_buf;
+
+    ssize_t n;
+    /* OBS refreshes its frame timing periodically, only the last message
+     * matters. Applying one may disconnect, nothing is read after that. */
+    while (true) {
+        msg.msg_controllen = sizeof(cmsg_buf);
+        n = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            break;
+        }
+
+        int fd = -1;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        /* servers of another protocol version write other sizes */
+        if (n != sizeof(control)) {
+            hlog("Unexpected control message size %zd", n);
+            if (fd >= 0) {
+                close(fd);
+            }
+            capture_disconnect(conn);
+            return;
+        }
+
+        capture_apply_control(conn, &control);
+        if (conn->fd < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+
+        if (fd >= 0) {
+            capture_map_control_shm(conn, fd);
+            if (conn->control_shm && capture_control_shm_read(conn->control_shm, &control, &conn->hint, &conn->control_seq)) {
+                capture_apply_control(conn, &control);
+                if (conn->fd < 0) {
+                    return;
+                }
+            }
         }
     }
     if (n == -1) {
@@ -153,70 +622,239 @@ void capture_update_socket()
             hlog("Socket recv error %s", strerror(errno));
         }
     }
-    if (n <= 0) {
-        close(data.connfd);
-        data.connfd = -1;
-        data.accepted = false;
+    capture_disconnect(conn);
+}
+
+void capture_update_socket()
+{
+    struct capture_control_data control;
+
+    /* Lock-free, picks up state changes on the next present */
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        struct capture_conn *conn = &data.conns[i];
+        if (conn->control_shm && capture_control_shm_read(conn->control_shm, &control, &conn->hint, &conn->control_seq)) {
+            capture_apply_control(conn, &control);
+        }
+    }
+
+    static int64_t last_check = 0;
+    const int64_t now = os_time_get_nano();
+    if (now - last_check < 1000000000) {
+        return;
+    }
+    last_check = now;
+
+    if (data.capturing) {
+        capture_send_stats();
+    }
+
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        struct capture_conn *conn = &data.conns[i];
+        if (conn->fd < 0) {
+            /* the first socket is always tried, its server may be in a
+             * sandbox that hides the announcement */
+            if (i > 0 && data.announce && !capture_server_announced(i)) {
+                continue;
+            }
+            if (!capture_try_connect(conn, i)) {
+                continue;
+            }
+        }
+        capture_read_socket(conn);
     }
 }
 
 void capture_init_shtex(
-        int width, int height, int format, int strides[4],
+        int width, int height, const struct capture_rect *source,
+        int format, int strides[4],
         int offsets[4], uint64_t modifier, uint32_t winid,
-        bool flip, int nfd, int fds[4])
-{
-    struct capture_texture_data td = {0};
-    td.type = CAPTURE_TEXTURE_DATA_TYPE;
-    td.nfd = nfd;
-    td.width = width;
-    td.height = height;
-    td.format = format;
-    memcpy(td.strides, strides, sizeof(int) * nfd);
-    memcpy(td.offsets, offsets, sizeof(int) * nfd);
-    td.modifier = modifier;
-    td.winid = winid;
-    td.flip = flip;
+        bool flip, bool memfd, int slot, int nslots, int nfd, int fds[4])
+{
+    if (slot == 0) {
+        capture_clear_textures();
+    }
+
+    struct capture_texture_data *td = &data.textures[slot];
+    memset(td, 0, sizeof(*td));
+    td->type = CAPTURE_TEXTURE_DATA_TYPE;
+    td->nfd = nfd;
+    td->width = width;
+    td->height = height;
+    td->format = format;
+    memcpy(td->strides, strides, sizeof(int) * nfd);
+    memcpy(td->offsets, offsets, sizeof(int) * nfd);
+    td->modifier = modifier;
+    td->winid = winid;
+    td->flip = flip;
+    td->memfd = memfd;
+    td->slot = slot;
+    td->nslots = nslots;
+    td->source_x = source->x;
+    td->source_y = source->y;
+    td->source_width = source->width;
+    td->source_height = source->height;
+
+    /* whatever the slot held before is gone with the old images */
+    capture_publish_slot(slot, 0);
+
+    /* every consumer imports the same images */
+    capture_send_texture(NULL, td, fds);
+
+    /* kept open for consumers that join later, without them they make
+     * everyone reinit */
+    if (data.texture_count == slot) {
+        int kept = 0;
+        while (kept < nfd) {
+            const int fd = fcntl(fds[kept], F_DUPFD_CLOEXEC, 0);
+            if (fd < 0) {
+                break;
+            }
+            data.texture_fds[slot][kept++] = fd;
+        }
+        if (kept == nfd) {
+            data.texture_count = slot + 1;
+        } else {
+            hlog("Failed to keep export image fds %s", strerror(errno));
+            while (kept) {
+                close(data.texture_fds[slot][--kept]);
+            }
+        }
+    }
+
+    data.capturing = true;
+    data.need_reinit = false;
+}
+
+void capture_send_frame(int slot, uint64_t seq, int sync_fd, const struct capture_rect *damage,
+        int64_t present_time, int64_t complete_time)
+{
+    if (!data.consumers) {
+        return;
+    }
+
+    struct capture_frame_data frame = {0};
+    frame.type = CAPTURE_FRAME_DATA_TYPE;
+    frame.slot = slot;
+    frame.seq = seq;
+    frame.nfd = sync_fd >= 0 ? 1 : 0;
+    if (damage) {
+        frame.damage = *damage;
+    }
+    frame.present_time = present_time;
+    frame.complete_time = complete_time;
 
     struct msghdr msg = {0};
 
     struct iovec io = {
-        .iov_base = &td,
-        .iov_len = CAPTURE_TEXTURE_DATA_SIZE,
+        .iov_base = &frame,
+        .iov_len = CAPTURE_FRAME_DATA_SIZE,
     };
     msg.msg_iov = &io;
     msg.msg_iovlen = 1;
 
-    char cmsg_buf[CMSG_SPACE(sizeof(int) * 4)];
-    msg.msg_control = cmsg_buf;
-    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfd);
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    cmsg->cmsg_level = SOL_SOCKET;
-    cmsg->cmsg_type = SCM_RIGHTS;
-    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfd);
-    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfd);
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    if (frame.nfd) {
+        msg.msg_control = cmsg_buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &sync_fd, sizeof(int));
+    }
 
-    const ssize_t sent = sendmsg(data.connfd, &msg, MSG_NOSIGNAL);
-    if (sent < 0) {
-        hlog("Socket sendmsg error %s", strerror(errno));
+    /* each consumer gets its own copy of the sync fd, a missed frame is
+     * made up for by the next one */
+    capture_send_consumers(&msg, true);
+}
+
+bool capture_slot_held(int slot)
+{
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        const struct capture_conn *conn = &data.conns[i];
+        if (conn->control_shm &&
+                __atomic_load_n(&conn->control_shm->slots[slot].readers, __ATOMIC_SEQ_CST)) {
+            return true;
+        }
     }
+    return false;
+}
 
-    data.capturing = true;
-    data.need_reinit = false;
+bool capture_claim_slot(int slot)
+{
+    uint64_t seqs[CAPTURE_MAX_SERVERS] = {0};
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        struct capture_conn *conn = &data.conns[i];
+        if (!conn->control_shm) {
+            continue;
+        }
+        struct capture_slot_state *state = &conn->control_shm->slots[slot];
+        seqs[i] = __atomic_exchange_n(&state->seq, 0, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&state->readers, __ATOMIC_SEQ_CST)) {
+            /* the others may have started reading since, give it back */
+            for (int j = 0; j <= i; ++j) {
+                if (data.conns[j].control_shm) {
+                    __atomic_store_n(&data.conns[j].control_shm->slots[slot].seq,
+                            seqs[j], __ATOMIC_SEQ_CST);
+                }
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+void capture_publish_slot(int slot, uint64_t seq)
+{
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        struct capture_conn *conn = &data.conns[i];
+        if (conn->control_shm) {
+            __atomic_store_n(&conn->control_shm->slots[slot].seq, seq, __ATOMIC_SEQ_CST);
+        }
+    }
 }
 
 void capture_stop()
 {
+    capture_clear_textures();
     data.capturing = false;
+    memset(&data.stats, 0, sizeof(data.stats));
+}
+
+int64_t capture_clock_ns()
+{
+    return clock_monotonic_ns();
+}
+
+void capture_stats_present(int64_t time, bool copied)
+{
+    if (copied) {
+        data.stats.frames_copied++;
+    } else {
+        data.stats.frames_skipped++;
+    }
+    capture_stats_push(&data.stats.present, time);
+}
+
+void capture_stats_copy(int64_t time, bool gpu)
+{
+    data.stats.gpu_copy_time = gpu;
+    capture_stats_push(&data.stats.copy, time);
+}
+
+void capture_stats_init(int64_t time)
+{
+    data.stats.init_time = time / 1000;
 }
 
 bool capture_should_stop()
 {
-    return data.capturing && (data.connfd < 0 || !data.accepted || data.need_reinit);
+    return data.capturing && (!data.accepted || data.need_reinit);
 }
 
 bool capture_should_init()
 {
-    return !data.capturing && data.connfd >= 0 && data.accepted;
+    return !data.capturing && data.accepted;
 }
 
 bool capture_ready()
@@ -224,6 +862,60 @@ bool capture_ready()
     return data.capturing;
 }
 
+/* True if this present is the one closest to the consumer's next tick */
+static bool capture_conn_wants_frame(struct capture_conn *conn, int64_t now)
+{
+    const int64_t interval = conn->frame_interval;
+    if (data.present_interval >= interval) {
+        return true;
+    }
+
+    /* next OBS tick at or after now */
+    int64_t target = conn->frame_time;
+    if (now > target) {
+        target += (now - target + interval - 1) / interval * interval;
+    }
+
+    /* the previous tick got no copy, deliver this frame right away */
+    if (conn->last_target && conn->last_target < target - interval) {
+        conn->last_target = target - interval;
+        return true;
+    }
+
+    if (now + data.present_interval / 2 < target || conn->last_target == target) {
+        return false;
+    }
+
+    conn->last_target = target;
+    return true;
+}
+
+bool capture_should_skip_frame()
+{
+    const int64_t now = clock_monotonic_ns();
+    if (data.last_present) {
+        /* smoothed time between presents */
+        data.present_interval = (data.present_interval * 7 + (now - data.last_present)) / 8;
+    }
+    data.last_present = now;
+
+    if (!data.limit_rate) {
+        return false;
+    }
+
+    /* OBS instances are rarely in phase, a present is copied if it is the
+     * closest to the tick of any of them. Every consumer is asked so each
+     * keeps track of its own ticks. */
+    bool wanted = false;
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        struct capture_conn *conn = &data.conns[i];
+        if (capture_conn_consumes(conn) && capture_conn_wants_frame(conn, now)) {
+            wanted = true;
+        }
+    }
+    return !wanted;
+}
+
 bool capture_allocate_no_modifiers()
 {
     return data.no_modifiers;
@@ -239,7 +931,200 @@ bool capture_allocate_map_host()
     return data.map_host;
 }
 
+bool capture_allocate_memfd()
+{
+    return data.memfd;
+}
+
+bool capture_allocate_yuv()
+{
+    return data.yuv;
+}
+
+void capture_get_export_size(int width, int height, int *export_width, int *export_height)
+{
+    *export_width = width;
+    *export_height = height;
+
+    const int max_width = data.output_width;
+    const int max_height = data.output_height;
+    if (!max_width || !max_height || (width <= max_width && height <= max_height)) {
+        return;
+    }
+
+    /* fit into the output size, keeping the aspect ratio */
+    if ((int64_t)width * max_height > (int64_t)height * max_width) {
+        *export_width = max_width;
+        *export_height = ((int64_t)height * max_width + width / 2) / width;
+    } else {
+        *export_height = max_height;
+        *export_width = ((int64_t)width * max_height + height / 2) / height;
+    }
+    if (*export_width < 1) {
+        *export_width = 1;
+    }
+    if (*export_height < 1) {
+        *export_height = 1;
+    }
+}
+
+void capture_get_crop(int width, int height, struct capture_rect *crop)
+{
+    const struct capture_crop *c = &data.crop;
+    crop->x = 0;
+    crop->y = 0;
+    crop->width = width;
+    crop->height = height;
+    if ((int64_t)c->left + c->right >= width || (int64_t)c->top + c->bottom >= height) {
+        return;
+    }
+    crop->x = c->left;
+    crop->y = c->top;
+    crop->width = width - c->left - c->right;
+    crop->height = height - c->top - c->bottom;
+}
+
+int capture_get_swapchain_policy()
+{
+    return data.swapchain;
+}
+
+uint32_t capture_get_winid()
+{
+    return data.winid;
+}
+
 bool capture_compare_device_uuid(uint8_t uuid[16])
 {
     return memcmp(data.device_uuid, uuid, 16) == 0;
 }
+
+bool capture_device_uuid_known()
+{
+    static const uint8_t zero[16];
+    return memcmp(data.device_uuid, zero, 16) != 0;
+}
+
+static const struct capture_format_modifiers *capture_find_format(
+        const struct capture_conn *conn, int32_t format)
+{
+    const struct capture_control_shm *shm = conn->control_shm;
+    if (!shm) {
+        return NULL;
+    }
+    const uint32_t nformats = __atomic_load_n(&shm->nformats, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < nformats && i < CAPTURE_MAX_FORMATS; ++i) {
+        if (shm->formats[i].format == format) {
+            return &shm->formats[i];
+        }
+    }
+    return NULL;
+}
+
+static bool capture_format_has_modifier(const struct capture_format_modifiers *f,
+        uint64_t modifier)
+{
+    for (uint32_t j = 0; j < f->nmodifiers && j < CAPTURE_MAX_MODIFIERS; ++j) {
+        if (f->modifiers[j] == modifier) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool capture_modifier_supported(int32_t format, uint64_t modifier)
+{
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        const struct capture_conn *conn = &data.conns[i];
+        if (!capture_conn_consumes(conn)) {
+            continue;
+        }
+        /* nothing known about this format, let the import ladder find out */
+        const struct capture_format_modifiers *f = capture_find_format(conn, format);
+        if (f && !capture_format_has_modifier(f, modifier)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool capture_format_supported(int32_t format)
+{
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        const struct capture_conn *conn = &data.conns[i];
+        if (!capture_conn_consumes(conn) || !conn->control_shm ||
+                !__atomic_load_n(&conn->control_shm->nformats, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        if (!capture_find_format(conn, format)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int capture_get_supported_modifiers(int32_t format, uint64_t modifiers[CAPTURE_MAX_MODIFIERS])
+{
+    int n = -1;
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        const struct capture_conn *conn = &data.conns[i];
+        if (!capture_conn_consumes(conn)) {
+            continue;
+        }
+        const struct capture_format_modifiers *f = capture_find_format(conn, format);
+        if (!f) {
+            continue;
+        }
+        if (n == -1) {
+            n = f->nmodifiers < CAPTURE_MAX_MODIFIERS ? f->nmodifiers : CAPTURE_MAX_MODIFIERS;
+            memcpy(modifiers, f->modifiers, sizeof(uint64_t) * n);
+            continue;
+        }
+        /* keep what every consumer imports */
+        int kept = 0;
+        for (int j = 0; j < n; ++j) {
+            if (capture_format_has_modifier(f, modifiers[j])) {
+                modifiers[kept++] = modifiers[j];
+            }
+        }
+        n = kept;
+    }
+    return n;
+}
+
+void capture_set_device_info(uint8_t uuid[16], uint32_t driver_version)
+{
+    memcpy(data.client_device_uuid, uuid, 16);
+    data.client_driver_version = driver_version;
+}
+
+bool capture_get_alloc_hint(int32_t format, uint64_t *modifier, int *nplanes)
+{
+    /* only when every consumer imported the same before */
+    const struct capture_alloc_hint *hint = NULL;
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        const struct capture_conn *conn = &data.conns[i];
+        if (!capture_conn_consumes(conn)) {
+            continue;
+        }
+        if (!conn->hint.nplanes || conn->hint.format != format ||
+                (hint && (hint->modifier != conn->hint.modifier ||
+                          hint->nplanes != conn->hint.nplanes))) {
+            return false;
+        }
+        hint = &conn->hint;
+    }
+    if (!hint) {
+        return false;
+    }
+    *modifier = hint->modifier;
+    *nplanes = hint->nplanes;
+    return true;
+}
+
+void capture_clear_alloc_hint()
+{
+    for (int i = 0; i < CAPTURE_MAX_SERVERS; ++i) {
+        memset(&data.conns[i].hint, 0, sizeof(data.conns[i].hint));
+    }
+}
@@ -21,6 +21,8 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <stdint.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <sys/un.h>
+#include <sys/socket.h>
 
 #ifndef DRM_FORMAT_XRGB8888
 #define fourcc_code(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | \
@@ -37,6 +39,15 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #define DRM_FORMAT_ABGR16161616 fourcc_code('A', 'B', '4', '8')
 #define DRM_FORMAT_XBGR16161616F fourcc_code('X', 'B', '4', 'H')
 #define DRM_FORMAT_ABGR16161616F fourcc_code('A', 'B', '4', 'H')
+#define DRM_FORMAT_RGB565 fourcc_code('R', 'G', '1', '6')
+#define DRM_FORMAT_BGR565 fourcc_code('B', 'G', '1', '6')
+#define DRM_FORMAT_ARGB1555 fourcc_code('A', 'R', '1', '5')
+#define DRM_FORMAT_R8 fourcc_code('R', '8', ' ', ' ')
+#define DRM_FORMAT_GR88 fourcc_code('G', 'R', '8', '8')
+#define DRM_FORMAT_R16 fourcc_code('R', '1', '6', ' ')
+#define DRM_FORMAT_GR1616 fourcc_code('G', 'R', '3', '2')
+#define DRM_FORMAT_NV12 fourcc_code('N', 'V', '1', '2')
+#define DRM_FORMAT_P010 fourcc_code('P', '0', '1', '0')
 #define fourcc_mod_code(vendor, val) ((((uint64_t)vendor) << 56) | ((val) & 0x00ffffffffffffffULL))
 #define DRM_FORMAT_MOD_INVALID fourcc_mod_code(0, ((1ULL << 56) - 1))
 #define DRM_FORMAT_MOD_LINEAR fourcc_mod_code(0, 0)
@@ -45,9 +56,25 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 struct capture_client_data {
     uint8_t type;
     char exe[48];
-    uint8_t padding[79];
+    uint8_t flags;
+    uint8_t device_uuid[16];
+    uint32_t driver_version;
+    uint8_t version;
+    uint8_t padding[57];
 } __attribute__((packed));
 
+/* Bumped whenever a message or the mailbox changes size. Servers answer a
+ * client of another version in its own format or disconnect it. Clients
+ * leaving `version` zero predate it and only take control messages of
+ * CAPTURE_CONTROL_DATA_SIZE_V0 bytes on the socket. */
+#define CAPTURE_PROTOCOL_VERSION 4
+
+/* Client maps a control mailbox if the server passes one */
+#define CAPTURE_CLIENT_FLAG_CONTROL_SHM 1
+/* Client publishes slot seqs in the mailbox and skips slots the server
+ * holds, see capture_slot_state */
+#define CAPTURE_CLIENT_FLAG_SLOT_STATE 2
+
 #define CAPTURE_CLIENT_DATA_TYPE 10
 #define CAPTURE_CLIENT_DATA_SIZE 128
 static_assert(sizeof(struct capture_client_data) == CAPTURE_CLIENT_DATA_SIZE, "size mismatch");
@@ -63,40 +90,366 @@ struct capture_texture_data {
     uint64_t modifier;
     uint32_t winid;
     uint8_t flip;
-    uint8_t padding[69];
+    uint8_t slot;
+    uint8_t nslots;
+    int32_t source_width;
+    int32_t source_height;
+    uint8_t memfd;
+    int32_t source_x;
+    int32_t source_y;
+    uint8_t padding[50];
 } __attribute__((packed));
 
 #define CAPTURE_TEXTURE_DATA_TYPE 11
 #define CAPTURE_TEXTURE_DATA_SIZE 128
 static_assert(sizeof(struct capture_texture_data) == CAPTURE_TEXTURE_DATA_SIZE, "size mismatch");
 
+#define CAPTURE_MAX_SLOTS 4
+
+/* With memfd set in the texture data the fd is a memfd holding this header
+ * followed by the linear image at CAPTURE_MEMFD_HEADER_SIZE. The client
+ * clears `seq` before copying into the slot and sets it once the copy is
+ * done, and skips the slot while `reading` is set. The server sets
+ * `reading`, then checks that `seq` still matches the frame message before
+ * reading the image. All accesses are sequentially consistent so the two
+ * sides never use the slot at the same time. */
+struct capture_memfd_header {
+    uint64_t seq;
+    uint32_t reading;
+    uint32_t padding;
+};
+
+#define CAPTURE_MEMFD_HEADER_SIZE 4096
+
+/* Frames in system memory, mapped dmabufs or memfd slots, are uploaded by
+ * OBS as they are, so they only come in formats whose bytes match an OBS
+ * texture format. */
+static inline bool capture_format_host_readable(int32_t format)
+{
+    switch (format) {
+    case DRM_FORMAT_ARGB8888:
+    case DRM_FORMAT_XRGB8888:
+    case DRM_FORMAT_ABGR8888:
+    case DRM_FORMAT_XBGR8888:
+    case DRM_FORMAT_ABGR2101010:
+    case DRM_FORMAT_XBGR2101010:
+    case DRM_FORMAT_ABGR16161616:
+    case DRM_FORMAT_XBGR16161616:
+    case DRM_FORMAT_ABGR16161616F:
+    case DRM_FORMAT_XBGR16161616F:
+        return true;
+    default:
+        return false;
+    }
+}
+
+struct capture_rect {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+} __attribute__((packed));
+
+static inline bool capture_rect_empty(const struct capture_rect *rect)
+{
+    return rect->width <= 0 || rect->height <= 0;
+}
+
+static inline void capture_rect_union(struct capture_rect *dst, const struct capture_rect *src)
+{
+    if (capture_rect_empty(src)) {
+        return;
+    }
+    if (capture_rect_empty(dst)) {
+        *dst = *src;
+        return;
+    }
+    const int32_t x1 = dst->x + dst->width > src->x + src->width ?
+        dst->x + dst->width : src->x + src->width;
+    const int32_t y1 = dst->y + dst->height > src->y + src->height ?
+        dst->y + dst->height : src->y + src->height;
+    dst->x = dst->x < src->x ? dst->x : src->x;
+    dst->y = dst->y < src->y ? dst->y : src->y;
+    dst->width = x1 - dst->x;
+    dst->height = y1 - dst->y;
+}
+
+/* Sent after a copy into `slot` has completed on the GPU. `seq` grows with
+ * every copy, the consumer should always read the slot with highest seq.
+ * With nfd == 1 the message carries a sync_file instead and is sent right
+ * after submit, the consumer must wait on it before reading the slot.
+ * `damage` bounds what changed in the slot since it was last reported, an
+ * empty rect means the whole slot. `present_time` is when the game
+ * presented the frame and `complete_time` when the copy was seen finished,
+ * both CLOCK_MONOTONIC nanoseconds. complete_time is 0 with a sync_file,
+ * the copy is still running when the message is sent. */
+struct capture_frame_data {
+    uint8_t type;
+    uint8_t slot;
+    uint64_t seq;
+    uint8_t nfd;
+    struct capture_rect damage;
+    uint64_t present_time;
+    uint64_t complete_time;
+    uint8_t padding[85];
+} __attribute__((packed));
+
+#define CAPTURE_FRAME_DATA_TYPE 12
+#define CAPTURE_FRAME_DATA_SIZE 128
+static_assert(sizeof(struct capture_frame_data) == CAPTURE_FRAME_DATA_SIZE, "size mismatch");
+
+/* Sent by the client about once a second while capturing. Times are in
+ * microseconds, p50/p99 over the last CAPTURE_STATS_SAMPLES samples. The
+ * copy time is measured with GPU timestamps if gpu_copy_time is set,
+ * otherwise it is the CPU time of recording it. `present` is what the
+ * capture adds to every present of the game. Counters start over whenever
+ * capture starts. */
+struct capture_stats_data {
+    uint8_t type;
+    uint32_t frames_copied;
+    uint32_t frames_skipped;
+    uint32_t copy_p50;
+    uint32_t copy_p99;
+    uint32_t present_p50;
+    uint32_t present_p99;
+    uint32_t init_time;
+    uint8_t gpu_copy_time;
+    uint8_t padding[98];
+} __attribute__((packed));
+
+#define CAPTURE_STATS_DATA_TYPE 13
+#define CAPTURE_STATS_DATA_SIZE 128
+#define CAPTURE_STATS_SAMPLES 128
+static_assert(sizeof(struct capture_stats_data) == CAPTURE_STATS_DATA_SIZE, "size mismatch");
+
+/* Pixels cut off each edge of the game's image */
+struct capture_crop {
+    uint32_t left;
+    uint32_t top;
+    uint32_t right;
+    uint32_t bottom;
+} __attribute__((packed));
+
+/* With frame_interval != 0 the client only copies the present closest to
+ * each OBS tick, ticks are at frame_time + n * frame_interval (CLOCK_MONOTONIC).
+ * With output_width/height != 0 the client scales frames down to fit, the
+ * texture then also carries the original size in source_width/height.
+ * A nonzero `crop` makes the client copy only the rest of the image, the
+ * texture carries where that region is in source_x/y. A crop that leaves
+ * nothing is ignored.
+ * With yuv set the client may send NV12 or P010 textures instead of RGB.
+ * `swapchain` picks which of several presented swapchains is captured, zero
+ * leaves it to the client. A nonzero `winid` captures that window if it
+ * presents. With memfd set the client copies frames into memfd slots in
+ * system memory instead of exporting dmabufs, see capture_memfd_header. */
 struct capture_control_data {
     uint8_t capturing;
     uint8_t no_modifiers;
     uint8_t linear;
     uint8_t map_host;
     uint8_t device_uuid[16];
-    uint8_t padding[12];
+    uint32_t frame_interval;
+    uint64_t frame_time;
+    uint32_t output_width;
+    uint32_t output_height;
+    uint8_t yuv;
+    uint8_t swapchain;
+    uint32_t winid;
+    uint8_t memfd;
+    struct capture_crop crop;
+    uint8_t padding[1];
 } __attribute__((packed));
 
+#define CAPTURE_SWAPCHAIN_LARGEST 1
+#define CAPTURE_SWAPCHAIN_RECENT 2
+
 #define CAPTURE_CONTROL_DATA_TYPE 10
-#define CAPTURE_CONTROL_DATA_SIZE 32
+#define CAPTURE_CONTROL_DATA_SIZE 64
+/* what clients without a protocol version read, the fields up to device_uuid */
+#define CAPTURE_CONTROL_DATA_SIZE_V0 32
 static_assert(sizeof(struct capture_control_data) == CAPTURE_CONTROL_DATA_SIZE, "size mismatch");
 
+#define CAPTURE_MAX_FORMATS 16
+#define CAPTURE_MAX_MODIFIERS 64
+
+/* Allocation that worked last time for this game, nplanes == 0 means none */
+struct capture_alloc_hint {
+    uint64_t modifier;
+    int32_t format;
+    uint8_t nplanes;
+    uint8_t padding[3];
+};
+
+struct capture_format_modifiers {
+    int32_t format;
+    uint32_t nmodifiers;
+    uint64_t modifiers[CAPTURE_MAX_MODIFIERS];
+};
+
+/* Which frame a slot holds and whether the server is reading it, the same
+ * handshake as capture_memfd_header for slots of any kind. The client
+ * clears `seq` before copying into the slot, skips it while `readers` is
+ * nonzero and sets `seq` before reporting the frame. The server increments
+ * `readers`, then checks that `seq` still matches the frame message before
+ * sampling the slot, and decrements it once those reads have retired. A
+ * ring of one slot is never held. */
+struct capture_slot_state {
+    uint64_t seq;
+    uint32_t readers;
+    uint32_t padding;
+};
+
+/* Shared memory mailbox for control data. The server sends its fd with a
+ * control message and from then only updates it. `seq` is odd while the
+ * server is writing, so the client can read it lock-free on every present.
+ * `formats` lists what the server can import, it is written once before
+ * `nformats` is set and never changes after. `slots` is the only part the
+ * client writes. */
+struct capture_control_shm {
+    uint32_t seq;
+    uint32_t nformats;
+    struct capture_control_data control;
+    struct capture_alloc_hint hint;
+    struct capture_format_modifiers formats[CAPTURE_MAX_FORMATS];
+    struct capture_slot_state slots[CAPTURE_MAX_SLOTS];
+};
+
+#define CAPTURE_CONTROL_SHM_SIZE 8472
+static_assert(sizeof(struct capture_control_shm) == CAPTURE_CONTROL_SHM_SIZE, "size mismatch");
+
+static inline void capture_control_shm_write(struct capture_control_shm *shm,
+        const struct capture_control_data *control,
+        const struct capture_alloc_hint *hint)
+{
+    const uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __builtin_memcpy((void *)&shm->control, control, sizeof(*control));
+    __builtin_memcpy((void *)&shm->hint, hint, sizeof(*hint));
+    __atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Returns true and fills control and hint if they changed since *last_seq */
+static inline bool capture_control_shm_read(const struct capture_control_shm *shm,
+        struct capture_control_data *control, struct capture_alloc_hint *hint,
+        uint32_t *last_seq)
+{
+    const uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+    if (seq == *last_seq || (seq & 1)) {
+        return false;
+    }
+    __builtin_memcpy(control, (const void *)&shm->control, sizeof(*control));
+    __builtin_memcpy(hint, (const void *)&shm->hint, sizeof(*hint));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq) {
+        return false;
+    }
+    *last_seq = seq;
+    return true;
+}
+
+/* Every OBS instance listens on the first free of CAPTURE_MAX_SERVERS
+ * sockets. Clients connect to all of them and feed the same export images
+ * to each. */
+#define CAPTURE_MAX_SERVERS 4
+#define CAPTURE_SOCKET_NAME "/com/obsproject/vkcapture"
+
+/* Abstract socket of server `index`, the first keeps the plain name */
+static inline socklen_t capture_socket_addr(struct sockaddr_un *addr, int index)
+{
+    const char name[] = CAPTURE_SOCKET_NAME;
+    addr->sun_family = PF_LOCAL;
+    addr->sun_path[0] = '\0'; // Abstract socket
+    __builtin_memcpy(&addr->sun_path[1], name, sizeof(name) - 1);
+    socklen_t len = sizeof(addr->sun_family) + sizeof(name);
+    if (index > 0) {
+        addr->sun_path[sizeof(name)] = '.';
+        addr->sun_path[sizeof(name) + 1] = '0' + index;
+        len += 2;
+    }
+    /* not part of the address, only so the name can be logged */
+    addr->sun_path[len - sizeof(addr->sun_family)] = '\0';
+    return len;
+}
+
+/* File every process maps read-only, created by the first server and only
+ * writable by its owner. Each server stores its pid at its socket index
+ * while it listens, so clients stay dormant, without a syscall per present,
+ * until one appears. Clients check that an announced pid is still running,
+ * a crash would otherwise keep them awake for good. */
+#define CAPTURE_ANNOUNCE_PATH "/dev/shm/com.obsproject.vkcapture"
+
+struct capture_announce {
+    uint32_t server_pid[CAPTURE_MAX_SERVERS];
+    uint8_t padding[48];
+};
+
+#define CAPTURE_ANNOUNCE_SIZE 64
+static_assert(sizeof(struct capture_announce) == CAPTURE_ANNOUNCE_SIZE, "size mismatch");
+
+/* Dormant clients still try to connect once every this many presents, the
+ * announcement may live in a /dev/shm the server cannot see */
+#define CAPTURE_DORMANT_POLL 1024
+
 void capture_init();
+/* True while no server is known and nothing is captured, the present hooks
+ * then skip all work */
+bool capture_dormant();
+/* Servers that want frames, each one may hold a slot while it reads */
+int capture_get_consumer_count();
 void capture_update_socket();
 void capture_init_shtex(
-        int width, int height, int format, int strides[4],
+        int width, int height, const struct capture_rect *source,
+        int format, int strides[4],
         int offsets[4], uint64_t modifier, uint32_t winid,
-        bool flip, int nfd, int fds[4]);
+        bool flip, bool memfd, int slot, int nslots, int nfd, int fds[4]);
+void capture_send_frame(int slot, uint64_t seq, int sync_fd, const struct capture_rect *damage,
+        int64_t present_time, int64_t complete_time);
+/* True if any server holds `slot`, see capture_slot_state */
+bool capture_slot_held(int slot);
+/* Invalidates `slot` for every server before copying into it, fails and
+ * leaves it valid if one of them holds it */
+bool capture_claim_slot(int slot);
+/* Makes `slot` valid as frame `seq`, before capture_send_frame reports it */
+void capture_publish_slot(int slot, uint64_t seq);
 void capture_stop();
 
+/* CLOCK_MONOTONIC, the clock OBS uses for its timestamps */
+int64_t capture_clock_ns();
+
+/* Timing samples for capture_stats_data, all in nanoseconds */
+void capture_stats_present(int64_t time, bool copied);
+void capture_stats_copy(int64_t time, bool gpu);
+void capture_stats_init(int64_t time);
+
 bool capture_should_stop();
 bool capture_should_init();
 bool capture_ready();
+bool capture_should_skip_frame();
 
 bool capture_allocate_no_modifiers();
 bool capture_allocate_linear();
 bool capture_allocate_map_host();
+bool capture_allocate_memfd();
+bool capture_allocate_yuv();
+/* Size to export a width x height frame at, honouring the OBS output size */
+void capture_get_export_size(int width, int height, int *export_width, int *export_height);
+/* Part of a width x height image OBS wants, the whole image without a crop */
+void capture_get_crop(int width, int height, struct capture_rect *crop);
+/* CAPTURE_SWAPCHAIN_* requested by OBS, 0 if none */
+int capture_get_swapchain_policy();
+/* Window OBS asked for, 0 if any */
+uint32_t capture_get_winid();
 
 bool capture_compare_device_uuid(uint8_t uuid[16]);
+/* OBS reported its GPU, false if its GL driver cannot tell */
+bool capture_device_uuid_known();
+bool capture_modifier_supported(int32_t format, uint64_t modifier);
+/* False only if OBS sent the formats it imports and format is not one */
+bool capture_format_supported(int32_t format);
+/* Copies what OBS can import for format, -1 if unknown */
+int capture_get_supported_modifiers(int32_t format, uint64_t modifiers[CAPTURE_MAX_MODIFIERS]);
+
+void capture_set_device_info(uint8_t uuid[16], uint32_t driver_version);
+bool capture_get_alloc_hint(int32_t format, uint64_t *modifier, int *nplanes);
+void capture_clear_alloc_hint();
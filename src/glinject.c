@@ -42,11 +42,45 @@ static struct vk_funcs vk_f;
 
 static bool vkcapture_glvulkan = false;
 
+enum gl_sync_mode {
+    GL_SYNC_NONE,
+    /* EGL_ANDROID_native_fence_sync */
+    GL_SYNC_EGL_FENCE,
+    /* GL_EXT_semaphore_fd, turned into a sync_file by Vulkan */
+    GL_SYNC_VK_SEMAPHORE,
+};
+
+/* how often the target is picked again, and after how long without a
+ * swap a surface stops being a candidate */
+#define SURFACE_SELECT_NS 250000000
+#define SURFACE_IDLE_NS 1000000000
+#define MAX_SURFACE_COUNT 16
+
+struct gl_surface {
+    void *display;
+    void *surface;
+    /* context current at the last swap */
+    void *context;
+    uint32_t winid;
+    int width;
+    int height;
+    /* creation order, for CAPTURE_SWAPCHAIN_RECENT */
+    uint64_t serial;
+    int64_t last_present;
+};
+
 struct gl_data {
+    /* surface and context the shared texture was created for, the texture
+     * is kept while the captured surface changes to one of the same size */
     void *display;
     void *surface;
+    void *context;
     int width;
     int height;
+    /* exported part of the surface, top-left origin like Vulkan */
+    struct capture_rect crop;
+    int export_width;
+    int export_height;
     GLuint fbo;
     GLuint texture;
     void *image;
@@ -67,9 +101,29 @@ struct gl_data {
     VkDevice vkdev;
     VkImage vkimage;
     VkDeviceMemory vkmemory;
+    VkQueue vkqueue;
+    bool vksync;
+    /* signalled by GL after the copy, then by Vulkan for export */
+    VkSemaphore vksemaphore;
+    VkSemaphore vkexport_semaphore;
+    GLuint glsemaphore;
 
     uint8_t device_uuid[16];
 
+    int gl_major;
+    /* copy without touching the game's bindings */
+    bool dsa;
+    /* GL_FRAMEBUFFER_SRGB changes the copy, only then is it saved */
+    bool srgb_backbuffer;
+
+    int sync_mode;
+    uint64_t frame_seq;
+
+    struct gl_surface surfaces[MAX_SURFACE_COUNT];
+    struct gl_surface *target;
+    uint64_t surface_serial;
+    int64_t select_time;
+
     bool valid;
 };
 static struct gl_data data;
@@ -130,6 +184,7 @@ static bool gl_init_funcs(bool glx)
         GETGLXADDR(GetProcAddress);
         GETGLXADDR(GetProcAddressARB);
         GETGLXPROCADDR(DestroyContext);
+        GETGLXPROCADDR(GetCurrentContext);
         GETGLXPROCADDR(SwapBuffers);
         GETGLXPROCADDR(SwapBuffersMscOML);
         GETGLXPROCADDR(CreatePixmap);
@@ -183,6 +238,10 @@ static bool gl_init_funcs(bool glx)
         GETEGLPROCADDR(SwapBuffers);
         GETEGLPROCADDR(ExportDMABUFImageQueryMESA);
         GETEGLPROCADDR(ExportDMABUFImageMESA);
+        egl_f.QueryString = (typeof(egl_f.QueryString))egl_f.GetProcAddress("eglQueryString");
+        egl_f.CreateSyncKHR = (typeof(egl_f.CreateSyncKHR))egl_f.GetProcAddress("eglCreateSyncKHR");
+        egl_f.DestroySyncKHR = (typeof(egl_f.DestroySyncKHR))egl_f.GetProcAddress("eglDestroySyncKHR");
+        egl_f.DupNativeFenceFDANDROID = (typeof(egl_f.DupNativeFenceFDANDROID))egl_f.GetProcAddress("eglDupNativeFenceFDANDROID");
         egl_f.valid = true;
     }
 
@@ -251,7 +310,7 @@ static bool vulkan_init()
         VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
     };
 
-    const char *device_extensions[] = {
+    const char *base_extensions[] = {
         VK_KHR_BIND_MEMORY_2_EXTENSION_NAME,
         VK_KHR_EXTERNAL_MEMORY_EXTENSION_NAME,
         VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME,
@@ -262,7 +321,15 @@ static bool vulkan_init()
         VK_KHR_SAMPLER_YCBCR_CONVERSION_EXTENSION_NAME,
         VK_KHR_MAINTENANCE1_EXTENSION_NAME,
         VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME,
-        VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
+    };
+
+    const char *device_extensions[16];
+    uint32_t device_extension_count = sizeof(base_extensions) / sizeof(*base_extensions);
+    memcpy(device_extensions, base_extensions, sizeof(base_extensions));
+
+    const char *sync_extensions[] = {
+        VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME,
+        VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME,
     };
 
     VkApplicationInfo appInfo = {};
@@ -297,6 +364,7 @@ static bool vulkan_init()
     GETINSTPROC(GetPhysicalDeviceMemoryProperties);
     GETINSTPROC(GetPhysicalDeviceFormatProperties2KHR);
     GETINSTPROC(GetPhysicalDeviceImageFormatProperties2KHR);
+    GETINSTPROC(EnumerateDeviceExtensionProperties);
 
     uint32_t deviceCount = 16;
     VkPhysicalDevice physicalDevices[16];
@@ -322,6 +390,29 @@ static bool vulkan_init()
         goto fail;
     }
 
+    /* only needed to hand OBS a sync_file, capture works without */
+    uint32_t ext_count = 0;
+    vk_f.EnumerateDeviceExtensionProperties(data.vkphys_dev, NULL, &ext_count, NULL);
+    VkExtensionProperties *exts = malloc(ext_count * sizeof(VkExtensionProperties));
+    vk_f.EnumerateDeviceExtensionProperties(data.vkphys_dev, NULL, &ext_count, exts);
+    uint32_t sync_found = 0;
+    for (uint32_t i = 0; i < ext_count; ++i) {
+        for (uint32_t j = 0; j < sizeof(sync_extensions) / sizeof(*sync_extensions); ++j) {
+            if (!strcmp(exts[i].extensionName, sync_extensions[j])) {
+                sync_found++;
+            }
+        }
+    }
+    free(exts);
+    data.vksync = sync_found == sizeof(sync_extensions) / sizeof(*sync_extensions);
+    if (data.vksync) {
+        for (uint32_t j = 0; j < sizeof(sync_extensions) / sizeof(*sync_extensions); ++j) {
+            device_extensions[device_extension_count++] = sync_extensions[j];
+        }
+    }
+    /* must stay last, it is dropped if device creation fails */
+    device_extensions[device_extension_count++] = VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME;
+
     float queuePriority = 1.0;
     VkDeviceQueueCreateInfo queueInfo = {};
     queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
@@ -333,7 +424,7 @@ static bool vulkan_init()
     deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     deviceInfo.queueCreateInfoCount = 1;
     deviceInfo.pQueueCreateInfos = &queueInfo;
-    deviceInfo.enabledExtensionCount = sizeof(device_extensions) / sizeof(*device_extensions);
+    deviceInfo.enabledExtensionCount = device_extension_count;
     deviceInfo.ppEnabledExtensionNames = device_extensions;
     res = vk_f.CreateDevice(data.vkphys_dev, &deviceInfo, NULL, &data.vkdev);
     if (res != VK_SUCCESS) {
@@ -354,6 +445,20 @@ static bool vulkan_init()
     GETDEVPROC(GetImageMemoryRequirements2KHR);
     GETDEVPROC(BindImageMemory2KHR);
     GETDEVPROC(GetMemoryFdKHR);
+    GETDEVPROC(GetDeviceQueue);
+    GETDEVPROC(QueueSubmit);
+    GETDEVPROC(QueueWaitIdle);
+    GETDEVPROC(CreateSemaphore);
+    GETDEVPROC(DestroySemaphore);
+
+    vk_f.GetDeviceQueue(data.vkdev, queueInfo.queueFamilyIndex, 0, &data.vkqueue);
+
+    vk_f.GetSemaphoreFdKHR = data.vksync ? (PFN_vkGetSemaphoreFdKHR)
+        vk_f.GetDeviceProcAddr(data.vkdev, "vkGetSemaphoreFdKHR") : NULL;
+    if (!vk_f.GetSemaphoreFdKHR) {
+        data.vksync = false;
+        hlog("Vulkan: External semaphore support not available");
+    }
 
     vk_f.GetImageDrmFormatModifierPropertiesEXT = (PFN_vkGetImageDrmFormatModifierPropertiesEXT)
         vk_f.GetDeviceProcAddr(data.vkdev, "vkGetImageDrmFormatModifierPropertiesEXT");
@@ -379,13 +484,23 @@ fail:
 #undef GETINSTPROC
 #undef GETDEVPROC
 
+static void gl_gen_fbo()
+{
+    /* DSA needs a framebuffer object up front, not just a name */
+    if (data.dsa) {
+        glCreateFramebuffers(1, &data.fbo);
+    } else {
+        glGenFramebuffers(1, &data.fbo);
+    }
+}
+
 static bool vulkan_shtex_init()
 {
     if (!vulkan_init()) {
         return false;
     }
 
-    glGenFramebuffers(1, &data.fbo);
+    gl_gen_fbo();
     if (data.fbo == 0) {
         hlog("Failed to initialize FBO");
         return false;
@@ -396,7 +511,7 @@ static bool vulkan_shtex_init()
     const bool map_host = capture_allocate_map_host();
     const bool same_device = capture_compare_device_uuid(data.device_uuid);
 
-    hlog("Texture %s %ux%u", "GL_RGBA (Vulkan)", data.width, data.height);
+    hlog("Texture %s %ux%u", "GL_RGBA (Vulkan)", data.export_width, data.export_height);
 
     VkExternalMemoryImageCreateInfo ext_mem_image_info = {};
     ext_mem_image_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
@@ -412,8 +527,8 @@ static bool vulkan_shtex_init()
     img_info.samples = VK_SAMPLE_COUNT_1_BIT;
     img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    img_info.extent.width = data.width;
-    img_info.extent.height = data.height;
+    img_info.extent.width = data.export_width;
+    img_info.extent.height = data.export_height;
     img_info.extent.depth = 1;
     img_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
     img_info.tiling = VK_IMAGE_TILING_LINEAR;
@@ -446,6 +561,9 @@ static bool vulkan_shtex_init()
             if (linear && modifier_props[i].drmFormatModifier != DRM_FORMAT_MOD_LINEAR) {
                 continue;
             }
+            if (!capture_modifier_supported(DRM_FORMAT_ABGR8888, modifier_props[i].drmFormatModifier)) {
+                continue;
+            }
             VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {};
             mod_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
             mod_info.drmFormatModifier = modifier_props[i].drmFormatModifier;
@@ -599,7 +717,7 @@ static bool vulkan_shtex_init()
     glGenTextures(1, &data.texture);
     glBindTexture(GL_TEXTURE_2D, data.texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_TILING_EXT, img_info.tiling == VK_IMAGE_TILING_LINEAR || linear ? GL_LINEAR_TILING_EXT : GL_OPTIMAL_TILING_EXT);
-    glTexStorageMem2DEXT(GL_TEXTURE_2D, 1, GL_RGBA8, data.width, data.height, glmem, 0);
+    glTexStorageMem2DEXT(GL_TEXTURE_2D, 1, GL_RGBA8, data.export_width, data.export_height, glmem, 0);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
@@ -666,23 +784,137 @@ static bool vulkan_shtex_init()
     return true;
 }
 
-static void querySurface(int *width, int *height)
+static bool has_extension(const char *list, const char *name)
+{
+    const size_t len = strlen(name);
+    while (list && (list = strstr(list, name))) {
+        if (list[len] == ' ' || list[len] == '\0') {
+            return true;
+        }
+        list += len;
+    }
+    return false;
+}
+
+static bool gl_has_extension(int major, const char *name)
+{
+    if (major < 3) {
+        return has_extension((const char *)glGetString(GL_EXTENSIONS), name);
+    }
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; ++i) {
+        if (!strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool egl_has_native_fence()
+{
+    return egl_f.QueryString && egl_f.CreateSyncKHR && egl_f.DestroySyncKHR &&
+        egl_f.DupNativeFenceFDANDROID &&
+        has_extension(egl_f.QueryString(data.display, P_EGL_EXTENSIONS), "EGL_ANDROID_native_fence_sync");
+}
+
+/* Queried once per capture so the copy needs no glGet round trips */
+static void gl_query_caps()
+{
+    const char *version = (const char *)glGetString(GL_VERSION);
+    const bool es = version && !strncmp(version, "OpenGL ES", 9);
+    int major = 0, minor = 0;
+    if (version) {
+        sscanf(es ? version + 9 : version, "%d.%d", &major, &minor);
+    }
+    data.gl_major = major;
+
+    data.dsa = !es && (major > 4 || (major == 4 && minor >= 5) ||
+            (major >= 3 && gl_has_extension(major, "GL_ARB_direct_state_access")));
+    data.srgb_backbuffer = true;
+    if (data.dsa) {
+        GLint encoding = GL_SRGB;
+        glGetNamedFramebufferAttachmentParameteriv(0, GL_BACK_LEFT,
+                GL_FRAMEBUFFER_ATTACHMENT_COLOR_ENCODING, &encoding);
+        data.srgb_backbuffer = glGetError() != GL_NO_ERROR || encoding != GL_LINEAR;
+    }
+}
+
+static bool vulkan_shtex_init_sync()
+{
+    if (!data.vksync || !gl_has_extension(data.gl_major, "GL_EXT_semaphore_fd")) {
+        return false;
+    }
+
+    VkExportSemaphoreCreateInfo export_info = {};
+    export_info.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+    export_info.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &export_info;
+
+    VkResult res = vk_f.CreateSemaphore(data.vkdev, &semaphore_info, NULL, &data.vksemaphore);
+    if (res != VK_SUCCESS) {
+        hlog("Vulkan: Failed to create semaphore %s", result_to_str(res));
+        data.vksemaphore = VK_NULL_HANDLE;
+        return false;
+    }
+
+    export_info.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+    res = vk_f.CreateSemaphore(data.vkdev, &semaphore_info, NULL, &data.vkexport_semaphore);
+    if (res != VK_SUCCESS) {
+        hlog("Vulkan: Failed to create sync_fd semaphore %s", result_to_str(res));
+        data.vkexport_semaphore = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VkSemaphoreGetFdInfoKHR fd_info = {};
+    fd_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+    fd_info.semaphore = data.vksemaphore;
+    fd_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_OPAQUE_FD_BIT;
+    int fd = -1;
+    res = vk_f.GetSemaphoreFdKHR(data.vkdev, &fd_info, &fd);
+    if (res != VK_SUCCESS) {
+        hlog("Vulkan: GetSemaphoreFdKHR opaque_fd failed %s", result_to_str(res));
+        return false;
+    }
+
+    glGenSemaphoresEXT(1, &data.glsemaphore);
+    glImportSemaphoreFdEXT(data.glsemaphore, GL_HANDLE_TYPE_OPAQUE_FD_EXT, fd);
+    if (!glIsSemaphoreEXT(data.glsemaphore) || glGetError() != GL_NO_ERROR) {
+        hlog("Vulkan: OpenGL semaphore import failed");
+        return false;
+    }
+
+    return true;
+}
+
+static void querySurface(void *display, void *surface, int *width, int *height)
 {
     if (data.glx) {
         unsigned w, h;
-        glx_f.QueryDrawable(data.display, data.surface, P_GLX_WIDTH, &w);
-        glx_f.QueryDrawable(data.display, data.surface, P_GLX_HEIGHT, &h);
+        glx_f.QueryDrawable(display, surface, P_GLX_WIDTH, &w);
+        glx_f.QueryDrawable(display, surface, P_GLX_HEIGHT, &h);
         *width = w;
         *height = h;
     } else {
-        egl_f.QuerySurface(data.display, data.surface, P_EGL_WIDTH, width);
-        egl_f.QuerySurface(data.display, data.surface, P_EGL_HEIGHT, height);
+        egl_f.QuerySurface(display, surface, P_EGL_WIDTH, width);
+        egl_f.QuerySurface(display, surface, P_EGL_HEIGHT, height);
     }
 }
 
+static void *gl_current_context()
+{
+    return data.glx ? glx_f.GetCurrentContext() : egl_f.GetCurrentContext();
+}
+
 static void gl_free()
 {
     const bool was_capturing = data.nfd;
+    /* GL names belong to the context that created them, in another one
+     * they could be the game's. Otherwise they go away with the context. */
+    const bool own_context = !data.context || gl_current_context() == data.context;
 
     if (data.nfd) {
         for (int i = 0; i < data.nfd; ++i) {
@@ -708,12 +940,16 @@ static void gl_free()
     }
 
     if (data.fbo) {
-        glDeleteFramebuffers(1, &data.fbo);
+        if (own_context) {
+            glDeleteFramebuffers(1, &data.fbo);
+        }
         data.fbo = 0;
     }
 
     if (data.texture) {
-        glDeleteTextures(1, &data.texture);
+        if (own_context) {
+            glDeleteTextures(1, &data.texture);
+        }
         data.texture = 0;
     }
 
@@ -727,6 +963,32 @@ static void gl_free()
         data.vkmemory = VK_NULL_HANDLE;
     }
 
+    if (data.vksemaphore) {
+        /* the last submit may still be waiting on the semaphores */
+        vk_f.QueueWaitIdle(data.vkqueue);
+    }
+
+    if (data.glsemaphore) {
+        if (own_context) {
+            glDeleteSemaphoresEXT(1, &data.glsemaphore);
+        }
+        data.glsemaphore = 0;
+    }
+
+    if (data.vksemaphore) {
+        vk_f.DestroySemaphore(data.vkdev, data.vksemaphore, NULL);
+        data.vksemaphore = VK_NULL_HANDLE;
+    }
+
+    if (data.vkexport_semaphore) {
+        vk_f.DestroySemaphore(data.vkdev, data.vkexport_semaphore, NULL);
+        data.vkexport_semaphore = VK_NULL_HANDLE;
+    }
+
+    data.sync_mode = GL_SYNC_NONE;
+    data.context = NULL;
+    data.surface = NULL;
+
     capture_stop();
 
     if (was_capturing) {
@@ -743,10 +1005,13 @@ static void gl_copy_backbuffer(GLuint dst)
     glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, dst, 0);
     glReadBuffer(GL_BACK);
     glDrawBuffer(GL_COLOR_ATTACHMENT0);
-    glBlitFramebuffer(0, 0, data.width, data.height, 0, 0, data.width, data.height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    const int y0 = data.height - data.crop.y - data.crop.height;
+    glBlitFramebuffer(data.crop.x, y0, data.crop.x + data.crop.width, y0 + data.crop.height,
+            0, 0, data.export_width, data.export_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
 }
 
-static void gl_shtex_capture()
+/* Without DSA the copy needs our bindings, the game's are put back */
+static void gl_copy_backbuffer_restore()
 {
     GLboolean last_srgb;
     GLint last_read_fbo;
@@ -770,6 +1035,108 @@ static void gl_shtex_capture()
     }
 }
 
+static void gl_copy_backbuffer_dsa()
+{
+    GLboolean last_srgb = GL_FALSE;
+    if (data.srgb_backbuffer) {
+        last_srgb = glIsEnabled(GL_FRAMEBUFFER_SRGB);
+        if (last_srgb) {
+            glDisable(GL_FRAMEBUFFER_SRGB);
+        }
+    }
+
+    glNamedFramebufferReadBuffer(0, GL_BACK);
+    const int y0 = data.height - data.crop.y - data.crop.height;
+    glBlitNamedFramebuffer(0, data.fbo, data.crop.x, y0, data.crop.x + data.crop.width, y0 + data.crop.height,
+            0, 0, data.export_width, data.export_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+
+    if (last_srgb) {
+        glEnable(GL_FRAMEBUFFER_SRGB);
+    }
+}
+
+/* Returns a sync_file that signals once the copy is done, -1 when OBS has to
+ * rely on implicit sync */
+static int gl_shtex_export_sync()
+{
+    if (data.sync_mode == GL_SYNC_EGL_FENCE) {
+        const int attribs[] = {
+            P_EGL_SYNC_NATIVE_FENCE_FD_ANDROID, P_EGL_NO_NATIVE_FENCE_FD_ANDROID,
+            P_EGL_NONE,
+        };
+        void *sync = egl_f.CreateSyncKHR(data.display, P_EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+        if (!sync) {
+            hlog("Failed to create native fence, using implicit sync");
+            data.sync_mode = GL_SYNC_NONE;
+            return -1;
+        }
+        /* the fd only exists once the fence is flushed */
+        glFlush();
+        const int fd = egl_f.DupNativeFenceFDANDROID(data.display, sync);
+        egl_f.DestroySyncKHR(data.display, sync);
+        return fd;
+    }
+
+    if (data.sync_mode == GL_SYNC_VK_SEMAPHORE) {
+        const GLenum layout = GL_LAYOUT_GENERAL_EXT;
+        glSignalSemaphoreEXT(data.glsemaphore, 0, NULL, 1, &data.texture, &layout);
+        /* Vulkan must not wait before the signal is submitted */
+        glFlush();
+
+        const VkPipelineStageFlags stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+        VkSubmitInfo submit_info = {};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores = &data.vksemaphore;
+        submit_info.pWaitDstStageMask = &stage;
+        submit_info.signalSemaphoreCount = 1;
+        submit_info.pSignalSemaphores = &data.vkexport_semaphore;
+        VkResult res = vk_f.QueueSubmit(data.vkqueue, 1, &submit_info, VK_NULL_HANDLE);
+        if (res != VK_SUCCESS) {
+            /* the GL semaphore stays signalled, it cannot be used again */
+            hlog("Vulkan: QueueSubmit failed, using implicit sync %s", result_to_str(res));
+            data.sync_mode = GL_SYNC_NONE;
+            return -1;
+        }
+
+        VkSemaphoreGetFdInfoKHR fd_info = {};
+        fd_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+        fd_info.semaphore = data.vkexport_semaphore;
+        fd_info.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+        int fd = -1;
+        res = vk_f.GetSemaphoreFdKHR(data.vkdev, &fd_info, &fd);
+        if (res != VK_SUCCESS) {
+            hlog("Vulkan: GetSemaphoreFdKHR sync_fd failed, using implicit sync %s", result_to_str(res));
+            data.sync_mode = GL_SYNC_NONE;
+            return -1;
+        }
+        return fd;
+    }
+
+    return -1;
+}
+
+static void gl_shtex_capture()
+{
+    const int64_t present_time = capture_clock_ns();
+
+    if (data.dsa) {
+        gl_copy_backbuffer_dsa();
+    } else {
+        gl_copy_backbuffer_restore();
+    }
+
+    const struct capture_rect damage = {
+        .width = data.export_width,
+        .height = data.export_height,
+    };
+    const int sync_fd = gl_shtex_export_sync();
+    capture_send_frame(0, ++data.frame_seq, sync_fd, &damage, present_time, 0);
+    if (sync_fd >= 0) {
+        close(sync_fd);
+    }
+}
+
 static bool gl_shtex_init()
 {
     if (vkcapture_glvulkan) {
@@ -784,23 +1151,23 @@ static bool gl_shtex_init()
         }
     }
 
-    glGenFramebuffers(1, &data.fbo);
+    gl_gen_fbo();
     if (data.fbo == 0) {
         hlog("Failed to initialize FBO");
         return false;
     }
 
-    hlog("Texture %s %ux%u", "GL_RGBA", data.width, data.height);
+    hlog("Texture %s %ux%u", "GL_RGBA", data.export_width, data.export_height);
 
     glGenTextures(1, &data.texture);
     glBindTexture(GL_TEXTURE_2D, data.texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, data.width, data.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, data.export_width, data.export_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
     if (data.glx) {
         unsigned long root = P_DefaultRootWindow(data.display);
-        data.xpixmap = x11_f.XCreatePixmap(data.display, root, data.width, data.height, 24);
+        data.xpixmap = x11_f.XCreatePixmap(data.display, root, data.export_width, data.export_height, 24);
 
         const int pixmap_config[] = {
             P_GLX_BIND_TO_TEXTURE_RGBA_EXT, true,
@@ -888,16 +1255,26 @@ fail:
     return false;
 }
 
-static bool gl_init(void *display, void *surface)
+static bool gl_init(struct gl_surface *surface)
 {
-    data.display = display;
-    data.surface = surface;
-    querySurface(&data.width, &data.height);
-
-    if (data.glx) {
-        data.winid = (uintptr_t)surface;
+    data.display = surface->display;
+    data.surface = surface->surface;
+    data.context = surface->context;
+    data.width = surface->width;
+    data.height = surface->height;
+    data.winid = surface->winid;
+    capture_get_crop(data.width, data.height, &data.crop);
+    if (data.crop.width != data.width || data.crop.height != data.height) {
+        hlog("Cropping to %dx%d at %d,%d", data.crop.width, data.crop.height,
+                data.crop.x, data.crop.y);
+    }
+    capture_get_export_size(data.crop.width, data.crop.height, &data.export_width, &data.export_height);
+    if (data.export_width != data.crop.width || data.export_height != data.crop.height) {
+        hlog("Scaling to %dx%d", data.export_width, data.export_height);
     }
 
+    gl_query_caps();
+
     GLint last_tex;
     glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_tex);
 
@@ -913,41 +1290,177 @@ static bool gl_init(void *display, void *surface)
         return false;
     }
 
-    capture_init_shtex(data.width, data.height, data.buf_fourcc,
+    if (data.dsa) {
+        glNamedFramebufferTexture(data.fbo, GL_COLOR_ATTACHMENT0, data.texture, 0);
+        glNamedFramebufferDrawBuffer(data.fbo, GL_COLOR_ATTACHMENT0);
+    }
+
+    data.frame_seq = 0;
+    data.sync_mode = GL_SYNC_NONE;
+    if (!data.glx && egl_has_native_fence()) {
+        data.sync_mode = GL_SYNC_EGL_FENCE;
+    } else if (data.vkimage && vulkan_shtex_init_sync()) {
+        data.sync_mode = GL_SYNC_VK_SEMAPHORE;
+    }
+    hlog("Copy %s, %s", data.dsa ? "DSA" : "with state restore",
+            data.sync_mode == GL_SYNC_EGL_FENCE ? "native fence" :
+            data.sync_mode == GL_SYNC_VK_SEMAPHORE ? "Vulkan semaphore" :
+            "implicit sync");
+
+    capture_init_shtex(data.export_width, data.export_height,
+            &data.crop, data.buf_fourcc,
             data.buf_strides, data.buf_offsets, data.buf_modifier,
-            data.winid, /*flip*/true, data.nfd, data.buf_fds);
+            data.winid, /*flip*/true, /*memfd*/false, /*slot*/0, /*nslots*/1,
+            data.nfd, data.buf_fds);
 
     hlog("------------------ opengl capture started ------------------");
 
     return true;
 }
 
+static struct gl_surface *gl_find_surface(void *display, void *surface, bool create)
+{
+    struct gl_surface *oldest = NULL;
+    for (int i = 0; i < MAX_SURFACE_COUNT; ++i) {
+        struct gl_surface *s = &data.surfaces[i];
+        if (s->surface == surface && s->display == display) {
+            return s;
+        }
+        if (s != data.target && (!oldest || s->last_present < oldest->last_present)) {
+            oldest = s;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->display = display;
+    oldest->surface = surface;
+    oldest->winid = data.glx ? (uintptr_t)surface : 0;
+    oldest->serial = ++data.surface_serial;
+    return oldest;
+}
+
+static inline bool gl_surface_candidate(const struct gl_surface *s, int64_t now)
+{
+    return s->surface && s->width > 0 && s->height > 0 &&
+        (s->width > 1 || s->height > 1) && now - s->last_present < SURFACE_IDLE_NS;
+}
+
+static bool gl_surface_preferred(const struct gl_surface *s,
+        const struct gl_surface *other, int policy, uint32_t winid)
+{
+    if (winid && (s->winid == winid) != (other->winid == winid)) {
+        return s->winid == winid;
+    }
+    if (policy == CAPTURE_SWAPCHAIN_RECENT) {
+        return s->serial > other->serial;
+    }
+    return (int64_t)s->width * s->height > (int64_t)other->width * other->height;
+}
+
+/* Picks the surface to capture among all recently swapped ones, the same
+ * way the Vulkan layer picks a swapchain. The current one is kept unless
+ * another is strictly preferred. */
+static void gl_select_surface(struct gl_surface *presented, int64_t now)
+{
+    if (!data.target) {
+        data.target = presented;
+        data.select_time = now;
+        return;
+    }
+    if (now - data.select_time < SURFACE_SELECT_NS) {
+        return;
+    }
+
+    int policy = capture_get_swapchain_policy();
+    if (!policy) {
+        policy = CAPTURE_SWAPCHAIN_LARGEST;
+    }
+    const uint32_t winid = capture_get_winid();
+
+    struct gl_surface *target = gl_surface_candidate(data.target, now) ? data.target : NULL;
+    for (int i = 0; i < MAX_SURFACE_COUNT; ++i) {
+        struct gl_surface *s = &data.surfaces[i];
+        if (gl_surface_candidate(s, now) &&
+                (!target || gl_surface_preferred(s, target, policy, winid))) {
+            target = s;
+        }
+    }
+
+    if (target && target != data.target) {
+        hlog("Capturing surface %dx%d winid 0x%x", target->width, target->height, target->winid);
+    }
+    data.target = target;
+    data.select_time = now;
+}
+
 static void gl_capture(void *display, void *surface)
 {
+    if (capture_dormant()) {
+        return;
+    }
+
+    const int64_t start = os_time_get_nano();
+
     capture_update_socket();
 
+    /* other surfaces are only queried when the target is picked again */
+    struct gl_surface *presented = gl_find_surface(display, surface, true);
+    if (!presented->last_present || presented == data.target ||
+            start - data.select_time >= SURFACE_SELECT_NS) {
+        querySurface(display, surface, &presented->width, &presented->height);
+    }
+    presented->context = gl_current_context();
+    presented->last_present = start;
+
+    gl_select_surface(presented, start);
+    if (presented != data.target) {
+        return;
+    }
+
     if (capture_should_stop()) {
         gl_free();
     }
 
+    if (capture_ready() && (presented->width != data.width ||
+                presented->height != data.height ||
+                presented->context != data.context ||
+                presented->display != data.display)) {
+        /* minimized windows report no size, keep the texture for them */
+        if (presented->width == 0 || presented->height == 0) {
+            return;
+        }
+        gl_free();
+    }
+
+    if (capture_ready() && presented->surface != data.surface) {
+        /* same size and context, OBS can keep its import */
+        hlog("Switching to surface %dx%d, reusing shared texture", data.width, data.height);
+        data.surface = presented->surface;
+    }
+
     if (capture_should_init()) {
-        if (!gl_init(display, surface)) {
+        if (!gl_init(presented)) {
             gl_free();
             data.valid = false;
             hlog("gl_init failed");
+        } else {
+            capture_stats_init(os_time_get_nano() - start);
         }
     }
 
-    if (capture_ready() && data.surface == surface) {
-        int width, height;
-        querySurface(&width, &height);
-        if (data.height != height || data.width != width) {
-            if (width != 0 && height != 0) {
-                gl_free();
-            }
+    if (capture_ready()) {
+        if (capture_should_skip_frame()) {
+            capture_stats_present(os_time_get_nano() - start, false);
             return;
         }
+        const int64_t copy_start = os_time_get_nano();
         gl_shtex_capture();
+        const int64_t end = os_time_get_nano();
+        /* only CPU time, the blit itself is not timed on the GPU */
+        capture_stats_copy(end - copy_start, false);
+        capture_stats_present(end - start, true);
     }
 }
 
@@ -995,7 +1508,9 @@ unsigned eglDestroyContext(void *display, void *context)
         return 0;
     }
 
-    gl_free();
+    if (context == data.context) {
+        gl_free();
+    }
 
     return egl_f.DestroyContext(display, context);
 }
@@ -1021,7 +1536,7 @@ void *eglCreateWindowSurface(void *display, void *config, void *win, const intpt
 
     void *res = egl_f.CreateWindowSurface(display, config, win, attrib_list);
     if (res) {
-        data.winid = (uintptr_t)win;
+        gl_find_surface(display, res, true)->winid = (uintptr_t)win;
     }
 
     return res;
@@ -1082,7 +1597,9 @@ void glXDestroyContext(void *display, void *context)
         return;
     }
 
-    gl_free();
+    if (context == data.context) {
+        gl_free();
+    }
 
     glx_f.DestroyContext(display, context);
 }
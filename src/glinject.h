@@ -25,6 +25,11 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #define P_EGL_HEIGHT 0x3056
 #define P_EGL_WIDTH 0x3057
 #define P_EGL_GL_TEXTURE_2D 0x30B1
+#define P_EGL_NONE 0x3038
+#define P_EGL_EXTENSIONS 0x3055
+#define P_EGL_SYNC_NATIVE_FENCE_ANDROID 0x3144
+#define P_EGL_SYNC_NATIVE_FENCE_FD_ANDROID 0x3145
+#define P_EGL_NO_NATIVE_FENCE_FD_ANDROID -1
 
 struct egl_funcs {
     void *(*GetProcAddress)(const char*);
@@ -38,6 +43,12 @@ struct egl_funcs {
     unsigned (*ExportDMABUFImageQueryMESA)(void *dpy, void *image, int *fourcc, int *num_planes, uint64_t *modifiers);
     unsigned (*ExportDMABUFImageMESA)(void *dpy, void *image, int *fds, int *strides, int *offsets);
 
+    /* optional, NULL when EGL_ANDROID_native_fence_sync is missing */
+    const char *(*QueryString)(void *display, int name);
+    void *(*CreateSyncKHR)(void *display, unsigned type, const int *attrib_list);
+    unsigned (*DestroySyncKHR)(void *display, void *sync);
+    int (*DupNativeFenceFDANDROID)(void *display, void *sync);
+
     bool valid;
 };
 
@@ -64,6 +75,7 @@ struct glx_funcs {
     void *(*GetProcAddress)(const char*);
     void *(*GetProcAddressARB)(const char*);
     void (*DestroyContext)(void *display, void *context);
+    void *(*GetCurrentContext)();
     void (*SwapBuffers)(void *display, void *drawable);
     int64_t (*SwapBuffersMscOML)(void *display, void *drawable, int64_t target_msc, int64_t divisor, int64_t remainder);
     void *(*CreatePixmap)(void *display, void *config, unsigned long pixmap, const int *attribList);
@@ -172,6 +184,7 @@ struct vk_funcs {
     PFN_vkGetPhysicalDeviceMemoryProperties GetPhysicalDeviceMemoryProperties;
     PFN_vkGetPhysicalDeviceFormatProperties2KHR GetPhysicalDeviceFormatProperties2KHR;
     PFN_vkGetPhysicalDeviceImageFormatProperties2KHR GetPhysicalDeviceImageFormatProperties2KHR;
+    PFN_vkEnumerateDeviceExtensionProperties EnumerateDeviceExtensionProperties;
 
     PFN_vkCreateImage CreateImage;
     PFN_vkDestroyImage DestroyImage;
@@ -182,6 +195,12 @@ struct vk_funcs {
     PFN_vkGetImageDrmFormatModifierPropertiesEXT GetImageDrmFormatModifierPropertiesEXT;
     PFN_vkBindImageMemory2KHR BindImageMemory2KHR;
     PFN_vkGetMemoryFdKHR GetMemoryFdKHR;
+    PFN_vkGetDeviceQueue GetDeviceQueue;
+    PFN_vkQueueSubmit QueueSubmit;
+    PFN_vkQueueWaitIdle QueueWaitIdle;
+    PFN_vkCreateSemaphore CreateSemaphore;
+    PFN_vkDestroySemaphore DestroySemaphore;
+    PFN_vkGetSemaphoreFdKHR GetSemaphoreFdKHR;
 
     bool valid;
 };
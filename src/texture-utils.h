@@ -0,0 +1,82 @@
+/*
+OBS Linux Vulkan/OpenGL game capture
+Copyright (C) 2021 David Rosca <nowrep@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program. If not, see <https://www.gnu.org/licenses/>
+*/
+
+#pragma once
+
+#include <obs.h>
+#include <string.h>
+
+#include "capture.h"
+
+/* Uploads `rect` of a GS_DYNAMIC texture from `data` pointing at the rect's
+ * first pixel, the rest keeps what the previous upload left in the staging
+ * buffer. `rect` must lie inside the texture. */
+static inline void texture_set_subimage(gs_texture_t *tex, const uint8_t *data,
+        uint32_t linesize, const struct capture_rect *rect)
+{
+    if (rect->x == 0 && rect->y == 0 &&
+            rect->width == (int32_t)gs_texture_get_width(tex) &&
+            rect->height == (int32_t)gs_texture_get_height(tex)) {
+        gs_texture_set_image(tex, data, linesize, false);
+        return;
+    }
+
+    uint8_t *ptr;
+    uint32_t tex_linesize;
+    if (!gs_texture_map(tex, &ptr, &tex_linesize)) {
+        return;
+    }
+    const uint32_t bpp = gs_get_format_bpp(gs_texture_get_color_format(tex)) / 8;
+    ptr += rect->y * tex_linesize + rect->x * bpp;
+    for (int32_t y = 0; y < rect->height; ++y) {
+        memcpy(ptr + y * tex_linesize, data + y * linesize, rect->width * bpp);
+    }
+    gs_texture_unmap(tex);
+}
+
+/* Same with `data` pointing at the whole image, an empty rect uploads all */
+static inline void texture_set_image_rect(gs_texture_t *tex, const uint8_t *data,
+        uint32_t linesize, const struct capture_rect *rect)
+{
+    const int32_t width = gs_texture_get_width(tex);
+    const int32_t height = gs_texture_get_height(tex);
+
+    struct capture_rect r = *rect;
+    if (r.x < 0) {
+        r.width += r.x;
+        r.x = 0;
+    }
+    if (r.y < 0) {
+        r.height += r.y;
+        r.y = 0;
+    }
+    if (r.x + r.width > width) {
+        r.width = width - r.x;
+    }
+    if (r.y + r.height > height) {
+        r.height = height - r.y;
+    }
+
+    if (capture_rect_empty(&r)) {
+        gs_texture_set_image(tex, data, linesize, false);
+        return;
+    }
+
+    const uint32_t bpp = gs_get_format_bpp(gs_texture_get_color_format(tex)) / 8;
+    texture_set_subimage(tex, data + r.y * linesize + r.x * bpp, linesize, &r);
+}
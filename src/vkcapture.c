@@ -20,27 +20,52 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include <obs-module.h>
 #include <obs-nix-platform.h>
+#include <util/platform.h>
+#include <util/threading.h>
 
 #include <poll.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include <inttypes.h>
 #include <sys/un.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <linux/dma-buf.h>
 
 #include "utils.h"
 #include "capture.h"
+#include "texture-utils.h"
 #include "plugin-macros.h"
 
 #if HAVE_X11_XCB
 #include "xcursor-xcb.h"
+#include <xcb/xcbext.h>
 static xcb_connection_t *xcb = NULL;
+
+/* Shared by all sources. Requests are sent in one tick and their replies
+ * picked up in a later one, the graphics thread never waits for X. The
+ * image is only fetched again when XFixes reports a new cursor. */
+static struct {
+    xcb_window_t root;
+    uint8_t first_event;
+    bool need_image;
+    bool image_pending;
+    xcb_xfixes_get_cursor_image_cookie_t image_cookie;
+    xcb_xfixes_get_cursor_image_reply_t *image;
+    bool pointer_pending;
+    xcb_query_pointer_cookie_t pointer_cookie;
+    int x;
+    int y;
+} xcursor_state;
 #endif
 
 #if HAVE_WAYLAND
@@ -49,64 +74,272 @@ static struct wl_display *wl_display = NULL;
 static wl_cursor_t *wlcursor = NULL;
 #endif
 
+/* video frame the shared cursor state was last updated for */
+static uint64_t cursor_tick_time = 0;
+
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 static uint8_t gl_device_uuid[16];
 void (*p_glGetUnsignedBytei_vEXT)(unsigned int target, unsigned int index, unsigned char *data) = NULL;
 
+static struct capture_format_modifiers egl_formats[CAPTURE_MAX_FORMATS];
+static uint32_t egl_nformats = 0;
+
+static bool egl_sync_checked = false;
+static bool egl_native_fence = false;
+static PFNEGLCREATESYNCKHRPROC p_eglCreateSyncKHR = NULL;
+static PFNEGLDESTROYSYNCKHRPROC p_eglDestroySyncKHR = NULL;
+static PFNEGLCLIENTWAITSYNCKHRPROC p_eglClientWaitSyncKHR = NULL;
+static PFNEGLWAITSYNCKHRPROC p_eglWaitSyncKHR = NULL;
+
 enum vkcapture_import_attempt {
     IMPORT_DEFAULT = 0,
     IMPORT_NO_MODIFIERS = 1,
     IMPORT_LINEAR = 2,
     IMPORT_LINEAR_HOST_MAPPED = 3,
-    IMPORT_FAILURES_MAX = IMPORT_LINEAR_HOST_MAPPED,
+    IMPORT_MEMFD = 4,
+    IMPORT_FAILURES_MAX = IMPORT_MEMFD,
 };
 
+#define DAMAGE_HISTORY 4
+
+typedef struct {
+    /* last reported frames of this slot, sources that uploaded it long ago
+     * upload everything */
+    uint64_t damage_seq[DAMAGE_HISTORY];
+    struct capture_rect damage[DAMAGE_HISTORY];
+    int damage_index;
+} vkcapture_slot_t;
+
 typedef struct {
+    int fds[4];
+    int32_t strides[4];
+    int32_t offsets[4];
+} vkcapture_planes_t;
+
+/* Dmabufs of one allocation, immutable once published. Sources take a
+ * reference and import them without holding any lock. */
+typedef struct {
+    long refs;
+    int id;
+    int nslots;
+    struct capture_texture_data tdata;
+    vkcapture_planes_t slots[CAPTURE_MAX_SLOTS];
+} vkcapture_buffers_t;
+
+/* Refcounted, the server thread and every source capturing it hold a
+ * reference. `mutex` guards everything below it, cdata and exe_hash are
+ * only written with server.mutex held as well. */
+typedef struct {
+    long refs;
     int id;
+    uint32_t exe_hash;
+    struct capture_client_data cdata;
+    bool unresponsive;
+
+    pthread_mutex_t mutex;
+    bool connected;
     int sockfd;
     int activated;
-    int buf_id;
-    int buf_fds[4];
+    vkcapture_buffers_t *buffers;
+    // allocation whose slots are still arriving
+    vkcapture_buffers_t *pending;
+    int nslots;
+    vkcapture_slot_t slots[CAPTURE_MAX_SLOTS];
+    int frame_slot;
+    uint64_t frame_seq;
+    int64_t frame_present_time;
+    int64_t frame_complete_time;
+    int frame_sync_fd;
     int import_failures;
-    size_t map_size;
-    void *map_memory;
     uint64_t timeout;
-    bool unresponsive;
-    struct capture_client_data cdata;
-    struct capture_texture_data tdata;
+    bool limit_rate;
+    bool downscale;
+    bool yuv;
+    bool yuv_failed;
+    int swapchain;
+    uint32_t winid;
+    struct capture_crop crop;
+    uint64_t control_time;
+    struct capture_control_data control;
+    // what the client reads of it, see CAPTURE_PROTOCOL_VERSION
+    size_t control_size;
+    struct capture_alloc_hint hint;
+    struct capture_control_shm *control_shm;
+    struct capture_stats_data stats;
 } vkcapture_client_t;
 
 static struct {
     bool quit;
     int eventfd;
+    int epollfd;
     pthread_t thread;
+    // guards the clients array only
     pthread_mutex_t mutex;
-    DARRAY(struct pollfd) fds;
-    DARRAY(vkcapture_client_t) clients;
+    // bumped whenever a client connects, disconnects or identifies itself
+    long generation;
+    DARRAY(vkcapture_client_t *) clients;
 } server;
 
 static int source_instances = 0;
 
+static obs_data_t *import_cache = NULL;
+
+static gs_effect_t *yuv_effect = NULL;
+
+enum vkcapture_stage_state {
+    STAGE_FREE = 0,
+    STAGE_BUSY,
+    STAGE_READY,
+};
+
+// Changed part of a host mapped slot, copied out of the dmabuf
+typedef struct {
+    enum vkcapture_stage_state state;
+    uint8_t *data;
+    uint32_t linesize;
+    int slot;
+    uint64_t seq;
+    struct capture_rect rect;
+} vkcapture_stage_t;
+
+typedef struct {
+    int fd;
+    int stride;
+    // where the image starts, a memfd has its header in front
+    size_t offset;
+    bool memfd;
+    size_t size;
+    void *memory;
+} vkcapture_map_t;
+
+/* Host mapped frames are read out of the dmabuf on a worker thread, the
+ * render thread only uploads the staged copy and posts the next frame. */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool running;
+    bool quit;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;
+    vkcapture_map_t maps[CAPTURE_MAX_SLOTS];
+    // in the client's mailbox, held while a mapped dmabuf is read
+    struct capture_slot_state *slot_states;
+    vkcapture_stage_t stages[2];
+
+    // request, at most one at a time
+    bool pending;
+    int slot;
+    uint64_t seq;
+    struct capture_rect rect;
+    int sync_fd;
+    uint64_t requested_seq;
+} vkcapture_upload_t;
+
+// Textures made from one vkcapture_buffers_t, moved into the source as a whole
+typedef struct {
+    int buf_id;
+    int import_failures;
+    bool imported;
+    struct capture_texture_data tdata;
+    int ntextures;
+    gs_texture_t *textures[CAPTURE_MAX_SLOTS];
+    gs_texture_t *uv_textures[CAPTURE_MAX_SLOTS];
+    vkcapture_map_t maps[CAPTURE_MAX_SLOTS];
+} vkcapture_textures_t;
+
+/* New buffers are imported on a worker while the source keeps drawing the
+ * textures it has, video_tick swaps the result in once it is ready. Each
+ * texture gets its own graphics section so rendering goes on in between. */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool running;
+    bool quit;
+    // bumped to drop whatever is in flight
+    uint64_t serial;
+
+    // request, a newer one replaces it
+    vkcapture_buffers_t *request;
+    int request_failures;
+
+    bool ready;
+    vkcapture_textures_t result;
+} vkcapture_import_t;
+
+#define LATENCY_SAMPLES 128
+#define LATENCY_BUCKETS 10
+
+/* Time from the game's present to the frame being drawn by OBS */
+typedef struct {
+    pthread_mutex_t mutex;
+    uint64_t shown_seq;
+    // present time of the newest frame per slot, for host mapped frames
+    uint64_t slot_seq[CAPTURE_MAX_SLOTS];
+    int64_t slot_present_time[CAPTURE_MAX_SLOTS];
+    int64_t copy_time;
+    uint32_t samples[LATENCY_SAMPLES];
+    uint32_t count;
+    uint32_t index;
+    // [0, 1) ms, then doubling up to [256, inf) ms
+    uint32_t buckets[LATENCY_BUCKETS];
+} vkcapture_latency_t;
+
 typedef struct {
     obs_source_t *source;
-    gs_texture_t *texture;
+    gs_texture_t *textures[CAPTURE_MAX_SLOTS];
+    gs_texture_t *uv_textures[CAPTURE_MAX_SLOTS];
+    uint64_t upload_seq[CAPTURE_MAX_SLOTS];
+    vkcapture_upload_t upload;
+    vkcapture_import_t import;
+    vkcapture_latency_t latency;
+    int ntextures;
+    int last_slot;
+    // in the client's mailbox if imported slots are held while drawn
+    struct capture_slot_state *slot_states;
+    bool held[CAPTURE_MAX_SLOTS];
+    uint64_t held_seq;
+    // released once the fence shows the draws of the slot are done
+    bool release_pending[CAPTURE_MAX_SLOTS];
+    EGLSyncKHR release_sync[CAPTURE_MAX_SLOTS];
 #if HAVE_X11_XCB
     xcb_xcursor_t *xcursor;
-    uint32_t root_winid;
+    // position of the window on the root, refreshed without blocking
+    bool origin_pending;
+    xcb_translate_coordinates_cookie_t origin_cookie;
 #endif
     bool show_cursor;
     bool allow_transparency;
+    bool limit_rate;
+    bool downscale;
+    bool yuv;
+    int swapchain;
+    uint32_t winid;
+    struct capture_crop crop;
     bool window_match;
     bool window_exclude;
     const char *window;
+    uint32_t window_hash;
 
     int buf_id;
+    // buffers handed to the import worker
+    int import_buf_id;
+    // a frame of the current textures has been drawn
+    bool shown;
+    vkcapture_client_t *client;
+    // for lookups from other threads, `client` belongs to the graphics thread
     int client_id;
+    // server.generation the client choice was last checked at
+    long generation;
     struct capture_texture_data tdata;
 
 } vkcapture_source_t;
 
 static bool server_wakeup();
+static void activate_client(vkcapture_source_t *ctx, vkcapture_client_t *client, bool activate);
 
 static const char *import_attempt_str(enum vkcapture_import_attempt attempt)
 {
@@ -115,10 +348,29 @@ static const char *import_attempt_str(enum vkcapture_import_attempt attempt)
     case IMPORT_NO_MODIFIERS: return "no modifiers";
     case IMPORT_LINEAR: return "linear";
     case IMPORT_LINEAR_HOST_MAPPED: return "linear host mapped";
+    case IMPORT_MEMFD: return "memfd";
     default: return "invalid";
     }
 }
 
+/* Reading a memfd in cached system memory beats mapping the dmabuf, so it
+ * comes before it. Clients without memfd support answer a memfd request
+ * with host mapped dmabufs. Returns -1 once everything was tried. */
+static int next_import_attempt(int attempt)
+{
+    switch (attempt) {
+    case IMPORT_LINEAR: return IMPORT_MEMFD;
+    case IMPORT_MEMFD: return IMPORT_LINEAR_HOST_MAPPED;
+    case IMPORT_LINEAR_HOST_MAPPED: return -1;
+    default: return attempt + 1;
+    }
+}
+
+static inline bool import_host_mapped(int attempt)
+{
+    return attempt == IMPORT_LINEAR_HOST_MAPPED || attempt == IMPORT_MEMFD;
+}
+
 static int64_t clock_ns()
 {
     struct timespec t;
@@ -126,6 +378,68 @@ static int64_t clock_ns()
     return t.tv_sec * 1000000000 + t.tv_nsec;
 }
 
+static void latency_reset(vkcapture_latency_t *latency)
+{
+    pthread_mutex_lock(&latency->mutex);
+    latency->shown_seq = 0;
+    memset(latency->slot_seq, 0, sizeof(latency->slot_seq));
+    latency->copy_time = 0;
+    latency->count = 0;
+    latency->index = 0;
+    memset(latency->buckets, 0, sizeof(latency->buckets));
+    pthread_mutex_unlock(&latency->mutex);
+}
+
+static void latency_add(vkcapture_latency_t *latency, uint64_t seq, int64_t present_time)
+{
+    if (!present_time || seq == latency->shown_seq) {
+        return;
+    }
+
+    const int64_t us = (clock_ns() - present_time) / 1000;
+    const uint32_t sample = us < 0 ? 0 : us > UINT32_MAX ? UINT32_MAX : us;
+
+    int bucket = 0;
+    for (uint32_t ms = sample / 1000; ms && bucket < LATENCY_BUCKETS - 1; ms >>= 1) {
+        bucket++;
+    }
+
+    pthread_mutex_lock(&latency->mutex);
+    latency->shown_seq = seq;
+    latency->samples[latency->index] = sample;
+    latency->index = (latency->index + 1) % LATENCY_SAMPLES;
+    if (latency->count < LATENCY_SAMPLES) {
+        latency->count++;
+    }
+    latency->buckets[bucket]++;
+    pthread_mutex_unlock(&latency->mutex);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void latency_percentiles(vkcapture_latency_t *latency, uint32_t *p50, uint32_t *p99,
+        uint32_t *count)
+{
+    uint32_t sorted[LATENCY_SAMPLES];
+    pthread_mutex_lock(&latency->mutex);
+    *count = latency->count;
+    memcpy(sorted, latency->samples, latency->count * sizeof(uint32_t));
+    pthread_mutex_unlock(&latency->mutex);
+
+    if (!*count) {
+        *p50 = *p99 = 0;
+        return;
+    }
+    qsort(sorted, *count, sizeof(uint32_t), compare_u32);
+    *p50 = sorted[*count / 2];
+    *p99 = sorted[*count * 99 / 100];
+}
+
 static const struct {
     int32_t drm;
     enum gs_color_format gs;
@@ -142,6 +456,15 @@ static const struct {
     { DRM_FORMAT_XBGR16161616, GS_RGBA16 },
     { DRM_FORMAT_ABGR16161616F, GS_RGBA16F },
     { DRM_FORMAT_XBGR16161616F, GS_RGBA16F },
+    /* dmabuf import only, EGL samples them as the format OBS is told */
+    { DRM_FORMAT_RGB565, GS_BGRX },
+    { DRM_FORMAT_BGR565, GS_BGRX },
+    { DRM_FORMAT_ARGB1555, GS_BGRA },
+    /* NV12 and P010 planes */
+    { DRM_FORMAT_R8, GS_R8 },
+    { DRM_FORMAT_GR88, GS_R8G8 },
+    { DRM_FORMAT_R16, GS_R16 },
+    { DRM_FORMAT_GR1616, GS_RG16 },
 };
 
 static enum gs_color_format drm_format_to_gs(int32_t drm)
@@ -154,6 +477,48 @@ static enum gs_color_format drm_format_to_gs(int32_t drm)
     return GS_UNKNOWN;
 }
 
+// Needs graphics context
+static void query_dmabuf_modifiers()
+{
+    static bool queried = false;
+    if (queried) {
+        return;
+    }
+    queried = true;
+
+    EGLDisplay dpy = eglGetCurrentDisplay();
+    const char *exts = eglQueryString(dpy, EGL_EXTENSIONS);
+    PFNEGLQUERYDMABUFMODIFIERSEXTPROC query = NULL;
+    if (exts && strstr(exts, "EGL_EXT_image_dma_buf_import_modifiers")) {
+        query = (PFNEGLQUERYDMABUFMODIFIERSEXTPROC)eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+    }
+    if (!query) {
+        blog(LOG_INFO, "Cannot query dmabuf modifiers");
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(gs_format_table) / sizeof(gs_format_table[0]); ++i) {
+        if (egl_nformats == CAPTURE_MAX_FORMATS) {
+            break;
+        }
+        EGLuint64KHR modifiers[CAPTURE_MAX_MODIFIERS];
+        EGLBoolean external_only[CAPTURE_MAX_MODIFIERS];
+        EGLint num = 0;
+        if (!query(dpy, gs_format_table[i].drm, CAPTURE_MAX_MODIFIERS, modifiers, external_only, &num)) {
+            continue;
+        }
+        struct capture_format_modifiers *f = &egl_formats[egl_nformats++];
+        f->format = gs_format_table[i].drm;
+        f->nmodifiers = 0;
+        for (EGLint j = 0; j < num; ++j) {
+            /* textures are sampled as GL_TEXTURE_2D */
+            if (!external_only[j]) {
+                f->modifiers[f->nmodifiers++] = modifiers[j];
+            }
+        }
+    }
+}
+
 static void cursor_create(vkcapture_source_t *ctx)
 {
     bool try_xcb = false;
@@ -185,6 +550,16 @@ static void cursor_create(vkcapture_source_t *ctx)
         if (xcb) {
             ctx->xcursor = xcb_xcursor_init(xcb);
         }
+        if (xcb && ctx->xcursor && !xcursor_state.root) {
+            /* xcb_xcursor_init negotiated the XFixes version */
+            xcursor_state.root = xcb_setup_roots_iterator(xcb_get_setup(xcb)).data->root;
+            const xcb_query_extension_reply_t *ext = xcb_get_extension_data(xcb, &xcb_xfixes_id);
+            xcursor_state.first_event = ext ? ext->first_event : 0;
+            xcb_xfixes_select_cursor_input(xcb, xcursor_state.root,
+                    XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR);
+            xcursor_state.need_image = true;
+            xcb_flush(xcb);
+        }
     }
 #endif
 }
@@ -193,11 +568,16 @@ static void cursor_destroy(vkcapture_source_t *ctx)
 {
 #if HAVE_X11_XCB
     if (ctx->xcursor) {
+        if (ctx->origin_pending) {
+            xcb_discard_reply(xcb, ctx->origin_cookie.sequence);
+        }
         obs_enter_graphics();
         xcb_xcursor_destroy(ctx->xcursor);
         obs_leave_graphics();
     }
     if (!source_instances) {
+        free(xcursor_state.image);
+        memset(&xcursor_state, 0, sizeof(xcursor_state));
         if (xcb) {
             xcb_disconnect(xcb);
             xcb = NULL;
@@ -234,37 +614,90 @@ static bool cursor_enabled(vkcapture_source_t *ctx)
     return false;
 }
 
-static void cursor_update(vkcapture_source_t *ctx)
-{
 #if HAVE_X11_XCB
-    if (ctx->xcursor) {
-        if (!ctx->root_winid && ctx->tdata.winid) {
-            xcb_query_tree_cookie_t tre_c = xcb_query_tree_unchecked(xcb, ctx->tdata.winid);
-            xcb_query_tree_reply_t *tre_r = xcb_query_tree_reply(xcb, tre_c, NULL);
-            if (tre_r) {
-                ctx->root_winid = tre_r->root;
-                free(tre_r);
-            }
+static void xcursor_tick()
+{
+    xcb_generic_event_t *event;
+    while ((event = xcb_poll_for_event(xcb))) {
+        if (xcursor_state.first_event &&
+                (event->response_type & ~0x80) == xcursor_state.first_event + XCB_XFIXES_CURSOR_NOTIFY) {
+            xcursor_state.need_image = true;
+        }
+        free(event);
+    }
+
+    void *reply = NULL;
+    if (xcursor_state.image_pending &&
+            xcb_poll_for_reply(xcb, xcursor_state.image_cookie.sequence, &reply, NULL)) {
+        xcursor_state.image_pending = false;
+        if (reply) {
+            free(xcursor_state.image);
+            xcursor_state.image = reply;
+            xcursor_state.x = xcursor_state.image->x;
+            xcursor_state.y = xcursor_state.image->y;
         }
-        xcb_translate_coordinates_cookie_t tr_c;
-        if (ctx->root_winid && ctx->tdata.winid) {
-            tr_c = xcb_translate_coordinates_unchecked(xcb, ctx->tdata.winid, ctx->root_winid, 0, 0);
+    }
+
+    reply = NULL;
+    if (xcursor_state.pointer_pending &&
+            xcb_poll_for_reply(xcb, xcursor_state.pointer_cookie.sequence, &reply, NULL)) {
+        xcursor_state.pointer_pending = false;
+        if (reply) {
+            xcb_query_pointer_reply_t *pointer = reply;
+            xcursor_state.x = pointer->root_x;
+            xcursor_state.y = pointer->root_y;
+            free(pointer);
         }
-        xcb_xfixes_get_cursor_image_cookie_t cur_c = xcb_xfixes_get_cursor_image_unchecked(xcb);
-        xcb_xfixes_get_cursor_image_reply_t *cur_r = xcb_xfixes_get_cursor_image_reply(xcb, cur_c, NULL);
-        if (ctx->root_winid && ctx->tdata.winid) {
-            xcb_translate_coordinates_reply_t *tr_r = xcb_translate_coordinates_reply(xcb, tr_c, NULL);
-            if (tr_r) {
-                xcb_xcursor_offset(ctx->xcursor, tr_r->dst_x, tr_r->dst_y);
-                free(tr_r);
+    }
+
+    if (xcursor_state.need_image && !xcursor_state.image_pending) {
+        xcursor_state.image_cookie = xcb_xfixes_get_cursor_image_unchecked(xcb);
+        xcursor_state.image_pending = true;
+        xcursor_state.need_image = false;
+    }
+    if (!xcursor_state.pointer_pending) {
+        xcursor_state.pointer_cookie = xcb_query_pointer_unchecked(xcb, xcursor_state.root);
+        xcursor_state.pointer_pending = true;
+    }
+    xcb_flush(xcb);
+}
+#endif
+
+/* Runs in video_tick, the shared state is updated once per frame however
+ * many sources show the cursor */
+static void cursor_tick(vkcapture_source_t *ctx)
+{
+    const uint64_t frame_time = obs_get_video_frame_time();
+    const bool shared = frame_time != cursor_tick_time;
+    cursor_tick_time = frame_time;
+
+#if HAVE_X11_XCB
+    if (shared && xcb && xcursor_state.root) {
+        xcursor_tick();
+    }
+    if (ctx->xcursor && xcursor_state.root) {
+        void *reply = NULL;
+        if (ctx->origin_pending &&
+                xcb_poll_for_reply(xcb, ctx->origin_cookie.sequence, &reply, NULL)) {
+            ctx->origin_pending = false;
+            if (reply) {
+                xcb_translate_coordinates_reply_t *origin = reply;
+                /* the texture starts at the crop, not the window corner */
+                xcb_xcursor_offset(ctx->xcursor, origin->dst_x + ctx->tdata.source_x,
+                        origin->dst_y + ctx->tdata.source_y);
+                free(origin);
             }
         }
-        xcb_xcursor_update(ctx->xcursor, cur_r);
-        free(cur_r);
+        if (!ctx->origin_pending && ctx->tdata.winid) {
+            ctx->origin_cookie = xcb_translate_coordinates_unchecked(xcb,
+                    ctx->tdata.winid, xcursor_state.root, 0, 0);
+            ctx->origin_pending = true;
+            xcb_flush(xcb);
+        }
     }
 #endif
 #if HAVE_WAYLAND
-    if (wlcursor) {
+    if (wlcursor && shared) {
         struct pollfd fd;
         fd.fd = wl_display_get_fd(wl_display);
         fd.events = POLLIN;
@@ -276,6 +709,17 @@ static void cursor_update(vkcapture_source_t *ctx)
 #endif
 }
 
+static void cursor_update(vkcapture_source_t *ctx)
+{
+#if HAVE_X11_XCB
+    if (ctx->xcursor && xcursor_state.image) {
+        /* the texture is only rebuilt when the serial changes */
+        xcb_xcursor_update(ctx->xcursor, xcursor_state.image);
+        xcb_xcursor_move(ctx->xcursor, xcursor_state.x, xcursor_state.y);
+    }
+#endif
+}
+
 static void cursor_render(vkcapture_source_t *ctx)
 {
 #if HAVE_X11_XCB
@@ -290,117 +734,1213 @@ static void cursor_render(vkcapture_source_t *ctx)
 #endif
 }
 
-static void destroy_texture(vkcapture_source_t *ctx)
+static void egl_sync_init()
 {
-    if (!ctx->texture) {
+    egl_sync_checked = true;
+
+    EGLDisplay dpy = eglGetCurrentDisplay();
+    const char *exts = eglQueryString(dpy, EGL_EXTENSIONS);
+    if (!exts || !strstr(exts, "EGL_KHR_fence_sync")) {
+        blog(LOG_WARNING, "EGL fence sync not available, frames are not synchronized");
         return;
     }
 
-    obs_enter_graphics();
-    gs_texture_destroy(ctx->texture);
-    obs_leave_graphics();
-    ctx->texture = NULL;
+    p_eglCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+    p_eglDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+    p_eglClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+    if (!p_eglCreateSyncKHR || !p_eglDestroySyncKHR || !p_eglClientWaitSyncKHR) {
+        p_eglCreateSyncKHR = NULL;
+        blog(LOG_WARNING, "Failed to get EGL sync functions");
+        return;
+    }
 
-    ctx->buf_id = 0;
-    memset(&ctx->tdata, 0, sizeof(ctx->tdata));
+    if (!strstr(exts, "EGL_ANDROID_native_fence_sync") || !strstr(exts, "EGL_KHR_wait_sync")) {
+        blog(LOG_WARNING, "EGL native fence sync not available, frames are not synchronized");
+        return;
+    }
+    p_eglWaitSyncKHR = (PFNEGLWAITSYNCKHRPROC)eglGetProcAddress("eglWaitSyncKHR");
+    egl_native_fence = p_eglWaitSyncKHR != NULL;
+    if (!egl_native_fence) {
+        blog(LOG_WARNING, "Failed to get EGL sync functions");
+    }
 }
 
-static void vkcapture_source_destroy(void *data)
+// Makes the GPU wait for the sync_file before following commands, takes ownership of fd
+static void egl_wait_sync_fd(int fd)
 {
-    --source_instances;
+    if (!egl_sync_checked) {
+        egl_sync_init();
+    }
 
-    vkcapture_source_t *ctx = data;
+    if (!egl_native_fence) {
+        close(fd);
+        return;
+    }
 
-    destroy_texture(ctx);
-    cursor_destroy(ctx);
+    EGLDisplay dpy = eglGetCurrentDisplay();
+    const EGLint attribs[] = {
+        EGL_SYNC_NATIVE_FENCE_FD_ANDROID, fd,
+        EGL_NONE,
+    };
+    EGLSyncKHR sync = p_eglCreateSyncKHR(dpy, EGL_SYNC_NATIVE_FENCE_ANDROID, attribs);
+    if (sync == EGL_NO_SYNC_KHR) {
+        blog(LOG_WARNING, "Failed to import sync fd: 0x%x", eglGetError());
+        close(fd);
+        return;
+    }
+    p_eglWaitSyncKHR(dpy, sync, 0);
+    p_eglDestroySyncKHR(dpy, sync);
+}
 
-    bfree(ctx);
+// Signals once everything drawn so far is done, EGL_NO_SYNC_KHR if unsupported
+static EGLSyncKHR egl_create_fence()
+{
+    if (!egl_sync_checked) {
+        egl_sync_init();
+    }
+
+    if (!p_eglCreateSyncKHR) {
+        return EGL_NO_SYNC_KHR;
+    }
+    return p_eglCreateSyncKHR(eglGetCurrentDisplay(), EGL_SYNC_FENCE_KHR, NULL);
 }
 
-static void vkcapture_source_update(void *data, obs_data_t *settings)
+// Destroys the fence and returns true if it signalled within timeout
+static bool egl_fence_done(EGLSyncKHR sync, EGLTimeKHR timeout)
 {
-    vkcapture_source_t *ctx = data;
+    EGLDisplay dpy = eglGetCurrentDisplay();
+    const EGLint ret = p_eglClientWaitSyncKHR(dpy, sync, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, timeout);
+    if (ret == EGL_TIMEOUT_EXPIRED_KHR) {
+        return false;
+    }
+    /* an error is not waited on again */
+    p_eglDestroySyncKHR(dpy, sync);
+    return true;
+}
 
-    ctx->show_cursor = obs_data_get_bool(settings, "show_cursor");
-    ctx->allow_transparency = obs_data_get_bool(settings, "allow_transparency");
+// Returns false if the client reused the slot before it could be read
+static bool upload_copy(vkcapture_upload_t *upload, vkcapture_stage_t *stage)
+{
+    const vkcapture_map_t *map = &upload->maps[stage->slot];
+    struct capture_rect *r = &stage->rect;
+    const struct capture_rect full = {
+        .width = upload->width,
+        .height = upload->height,
+    };
+    if (capture_rect_empty(r) || r->x < 0 || r->y < 0 ||
+            r->x + r->width > full.width || r->y + r->height > full.height) {
+        *r = full;
+    }
 
-    ctx->window_match = false;
-    ctx->window_exclude = false;
-    ctx->window = obs_data_get_string(settings, "window");
-    if (!strncmp(ctx->window, "exclude=", 8)) {
-        ctx->window_exclude = true;
-        ctx->window = ctx->window + 8;
+    const size_t row = (size_t)r->width * upload->bpp;
+    const uint8_t *src = (const uint8_t *)map->memory + map->offset +
+        (size_t)r->y * map->stride + (size_t)r->x * upload->bpp;
+    stage->linesize = row;
+
+    struct capture_memfd_header *header = map->memfd ? map->memory : NULL;
+    struct capture_slot_state *state = !header && upload->slot_states ?
+        &upload->slot_states[stage->slot] : NULL;
+    if (header) {
+        __atomic_store_n(&header->reading, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&header->seq, __ATOMIC_SEQ_CST) != stage->seq) {
+            __atomic_store_n(&header->reading, 0, __ATOMIC_SEQ_CST);
+            return false;
+        }
+    } else if (state) {
+        __atomic_add_fetch(&state->readers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&state->seq, __ATOMIC_SEQ_CST) != stage->seq) {
+            __atomic_sub_fetch(&state->readers, 1, __ATOMIC_SEQ_CST);
+            return false;
+        }
+    }
+
+    struct dma_buf_sync sync;
+    sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+    if (!header) {
+        ioctl(map->fd, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+
+    if (row == (size_t)map->stride) {
+        memcpy(stage->data, src, row * r->height);
     } else {
-        ctx->window_match = true;
+        /* repack to tight rows, the texture upload then needs no stride */
+        for (int32_t y = 0; y < r->height; ++y) {
+            memcpy(stage->data + y * row, src + (size_t)y * map->stride, row);
+        }
     }
-    if (!strlen(ctx->window)) {
-        ctx->window = NULL;
+
+    if (header) {
+        __atomic_store_n(&header->reading, 0, __ATOMIC_SEQ_CST);
+    } else {
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+        ioctl(map->fd, DMA_BUF_IOCTL_SYNC, &sync);
+        if (state) {
+            __atomic_sub_fetch(&state->readers, 1, __ATOMIC_SEQ_CST);
+        }
     }
+    return true;
 }
 
-static void *vkcapture_source_create(obs_data_t *settings, obs_source_t *source)
+static void *upload_thread_run(void *data)
 {
-    ++source_instances;
+    vkcapture_upload_t *upload = data;
 
-    vkcapture_source_t *ctx = bzalloc(sizeof(vkcapture_source_t));
-    ctx->source = source;
+    pthread_mutex_lock(&upload->mutex);
+    while (true) {
+        while (!upload->pending && !upload->quit) {
+            pthread_cond_wait(&upload->cond, &upload->mutex);
+        }
+        if (upload->quit) {
+            break;
+        }
 
-    vkcapture_source_update(ctx, settings);
+        vkcapture_stage_t *stage = upload->stages[0].state == STAGE_FREE ?
+            &upload->stages[0] : &upload->stages[1];
+        stage->state = STAGE_BUSY;
+        stage->slot = upload->slot;
+        stage->seq = upload->seq;
+        stage->rect = upload->rect;
+        const int sync_fd = upload->sync_fd;
+        upload->sync_fd = -1;
+        pthread_mutex_unlock(&upload->mutex);
+
+        if (sync_fd >= 0) {
+            /* the copy into the slot may still be running on the game's GPU */
+            struct pollfd pfd = {
+                .fd = sync_fd,
+                .events = POLLIN,
+            };
+            poll(&pfd, 1, 1000);
+            close(sync_fd);
+        }
+        const bool copied = upload_copy(upload, stage);
 
-    cursor_create(ctx);
+        pthread_mutex_lock(&upload->mutex);
+        stage->state = copied ? STAGE_READY : STAGE_FREE;
+        upload->pending = false;
+    }
+    pthread_mutex_unlock(&upload->mutex);
 
-    UNUSED_PARAMETER(settings);
-    return ctx;
+    return NULL;
 }
 
-static vkcapture_client_t *find_matching_client(vkcapture_source_t *ctx)
+static bool upload_start(vkcapture_upload_t *upload, uint32_t width, uint32_t height, uint32_t bpp)
 {
-    vkcapture_client_t *client = NULL;
-    if (ctx->window) {
-        for (size_t i = 0; i < server.clients.num; i++) {
-            vkcapture_client_t *c = server.clients.array + i;
-            bool match = !strcmp(c->cdata.exe, ctx->window);
-            if ((ctx->window_match && match) || (ctx->window_exclude && !match)) {
-                client = c;
-                break;
-            }
+    upload->width = width;
+    upload->height = height;
+    upload->bpp = bpp;
+    upload->quit = false;
+    upload->pending = false;
+    upload->sync_fd = -1;
+    upload->requested_seq = 0;
+    for (int i = 0; i < 2; ++i) {
+        upload->stages[i].state = STAGE_FREE;
+        upload->stages[i].data = bmalloc((size_t)width * height * bpp);
+    }
+    upload->running = pthread_create(&upload->thread, NULL, upload_thread_run, upload) == 0;
+    if (!upload->running) {
+        blog(LOG_ERROR, "Failed to create upload thread");
+    }
+    return upload->running;
+}
+
+static void upload_stop(vkcapture_upload_t *upload)
+{
+    if (upload->running) {
+        pthread_mutex_lock(&upload->mutex);
+        upload->quit = true;
+        pthread_cond_signal(&upload->cond);
+        pthread_mutex_unlock(&upload->mutex);
+        pthread_join(upload->thread, NULL);
+        upload->running = false;
+    }
+    if (upload->sync_fd >= 0) {
+        close(upload->sync_fd);
+        upload->sync_fd = -1;
+    }
+    for (int i = 0; i < 2; ++i) {
+        bfree(upload->stages[i].data);
+        upload->stages[i].data = NULL;
+        upload->stages[i].state = STAGE_FREE;
+    }
+    upload->slot_states = NULL;
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        vkcapture_map_t *map = &upload->maps[s];
+        if (map->memory) {
+            munmap(map->memory, map->size);
+            map->memory = NULL;
         }
-    } else if (server.clients.num) {
-        client = server.clients.array;
+        if (map->fd >= 0) {
+            close(map->fd);
+            map->fd = -1;
+        }
+    }
+}
+
+// Returns the ready stage with the newest frame, older ones are dropped
+static vkcapture_stage_t *upload_take_ready(vkcapture_upload_t *upload)
+{
+    pthread_mutex_lock(&upload->mutex);
+    vkcapture_stage_t *ready = NULL;
+    for (int i = 0; i < 2; ++i) {
+        vkcapture_stage_t *stage = &upload->stages[i];
+        if (stage->state != STAGE_READY) {
+            continue;
+        }
+        if (ready && ready->seq > stage->seq) {
+            stage->state = STAGE_FREE;
+            continue;
+        }
+        if (ready) {
+            ready->state = STAGE_FREE;
+        }
+        ready = stage;
+    }
+    pthread_mutex_unlock(&upload->mutex);
+    return ready;
+}
+
+static void upload_release(vkcapture_upload_t *upload, vkcapture_stage_t *stage)
+{
+    pthread_mutex_lock(&upload->mutex);
+    stage->state = STAGE_FREE;
+    pthread_mutex_unlock(&upload->mutex);
+}
+
+// Takes ownership of sync_fd
+static void upload_post(vkcapture_upload_t *upload, int slot, uint64_t seq,
+        const struct capture_rect *rect, int sync_fd)
+{
+    pthread_mutex_lock(&upload->mutex);
+    const bool free_stage = upload->stages[0].state == STAGE_FREE ||
+        upload->stages[1].state == STAGE_FREE;
+    if (upload->running && !upload->pending && free_stage && seq > upload->requested_seq) {
+        upload->pending = true;
+        upload->slot = slot;
+        upload->seq = seq;
+        upload->rect = *rect;
+        upload->sync_fd = sync_fd;
+        upload->requested_seq = seq;
+        sync_fd = -1;
+        pthread_cond_signal(&upload->cond);
+    }
+    pthread_mutex_unlock(&upload->mutex);
+
+    if (sync_fd >= 0) {
+        close(sync_fd);
+    }
+}
+
+// FNV-1a, to skip most string compares when matching clients by executable
+static uint32_t exe_hash(const char *exe, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size && exe[i]; ++i) {
+        hash = (hash ^ (uint8_t)exe[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static vkcapture_client_t *client_ref(vkcapture_client_t *client)
+{
+    os_atomic_inc_long(&client->refs);
+    return client;
+}
+
+static void client_release(vkcapture_client_t *client)
+{
+    if (client && !os_atomic_dec_long(&client->refs)) {
+        /* outlives the connection, sources may still hold slots in it */
+        if (client->control_shm) {
+            munmap(client->control_shm, CAPTURE_CONTROL_SHM_SIZE);
+        }
+        pthread_mutex_destroy(&client->mutex);
+        bfree(client);
+    }
+}
+
+static vkcapture_buffers_t *buffers_create(const struct capture_texture_data *tdata)
+{
+    vkcapture_buffers_t *buffers = bzalloc(sizeof(vkcapture_buffers_t));
+    buffers->refs = 1;
+    buffers->tdata = *tdata;
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        memset(buffers->slots[s].fds, -1, sizeof(buffers->slots[s].fds));
+    }
+    return buffers;
+}
+
+static vkcapture_buffers_t *buffers_ref(vkcapture_buffers_t *buffers)
+{
+    os_atomic_inc_long(&buffers->refs);
+    return buffers;
+}
+
+static void buffers_release(vkcapture_buffers_t *buffers)
+{
+    if (!buffers || os_atomic_dec_long(&buffers->refs)) {
+        return;
+    }
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        for (int i = 0; i < 4; ++i) {
+            if (buffers->slots[s].fds[i] >= 0) {
+                close(buffers->slots[s].fds[i]);
+            }
+        }
+    }
+    bfree(buffers);
+}
+
+static inline bool is_yuv_format(int32_t format)
+{
+    return format == DRM_FORMAT_NV12 || format == DRM_FORMAT_P010;
+}
+
+// Luma and chroma planes are imported as separate textures
+static gs_texture_t *import_slot_yuv(vkcapture_textures_t *t, vkcapture_buffers_t *buffers, int s)
+{
+    vkcapture_planes_t *slot = &buffers->slots[s];
+    const bool p010 = buffers->tdata.format == DRM_FORMAT_P010;
+
+    if (buffers->tdata.nfd != 2) {
+        return NULL;
+    }
+
+    gs_texture_t *planes[2] = {NULL, NULL};
+    obs_enter_graphics();
+    for (int i = 0; i < 2; ++i) {
+        const int32_t format = i ? (p010 ? DRM_FORMAT_GR1616 : DRM_FORMAT_GR88) :
+            (p010 ? DRM_FORMAT_R16 : DRM_FORMAT_R8);
+        const uint32_t stride = slot->strides[i];
+        const uint32_t offset = slot->offsets[i];
+        const uint64_t modifier = buffers->tdata.modifier;
+        blog(LOG_INFO, " [%d:%d] fd:%d stride:%d offset:%d", s, i, slot->fds[i], stride, offset);
+        planes[i] = gs_texture_create_from_dmabuf(buffers->tdata.width >> i, buffers->tdata.height >> i,
+            format, drm_format_to_gs(format), 1, &slot->fds[i], &stride, &offset,
+            modifier != DRM_FORMAT_MOD_INVALID ? &modifier : NULL);
+    }
+    if (!planes[0] || !planes[1]) {
+        gs_texture_destroy(planes[0]);
+        gs_texture_destroy(planes[1]);
+        planes[0] = planes[1] = NULL;
+    }
+    obs_leave_graphics();
+
+    t->uv_textures[s] = planes[1];
+    return planes[0];
+}
+
+static gs_texture_t *import_slot_texture(vkcapture_textures_t *t, vkcapture_buffers_t *buffers,
+        bool map_host, int s)
+{
+    if (is_yuv_format(buffers->tdata.format)) {
+        return import_slot_yuv(t, buffers, s);
+    }
+
+    vkcapture_planes_t *slot = &buffers->slots[s];
+    gs_texture_t *texture = NULL;
+
+    uint32_t strides[4];
+    uint32_t offsets[4];
+    uint64_t modifiers[4];
+    for (uint8_t i = 0; i < buffers->tdata.nfd; ++i) {
+        strides[i] = slot->strides[i];
+        offsets[i] = slot->offsets[i];
+        modifiers[i] = buffers->tdata.modifier;
+        blog(LOG_INFO, " [%d:%d] fd:%d stride:%d offset:%d", s, i, slot->fds[i], strides[i], offsets[i]);
+    }
+
+    if (map_host && !capture_format_host_readable(buffers->tdata.format)) {
+        blog(LOG_ERROR, "Cannot upload format %.4s from system memory", (const char *)&buffers->tdata.format);
+    } else if (map_host) {
+        /* owned by the source, the upload thread may read it after the
+         * client is gone */
+        vkcapture_map_t *map = &t->maps[s];
+        map->fd = os_dupfd_cloexec(slot->fds[0]);
+        map->stride = slot->strides[0];
+        map->memfd = buffers->tdata.memfd;
+        map->offset = map->memfd ? slot->offsets[0] : 0;
+        map->size = lseek(map->fd, 0, SEEK_END);
+        /* the memfd header is written by both sides */
+        map->memory = mmap(NULL, map->size, map->memfd ? PROT_READ | PROT_WRITE : PROT_READ,
+            MAP_SHARED, map->fd, 0);
+        if (map->memory == MAP_FAILED) {
+            map->memory = NULL;
+            blog(LOG_ERROR, "Failed to map %s '%s'", map->memfd ? "memfd" : "dmabuf", strerror(errno));
+        } else {
+            obs_enter_graphics();
+            texture = gs_texture_create(buffers->tdata.width, buffers->tdata.height,
+                drm_format_to_gs(buffers->tdata.format), 1, NULL, GS_DYNAMIC);
+            obs_leave_graphics();
+        }
+    } else {
+        obs_enter_graphics();
+        texture = gs_texture_create_from_dmabuf(buffers->tdata.width, buffers->tdata.height,
+            buffers->tdata.format, drm_format_to_gs(buffers->tdata.format), buffers->tdata.nfd, slot->fds,
+            strides, offsets, buffers->tdata.modifier != DRM_FORMAT_MOD_INVALID ? modifiers : NULL);
+        obs_leave_graphics();
+    }
+
+    return texture;
+}
+
+static void textures_init(vkcapture_textures_t *t)
+{
+    memset(t, 0, sizeof(*t));
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        t->maps[s].fd = -1;
+    }
+}
+
+static void textures_free(vkcapture_textures_t *t)
+{
+    obs_enter_graphics();
+    for (int i = 0; i < t->ntextures; ++i) {
+        gs_texture_destroy(t->textures[i]);
+        gs_texture_destroy(t->uv_textures[i]);
+    }
+    obs_leave_graphics();
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        vkcapture_map_t *map = &t->maps[s];
+        if (map->memory) {
+            munmap(map->memory, map->size);
+        }
+        if (map->fd >= 0) {
+            close(map->fd);
+        }
+    }
+    textures_init(t);
+}
+
+static void import_textures(vkcapture_textures_t *t, vkcapture_buffers_t *buffers, int import_failures)
+{
+    textures_init(t);
+    t->buf_id = buffers->id;
+    t->import_failures = import_failures;
+    t->tdata = buffers->tdata;
+
+    blog(LOG_INFO, "Creating %d texture(s) from %s %dx%d modifier:%" PRIu64,
+            buffers->nslots, t->tdata.memfd ? "memfd" : "dmabuf",
+            t->tdata.width, t->tdata.height, t->tdata.modifier);
+
+    const bool map_host = import_host_mapped(import_failures) || t->tdata.memfd;
+    t->imported = true;
+    for (int s = 0; s < buffers->nslots; ++s) {
+        t->textures[s] = import_slot_texture(t, buffers, map_host, s);
+        t->ntextures = s + 1;
+        if (!t->textures[s]) {
+            t->imported = false;
+            break;
+        }
+    }
+}
+
+static void *import_thread_run(void *data)
+{
+    vkcapture_import_t *import = data;
+
+    pthread_mutex_lock(&import->mutex);
+    while (true) {
+        while (!import->request && !import->quit) {
+            pthread_cond_wait(&import->cond, &import->mutex);
+        }
+        if (import->quit) {
+            break;
+        }
+
+        vkcapture_buffers_t *buffers = import->request;
+        const int import_failures = import->request_failures;
+        const uint64_t serial = import->serial;
+        import->request = NULL;
+        pthread_mutex_unlock(&import->mutex);
+
+        vkcapture_textures_t result;
+        import_textures(&result, buffers, import_failures);
+        buffers_release(buffers);
+
+        pthread_mutex_lock(&import->mutex);
+        vkcapture_textures_t unused = result;
+        bool drop = true;
+        if (serial == import->serial) {
+            /* a result the source has not taken yet is out of date now */
+            drop = import->ready;
+            unused = import->result;
+            import->result = result;
+            import->ready = true;
+        }
+        if (drop) {
+            pthread_mutex_unlock(&import->mutex);
+            textures_free(&unused);
+            pthread_mutex_lock(&import->mutex);
+        }
+    }
+    pthread_mutex_unlock(&import->mutex);
+
+    return NULL;
+}
+
+// Takes ownership of the buffers reference
+static void import_post(vkcapture_import_t *import, vkcapture_buffers_t *buffers, int import_failures)
+{
+    if (!import->running) {
+        import->quit = false;
+        import->running = pthread_create(&import->thread, NULL, import_thread_run, import) == 0;
+        if (!import->running) {
+            blog(LOG_ERROR, "Failed to create import thread");
+            buffers_release(buffers);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&import->mutex);
+    vkcapture_buffers_t *replaced = import->request;
+    import->request = buffers;
+    import->request_failures = import_failures;
+    pthread_cond_signal(&import->cond);
+    pthread_mutex_unlock(&import->mutex);
+
+    buffers_release(replaced);
+}
+
+static bool import_take(vkcapture_import_t *import, vkcapture_textures_t *t)
+{
+    pthread_mutex_lock(&import->mutex);
+    const bool ready = import->ready;
+    if (ready) {
+        *t = import->result;
+        import->ready = false;
+    }
+    pthread_mutex_unlock(&import->mutex);
+    return ready;
+}
+
+// Drops the request and the result, an import still running drops itself
+static void import_cancel(vkcapture_import_t *import)
+{
+    vkcapture_textures_t unused;
+    pthread_mutex_lock(&import->mutex);
+    import->serial++;
+    vkcapture_buffers_t *request = import->request;
+    import->request = NULL;
+    const bool ready = import->ready;
+    if (ready) {
+        unused = import->result;
+        import->ready = false;
+    }
+    pthread_mutex_unlock(&import->mutex);
+
+    buffers_release(request);
+    if (ready) {
+        textures_free(&unused);
+    }
+}
+
+static void import_stop(vkcapture_import_t *import)
+{
+    import_cancel(import);
+    if (import->running) {
+        pthread_mutex_lock(&import->mutex);
+        import->quit = true;
+        pthread_cond_signal(&import->cond);
+        pthread_mutex_unlock(&import->mutex);
+        pthread_join(import->thread, NULL);
+        import->running = false;
+    }
+}
+
+/* Releases the slots whose draws have retired, waiting up to `timeout` for
+ * each. Without fences a slot is released on the next frame, by then the
+ * draws from before are usually done. */
+static void source_release_slots(vkcapture_source_t *ctx, EGLTimeKHR timeout)
+{
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        if (!ctx->release_pending[s]) {
+            continue;
+        }
+        if (ctx->release_sync[s] != EGL_NO_SYNC_KHR &&
+                !egl_fence_done(ctx->release_sync[s], timeout)) {
+            continue;
+        }
+        ctx->release_sync[s] = EGL_NO_SYNC_KHR;
+        ctx->release_pending[s] = false;
+        ctx->held[s] = false;
+        __atomic_sub_fetch(&ctx->slot_states[s].readers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Releases slot s once what has been drawn from it so far is done
+static void source_schedule_release(vkcapture_source_t *ctx, int s)
+{
+    if (!ctx->held[s] || ctx->release_pending[s]) {
+        return;
+    }
+    ctx->release_sync[s] = egl_create_fence();
+    ctx->release_pending[s] = true;
+}
+
+/* Keeps the client from copying into slot s while it is drawn, the slot
+ * drawn before is released once the GPU is done with it. Returns false if
+ * the slot no longer holds frame seq. */
+static bool source_hold_slot(vkcapture_source_t *ctx, int s, uint64_t seq)
+{
+    if (!ctx->slot_states) {
+        return true;
+    }
+    if (ctx->held[s] && !ctx->release_pending[s] && ctx->held_seq == seq) {
+        return true;
+    }
+
+    struct capture_slot_state *state = &ctx->slot_states[s];
+    if (!ctx->held[s]) {
+        __atomic_add_fetch(&state->readers, 1, __ATOMIC_SEQ_CST);
+    }
+    if (__atomic_load_n(&state->seq, __ATOMIC_SEQ_CST) != seq) {
+        if (!ctx->held[s]) {
+            __atomic_sub_fetch(&state->readers, 1, __ATOMIC_SEQ_CST);
+        }
+        return false;
+    }
+
+    if (ctx->release_pending[s]) {
+        /* drawn again before it was released */
+        if (ctx->release_sync[s] != EGL_NO_SYNC_KHR) {
+            p_eglDestroySyncKHR(eglGetCurrentDisplay(), ctx->release_sync[s]);
+            ctx->release_sync[s] = EGL_NO_SYNC_KHR;
+        }
+        ctx->release_pending[s] = false;
+    }
+    if (ctx->last_slot != s) {
+        source_schedule_release(ctx, ctx->last_slot);
+    }
+    ctx->held[s] = true;
+    ctx->held_seq = seq;
+    return true;
+}
+
+// With the graphics context entered
+static void source_release_all_slots(vkcapture_source_t *ctx)
+{
+    if (!ctx->slot_states) {
+        return;
+    }
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        source_schedule_release(ctx, s);
+    }
+    source_release_slots(ctx, 100000000);
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        if (ctx->release_pending[s] && ctx->release_sync[s] != EGL_NO_SYNC_KHR) {
+            /* the GPU is stuck, the images go away with the textures anyway */
+            p_eglDestroySyncKHR(eglGetCurrentDisplay(), ctx->release_sync[s]);
+            ctx->release_sync[s] = EGL_NO_SYNC_KHR;
+        }
+    }
+    source_release_slots(ctx, 0);
+    ctx->slot_states = NULL;
+    ctx->held_seq = 0;
+}
+
+static void destroy_texture(vkcapture_source_t *ctx)
+{
+    if (!ctx->ntextures) {
+        return;
+    }
+
+    upload_stop(&ctx->upload);
+
+    obs_enter_graphics();
+    source_release_all_slots(ctx);
+    for (int i = 0; i < ctx->ntextures; ++i) {
+        if (ctx->textures[i]) {
+            gs_texture_destroy(ctx->textures[i]);
+            ctx->textures[i] = NULL;
+        }
+        if (ctx->uv_textures[i]) {
+            gs_texture_destroy(ctx->uv_textures[i]);
+            ctx->uv_textures[i] = NULL;
+        }
+    }
+    obs_leave_graphics();
+    ctx->ntextures = 0;
+    ctx->last_slot = 0;
+    ctx->shown = false;
+    memset(ctx->upload_seq, 0, sizeof(ctx->upload_seq));
+    latency_reset(&ctx->latency);
+
+    ctx->buf_id = 0;
+    memset(&ctx->tdata, 0, sizeof(ctx->tdata));
+}
+
+static void vkcapture_source_destroy(void *data)
+{
+    --source_instances;
+
+    vkcapture_source_t *ctx = data;
+
+    import_stop(&ctx->import);
+    destroy_texture(ctx);
+    cursor_destroy(ctx);
+
+    if (ctx->client) {
+        pthread_mutex_lock(&ctx->client->mutex);
+        activate_client(ctx, ctx->client, false);
+        pthread_mutex_unlock(&ctx->client->mutex);
+        client_release(ctx->client);
+        ctx->client = NULL;
+    }
+
+    pthread_mutex_destroy(&ctx->upload.mutex);
+    pthread_cond_destroy(&ctx->upload.cond);
+    pthread_mutex_destroy(&ctx->import.mutex);
+    pthread_cond_destroy(&ctx->import.cond);
+    pthread_mutex_destroy(&ctx->latency.mutex);
+
+    bfree(ctx);
+}
+
+static void vkcapture_source_update(void *data, obs_data_t *settings)
+{
+    vkcapture_source_t *ctx = data;
+
+    ctx->show_cursor = obs_data_get_bool(settings, "show_cursor");
+    ctx->allow_transparency = obs_data_get_bool(settings, "allow_transparency");
+    ctx->limit_rate = obs_data_get_bool(settings, "limit_capture_rate");
+    ctx->downscale = obs_data_get_bool(settings, "downscale_to_canvas");
+    ctx->yuv = obs_data_get_bool(settings, "share_yuv");
+    ctx->swapchain = obs_data_get_int(settings, "swapchain");
+    ctx->winid = obs_data_get_int(settings, "window_id");
+    ctx->crop.left = obs_data_get_int(settings, "crop_left");
+    ctx->crop.top = obs_data_get_int(settings, "crop_top");
+    ctx->crop.right = obs_data_get_int(settings, "crop_right");
+    ctx->crop.bottom = obs_data_get_int(settings, "crop_bottom");
+
+    ctx->window_match = false;
+    ctx->window_exclude = false;
+    ctx->window = obs_data_get_string(settings, "window");
+    if (!strncmp(ctx->window, "exclude=", 8)) {
+        ctx->window_exclude = true;
+        ctx->window = ctx->window + 8;
+    } else {
+        ctx->window_match = true;
+    }
+    if (!strlen(ctx->window)) {
+        ctx->window = NULL;
+    }
+    ctx->window_hash = ctx->window ? exe_hash(ctx->window, strlen(ctx->window)) : 0;
+    // check the client choice again on the next tick
+    ctx->generation = -1;
+}
+
+// Returns a reference to the client the source should capture
+static vkcapture_client_t *find_matching_client(vkcapture_source_t *ctx)
+{
+    vkcapture_client_t *client = NULL;
+    pthread_mutex_lock(&server.mutex);
+    if (ctx->window) {
+        for (size_t i = 0; i < server.clients.num; i++) {
+            vkcapture_client_t *c = server.clients.array[i];
+            bool match = c->exe_hash == ctx->window_hash && !strcmp(c->cdata.exe, ctx->window);
+            if ((ctx->window_match && match) || (ctx->window_exclude && !match)) {
+                client = c;
+                break;
+            }
+        }
+    } else if (server.clients.num) {
+        client = server.clients.array[0];
+    }
+    if (client) {
+        client_ref(client);
+    }
+    pthread_mutex_unlock(&server.mutex);
+    return client;
+}
+
+// Caller holds server.mutex
+static vkcapture_client_t *find_client_by_id(int id)
+{
+    for (size_t i = 0; id && i < server.clients.num; i++) {
+        if (server.clients.array[i]->id == id) {
+            return server.clients.array[i];
+        }
+    }
+    return NULL;
+}
+
+static void vkcapture_source_get_stats(void *data, calldata_t *cd)
+{
+    vkcapture_source_t *ctx = data;
+
+    struct capture_stats_data stats = {0};
+    bool active = false;
+
+    pthread_mutex_lock(&server.mutex);
+    vkcapture_client_t *client = find_client_by_id(ctx->client_id);
+    if (client) {
+        pthread_mutex_lock(&client->mutex);
+        stats = client->stats;
+        pthread_mutex_unlock(&client->mutex);
+        active = stats.type == CAPTURE_STATS_DATA_TYPE;
+    }
+    pthread_mutex_unlock(&server.mutex);
+
+    calldata_set_bool(cd, "active", active);
+    calldata_set_int(cd, "frames_copied", stats.frames_copied);
+    calldata_set_int(cd, "frames_skipped", stats.frames_skipped);
+    calldata_set_int(cd, "copy_p50_us", stats.copy_p50);
+    calldata_set_int(cd, "copy_p99_us", stats.copy_p99);
+    calldata_set_int(cd, "present_p50_us", stats.present_p50);
+    calldata_set_int(cd, "present_p99_us", stats.present_p99);
+    calldata_set_int(cd, "init_us", stats.init_time);
+    calldata_set_bool(cd, "gpu_copy_time", stats.gpu_copy_time);
+}
+
+static void vkcapture_source_get_latency(void *data, calldata_t *cd)
+{
+    vkcapture_source_t *ctx = data;
+
+    uint32_t p50, p99, count;
+    latency_percentiles(&ctx->latency, &p50, &p99, &count);
+
+    char histogram[LATENCY_BUCKETS * 11] = "";
+    size_t len = 0;
+    pthread_mutex_lock(&ctx->latency.mutex);
+    const int64_t copy_time = ctx->latency.copy_time;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        len += snprintf(histogram + len, sizeof(histogram) - len, i ? " %u" : "%u",
+                ctx->latency.buckets[i]);
+    }
+    pthread_mutex_unlock(&ctx->latency.mutex);
+
+    calldata_set_int(cd, "samples", count);
+    calldata_set_int(cd, "p50_us", p50);
+    calldata_set_int(cd, "p99_us", p99);
+    calldata_set_int(cd, "copy_us", copy_time / 1000);
+    calldata_set_string(cd, "histogram", histogram);
+}
+
+static void *vkcapture_source_create(obs_data_t *settings, obs_source_t *source)
+{
+    ++source_instances;
+
+    vkcapture_source_t *ctx = bzalloc(sizeof(vkcapture_source_t));
+    ctx->source = source;
+
+    pthread_mutex_init(&ctx->upload.mutex, NULL);
+    pthread_cond_init(&ctx->upload.cond, NULL);
+    pthread_mutex_init(&ctx->import.mutex, NULL);
+    pthread_cond_init(&ctx->import.cond, NULL);
+    pthread_mutex_init(&ctx->latency.mutex, NULL);
+    ctx->upload.sync_fd = -1;
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        ctx->upload.maps[s].fd = -1;
+    }
+
+    vkcapture_source_update(ctx, settings);
+
+    cursor_create(ctx);
+
+    proc_handler_t *ph = obs_source_get_proc_handler(source);
+    proc_handler_add(ph, "void get_capture_stats(out bool active, "
+            "out int frames_copied, out int frames_skipped, "
+            "out int copy_p50_us, out int copy_p99_us, "
+            "out int present_p50_us, out int present_p99_us, "
+            "out int init_us, out bool gpu_copy_time)",
+            vkcapture_source_get_stats, ctx);
+    /* histogram counts frames per bucket: under 1 ms, then doubling up to
+     * 256 ms and over */
+    proc_handler_add(ph, "void get_capture_latency(out int samples, "
+            "out int p50_us, out int p99_us, out int copy_us, "
+            "out string histogram)",
+            vkcapture_source_get_latency, ctx);
+
+    UNUSED_PARAMETER(settings);
+    return ctx;
+}
+
+static void query_gl_device()
+{
+    static bool queried = false;
+    if (!queried) {
+        queried = true;
+        obs_enter_graphics();
+        p_glGetUnsignedBytei_vEXT = (typeof(p_glGetUnsignedBytei_vEXT))
+            eglGetProcAddress("glGetUnsignedBytei_vEXT");
+        if (p_glGetUnsignedBytei_vEXT) {
+            p_glGetUnsignedBytei_vEXT(0x9597, 0, gl_device_uuid);
+        }
+        query_dmabuf_modifiers();
+        obs_leave_graphics();
+    }
+}
+
+static bool load_yuv_effect()
+{
+    static bool loaded = false;
+    if (loaded) {
+        return yuv_effect;
+    }
+    loaded = true;
+
+    char *path = obs_module_file("yuv_to_rgb.effect");
+    char *error = NULL;
+    obs_enter_graphics();
+    yuv_effect = gs_effect_create_from_file(path, &error);
+    obs_leave_graphics();
+    if (!yuv_effect) {
+        blog(LOG_ERROR, "Failed to load %s: %s", path, error ? error : "");
+    }
+    bfree(error);
+    bfree(path);
+    return yuv_effect;
+}
+
+static void fill_capture_control_data(struct capture_control_data *msg, vkcapture_client_t *client)
+{
+    query_gl_device();
+
+    msg->no_modifiers = !!(client->import_failures == IMPORT_NO_MODIFIERS);
+    msg->linear = !!(client->import_failures == IMPORT_LINEAR
+        || import_host_mapped(client->import_failures));
+    msg->map_host = !!import_host_mapped(client->import_failures);
+    msg->memfd = !!(client->import_failures == IMPORT_MEMFD);
+    memcpy(msg->device_uuid, gl_device_uuid, 16);
+    if (client->limit_rate) {
+        msg->frame_interval = obs_get_frame_interval_ns();
+        msg->frame_time = obs_get_video_frame_time();
+    }
+    struct obs_video_info ovi;
+    if (client->downscale && obs_get_video_info(&ovi)) {
+        msg->output_width = ovi.base_width;
+        msg->output_height = ovi.base_height;
+    }
+    msg->yuv = client->yuv && !client->yuv_failed && load_yuv_effect();
+    msg->swapchain = client->swapchain;
+    msg->winid = client->winid;
+    msg->crop = client->crop;
+    client->control_time = clock_ns();
+}
+
+static void write_control_shm_formats(vkcapture_client_t *client)
+{
+    if (!egl_nformats || client->control_shm->nformats) {
+        return;
+    }
+    memcpy(client->control_shm->formats, egl_formats, sizeof(egl_formats));
+    __atomic_store_n(&client->control_shm->nformats, egl_nformats, __ATOMIC_RELEASE);
+}
+
+static void write_capture_control_data(vkcapture_client_t *client, const struct capture_control_data *msg)
+{
+    client->control = *msg;
+
+    if (!client->connected) {
+        return;
+    }
+
+    if (client->control_shm) {
+        write_control_shm_formats(client);
+        capture_control_shm_write(client->control_shm, msg, &client->hint);
+        return;
+    }
+
+    ssize_t ret = write(client->sockfd, msg, client->control_size);
+    if (ret != (ssize_t)client->control_size) {
+        blog(LOG_WARNING, "Socket write error: %s", strerror(errno));
+    }
+}
+
+static void send_capture_control_data(vkcapture_client_t *client)
+{
+    struct capture_control_data msg = {0};
+    msg.capturing = client->activated ? 1 : 0;
+    fill_capture_control_data(&msg, client);
+    write_capture_control_data(client, &msg);
+}
+
+static bool create_control_shm(vkcapture_client_t *client)
+{
+    int fd = memfd_create("vkcapture-control", MFD_CLOEXEC);
+    if (fd < 0) {
+        blog(LOG_WARNING, "Failed to create control mailbox: %s", strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, CAPTURE_CONTROL_SHM_SIZE) != 0) {
+        blog(LOG_WARNING, "Failed to resize control mailbox: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, CAPTURE_CONTROL_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        blog(LOG_WARNING, "Failed to map control mailbox: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    client->control_shm = map;
+    write_control_shm_formats(client);
+    capture_control_shm_write(client->control_shm, &client->control, &client->hint);
+
+    /* Last control message on the socket, everything after goes through the mailbox */
+    struct msghdr msg = {0};
+    struct iovec io = {
+        .iov_base = &client->control,
+        .iov_len = sizeof(client->control),
+    };
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    const ssize_t sent = sendmsg(client->sockfd, &msg, MSG_NOSIGNAL);
+    close(fd);
+    if (sent != sizeof(client->control)) {
+        blog(LOG_WARNING, "Socket sendmsg error: %s", strerror(errno));
+        munmap(client->control_shm, CAPTURE_CONTROL_SHM_SIZE);
+        client->control_shm = NULL;
+        return false;
+    }
+    return true;
+}
+
+static void import_cache_save()
+{
+    char *dir = obs_module_config_path("");
+    os_mkdirs(dir);
+    bfree(dir);
+
+    char *path = obs_module_config_path("import_cache.json");
+    if (!obs_data_save_json_safe(import_cache, path, "tmp", "bak")) {
+        blog(LOG_WARNING, "Failed to save %s", path);
+    }
+    bfree(path);
+}
+
+// Games are keyed by executable, both GPUs and the driver that allocated the texture
+static void import_cache_key(vkcapture_client_t *client, char *key, size_t size)
+{
+    char client_uuid[33];
+    char obs_uuid[33];
+    for (int i = 0; i < 16; ++i) {
+        snprintf(client_uuid + i * 2, 3, "%02x", client->cdata.device_uuid[i]);
+        snprintf(obs_uuid + i * 2, 3, "%02x", gl_device_uuid[i]);
+    }
+    snprintf(key, size, "%.*s:%s:%u:%s", (int)sizeof(client->cdata.exe), client->cdata.exe,
+        client_uuid, client->cdata.driver_version, obs_uuid);
+}
+
+static void import_cache_apply(vkcapture_client_t *client)
+{
+    query_gl_device();
+
+    char key[160];
+    import_cache_key(client, key, sizeof(key));
+    obs_data_t *entry = obs_data_get_obj(import_cache, key);
+    if (!entry) {
+        return;
+    }
+
+    const long long mode = obs_data_get_int(entry, "mode");
+    if (mode >= IMPORT_DEFAULT && mode <= IMPORT_FAILURES_MAX) {
+        client->import_failures = mode;
+        client->hint.format = obs_data_get_int(entry, "format");
+        client->hint.modifier = obs_data_get_int(entry, "modifier");
+        client->hint.nplanes = obs_data_get_int(entry, "planes");
+        blog(LOG_INFO, "Using cached import mode %s for %s", import_attempt_str(mode), client->cdata.exe);
+    }
+    obs_data_release(entry);
+}
+
+static void import_cache_store(vkcapture_client_t *client, const struct capture_texture_data *tdata)
+{
+    char key[160];
+    import_cache_key(client, key, sizeof(key));
+
+    obs_data_t *entry = obs_data_get_obj(import_cache, key);
+    const bool changed = !entry
+        || obs_data_get_int(entry, "mode") != client->import_failures
+        || obs_data_get_int(entry, "format") != tdata->format
+        || (uint64_t)obs_data_get_int(entry, "modifier") != tdata->modifier
+        || obs_data_get_int(entry, "planes") != tdata->nfd;
+    obs_data_release(entry);
+    if (!changed) {
+        return;
+    }
+
+    entry = obs_data_create();
+    obs_data_set_int(entry, "mode", client->import_failures);
+    obs_data_set_int(entry, "format", tdata->format);
+    obs_data_set_int(entry, "modifier", (long long)tdata->modifier);
+    obs_data_set_int(entry, "planes", tdata->nfd);
+    obs_data_set_obj(import_cache, key, entry);
+    obs_data_release(entry);
+    import_cache_save();
+}
+
+static void import_cache_remove(vkcapture_client_t *client)
+{
+    memset(&client->hint, 0, sizeof(client->hint));
+
+    char key[160];
+    import_cache_key(client, key, sizeof(key));
+    if (obs_data_has_user_value(import_cache, key)) {
+        obs_data_erase(import_cache, key);
+        import_cache_save();
     }
-    return client;
 }
 
-static vkcapture_client_t *find_client_by_id(int id)
+// Frames reported so far refer to buffers that are being replaced
+static void client_reset_frames(vkcapture_client_t *client)
 {
-    vkcapture_client_t *client = NULL;
-    for (size_t i = 0; i < server.clients.num; i++) {
-        vkcapture_client_t *c = server.clients.array + i;
-        if (c->id == id) {
-            client = c;
-            break;
-        }
+    for (int s = 0; s < CAPTURE_MAX_SLOTS; ++s) {
+        memset(client->slots[s].damage_seq, 0, sizeof(client->slots[s].damage_seq));
     }
-    return client;
+    if (client->frame_sync_fd >= 0) {
+        close(client->frame_sync_fd);
+        client->frame_sync_fd = -1;
+    }
+    client->nslots = 0;
+    client->frame_slot = 0;
+    client->frame_seq = 0;
 }
 
-static void fill_capture_control_data(struct capture_control_data *msg, vkcapture_client_t *client)
+static void client_close_slots(vkcapture_client_t *client)
 {
-    if (!p_glGetUnsignedBytei_vEXT) {
-        obs_enter_graphics();
-        p_glGetUnsignedBytei_vEXT = (typeof(p_glGetUnsignedBytei_vEXT))
-            eglGetProcAddress("glGetUnsignedBytei_vEXT");
-        if (p_glGetUnsignedBytei_vEXT) {
-            p_glGetUnsignedBytei_vEXT(0x9597, 0, gl_device_uuid);
+    client_reset_frames(client);
+    buffers_release(client->buffers);
+    buffers_release(client->pending);
+    client->buffers = NULL;
+    client->pending = NULL;
+}
+
+// Region of slot `s` that changed after `seq`, empty when it all has to be uploaded
+static struct capture_rect slot_damage_since(vkcapture_slot_t *slot, uint64_t seq)
+{
+    struct capture_rect rect = {0};
+    if (!seq) {
+        return rect;
+    }
+    uint64_t oldest = UINT64_MAX;
+    for (int i = 0; i < DAMAGE_HISTORY; ++i) {
+        if (slot->damage_seq[i] < oldest) {
+            oldest = slot->damage_seq[i];
+        }
+        if (slot->damage_seq[i] > seq) {
+            if (capture_rect_empty(&slot->damage[i])) {
+                return (struct capture_rect){0};
+            }
+            capture_rect_union(&rect, &slot->damage[i]);
         }
-        obs_leave_graphics();
     }
-
-    msg->no_modifiers = !!(client->import_failures == IMPORT_NO_MODIFIERS);
-    msg->linear = !!(client->import_failures == IMPORT_LINEAR
-        || client->import_failures == IMPORT_LINEAR_HOST_MAPPED);
-    msg->map_host = !!(client->import_failures == IMPORT_LINEAR_HOST_MAPPED);
-    memcpy(msg->device_uuid, gl_device_uuid, 16);
+    /* reports between seq and the oldest one we kept are gone */
+    if (oldest > seq) {
+        return (struct capture_rect){0};
+    }
+    return rect;
 }
 
 static void activate_client(vkcapture_source_t *ctx, vkcapture_client_t *client, bool activate)
@@ -408,25 +1948,87 @@ static void activate_client(vkcapture_source_t *ctx, vkcapture_client_t *client,
     struct capture_control_data msg = {0};
     if (activate && !client->activated++) {
         msg.capturing = 1;
+        import_cache_apply(client);
     } else if (!activate && !--client->activated) {
         msg.capturing = 0;
     } else {
         return;
     }
+    client->limit_rate = ctx->limit_rate;
+    client->downscale = ctx->downscale;
+    client->yuv = ctx->yuv;
+    client->swapchain = ctx->swapchain;
+    client->winid = ctx->winid;
+    client->crop = ctx->crop;
     fill_capture_control_data(&msg, client);
-    client->buf_id = 0;
-    for (int i = 0; i < 4; ++i) {
-        if (client->buf_fds[i] >= 0) {
-            close(client->buf_fds[i]);
-            client->buf_fds[i] = -1;
-        }
+    client_close_slots(client);
+    write_capture_control_data(client, &msg);
+    client->timeout = clock_ns() + 5000000000; // 5s timeout
+}
+
+static void drop_client(vkcapture_source_t *ctx)
+{
+    import_cancel(&ctx->import);
+    ctx->import_buf_id = 0;
+    /* the textures may hold slots in the client's mailbox */
+    destroy_texture(ctx);
+    client_release(ctx->client);
+    ctx->client = NULL;
+    ctx->client_id = 0;
+}
+
+// Replaces the textures with a finished import and tells the client how it went
+static void swap_textures(vkcapture_source_t *ctx, vkcapture_client_t *client, vkcapture_textures_t *t)
+{
+    destroy_texture(ctx);
+    memcpy(&ctx->tdata, &t->tdata, sizeof(t->tdata));
+    memcpy(ctx->textures, t->textures, sizeof(t->textures));
+    memcpy(ctx->uv_textures, t->uv_textures, sizeof(t->uv_textures));
+    memcpy(ctx->upload.maps, t->maps, sizeof(t->maps));
+    ctx->ntextures = t->ntextures;
+
+    /* a single slot is overwritten while drawn anyway */
+    pthread_mutex_lock(&client->mutex);
+    struct capture_slot_state *slot_states = NULL;
+    if (client->control_shm && (client->cdata.flags & CAPTURE_CLIENT_FLAG_SLOT_STATE) &&
+            t->ntextures > 1) {
+        slot_states = client->control_shm->slots;
     }
-    memset(&client->tdata, 0, sizeof(client->tdata));
-    ssize_t ret = write(client->sockfd, &msg, sizeof(msg));
-    if (ret != sizeof(msg)) {
-        blog(LOG_WARNING, "Socket write error: %s", strerror(errno));
+    pthread_mutex_unlock(&client->mutex);
+
+    bool imported = t->imported;
+    if (imported && (import_host_mapped(t->import_failures) || t->tdata.memfd)) {
+        const uint32_t bpp = gs_get_format_bpp(drm_format_to_gs(t->tdata.format)) / 8;
+        ctx->upload.slot_states = slot_states;
+        imported = upload_start(&ctx->upload, t->tdata.width, t->tdata.height, bpp);
+    } else if (imported) {
+        ctx->slot_states = slot_states;
     }
-    client->timeout = clock_ns() + 5000000000; // 5s timeout
+    if (!imported) {
+        destroy_texture(ctx);
+    }
+    ctx->buf_id = t->buf_id;
+
+    pthread_mutex_lock(&client->mutex);
+    if (imported) {
+        import_cache_store(client, &t->tdata);
+    } else if (is_yuv_format(t->tdata.format)) {
+        client->yuv_failed = true;
+        blog(LOG_WARNING, "Could not import NV12/P010 planes, asking client for RGB");
+        send_capture_control_data(client);
+    } else if (client->import_failures == t->import_failures) {
+        import_cache_remove(client);
+        const int next = next_import_attempt(client->import_failures);
+        if (next != -1) {
+            client->import_failures = next;
+            blog(LOG_WARNING, "Asking client to create texture %s",
+                import_attempt_str(client->import_failures));
+            send_capture_control_data(client);
+        } else {
+            blog(LOG_ERROR, "Could not create texture from dmabuf source");
+        }
+    }
+    pthread_mutex_unlock(&client->mutex);
 }
 
 static void vkcapture_source_video_tick(void *data, float seconds)
@@ -437,98 +2039,185 @@ static void vkcapture_source_video_tick(void *data, float seconds)
         return;
     }
 
-    pthread_mutex_lock(&server.mutex);
+    query_gl_device();
 
-    if (ctx->client_id) {
-        vkcapture_client_t *client = find_client_by_id(ctx->client_id);
-        if (!client) {
-            ctx->client_id = 0;
-            destroy_texture(ctx);
-        } else if (ctx->buf_id != client->buf_id) {
-            destroy_texture(ctx);
-            memcpy(&ctx->tdata, &client->tdata, sizeof(client->tdata));
-
-            blog(LOG_INFO, "Creating texture from dmabuf %dx%d modifier:%" PRIu64,
-                    ctx->tdata.width, ctx->tdata.height, ctx->tdata.modifier);
-
-            uint32_t strides[4];
-            uint32_t offsets[4];
-            uint64_t modifiers[4];
-            for (uint8_t i = 0; i < ctx->tdata.nfd; ++i) {
-                strides[i] = ctx->tdata.strides[i];
-                offsets[i] = ctx->tdata.offsets[i];
-                modifiers[i] = ctx->tdata.modifier;
-                blog(LOG_INFO, " [%d] fd:%d stride:%d offset:%d", i, client->buf_fds[i], strides[i], offsets[i]);
-            }
-
-            if (client->import_failures == IMPORT_LINEAR_HOST_MAPPED) {
-                lseek(client->buf_fds[0], 0, SEEK_SET);
-                client->map_size = lseek(client->buf_fds[0], 0, SEEK_END);
-                client->map_memory = mmap(NULL, client->map_size, PROT_READ, MAP_SHARED, client->buf_fds[0], 0);
-                if (client->map_memory == MAP_FAILED) {
-                    client->map_memory = NULL;
-                    blog(LOG_ERROR, "Failed to map dmabuf '%s'", strerror(errno));
-                } else {
-                    obs_enter_graphics();
-                    ctx->texture = gs_texture_create(ctx->tdata.width, ctx->tdata.height,
-                        drm_format_to_gs(ctx->tdata.format), 1, NULL, GS_DYNAMIC);
-                    obs_leave_graphics();
-                }
-            } else {
-                obs_enter_graphics();
-                ctx->texture = gs_texture_create_from_dmabuf(ctx->tdata.width, ctx->tdata.height,
-                    ctx->tdata.format, drm_format_to_gs(ctx->tdata.format), ctx->tdata.nfd, client->buf_fds,
-                    strides, offsets, ctx->tdata.modifier != DRM_FORMAT_MOD_INVALID ? modifiers : NULL);
-                obs_leave_graphics();
-            }
-
-            if (!ctx->texture) {
-                if (client->import_failures < IMPORT_FAILURES_MAX) {
-                    client->import_failures++;
-                    blog(LOG_WARNING, "Asking client to create texture %s",
-                        import_attempt_str(client->import_failures));
-                    struct capture_control_data msg = {0};
-                    msg.capturing = client->activated ? 1 : 0;
-                    fill_capture_control_data(&msg, client);
-                    ssize_t ret = write(client->sockfd, &msg, sizeof(msg));
-                    if (ret != sizeof(msg)) {
-                        blog(LOG_WARNING, "Socket write error: %s", strerror(errno));
-                    }
-                } else {
-                    blog(LOG_ERROR, "Could not create texture from dmabuf source");
-                }
-            }
-            ctx->buf_id = client->buf_id;
-            client->timeout = 0;
-        } else if (client != find_matching_client(ctx)) {
-            activate_client(ctx, client, false);
-            ctx->client_id = 0;
-            destroy_texture(ctx);
-        } else if (client->timeout && clock_ns() > client->timeout) {
-            blog(LOG_INFO, "Client %d not responding, disconnecting...", client->id);
-            client->unresponsive = true;
-            server_wakeup();
-            ctx->client_id = 0;
-            destroy_texture(ctx);
-        }
-    } else {
-        vkcapture_client_t *client = find_matching_client(ctx);
+    if (ctx->show_cursor) {
+        cursor_tick(ctx);
+    }
+
+    vkcapture_client_t *client = ctx->client;
+    const long generation = os_atomic_load_long(&server.generation);
+
+    if (!client) {
+        client = find_matching_client(ctx);
         if (client) {
+            pthread_mutex_lock(&client->mutex);
             activate_client(ctx, client, true);
+            pthread_mutex_unlock(&client->mutex);
+            ctx->client = client;
             ctx->client_id = client->id;
+            ctx->generation = generation;
+        }
+        return;
+    }
+
+    /* clients only come and go rarely, skip the lookup until they do */
+    if (ctx->generation != generation) {
+        ctx->generation = generation;
+        vkcapture_client_t *match = find_matching_client(ctx);
+        client_release(match);
+        if (match != client) {
+            pthread_mutex_lock(&client->mutex);
+            activate_client(ctx, client, false);
+            pthread_mutex_unlock(&client->mutex);
+            drop_client(ctx);
+            return;
         }
     }
 
-    pthread_mutex_unlock(&server.mutex);
+    vkcapture_buffers_t *buffers = NULL;
+    int import_failures = 0;
+    bool drop = false;
+
+    pthread_mutex_lock(&client->mutex);
+    const int buf_id = client->buffers ? client->buffers->id : 0;
+    if (!client->connected) {
+        drop = true;
+    } else if (ctx->buf_id != buf_id) {
+        if (client->buffers && ctx->import_buf_id != buf_id) {
+            buffers = buffers_ref(client->buffers);
+            import_failures = client->import_failures;
+            client->timeout = 0;
+        }
+    } else if (client->timeout && clock_ns() > client->timeout) {
+        blog(LOG_INFO, "Client %d not responding, disconnecting...", client->id);
+        os_atomic_store_bool(&client->unresponsive, true);
+        server_wakeup();
+        drop = true;
+    } else if (client->limit_rate != ctx->limit_rate
+            || client->downscale != ctx->downscale
+            || client->yuv != ctx->yuv
+            || client->swapchain != ctx->swapchain
+            || client->winid != ctx->winid
+            || memcmp(&client->crop, &ctx->crop, sizeof(ctx->crop))
+            || (client->limit_rate && clock_ns() - client->control_time > 1000000000)) {
+        /* keep the client's idea of our frame timing from drifting */
+        client->limit_rate = ctx->limit_rate;
+        client->downscale = ctx->downscale;
+        client->yuv = ctx->yuv;
+        client->swapchain = ctx->swapchain;
+        client->winid = ctx->winid;
+        client->crop = ctx->crop;
+        send_capture_control_data(client);
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    if (drop) {
+        drop_client(ctx);
+        return;
+    }
+
+    if (buffers) {
+        ctx->import_buf_id = buffers->id;
+        import_post(&ctx->import, buffers, import_failures);
+    } else if (!buf_id && (ctx->buf_id || ctx->import_buf_id)) {
+        import_cancel(&ctx->import);
+        ctx->import_buf_id = 0;
+        destroy_texture(ctx);
+    }
+
+    vkcapture_textures_t textures;
+    if (import_take(&ctx->import, &textures)) {
+        if (textures.buf_id == ctx->import_buf_id) {
+            swap_textures(ctx, client, &textures);
+        } else {
+            /* newer buffers arrived while importing, keep the old frame up */
+            textures_free(&textures);
+        }
+    }
 
     UNUSED_PARAMETER(seconds);
 }
 
+/* Brings the textures up to the client's newest frame, returns false if
+ * there is nothing to draw yet */
+static bool source_update_frame(vkcapture_source_t *ctx, vkcapture_client_t *client)
+{
+    source_release_slots(ctx, 0);
+
+    /* only this client's messages contend for the lock */
+    pthread_mutex_lock(&client->mutex);
+    /* while new buffers are on their way the last frame stays up */
+    if (!client->connected || !client->buffers || client->buffers->id != ctx->buf_id ||
+            (ctx->ntextures > 1 && !client->frame_seq)) {
+        pthread_mutex_unlock(&client->mutex);
+        return ctx->shown;
+    }
+    const int s = client->frame_slot < ctx->ntextures ? client->frame_slot : 0;
+    const uint64_t seq = client->frame_seq;
+    const int64_t present_time = client->frame_present_time;
+    const int64_t complete_time = client->frame_complete_time;
+    const struct capture_rect damage = slot_damage_since(&client->slots[s], ctx->upload_seq[s]);
+    int sync_fd = -1;
+    if (client->frame_sync_fd >= 0) {
+        /* other sources may draw the same frame, keep the original */
+        sync_fd = fcntl(client->frame_sync_fd, F_DUPFD_CLOEXEC, 0);
+    }
+    pthread_mutex_unlock(&client->mutex);
+
+    if (complete_time) {
+        pthread_mutex_lock(&ctx->latency.mutex);
+        ctx->latency.copy_time = complete_time - present_time;
+        pthread_mutex_unlock(&ctx->latency.mutex);
+    }
+
+    if (ctx->upload.running) {
+        /* show the last staged frame, one behind the newest */
+        vkcapture_stage_t *stage = upload_take_ready(&ctx->upload);
+        if (stage) {
+            obs_enter_graphics();
+            texture_set_subimage(ctx->textures[stage->slot], stage->data,
+                    stage->linesize, &stage->rect);
+            obs_leave_graphics();
+            ctx->upload_seq[stage->slot] = stage->seq;
+            ctx->last_slot = stage->slot;
+            if (ctx->latency.slot_seq[stage->slot] == stage->seq) {
+                latency_add(&ctx->latency, stage->seq,
+                        ctx->latency.slot_present_time[stage->slot]);
+            }
+            upload_release(&ctx->upload, stage);
+        }
+        ctx->latency.slot_seq[s] = seq;
+        ctx->latency.slot_present_time[s] = present_time;
+        upload_post(&ctx->upload, s, seq, &damage, sync_fd);
+        if (!ctx->upload_seq[ctx->last_slot]) {
+            /* no copy has finished yet */
+            return false;
+        }
+    } else {
+        if (!source_hold_slot(ctx, s, seq)) {
+            /* the client is already copying a newer frame into it */
+            if (sync_fd >= 0) {
+                close(sync_fd);
+            }
+            return ctx->shown;
+        }
+        if (sync_fd >= 0) {
+            egl_wait_sync_fd(sync_fd);
+        }
+        ctx->last_slot = s;
+        latency_add(&ctx->latency, seq, present_time);
+    }
+
+    ctx->shown = true;
+    return true;
+}
+
 static void vkcapture_source_render(void *data, gs_effect_t *effect)
 {
     vkcapture_source_t *ctx = data;
 
-    if (!ctx->texture) {
+    if (!ctx->ntextures) {
         return;
     }
 
@@ -536,39 +2225,39 @@ static void vkcapture_source_render(void *data, gs_effect_t *effect)
         cursor_update(ctx);
     }
 
-    pthread_mutex_lock(&server.mutex);
-    vkcapture_client_t *client = find_client_by_id(ctx->client_id);
-    void *memory = client->map_memory;
-    int stride = client->tdata.strides[0];
-    int fd = client->buf_fds[0];
-    pthread_mutex_unlock(&server.mutex);
+    vkcapture_client_t *client = ctx->client;
+    if (!client || !source_update_frame(ctx, client)) {
+        return;
+    }
 
-    if (memory) {
-        struct dma_buf_sync sync;
-        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
-        ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    gs_texture_t *texture = ctx->textures[ctx->last_slot];
 
-        obs_enter_graphics();
-        gs_texture_set_image(ctx->texture, memory, stride, false);
-        obs_leave_graphics();
+    /* chroma of the slot the luma texture belongs to */
+    gs_texture_t *uv_texture = ctx->uv_textures[ctx->last_slot];
 
-        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
-        ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    if (uv_texture && yuv_effect) {
+        effect = yuv_effect;
+        gs_effect_set_texture(gs_effect_get_param_by_name(effect, "image_uv"), uv_texture);
+    } else {
+        effect = obs_get_base_effect(ctx->allow_transparency ? OBS_EFFECT_DEFAULT : OBS_EFFECT_OPAQUE);
     }
 
-    effect = obs_get_base_effect(ctx->allow_transparency ? OBS_EFFECT_DEFAULT : OBS_EFFECT_OPAQUE);
-
     gs_eparam_t *image = gs_effect_get_param_by_name(effect, "image");
-    gs_effect_set_texture(image, ctx->texture);
+    gs_effect_set_texture(image, texture);
+
+    /* a downscaled frame is stretched back to the game's size, so the scene
+     * layout and the cursor position don't depend on the scaling */
+    const uint32_t cx = ctx->tdata.source_width;
+    const uint32_t cy = ctx->tdata.source_height;
 
     while (gs_effect_loop(effect, "Draw")) {
-        gs_draw_sprite(ctx->texture, ctx->tdata.flip ? GS_FLIP_V : 0, 0, 0);
-        if (ctx->allow_transparency && ctx->show_cursor) {
+        gs_draw_sprite(texture, ctx->tdata.flip ? GS_FLIP_V : 0, cx, cy);
+        if (ctx->allow_transparency && ctx->show_cursor && !uv_texture) {
             cursor_render(ctx);
         }
     }
 
-    if (!ctx->allow_transparency && ctx->show_cursor) {
+    if ((!ctx->allow_transparency || uv_texture) && ctx->show_cursor) {
         effect = obs_get_base_effect(OBS_EFFECT_DEFAULT);
         while (gs_effect_loop(effect, "Draw")) {
             cursor_render(ctx);
@@ -584,19 +2273,28 @@ static const char *vkcapture_source_get_name(void *data)
 static uint32_t vkcapture_source_get_width(void *data)
 {
     const vkcapture_source_t *ctx = data;
-    return ctx->tdata.width;
+    return ctx->tdata.source_width ? ctx->tdata.source_width : ctx->tdata.width;
 }
 
 static uint32_t vkcapture_source_get_height(void *data)
 {
     const vkcapture_source_t *ctx = data;
-    return ctx->tdata.height;
+    return ctx->tdata.source_height ? ctx->tdata.source_height : ctx->tdata.height;
 }
 
 static void vkcapture_source_get_defaults(obs_data_t *defaults)
 {
     obs_data_set_default_bool(defaults, "show_cursor", true);
     obs_data_set_default_bool(defaults, "allow_transparency", false);
+    obs_data_set_default_bool(defaults, "limit_capture_rate", false);
+    obs_data_set_default_bool(defaults, "downscale_to_canvas", false);
+    obs_data_set_default_bool(defaults, "share_yuv", false);
+    obs_data_set_default_int(defaults, "swapchain", 0);
+    obs_data_set_default_int(defaults, "window_id", 0);
+    obs_data_set_default_int(defaults, "crop_left", 0);
+    obs_data_set_default_int(defaults, "crop_top", 0);
+    obs_data_set_default_int(defaults, "crop_right", 0);
+    obs_data_set_default_int(defaults, "crop_bottom", 0);
 }
 
 static obs_properties_t *vkcapture_source_get_properties(void *data)
@@ -615,7 +2313,7 @@ static obs_properties_t *vkcapture_source_get_properties(void *data)
         bool window_found = false;
         pthread_mutex_lock(&server.mutex);
         for (size_t i = 0; i < server.clients.num; i++) {
-            vkcapture_client_t *client = server.clients.array + i;
+            vkcapture_client_t *client = server.clients.array[i];
             obs_property_list_add_string(p, client->cdata.exe, client->cdata.exe);
             if (ctx->window && !strcmp(client->cdata.exe, ctx->window)) {
                 window_found = true;
@@ -642,6 +2340,55 @@ static obs_properties_t *vkcapture_source_get_properties(void *data)
     }
 
     obs_properties_add_bool(props, "allow_transparency", obs_module_text("AllowTransparency"));
+    obs_properties_add_bool(props, "limit_capture_rate", obs_module_text("LimitCaptureRate"));
+    obs_properties_add_bool(props, "downscale_to_canvas", obs_module_text("DownscaleToCanvas"));
+    obs_properties_add_bool(props, "share_yuv", obs_module_text("ShareYuv"));
+
+    p = obs_properties_add_list(props, "swapchain",
+            obs_module_text("CaptureSwapchain"),
+            OBS_COMBO_TYPE_LIST,
+            OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(p, obs_module_text("SwapchainDefault"), 0);
+    obs_property_list_add_int(p, obs_module_text("SwapchainLargest"), CAPTURE_SWAPCHAIN_LARGEST);
+    obs_property_list_add_int(p, obs_module_text("SwapchainRecent"), CAPTURE_SWAPCHAIN_RECENT);
+    obs_properties_add_int(props, "window_id", obs_module_text("WindowId"), 0, INT_MAX, 1);
+    obs_properties_add_int(props, "crop_left", obs_module_text("CropLeft"), 0, 16384, 1);
+    obs_properties_add_int(props, "crop_top", obs_module_text("CropTop"), 0, 16384, 1);
+    obs_properties_add_int(props, "crop_right", obs_module_text("CropRight"), 0, 16384, 1);
+    obs_properties_add_int(props, "crop_bottom", obs_module_text("CropBottom"), 0, 16384, 1);
+
+    if (ctx && ctx->client_id) {
+        struct capture_stats_data stats = {0};
+        pthread_mutex_lock(&server.mutex);
+        vkcapture_client_t *client = find_client_by_id(ctx->client_id);
+        if (client) {
+            pthread_mutex_lock(&client->mutex);
+            stats = client->stats;
+            pthread_mutex_unlock(&client->mutex);
+        }
+        pthread_mutex_unlock(&server.mutex);
+
+        if (stats.type == CAPTURE_STATS_DATA_TYPE) {
+            char text[256];
+            snprintf(text, sizeof(text),
+                    "%s: %u / %u frames, copy %.2f / %.2f ms%s, present %.2f / %.2f ms, init %.1f ms",
+                    obs_module_text("CaptureStats"), stats.frames_copied, stats.frames_copied + stats.frames_skipped,
+                    stats.copy_p50 / 1000.0, stats.copy_p99 / 1000.0,
+                    stats.gpu_copy_time ? " (GPU)" : "",
+                    stats.present_p50 / 1000.0, stats.present_p99 / 1000.0,
+                    stats.init_time / 1000.0);
+            obs_properties_add_text(props, "capture_stats", text, OBS_TEXT_INFO);
+        }
+
+        uint32_t p50, p99, count;
+        latency_percentiles(&ctx->latency, &p50, &p99, &count);
+        if (count) {
+            char text[128];
+            snprintf(text, sizeof(text), "%s: %.1f / %.1f ms",
+                    obs_module_text("CaptureLatency"), p50 / 1000.0, p99 / 1000.0);
+            obs_properties_add_text(props, "capture_latency", text, OBS_TEXT_INFO);
+        }
+    }
 
     return props;
 }
@@ -669,226 +2416,392 @@ static bool server_wakeup()
     return write(server.eventfd, &q, sizeof(q)) == sizeof(q);
 }
 
-static void server_add_fd(int fd, int events)
+static bool server_add_fd(int fd, void *ptr)
 {
-    struct pollfd p;
-    p.fd = fd;
-    p.events = events;
-    da_push_back(server.fds, &p);
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    return epoll_ctl(server.epollfd, EPOLL_CTL_ADD, fd, &ev) == 0;
 }
 
 static void server_remove_fd(int fd)
 {
-    for (size_t i = 0; i < server.fds.num; ++i) {
-        struct pollfd *p = server.fds.array + i;
-        if (p->fd == fd) {
-            da_erase(server.fds, i);
+    epoll_ctl(server.epollfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static void server_cleanup_client(vkcapture_client_t *client)
+{
+    blog(LOG_INFO, "Client %d disconnected", client->id);
+
+    server_remove_fd(client->sockfd);
+
+    pthread_mutex_lock(&server.mutex);
+    da_erase_item(server.clients, &client);
+    pthread_mutex_unlock(&server.mutex);
+    os_atomic_inc_long(&server.generation);
+
+    /* sources still holding the client drop it on their next tick */
+    pthread_mutex_lock(&client->mutex);
+    client->connected = false;
+    close(client->sockfd);
+    client->sockfd = -1;
+
+    client_close_slots(client);
+    pthread_mutex_unlock(&client->mutex);
+
+    client_release(client);
+}
+
+static void server_cleanup_unresponsive()
+{
+    while (true) {
+        vkcapture_client_t *client = NULL;
+        pthread_mutex_lock(&server.mutex);
+        for (size_t i = 0; i < server.clients.num; i++) {
+            if (os_atomic_load_bool(&server.clients.array[i]->unresponsive)) {
+                client = server.clients.array[i];
+                break;
+            }
+        }
+        pthread_mutex_unlock(&server.mutex);
+        if (!client) {
             break;
         }
+        server_cleanup_client(client);
     }
 }
 
-static bool server_has_event_on_fd(int fd)
+static void server_accept_client(int sockfd, int *clientid)
 {
-    for (size_t i = 0; i < server.fds.num; ++i) {
-        struct pollfd *p = server.fds.array + i;
-        if (p->fd == fd && p->revents) {
-            return true;
+    int clientfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (clientfd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+            blog(LOG_ERROR, "Cannot accept unix socket: %s", strerror(errno));
         }
+        return;
     }
-    return false;
+
+    vkcapture_client_t *client = bzalloc(sizeof(vkcapture_client_t));
+    client->refs = 1;
+    pthread_mutex_init(&client->mutex, NULL);
+    client->connected = true;
+    client->frame_sync_fd = -1;
+    client->id = ++*clientid;
+    client->sockfd = clientfd;
+    client->control_size = CAPTURE_CONTROL_DATA_SIZE_V0;
+
+    if (!server_add_fd(clientfd, client)) {
+        blog(LOG_ERROR, "Cannot watch client socket: %s", strerror(errno));
+        close(clientfd);
+        client_release(client);
+        return;
+    }
+    pthread_mutex_lock(&server.mutex);
+    da_push_back(server.clients, &client);
+    pthread_mutex_unlock(&server.mutex);
+    os_atomic_inc_long(&server.generation);
+
+    struct ucred cred = {0};
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(clientfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
+        blog(LOG_WARNING, "Failed to get socket credentials: %s", strerror(errno));
+    }
+    blog(LOG_INFO, "Client %d connected (pid=%d)", client->id, cred.pid);
 }
 
-static void server_cleanup_client(vkcapture_client_t *client)
+// Reads everything the client sent, returns false if it was disconnected
+static bool server_read_client(vkcapture_client_t *client, int *bufid)
 {
-    pthread_mutex_lock(&server.mutex);
+    uint8_t buf[CAPTURE_TEXTURE_DATA_SIZE];
+    struct msghdr msg = {0};
+    struct iovec io = {
+        .iov_base = buf,
+        .iov_len = CAPTURE_TEXTURE_DATA_SIZE,
+    };
+    msg.msg_iov = &io;
+    msg.msg_iovlen = 1;
+
+    char cmsg_buf[CMSG_SPACE(sizeof(int)) * 4];
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
 
-    blog(LOG_INFO, "Client %d disconnected", client->id);
+    while (true) {
+        msg.msg_controllen = sizeof(cmsg_buf);
+        const ssize_t n = recvmsg(client->sockfd, &msg, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno != ECONNRESET) {
+                blog(LOG_ERROR, "Socket recv error: %s", strerror(errno));
+            }
+        }
+        if (n <= 0) {
+            return false;
+        }
 
-    close(client->sockfd);
-    server_remove_fd(client->sockfd);
+        if (buf[0] == CAPTURE_CLIENT_DATA_TYPE) {
+            if (n != CAPTURE_CLIENT_DATA_SIZE) {
+                return false;
+            }
+            const struct capture_client_data *cdata = (const struct capture_client_data *)buf;
+            if (cdata->version && cdata->version != CAPTURE_PROTOCOL_VERSION) {
+                blog(LOG_WARNING, "Client %d speaks protocol version %u, expected %u",
+                        client->id, cdata->version, CAPTURE_PROTOCOL_VERSION);
+                return false;
+            }
+            pthread_mutex_lock(&server.mutex);
+            pthread_mutex_lock(&client->mutex);
+            memcpy(&client->cdata, buf, CAPTURE_CLIENT_DATA_SIZE);
+            client->exe_hash = exe_hash(client->cdata.exe, sizeof(client->cdata.exe));
+            /* older clients get the start of each control message, and
+             * neither a mailbox nor anything else they don't know */
+            if (!client->cdata.version) {
+                client->cdata.flags = 0;
+            }
+            client->control_size = client->cdata.version ?
+                CAPTURE_CONTROL_DATA_SIZE : CAPTURE_CONTROL_DATA_SIZE_V0;
+            if ((client->cdata.flags & CAPTURE_CLIENT_FLAG_CONTROL_SHM) && !client->control_shm) {
+                create_control_shm(client);
+            }
+            pthread_mutex_unlock(&client->mutex);
+            pthread_mutex_unlock(&server.mutex);
+            os_atomic_inc_long(&server.generation);
+            return true;
+        } else if (buf[0] == CAPTURE_TEXTURE_DATA_TYPE) {
+            struct capture_texture_data *td = (struct capture_texture_data *)buf;
 
-    if (client->map_memory) {
-        munmap(client->map_memory, client->map_size);
-        client->map_memory = NULL;
-    }
+            struct cmsghdr *cmsgh = CMSG_FIRSTHDR(&msg);
+            if (!cmsgh || cmsgh->cmsg_level != SOL_SOCKET || cmsgh->cmsg_type != SCM_RIGHTS) {
+                return false;
+            }
+
+            const size_t nfd = (cmsgh->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
+
+            int buf_fds[4] = {-1, -1, -1, -1};
+            for (size_t i = 0; i < nfd && i < 4; ++i) {
+                buf_fds[i] = ((int*)CMSG_DATA(cmsgh))[i];
+            }
+
+            /* Older clients leave nslots zeroed and only send one buffer */
+            const int nslots = td->nslots ? td->nslots : 1;
+
+            if (n != CAPTURE_TEXTURE_DATA_SIZE || td->nfd != nfd
+                    || nslots > CAPTURE_MAX_SLOTS || td->slot >= nslots) {
+                for (size_t i = 0; i < nfd && i < 4; ++i) {
+                    close(buf_fds[i]);
+                }
+                return false;
+            }
+
+            pthread_mutex_lock(&client->mutex);
+            if (td->slot == 0) {
+                /* sources keep showing the old buffers until all slots are here */
+                client_reset_frames(client);
+                buffers_release(client->pending);
+                client->pending = buffers_create(td);
+            }
+            if (!client->pending) {
+                for (int i = 0; i < 4; ++i) {
+                    if (buf_fds[i] >= 0) {
+                        close(buf_fds[i]);
+                    }
+                }
+                pthread_mutex_unlock(&client->mutex);
+                continue;
+            }
+            vkcapture_planes_t *slot = &client->pending->slots[td->slot];
+            for (int i = 0; i < 4; ++i) {
+                if (slot->fds[i] >= 0) {
+                    close(slot->fds[i]);
+                }
+                slot->fds[i] = buf_fds[i];
+                slot->strides[i] = td->strides[i];
+                slot->offsets[i] = td->offsets[i];
+            }
+            if (td->slot == nslots - 1) {
+                client->pending->nslots = nslots;
+                client->pending->id = ++*bufid;
+                buffers_release(client->buffers);
+                client->buffers = client->pending;
+                client->pending = NULL;
+                client->nslots = nslots;
+            }
+            pthread_mutex_unlock(&client->mutex);
+        } else if (buf[0] == CAPTURE_STATS_DATA_TYPE) {
+            if (n != CAPTURE_STATS_DATA_SIZE) {
+                return false;
+            }
+            pthread_mutex_lock(&client->mutex);
+            memcpy(&client->stats, buf, CAPTURE_STATS_DATA_SIZE);
+            pthread_mutex_unlock(&client->mutex);
+        } else if (buf[0] == CAPTURE_FRAME_DATA_TYPE) {
+            struct capture_frame_data *frame = (struct capture_frame_data *)buf;
+
+            int sync_fd = -1;
+            size_t nfd = 0;
+            struct cmsghdr *cmsgh = CMSG_FIRSTHDR(&msg);
+            if (cmsgh && cmsgh->cmsg_level == SOL_SOCKET && cmsgh->cmsg_type == SCM_RIGHTS) {
+                nfd = (cmsgh->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
+                if (nfd) {
+                    sync_fd = ((int*)CMSG_DATA(cmsgh))[0];
+                }
+            }
 
-    for (int i = 0; i < 4; ++i) {
-        if (client->buf_fds[i] >= 0) {
-            close(client->buf_fds[i]);
-            client->buf_fds[i] = -1;
+            if (n != CAPTURE_FRAME_DATA_SIZE || frame->nfd != nfd || nfd > 1) {
+                for (size_t i = 0; i < nfd; ++i) {
+                    close(((int*)CMSG_DATA(cmsgh))[i]);
+                }
+                return false;
+            }
+
+            pthread_mutex_lock(&client->mutex);
+            if (frame->slot < client->nslots && frame->seq > client->frame_seq) {
+                vkcapture_slot_t *slot = &client->slots[frame->slot];
+                slot->damage_index = (slot->damage_index + 1) % DAMAGE_HISTORY;
+                slot->damage_seq[slot->damage_index] = frame->seq;
+                slot->damage[slot->damage_index] = frame->damage;
+                client->frame_slot = frame->slot;
+                client->frame_seq = frame->seq;
+                client->frame_present_time = frame->present_time;
+                client->frame_complete_time = frame->complete_time;
+                if (client->frame_sync_fd >= 0) {
+                    close(client->frame_sync_fd);
+                }
+                client->frame_sync_fd = sync_fd;
+                sync_fd = -1;
+            }
+            pthread_mutex_unlock(&client->mutex);
+
+            if (sync_fd >= 0) {
+                close(sync_fd);
+            }
         }
     }
+}
 
-    da_erase_item(server.clients, client);
+// Wakes the dormant clients, they skip the socket until a server is announced
+static struct capture_announce *server_announce(int index)
+{
+    int fd = open(CAPTURE_ANNOUNCE_PATH, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        blog(LOG_WARNING, "Cannot open %s: %s, running games only notice OBS after a while",
+            CAPTURE_ANNOUNCE_PATH, strerror(errno));
+        return NULL;
+    }
+    // games of every user read it, only its owner may write it
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()) {
+        blog(LOG_WARNING, "%s belongs to another user, running games only notice OBS after a while",
+            CAPTURE_ANNOUNCE_PATH);
+        close(fd);
+        return NULL;
+    }
+    if (fchmod(fd, 0644) != 0 || (st.st_size < CAPTURE_ANNOUNCE_SIZE && ftruncate(fd, CAPTURE_ANNOUNCE_SIZE) != 0)) {
+        blog(LOG_WARNING, "Cannot resize %s: %s", CAPTURE_ANNOUNCE_PATH, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    struct capture_announce *announce = mmap(NULL, CAPTURE_ANNOUNCE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (announce == MAP_FAILED) {
+        blog(LOG_WARNING, "Cannot map %s: %s", CAPTURE_ANNOUNCE_PATH, strerror(errno));
+        return NULL;
+    }
+    __atomic_store_n(&announce->server_pid[index], (uint32_t)getpid(), __ATOMIC_RELAXED);
+    return announce;
+}
 
-    pthread_mutex_unlock(&server.mutex);
+static void server_withdraw(struct capture_announce *announce, int index)
+{
+    if (!announce) {
+        return;
+    }
+    // leave it alone if another OBS took over
+    uint32_t pid = getpid();
+    __atomic_compare_exchange_n(&announce->server_pid[index], &pid, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    munmap(announce, CAPTURE_ANNOUNCE_SIZE);
 }
 
 static void *server_thread_run(void *data)
 {
-    const char sockname[] = "/com/obsproject/vkcapture";
-
     int bufid = 0;
     int clientid = 0;
 
-    da_init(server.fds);
     da_init(server.clients);
 
+    // another OBS may hold the first socket, games feed every one of them
     struct sockaddr_un addr;
-    addr.sun_family = PF_LOCAL;
-    addr.sun_path[0] = '\0'; // Abstract socket
-    memcpy(&addr.sun_path[1], sockname, sizeof(sockname) - 1);
-
     int sockfd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
-    int ret = bind(sockfd, (const struct sockaddr *)&addr, sizeof(addr.sun_family) + sizeof(sockname));
+    int ret = -1;
+    int index = 0;
+    for (; index < CAPTURE_MAX_SERVERS; ++index) {
+        const socklen_t addr_len = capture_socket_addr(&addr, index);
+        ret = bind(sockfd, (const struct sockaddr *)&addr, addr_len);
+        if (ret == 0 || errno != EADDRINUSE) {
+            break;
+        }
+    }
     if (ret < 0) {
-        blog(LOG_ERROR, "Cannot bind unix socket to %s: %d", addr.sun_path, errno);
+        blog(LOG_ERROR, "Cannot bind unix socket to %s: %d", &addr.sun_path[1], errno);
         return NULL;
     }
+    if (index > 0) {
+        blog(LOG_INFO, "Another OBS is capturing games, listening on %s", &addr.sun_path[1]);
+    }
 
     ret = listen(sockfd, 1);
     if (ret < 0) {
-        blog(LOG_ERROR, "Cannot listen on unix socket bound to %s: %d", addr.sun_path, errno);
+        blog(LOG_ERROR, "Cannot listen on unix socket bound to %s: %d", &addr.sun_path[1], errno);
         return NULL;
     }
 
-    server_add_fd(sockfd, POLLIN);
-    server_add_fd(server.eventfd, POLLIN);
+    /* clients are tagged with their own pointer */
+    server_add_fd(sockfd, &sockfd);
+    server_add_fd(server.eventfd, &server.eventfd);
+
+    struct capture_announce *announce = server_announce(index);
+
+    struct epoll_event events[16];
 
     while (true) {
-        int ret = poll(server.fds.array, server.fds.num, -1);
-        if (ret <= 0) {
+        int n = epoll_wait(server.epollfd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (n <= 0) {
             continue;
         }
 
-        if (server_has_event_on_fd(server.eventfd)) {
-            uint64_t q;
-            read(server.eventfd, &q, sizeof(q));
-            if (server.quit) {
-                break;
-            }
-        }
-
-        if (server_has_event_on_fd(sockfd)) {
-            int clientfd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
-            if (clientfd >= 0) {
-                vkcapture_client_t client = {0};
-                memset(&client.buf_fds, -1, sizeof(client.buf_fds));
-                client.id = ++clientid;
-                client.sockfd = clientfd;
-                pthread_mutex_lock(&server.mutex);
-                da_push_back(server.clients, &client);
-                pthread_mutex_unlock(&server.mutex);
-                server_add_fd(client.sockfd, POLLIN);
-                struct ucred cred = {0};
-                socklen_t cred_len = sizeof(cred);
-                if (getsockopt(client.sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0) {
-                    blog(LOG_WARNING, "Failed to get socket credentials: %s", strerror(errno));
-                }
-                blog(LOG_INFO, "Client %d connected (pid=%d)", client.id, cred.pid);
-            } else {
-                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
-                    blog(LOG_ERROR, "Cannot accept unix socket: %s", strerror(errno));
-                }
+        bool wakeup = false;
+        for (int i = 0; i < n; ++i) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &server.eventfd) {
+                uint64_t q;
+                read(server.eventfd, &q, sizeof(q));
+                wakeup = true;
+            } else if (ptr == &sockfd) {
+                server_accept_client(sockfd, &clientid);
+            } else if (!server_read_client(ptr, &bufid)) {
+                server_cleanup_client(ptr);
             }
         }
 
-        for (size_t i = 0; i < server.clients.num; i++) {
-            vkcapture_client_t *client = server.clients.array + i;
-            if (client->unresponsive) {
-                server_cleanup_client(client);
-                continue;
-            }
-            if (!server_has_event_on_fd(client->sockfd)) {
-                continue;
-            }
-
-            uint8_t buf[CAPTURE_TEXTURE_DATA_SIZE];
-            struct msghdr msg = {0};
-            struct iovec io = {
-                .iov_base = buf,
-                .iov_len = CAPTURE_TEXTURE_DATA_SIZE,
-            };
-            msg.msg_iov = &io;
-            msg.msg_iovlen = 1;
-
-            char cmsg_buf[CMSG_SPACE(sizeof(int)) * 4];
-            msg.msg_control = cmsg_buf;
-            msg.msg_controllen = sizeof(cmsg_buf);
-
-            while (true) {
-                const ssize_t n = recvmsg(client->sockfd, &msg, MSG_NOSIGNAL);
-                if (n == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        break;
-                    }
-                    if (errno != ECONNRESET) {
-                        blog(LOG_ERROR, "Socket recv error: %s", strerror(errno));
-                    }
-                }
-                if (n <= 0) {
-                    server_cleanup_client(client);
-                    break;
-                }
-
-                if (buf[0] == CAPTURE_CLIENT_DATA_TYPE) {
-                    if (io.iov_len != CAPTURE_CLIENT_DATA_SIZE) {
-                        server_cleanup_client(client);
-                        break;
-                    }
-                    pthread_mutex_lock(&server.mutex);
-                    memcpy(&client->cdata, buf, CAPTURE_CLIENT_DATA_SIZE);
-                    pthread_mutex_unlock(&server.mutex);
-                    break;
-                } else if (buf[0] == CAPTURE_TEXTURE_DATA_TYPE) {
-                    pthread_mutex_lock(&server.mutex);
-                    memcpy(&client->tdata, buf, CAPTURE_TEXTURE_DATA_SIZE);
-                    pthread_mutex_unlock(&server.mutex);
-
-                    struct cmsghdr *cmsgh = CMSG_FIRSTHDR(&msg);
-                    if (!cmsgh || cmsgh->cmsg_level != SOL_SOCKET || cmsgh->cmsg_type != SCM_RIGHTS) {
-                        server_cleanup_client(client);
-                        break;
-                    }
-
-                    const size_t nfd = (cmsgh->cmsg_len - sizeof(struct cmsghdr)) / sizeof(int);
-
-                    int buf_fds[4] = {-1, -1, -1, -1};
-                    for (size_t i = 0; i < nfd; ++i) {
-                        buf_fds[i] = ((int*)CMSG_DATA(cmsgh))[i];
-                    }
-
-                    if (io.iov_len != CAPTURE_TEXTURE_DATA_SIZE || client->tdata.nfd != nfd) {
-                        for (size_t i = 0; i < nfd; ++i) {
-                            close(buf_fds[i]);
-                        }
-                        server_cleanup_client(client);
-                        break;
-                    }
-
-                    pthread_mutex_lock(&server.mutex);
-                    for (int i = 0; i < 4; ++i) {
-                        if (client->buf_fds[i] >= 0) {
-                            close(client->buf_fds[i]);
-                        }
-                        client->buf_fds[i] = buf_fds[i];
-                    }
-                    client->buf_id = ++bufid;
-                    pthread_mutex_unlock(&server.mutex);
-                }
+        /* not while handling the batch, it may still list their sockets */
+        if (wakeup) {
+            if (server.quit) {
+                break;
             }
+            server_cleanup_unresponsive();
         }
     }
 
+    server_withdraw(announce, index);
+
     while (server.clients.num) {
-        server_cleanup_client(server.clients.array);
+        server_cleanup_client(server.clients.array[0]);
     }
 
     close(sockfd);
 
     da_free(server.clients);
-    da_free(server.fds);
 
     return NULL;
 }
@@ -911,6 +2824,19 @@ bool obs_module_load(void)
         return false;
     }
 
+    server.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server.epollfd < 0) {
+        blog(LOG_ERROR, "Failed to create epoll: %s", strerror(errno));
+        return false;
+    }
+
+    char *cache_path = obs_module_config_path("import_cache.json");
+    import_cache = obs_data_create_from_json_file_safe(cache_path, "bak");
+    bfree(cache_path);
+    if (!import_cache) {
+        import_cache = obs_data_create();
+    }
+
     pthread_mutex_init(&server.mutex, NULL);
     if (pthread_create(&server.thread, NULL, server_thread_run, NULL) != 0) {
         blog(LOG_ERROR, "Failed to create thread");
@@ -931,6 +2857,16 @@ void obs_module_unload()
         pthread_join(server.thread, NULL);
     }
 
+    obs_data_release(import_cache);
+    import_cache = NULL;
+
+    if (yuv_effect) {
+        obs_enter_graphics();
+        gs_effect_destroy(yuv_effect);
+        obs_leave_graphics();
+        yuv_effect = NULL;
+    }
+
     blog(LOG_INFO, "plugin unloaded");
 }
 
@@ -16,6 +16,8 @@ You should have received a copy of the GNU General Public License along
 with this program. If not, see <https://www.gnu.org/licenses/>
 */
 
+#define _GNU_SOURCE
+
 #include "vklayer.h"
 #include "capture.h"
 #include "utils.h"
@@ -24,10 +26,18 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <inttypes.h>
+#include <sys/mman.h>
 #include <vulkan/vk_layer.h>
 
+#if HAVE_YUV_SHADERS
+#include "rgb_to_nv12.spv.h"
+#include "rgb_to_p010.spv.h"
+#endif
+
 // Based on obs-studio/plugins/win-capture/graphics-hook/vulkan-capture.c
 
 /* ======================================================================== */
@@ -40,42 +50,160 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #define MAX_PRESENT_SWAP_SEMAPHORE_COUNT 32
 static VkPipelineStageFlagBits semaphore_dst_stage_masks[MAX_PRESENT_SWAP_SEMAPHORE_COUNT];
+static VkPipelineStageFlagBits semaphore_compute_stage_masks[MAX_PRESENT_SWAP_SEMAPHORE_COUNT];
 
 static bool vulkan_seen = false;
 
 static bool vkcapture_linear = false;
 
+static int vkcapture_slots = 3;
+
+static bool vkcapture_cross_device = true;
+
+static bool vkcapture_transfer_queue = true;
+
+static bool vkcapture_low_latency = false;
+
+static int vkcapture_swapchain_policy = CAPTURE_SWAPCHAIN_LARGEST;
+
 /* ======================================================================== */
 /* hook data                                                                */
 
 struct vk_obj_node {
     uint64_t obj;
-    struct vk_obj_node *next;
+    /* entry in the current table, only valid with the list mutex held */
+    uint32_t index;
+};
+
+/* Open addressing table keyed on dispatch pointer or handle. Lookups are
+ * lock-free, writers take the list mutex. An entry with a key and no node is
+ * a tombstone. Removing a node waits for the lookups that may still see it,
+ * see wait_obj_readers. */
+struct vk_obj_entry {
+    uint64_t obj;
+    struct vk_obj_node *node;
+};
+
+struct vk_obj_table {
+    struct vk_obj_table *retired;
+    uint32_t mask;
+    uint32_t used;
+    uint32_t count;
+    struct vk_obj_entry entries[];
 };
 
 struct vk_obj_list {
-    struct vk_obj_node *root;
+    struct vk_obj_table *table;
     pthread_mutex_t mutex;
+    /* lookups in progress, counted by the parity of the epoch they began in */
+    uint32_t epoch;
+    uint32_t readers[2];
+};
+
+struct vk_export_slot {
+    VkImage image;
+    VkDeviceMemory mem;
+
+    int dmabuf_nfd;
+    int dmabuf_fds[4];
+    int dmabuf_strides[4];
+    int dmabuf_offsets[4];
+
+    /* chroma plane and compute resources when converting to NV12/P010 */
+    VkImage uv_image;
+    VkDeviceMemory uv_mem;
+    VkImageView yuv_views[2];
+    VkDescriptorPool desc_pool;
+    VkDescriptorSet *desc_sets;
+
+    /* changed since this slot was last written, and written since it was
+     * last reported to OBS */
+    struct capture_rect damage;
+    struct capture_rect unreported;
+
+    /* memfd transport: buffer over the imported mapping, which starts with
+     * the header shared with OBS */
+    VkBuffer buffer;
+    struct capture_memfd_header *header;
+    size_t host_size;
+
+    /* device local copy of the swapchain image, the slow copy into the
+     * slot reads it after the present was released */
+    VkImage stage_image;
+    VkDeviceMemory stage_mem;
+
+    /* frame that is still copying into this slot, NULL when idle */
+    struct vk_frame_data *frame_data;
+    uint64_t seq;
+    /* capture_clock_ns() of the present the copy was made for */
+    int64_t present_time;
+};
+
+/* Export slot released while the GPU may still be copying into it */
+struct vk_retired_slot {
+    struct vk_retired_slot *next;
+    struct vk_export_slot slot;
+};
+
+/* Snapshot of the capture settings, the init thread must not touch capture.c */
+struct vk_export_params {
+    bool no_modifiers;
+    bool linear;
+    bool map_host;
+    bool same_device;
+    /* OBS is on another GPU: linear images in system memory, reported once
+     * the copy is done */
+    bool cross_device;
+    /* copy into memfd slots instead of exporting images */
+    bool memfd;
+    /* present only waits for a copy into stage images */
+    bool stage;
+    /* OBS instances reading the images, each may hold a slot */
+    int consumers;
+    bool use_hint;
+    bool hint_rejected;
+    uint64_t hint_modifier;
+    int hint_planes;
+    int supported_modifier_count;
+    uint64_t supported_modifiers[CAPTURE_MAX_MODIFIERS];
 };
 
 struct vk_swap_data {
     struct vk_obj_node node;
 
     VkExtent2D image_extent;
+    /* part of the image that is exported, all of it without a crop */
+    struct capture_rect crop;
     VkFormat format;
     uint64_t winid;
-    VkImage export_image;
     VkFormat export_format;
-    VkDeviceMemory export_mem;
+    VkExtent2D export_extent;
     VkImage *swap_images;
     uint32_t image_count;
+    bool exclusive_sharing;
+
+    /* mailbox or immediate with OBS_VKCAPTURE_LOW_LATENCY */
+    bool low_latency;
+
+    /* DRM_FORMAT_NV12 or DRM_FORMAT_P010 when converting on the GPU */
+    int32_t yuv_format;
+    bool sampled;
+    VkImageView *src_views;
+
+    struct vk_export_slot slots[CAPTURE_MAX_SLOTS];
+    int slot_count;
+    int slot_index;
+    int latest_slot;
+    uint64_t latest_seq;
+    uint64_t frame_seq;
 
-    int dmabuf_nfd;
-    int dmabuf_fds[4];
-    int dmabuf_strides[4];
-    int dmabuf_offsets[4];
     uint64_t dmabuf_modifier;
+    struct vk_export_params params;
     bool captured;
+
+    /* creation order, swapchains are recreated when the window is resized */
+    uint64_t serial;
+    int64_t last_present;
 };
 
 struct vk_queue_data {
@@ -83,6 +211,7 @@ struct vk_queue_data {
 
     uint32_t fam_idx;
     bool supports_transfer;
+    uint32_t timestamp_bits;
     struct vk_frame_data *frames;
     uint32_t frame_index;
     uint32_t frame_count;
@@ -91,9 +220,30 @@ struct vk_queue_data {
 struct vk_frame_data {
     VkCommandPool cmd_pool;
     VkCommandBuffer cmd_buffer;
+    /* copy into the stage image, the present waits for this one only */
+    VkCommandBuffer stage_cmd_buffer;
     VkFence fence;
     VkSemaphore semaphore;
+    VkSemaphore export_semaphore;
     bool cmd_buffer_busy;
+
+    /* swapchain image ownership transfer when copying on the transfer queue,
+     * recorded on the present queue before and after the copy */
+    VkCommandPool own_cmd_pool;
+    uint32_t own_fam_idx;
+    VkCommandBuffer own_cmd_buffers[2];
+    VkSemaphore own_semaphores[2];
+
+    /* export copy of a staged slot on the transfer queue, it waits for the
+     * stage copy through stage_semaphore */
+    VkCommandPool export_cmd_pool;
+    VkCommandBuffer export_cmd_buffer;
+    VkSemaphore stage_semaphore;
+
+    /* timestamps around the copy, VK_NULL_HANDLE if the queue has none */
+    VkQueryPool query_pool;
+    uint64_t timestamp_mask;
+    bool timestamps_written;
 };
 
 struct vk_surf_data {
@@ -126,11 +276,55 @@ struct vk_data {
     struct vk_obj_list swaps;
     struct vk_swap_data *cur_swap;
 
+    /* swapchain picked by vk_shtex_select_swap, refreshed every SWAP_SELECT_NS */
+    struct vk_swap_data *target_swap;
+    int64_t select_time;
+    uint64_t swap_serial;
+
     struct vk_obj_list queues;
     VkQueue graphics_queue;
 
+    /* queue created by the layer on a family without graphics, NULL if none */
+    VkQueue transfer_queue;
+
+    /* NV12/P010 conversion, created on first use */
+    VkDescriptorSetLayout yuv_set_layout;
+    VkPipelineLayout yuv_pipeline_layout;
+    VkPipeline yuv_pipelines[2];
+    VkSampler yuv_sampler;
+
+    /* destroyed once the copy into them has finished, see vk_shtex_collect_retired */
+    struct vk_retired_slot *retired;
+
+    /* export images are created on a helper thread, see vk_shtex_start_init */
+    pthread_t init_thread;
+    bool init_running;
+    bool init_joinable;
+    /* capture stopped while it was running, init_swap is freed once done */
+    bool init_abandoned;
+    int init_done;
+    bool init_result;
+    struct vk_swap_data *init_swap;
+    struct vk_queue_data *init_queue;
+    int64_t init_time;
+
+    /* nanoseconds per timestamp tick */
+    float timestamp_period;
+
     VkExternalMemoryProperties external_mem_props;
 
+    bool sync_fd_supported;
+
+    /* bit per vk_format_table entry the device can export as a dmabuf
+     * and copy or blit into */
+    uint32_t copy_formats;
+    uint32_t blit_formats;
+    bool formats_queried;
+
+    /* VK_EXT_external_memory_host, needed for the memfd transport */
+    bool host_ptr_supported;
+    VkDeviceSize host_ptr_alignment;
+
     struct vk_inst_data *inst_data;
 
     VkAllocationCallbacks ac_storage;
@@ -154,37 +348,125 @@ static void vk_free(const VkAllocationCallbacks *ac, void *memory)
         free(memory);
 }
 
+#define OBJ_TABLE_MIN_SIZE 16
+
+static inline uint32_t obj_hash(uint64_t obj)
+{
+    obj ^= obj >> 33;
+    obj *= 0xff51afd7ed558ccdULL;
+    obj ^= obj >> 33;
+    return (uint32_t)obj;
+}
+
+static struct vk_obj_table *alloc_obj_table(uint32_t size)
+{
+    struct vk_obj_table *table = calloc(1, sizeof(struct vk_obj_table) +
+            size * sizeof(struct vk_obj_entry));
+    if (table)
+        table->mask = size - 1;
+    return table;
+}
+
+static void insert_obj_entry(struct vk_obj_table *table,
+        struct vk_obj_node *node)
+{
+    uint32_t i = obj_hash(node->obj) & table->mask;
+    while (__atomic_load_n(&table->entries[i].node, __ATOMIC_RELAXED))
+        i = (i + 1) & table->mask;
+
+    struct vk_obj_entry *entry = &table->entries[i];
+    if (!entry->obj)
+        table->used++;
+    table->count++;
+    node->index = i;
+
+    /* a reader seeing the key before the node skips the entry as a
+     * tombstone, the handle is not known to the app yet */
+    __atomic_store_n(&entry->obj, node->obj, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->node, node, __ATOMIC_RELEASE);
+}
+
+/* Replaces the table when it runs out of empty entries. Readers may still be
+ * walking the old one, so it is kept until the list itself is freed. Tables
+ * only ever double, which bounds what is kept to the size of the live one. */
+static bool grow_obj_list(struct vk_obj_list *list)
+{
+    struct vk_obj_table *old = list->table;
+    const uint32_t size = old->mask + 1;
+    if ((old->used + 1) * 4 < size * 3)
+        return true;
+
+    const uint32_t new_size = (old->count + 1) * 2 > size ? size * 2 : size;
+    struct vk_obj_table *table = alloc_obj_table(new_size);
+    if (!table)
+        return old->count < size;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        if (old->entries[i].node)
+            insert_obj_entry(table, old->entries[i].node);
+    }
+
+    table->retired = old;
+    __atomic_store_n(&list->table, table, __ATOMIC_RELEASE);
+    return true;
+}
+
 static void add_obj_data(struct vk_obj_list *list, uint64_t obj, void *data)
 {
     pthread_mutex_lock(&list->mutex);
 
     struct vk_obj_node *const node = (struct vk_obj_node*)data;
     node->obj = obj;
-    node->next = list->root;
-    list->root = node;
+    if (grow_obj_list(list))
+        insert_obj_entry(list->table, node);
+    else
+        hlog("Failed to track object 0x%" PRIx64, obj);
 
     pthread_mutex_unlock(&list->mutex);
 }
 
 static struct vk_obj_node *get_obj_data(struct vk_obj_list *list, uint64_t obj)
 {
-    struct vk_obj_node *data = NULL;
-
-    pthread_mutex_lock(&list->mutex);
-
-    struct vk_obj_node *node = list->root;
-    while (node) {
-        if (node->obj == obj) {
-            data = node;
+    const uint32_t epoch = __atomic_load_n(&list->epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&list->readers[epoch], 1, __ATOMIC_SEQ_CST);
+
+    const struct vk_obj_table *table =
+        __atomic_load_n(&list->table, __ATOMIC_SEQ_CST);
+
+    struct vk_obj_node *found = NULL;
+    uint32_t i = obj_hash(obj) & table->mask;
+    for (uint32_t n = 0; n <= table->mask; ++n) {
+        const struct vk_obj_entry *entry = &table->entries[i];
+        const uint64_t key = __atomic_load_n(&entry->obj, __ATOMIC_SEQ_CST);
+        if (!key)
             break;
+        if (key == obj) {
+            struct vk_obj_node *node =
+                __atomic_load_n(&entry->node, __ATOMIC_SEQ_CST);
+            if (node && node->obj == obj) {
+                found = node;
+                break;
+            }
         }
-
-        node = node->next;
+        i = (i + 1) & table->mask;
     }
 
-    pthread_mutex_unlock(&list->mutex);
+    __atomic_sub_fetch(&list->readers[epoch], 1, __ATOMIC_RELEASE);
+    return found;
+}
 
-    return data;
+/* Returns once no lookup can still read a node removed before the call, so
+ * the caller may free it. New lookups count towards the other parity after
+ * each flip, stragglers that read the epoch before a flip are drained by the
+ * second one. Called with the list mutex held. */
+static void wait_obj_readers(struct vk_obj_list *list)
+{
+    for (int flip = 0; flip < 2; ++flip) {
+        const uint32_t epoch =
+            __atomic_fetch_add(&list->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&list->readers[epoch], __ATOMIC_SEQ_CST))
+            sched_yield();
+    }
 }
 
 static struct vk_obj_node *remove_obj_data(struct vk_obj_list *list,
@@ -194,22 +476,25 @@ static struct vk_obj_node *remove_obj_data(struct vk_obj_list *list,
 
     pthread_mutex_lock(&list->mutex);
 
-    struct vk_obj_node *prev = NULL;
-    struct vk_obj_node *node = list->root;
-    while (node) {
-        if (node->obj == obj) {
-            data = node;
-            if (prev)
-                prev->next = node->next;
-            else
-                list->root = node->next;
+    struct vk_obj_table *table = list->table;
+    uint32_t i = obj_hash(obj) & table->mask;
+    for (uint32_t n = 0; n <= table->mask; ++n) {
+        struct vk_obj_entry *entry = &table->entries[i];
+        if (!entry->obj)
+            break;
+        if (entry->obj == obj && entry->node) {
+            data = entry->node;
+            __atomic_store_n(&entry->node, NULL, __ATOMIC_SEQ_CST);
+            table->count--;
             break;
         }
-
-        prev = node;
-        node = node->next;
+        i = (i + 1) & table->mask;
     }
 
+    /* retired tables still point at the node too */
+    if (data)
+        wait_obj_readers(list);
+
     pthread_mutex_unlock(&list->mutex);
 
     return data;
@@ -217,19 +502,47 @@ static struct vk_obj_node *remove_obj_data(struct vk_obj_list *list,
 
 static void init_obj_list(struct vk_obj_list *list)
 {
-    list->root = NULL;
+    list->table = alloc_obj_table(OBJ_TABLE_MIN_SIZE);
+    list->epoch = 0;
+    list->readers[0] = 0;
+    list->readers[1] = 0;
     pthread_mutex_init(&list->mutex, NULL);
 }
 
+/* the owner is being destroyed, so nothing can look it up anymore */
+static void free_obj_list(struct vk_obj_list *list)
+{
+    struct vk_obj_table *table = list->table;
+    while (table) {
+        struct vk_obj_table *retired = table->retired;
+        free(table);
+        table = retired;
+    }
+    list->table = NULL;
+    pthread_mutex_destroy(&list->mutex);
+}
+
+static struct vk_obj_node *obj_walk_from(struct vk_obj_list *list,
+        uint32_t index)
+{
+    const struct vk_obj_table *table = list->table;
+    for (uint32_t i = index; i <= table->mask; ++i) {
+        if (table->entries[i].node)
+            return table->entries[i].node;
+    }
+    return NULL;
+}
+
 static struct vk_obj_node *obj_walk_begin(struct vk_obj_list *list)
 {
     pthread_mutex_lock(&list->mutex);
-    return list->root;
+    return obj_walk_from(list, 0);
 }
 
-static struct vk_obj_node *obj_walk_next(struct vk_obj_node *node)
+static struct vk_obj_node *obj_walk_next(struct vk_obj_list *list,
+        struct vk_obj_node *node)
 {
-    return node->next;
+    return obj_walk_from(list, node->index + 1);
 }
 
 static void obj_walk_end(struct vk_obj_list *list)
@@ -253,6 +566,15 @@ static void init_device_data(struct vk_data *data, VkDevice device)
 {
     add_obj_data(&devices, (uintptr_t)GET_LDT(device), data);
     data->device = device;
+    data->init_running = false;
+    data->init_abandoned = false;
+    data->retired = NULL;
+    data->formats_queried = false;
+    data->yuv_set_layout = VK_NULL_HANDLE;
+    data->yuv_pipeline_layout = VK_NULL_HANDLE;
+    data->yuv_pipelines[0] = VK_NULL_HANDLE;
+    data->yuv_pipelines[1] = VK_NULL_HANDLE;
+    data->yuv_sampler = VK_NULL_HANDLE;
 }
 
 static struct vk_data *get_device_data(VkDevice device)
@@ -279,6 +601,7 @@ static struct vk_queue_data *add_queue_data(struct vk_data *data, VkQueue queue,
         uint32_t fam_idx,
         bool supports_transfer,
         bool supports_graphics,
+        uint32_t timestamp_bits,
         const VkAllocationCallbacks *ac)
 {
     struct vk_queue_data *const queue_data =
@@ -288,6 +611,7 @@ static struct vk_queue_data *add_queue_data(struct vk_data *data, VkQueue queue,
     add_obj_data(&data->queues, (uintptr_t)queue, queue_data);
     queue_data->fam_idx = fam_idx;
     queue_data->supports_transfer = supports_transfer;
+    queue_data->timestamp_bits = timestamp_bits;
     queue_data->frames = NULL;
     queue_data->frame_index = 0;
     queue_data->frame_count = 0;
@@ -302,27 +626,15 @@ static struct vk_queue_data *get_queue_data(struct vk_data *data, VkQueue queue)
             (uintptr_t)queue);
 }
 
-static void remove_free_queue_all(struct vk_data *data,
-        const VkAllocationCallbacks *ac)
-{
-    struct vk_queue_data *queue_data =
-        (struct vk_queue_data *)data->queues.root;
-    while (data->queues.root) {
-        remove_obj_data(&data->queues, queue_data->node.obj);
-        vk_free(ac, queue_data);
-
-        queue_data = (struct vk_queue_data *)data->queues.root;
-    }
-}
-
 static struct vk_queue_data *queue_walk_begin(struct vk_data *data)
 {
     return (struct vk_queue_data *)obj_walk_begin(&data->queues);
 }
 
-static struct vk_queue_data *queue_walk_next(struct vk_queue_data *queue_data)
+static struct vk_queue_data *queue_walk_next(struct vk_data *data,
+        struct vk_queue_data *queue_data)
 {
-    return (struct vk_queue_data *)obj_walk_next(
+    return (struct vk_queue_data *)obj_walk_next(&data->queues,
             (struct vk_obj_node *)queue_data);
 }
 
@@ -331,6 +643,18 @@ static void queue_walk_end(struct vk_data *data)
     obj_walk_end(&data->queues);
 }
 
+static void remove_free_queue_all(struct vk_data *data,
+        const VkAllocationCallbacks *ac)
+{
+    struct vk_queue_data *queue_data = queue_walk_begin(data);
+    while (queue_data) {
+        struct vk_queue_data *next = queue_walk_next(data, queue_data);
+        vk_free(ac, queue_data);
+        queue_data = next;
+    }
+    queue_walk_end(data);
+}
+
 /* ------------------------------------------------------------------------- */
 
 static struct vk_swap_data *alloc_swap_data(const VkAllocationCallbacks *ac)
@@ -367,9 +691,10 @@ static struct vk_swap_data *swap_walk_begin(struct vk_data *data)
     return (struct vk_swap_data *)obj_walk_begin(&data->swaps);
 }
 
-static struct vk_swap_data *swap_walk_next(struct vk_swap_data *swap_data)
+static struct vk_swap_data *swap_walk_next(struct vk_data *data,
+        struct vk_swap_data *swap_data)
 {
-    return (struct vk_swap_data *)obj_walk_next(
+    return (struct vk_swap_data *)obj_walk_next(&data->swaps,
             (struct vk_obj_node *)swap_data);
 }
 
@@ -390,6 +715,16 @@ static void vk_shtex_clear_fence(const struct vk_data *data,
         funcs->WaitForFences(device, 1, &fence, VK_TRUE, ~0ull);
         funcs->ResetFences(device, 1, &fence);
         frame_data->cmd_buffer_busy = false;
+
+        uint64_t ts[2];
+        if (frame_data->timestamps_written &&
+                funcs->GetQueryPoolResults(device, frame_data->query_pool, 0, 2,
+                    sizeof(ts), ts, sizeof(uint64_t),
+                    VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+            const uint64_t ticks = (ts[1] - ts[0]) & frame_data->timestamp_mask;
+            capture_stats_copy((int64_t)(ticks * data->timestamp_period), true);
+        }
+        frame_data->timestamps_written = false;
     }
 }
 
@@ -405,48 +740,182 @@ static void vk_shtex_wait_until_pool_idle(struct vk_data *data,
     }
 }
 
-static void vk_shtex_wait_until_idle(struct vk_data *data)
+static void vk_shtex_free_slot(struct vk_data *data,
+        struct vk_export_slot *slot)
 {
-    struct vk_queue_data *queue_data = queue_walk_begin(data);
+    VkDevice device = data->device;
+    for (int i = 0; i < 2; ++i) {
+        if (slot->yuv_views[i])
+            data->funcs.DestroyImageView(device, slot->yuv_views[i], data->ac);
+        slot->yuv_views[i] = VK_NULL_HANDLE;
+    }
+    if (slot->desc_pool)
+        data->funcs.DestroyDescriptorPool(device, slot->desc_pool, data->ac);
+    vk_free(data->ac, slot->desc_sets);
+    if (slot->image)
+        data->funcs.DestroyImage(device, slot->image, data->ac);
+    if (slot->uv_image)
+        data->funcs.DestroyImage(device, slot->uv_image, data->ac);
+    if (slot->buffer)
+        data->funcs.DestroyBuffer(device, slot->buffer, data->ac);
+    if (slot->stage_image)
+        data->funcs.DestroyImage(device, slot->stage_image, data->ac);
+    if (slot->stage_mem)
+        data->funcs.FreeMemory(device, slot->stage_mem, NULL);
+
+    slot->dmabuf_nfd = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (slot->dmabuf_fds[i] >= 0) {
+            close(slot->dmabuf_fds[i]);
+            slot->dmabuf_fds[i] = -1;
+        }
+    }
 
-    while (queue_data) {
-        vk_shtex_wait_until_pool_idle(data, queue_data);
+    if (slot->mem)
+        data->funcs.FreeMemory(device, slot->mem, NULL);
+    if (slot->uv_mem)
+        data->funcs.FreeMemory(device, slot->uv_mem, NULL);
+    /* only after the memory imported from it is gone */
+    if (slot->header)
+        munmap(slot->header, slot->host_size);
+
+    slot->mem = VK_NULL_HANDLE;
+    slot->image = VK_NULL_HANDLE;
+    slot->uv_mem = VK_NULL_HANDLE;
+    slot->uv_image = VK_NULL_HANDLE;
+    slot->buffer = VK_NULL_HANDLE;
+    slot->stage_image = VK_NULL_HANDLE;
+    slot->stage_mem = VK_NULL_HANDLE;
+    slot->header = NULL;
+    slot->host_size = 0;
+    slot->desc_pool = VK_NULL_HANDLE;
+    slot->desc_sets = NULL;
+    slot->frame_data = NULL;
+    slot->seq = 0;
+}
+
+static inline bool vk_shtex_frame_idle(struct vk_data *data,
+        struct vk_frame_data *frame_data)
+{
+    return !frame_data || !frame_data->cmd_buffer_busy ||
+        data->funcs.GetFenceStatus(data->device, frame_data->fence) == VK_SUCCESS;
+}
+
+static void vk_shtex_retire_slot(struct vk_data *data,
+        struct vk_export_slot *slot)
+{
+    struct vk_frame_data *frame_data = slot->frame_data;
 
-        queue_data = queue_walk_next(queue_data);
+    struct vk_retired_slot *retired = NULL;
+    if (!vk_shtex_frame_idle(data, frame_data)) {
+        retired = vk_alloc(data->ac, sizeof(struct vk_retired_slot),
+                _Alignof(struct vk_retired_slot), VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+        if (!retired) {
+            vk_shtex_clear_fence(data, frame_data);
+        }
     }
 
-    queue_walk_end(data);
+    if (!retired) {
+        vk_shtex_free_slot(data, slot);
+        return;
+    }
+
+    retired->slot = *slot;
+    retired->next = data->retired;
+    data->retired = retired;
+
+    memset(slot, 0, sizeof(*slot));
+    for (int i = 0; i < 4; ++i) {
+        slot->dmabuf_fds[i] = -1;
+    }
 }
 
-static void vk_shtex_free(struct vk_data *data)
+static bool vk_shtex_wait_init(struct vk_data *data)
 {
-    vk_shtex_wait_until_idle(data);
+    if (!data->init_running) {
+        return false;
+    }
+    if (data->init_joinable) {
+        pthread_join(data->init_thread, NULL);
+    }
+    data->init_running = false;
+    data->init_abandoned = false;
+    if (data->init_swap->params.hint_rejected) {
+        capture_clear_alloc_hint();
+    }
+    return data->init_result;
+}
 
-    struct vk_swap_data *swap = swap_walk_begin(data);
+static void vk_shtex_release_swap(struct vk_data *data, struct vk_swap_data *swap)
+{
+    for (int i = 0; i < CAPTURE_MAX_SLOTS; ++i) {
+        vk_shtex_retire_slot(data, &swap->slots[i]);
+    }
 
-    while (swap) {
-        VkDevice device = data->device;
-        if (swap->export_image)
-            data->funcs.DestroyImage(device, swap->export_image,
-                    data->ac);
+    swap->slot_count = 0;
+    swap->slot_index = 0;
+    swap->latest_slot = -1;
+    swap->latest_seq = 0;
+    swap->frame_seq = 0;
+
+    swap->captured = false;
+}
+
+/* Destroys retired slots whose copy has finished, with wait set it blocks
+ * until all of them are done. Must run before the frames they point at are
+ * destroyed. An abandoned init is joined here once it is done, its slots
+ * are retired along with the others. */
+static void vk_shtex_collect_retired(struct vk_data *data, bool wait)
+{
+    if (data->init_abandoned &&
+            __atomic_load_n(&data->init_done, __ATOMIC_ACQUIRE)) {
+        struct vk_swap_data *init_swap = data->init_swap;
+        vk_shtex_wait_init(data);
+        vk_shtex_release_swap(data, init_swap);
+    }
+
+    struct vk_retired_slot **link = &data->retired;
 
-        swap->dmabuf_nfd = 0;
-        for (int i = 0; i < 4; ++i) {
-            if (swap->dmabuf_fds[i] >= 0) {
-                close(swap->dmabuf_fds[i]);
-                swap->dmabuf_fds[i] = -1;
+    while (*link) {
+        struct vk_retired_slot *retired = *link;
+        struct vk_frame_data *frame_data = retired->slot.frame_data;
+
+        if (!vk_shtex_frame_idle(data, frame_data)) {
+            if (!wait) {
+                link = &retired->next;
+                continue;
             }
+            vk_shtex_clear_fence(data, frame_data);
         }
 
-        if (swap->export_mem)
-            data->funcs.FreeMemory(device, swap->export_mem, NULL);
+        *link = retired->next;
+        vk_shtex_free_slot(data, &retired->slot);
+        vk_free(data->ac, retired);
+    }
+}
+
+/* Never waits for the init thread, the swapchain it is creating export
+ * images for is released once it is done */
+static void vk_shtex_free(struct vk_data *data)
+{
+    struct vk_swap_data *init_swap = NULL;
+    if (data->init_running) {
+        if (__atomic_load_n(&data->init_done, __ATOMIC_ACQUIRE)) {
+            vk_shtex_wait_init(data);
+        } else {
+            init_swap = data->init_swap;
+            data->init_abandoned = true;
+        }
+    }
 
-        swap->export_mem = VK_NULL_HANDLE;
-        swap->export_image = VK_NULL_HANDLE;
+    struct vk_swap_data *swap = swap_walk_begin(data);
 
-        swap->captured = false;
+    while (swap) {
+        if (swap != init_swap) {
+            vk_shtex_release_swap(data, swap);
+        }
 
-        swap = swap_walk_next(swap);
+        swap = swap_walk_next(data, swap);
     }
 
     swap_walk_end(data);
@@ -545,62 +1014,169 @@ static void remove_free_inst_data(VkInstance inst,
 /* ======================================================================== */
 /* capture                                                                  */
 
-static const struct {
-    int32_t drm;
+/* Swapchain formats the layer knows how to share. Formats with a DRM fourcc
+ * are copied straight into the export images when the device can export
+ * them and OBS can import them, anything else is blitted down the chain of
+ * `fallback` formats, which keep the precision where they can. sRGB formats
+ * have none as a blit would decode them. */
+static const struct vk_format_info {
     VkFormat vk;
+    int32_t drm;
+    uint32_t bpp;
+    VkFormat fallback;
 } vk_format_table[] = {
-    { DRM_FORMAT_ARGB8888, VK_FORMAT_B8G8R8A8_UNORM },
-    { DRM_FORMAT_ARGB8888, VK_FORMAT_B8G8R8A8_SRGB },
-    { DRM_FORMAT_XRGB8888, VK_FORMAT_B8G8R8A8_UNORM },
-    { DRM_FORMAT_XRGB8888, VK_FORMAT_B8G8R8A8_SRGB },
-    { DRM_FORMAT_ABGR8888, VK_FORMAT_R8G8B8A8_UNORM },
-    { DRM_FORMAT_ABGR8888, VK_FORMAT_R8G8B8A8_SRGB },
-    { DRM_FORMAT_XBGR8888, VK_FORMAT_R8G8B8A8_UNORM },
-    { DRM_FORMAT_XBGR8888, VK_FORMAT_R8G8B8A8_SRGB },
-    { DRM_FORMAT_ARGB2101010, VK_FORMAT_A2R10G10B10_UNORM_PACK32 },
-    { DRM_FORMAT_XRGB2101010, VK_FORMAT_A2R10G10B10_UNORM_PACK32 },
-    { DRM_FORMAT_ABGR2101010, VK_FORMAT_A2B10G10R10_UNORM_PACK32 },
-    { DRM_FORMAT_XBGR2101010, VK_FORMAT_A2B10G10R10_UNORM_PACK32 },
-    { DRM_FORMAT_ABGR16161616, VK_FORMAT_R16G16B16A16_UNORM },
-    { DRM_FORMAT_XBGR16161616, VK_FORMAT_R16G16B16A16_UNORM },
-    { DRM_FORMAT_ABGR16161616F, VK_FORMAT_R16G16B16A16_SFLOAT },
-    { DRM_FORMAT_XBGR16161616F, VK_FORMAT_R16G16B16A16_SFLOAT },
+    { VK_FORMAT_B8G8R8A8_UNORM, DRM_FORMAT_ARGB8888, 4, VK_FORMAT_UNDEFINED },
+    { VK_FORMAT_B8G8R8A8_SRGB, DRM_FORMAT_ARGB8888, 4, VK_FORMAT_UNDEFINED },
+    { VK_FORMAT_R8G8B8A8_UNORM, DRM_FORMAT_ABGR8888, 4, VK_FORMAT_B8G8R8A8_UNORM },
+    { VK_FORMAT_R8G8B8A8_SRGB, DRM_FORMAT_ABGR8888, 4, VK_FORMAT_UNDEFINED },
+    { VK_FORMAT_A8B8G8R8_UNORM_PACK32, DRM_FORMAT_ABGR8888, 4, VK_FORMAT_B8G8R8A8_UNORM },
+    { VK_FORMAT_A8B8G8R8_SRGB_PACK32, DRM_FORMAT_ABGR8888, 4, VK_FORMAT_UNDEFINED },
+    { VK_FORMAT_A2R10G10B10_UNORM_PACK32, DRM_FORMAT_ARGB2101010, 4, VK_FORMAT_A2B10G10R10_UNORM_PACK32 },
+    { VK_FORMAT_A2B10G10R10_UNORM_PACK32, DRM_FORMAT_ABGR2101010, 4, VK_FORMAT_B8G8R8A8_UNORM },
+    { VK_FORMAT_R16G16B16A16_UNORM, DRM_FORMAT_ABGR16161616, 8, VK_FORMAT_A2B10G10R10_UNORM_PACK32 },
+    { VK_FORMAT_R16G16B16A16_SFLOAT, DRM_FORMAT_ABGR16161616F, 8, VK_FORMAT_A2B10G10R10_UNORM_PACK32 },
+    { VK_FORMAT_R5G6B5_UNORM_PACK16, DRM_FORMAT_RGB565, 2, VK_FORMAT_B8G8R8A8_UNORM },
+    { VK_FORMAT_B5G6R5_UNORM_PACK16, DRM_FORMAT_BGR565, 2, VK_FORMAT_B8G8R8A8_UNORM },
+    { VK_FORMAT_A1R5G5B5_UNORM_PACK16, DRM_FORMAT_ARGB1555, 2, VK_FORMAT_B8G8R8A8_UNORM },
+    /* no fourcc, only ever blitted */
+    { VK_FORMAT_B10G11R11_UFLOAT_PACK32, -1, 4, VK_FORMAT_R16G16B16A16_SFLOAT },
 };
 
-static int32_t vk_format_to_drm(VkFormat vk)
+#define VK_FORMAT_TABLE_SIZE (sizeof(vk_format_table) / sizeof(vk_format_table[0]))
+static_assert(VK_FORMAT_TABLE_SIZE <= 32, "vk_data format masks hold 32 formats");
+
+static int vk_format_index(VkFormat vk)
 {
-    for (size_t i = 0; i < sizeof(vk_format_table) / sizeof(vk_format_table[0]); ++i) {
+    for (size_t i = 0; i < VK_FORMAT_TABLE_SIZE; ++i) {
         if (vk_format_table[i].vk == vk) {
-            return vk_format_table[i].drm;
+            return i;
         }
     }
     return -1;
 }
 
-static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
-        struct vk_swap_data *swap)
+static int32_t vk_format_to_drm(VkFormat vk)
+{
+    const int i = vk_format_index(vk);
+    return i != -1 ? vk_format_table[i].drm : -1;
+}
+
+/* Checked on the first capture of the device, apps never captured skip
+ * the queries */
+static void vk_query_export_formats(struct vk_data *data)
 {
-    struct vk_device_funcs *funcs = &data->funcs;
     struct vk_inst_funcs *ifuncs =
         get_inst_funcs_by_physical_device(data->phy_device);
 
-    const bool no_modifiers = capture_allocate_no_modifiers();
-    const bool linear = vkcapture_linear || capture_allocate_linear();
-    const bool map_host = capture_allocate_map_host();
-    const bool same_device = capture_compare_device_uuid(data->device_uuid);
+    data->copy_formats = 0;
+    data->blit_formats = 0;
+    data->formats_queried = true;
 
-    hlog("Texture %s %ux%u", vk_format_to_str(swap->format), swap->image_extent.width, swap->image_extent.height);
+    for (size_t i = 0; i < VK_FORMAT_TABLE_SIZE; ++i) {
+        const VkFormat format = vk_format_table[i].vk;
+        if (vk_format_table[i].drm == -1) {
+            continue;
+        }
 
-    if (vk_format_to_drm(swap->format) != -1) {
-        swap->export_format = swap->format;
-    } else {
-        swap->export_format = VK_FORMAT_B8G8R8A8_UNORM;
-        hlog("Converting to %s", vk_format_to_str(swap->export_format));
+        VkPhysicalDeviceExternalImageFormatInfo ext_info = {};
+        ext_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO;
+        ext_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+        VkPhysicalDeviceImageFormatInfo2 format_info = {};
+        format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+        format_info.pNext = &ext_info;
+        format_info.format = format;
+        format_info.type = VK_IMAGE_TYPE_2D;
+        format_info.tiling = VK_IMAGE_TILING_LINEAR;
+        format_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+        VkExternalImageFormatProperties ext_props = {};
+        ext_props.sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES;
+
+        VkImageFormatProperties2KHR image_props = {};
+        image_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+        image_props.pNext = &ext_props;
+
+        const bool linear_exportable = ifuncs->GetPhysicalDeviceImageFormatProperties2KHR(
+                data->phy_device, &format_info, &image_props) == VK_SUCCESS &&
+            (ext_props.externalMemoryProperties.externalMemoryFeatures &
+             VK_EXTERNAL_MEMORY_FEATURE_EXPORTABLE_BIT);
+
+        VkDrmFormatModifierPropertiesListEXT modifier_props_list = {};
+        modifier_props_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+
+        VkFormatProperties2KHR format_props = {};
+        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+        format_props.pNext = &modifier_props_list;
+        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+                format, &format_props);
+
+        VkFormatFeatureFlags features = linear_exportable ?
+            format_props.formatProperties.linearTilingFeatures : 0;
+
+        struct VkDrmFormatModifierPropertiesEXT *modifier_props = NULL;
+        if (modifier_props_list.drmFormatModifierCount) {
+            modifier_props =
+                vk_alloc(data->ac, modifier_props_list.drmFormatModifierCount * sizeof(struct VkDrmFormatModifierPropertiesEXT),
+                        _Alignof(struct VkDrmFormatModifierPropertiesEXT), VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+        }
+        if (modifier_props) {
+            modifier_props_list.pDrmFormatModifierProperties = modifier_props;
+            ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+                    format, &format_props);
+            for (uint32_t j = 0; j < modifier_props_list.drmFormatModifierCount; ++j) {
+                features |= modifier_props[j].drmFormatModifierTilingFeatures;
+            }
+            vk_free(data->ac, modifier_props);
+        }
+
+        if (features & VK_FORMAT_FEATURE_TRANSFER_DST_BIT) {
+            data->copy_formats |= 1u << i;
+        }
+        if (features & VK_FORMAT_FEATURE_BLIT_DST_BIT) {
+            data->blit_formats |= 1u << i;
+        }
+#ifndef NDEBUG
+        hlog("Export %s: copy %d blit %d", vk_format_to_str(format),
+                (data->copy_formats >> i) & 1, (data->blit_formats >> i) & 1);
+#endif
     }
+}
 
-    if (!same_device) {
-        hlog("OBS is running on different GPU");
+static bool vk_export_modifier_supported(const struct vk_export_params *params,
+        uint64_t modifier)
+{
+    if (params->supported_modifier_count < 0) {
+        return true;
     }
+    for (int i = 0; i < params->supported_modifier_count; ++i) {
+        if (params->supported_modifiers[i] == modifier) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
+        struct vk_swap_data *swap, struct vk_export_slot *slot, bool first)
+{
+    struct vk_device_funcs *funcs = &data->funcs;
+    struct vk_inst_funcs *ifuncs =
+        get_inst_funcs_by_physical_device(data->phy_device);
+
+    struct vk_export_params *params = &swap->params;
+    const bool no_modifiers = params->no_modifiers;
+    const bool linear = params->linear;
+    const bool map_host = params->map_host;
+    const bool same_device = params->same_device;
+
+    const uint64_t hint_modifier = params->hint_modifier;
+    const int hint_planes = params->hint_planes;
+    const bool use_hint = params->use_hint && !no_modifiers &&
+        funcs->GetImageDrmFormatModifierPropertiesEXT &&
+        hint_modifier != DRM_FORMAT_MOD_INVALID &&
+        (!linear || hint_modifier == DRM_FORMAT_MOD_LINEAR) &&
+        (first || hint_modifier == swap->dmabuf_modifier);
 
     VkExternalMemoryImageCreateInfo ext_mem_image_info = {};
     ext_mem_image_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
@@ -616,8 +1192,8 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
     img_info.samples = VK_SAMPLE_COUNT_1_BIT;
     img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    img_info.extent.width = swap->image_extent.width;
-    img_info.extent.height = swap->image_extent.height;
+    img_info.extent.width = swap->export_extent.width;
+    img_info.extent.height = swap->export_extent.height;
     img_info.extent.depth = 1;
     img_info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
     img_info.tiling = VK_IMAGE_TILING_LINEAR;
@@ -629,59 +1205,79 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
     uint32_t modifier_prop_count = 0;
 
     if (!no_modifiers && funcs->GetImageDrmFormatModifierPropertiesEXT) {
-        VkDrmFormatModifierPropertiesListEXT modifier_props_list = {};
-        modifier_props_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
+        if (use_hint) {
+            /* skip the modifier discovery, the plugin told us what worked */
+            modifier_props = vk_alloc(data->ac, sizeof(struct VkDrmFormatModifierPropertiesEXT),
+                    _Alignof(struct VkDrmFormatModifierPropertiesEXT), VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+            memset(modifier_props, 0, sizeof(struct VkDrmFormatModifierPropertiesEXT));
+            modifier_props[0].drmFormatModifier = hint_modifier;
+            modifier_props[0].drmFormatModifierPlaneCount = hint_planes;
+            modifier_prop_count = 1;
+        } else {
+            VkDrmFormatModifierPropertiesListEXT modifier_props_list = {};
+            modifier_props_list.sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT;
 
-        VkFormatProperties2KHR format_props = {};
-        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
-        format_props.pNext = &modifier_props_list;
+            VkFormatProperties2KHR format_props = {};
+            format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+            format_props.pNext = &modifier_props_list;
 
-        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
-                img_info.format, &format_props);
+            ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+                    img_info.format, &format_props);
 
-        modifier_props =
-            vk_alloc(data->ac, modifier_props_list.drmFormatModifierCount * sizeof(struct VkDrmFormatModifierPropertiesEXT),
-                    _Alignof(struct VkDrmFormatModifierPropertiesEXT), VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+            modifier_props =
+                vk_alloc(data->ac, modifier_props_list.drmFormatModifierCount * sizeof(struct VkDrmFormatModifierPropertiesEXT),
+                        _Alignof(struct VkDrmFormatModifierPropertiesEXT), VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
 
-        modifier_props_list.pDrmFormatModifierProperties = modifier_props;
+            modifier_props_list.pDrmFormatModifierProperties = modifier_props;
 
-        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
-                img_info.format, &format_props);
+            ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+                    img_info.format, &format_props);
 
 #ifndef NDEBUG
-        hlog("Available modifiers:");
+            if (first)
+                hlog("Available modifiers:");
 #endif
-        for (uint32_t i = 0; i < modifier_props_list.drmFormatModifierCount; i++) {
-            if (linear && modifier_props[i].drmFormatModifier != DRM_FORMAT_MOD_LINEAR) {
-                continue;
-            }
-            VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {};
-            mod_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
-            mod_info.drmFormatModifier = modifier_props[i].drmFormatModifier;
-            mod_info.sharingMode = img_info.sharingMode;
-
-            VkPhysicalDeviceImageFormatInfo2 format_info = {};
-            format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
-            format_info.pNext = &mod_info;
-            format_info.format = img_info.format;
-            format_info.type = VK_IMAGE_TYPE_2D;
-            format_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
-            format_info.usage = img_info.usage;
-            format_info.flags = img_info.flags;
-
-            VkImageFormatProperties2KHR format_props = {};
-            format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
-            format_props.pNext = NULL;
-
-            VkResult result = ifuncs->GetPhysicalDeviceImageFormatProperties2KHR(data->phy_device,
-                    &format_info, &format_props);
-            if (result == VK_SUCCESS) {
+            for (uint32_t i = 0; i < modifier_props_list.drmFormatModifierCount; i++) {
+                if (linear && modifier_props[i].drmFormatModifier != DRM_FORMAT_MOD_LINEAR) {
+                    continue;
+                }
+                if (!vk_export_modifier_supported(params, modifier_props[i].drmFormatModifier)) {
+                    continue;
+                }
+                /* all slots must share the modifier picked for the first one */
+                if (!first && swap->dmabuf_modifier != DRM_FORMAT_MOD_INVALID &&
+                        modifier_props[i].drmFormatModifier != swap->dmabuf_modifier) {
+                    continue;
+                }
+                VkPhysicalDeviceImageDrmFormatModifierInfoEXT mod_info = {};
+                mod_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT;
+                mod_info.drmFormatModifier = modifier_props[i].drmFormatModifier;
+                mod_info.sharingMode = img_info.sharingMode;
+
+                VkPhysicalDeviceImageFormatInfo2 format_info = {};
+                format_info.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+                format_info.pNext = &mod_info;
+                format_info.format = img_info.format;
+                format_info.type = VK_IMAGE_TYPE_2D;
+                format_info.tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT;
+                format_info.usage = img_info.usage;
+                format_info.flags = img_info.flags;
+
+                VkImageFormatProperties2KHR format_props = {};
+                format_props.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+                format_props.pNext = NULL;
+
+                VkResult result = ifuncs->GetPhysicalDeviceImageFormatProperties2KHR(data->phy_device,
+                        &format_info, &format_props);
+                if (result == VK_SUCCESS) {
 #ifndef NDEBUG
-                hlog(" %d: modifier:%"PRIu64" planes:%d", i,
-                        modifier_props[i].drmFormatModifier,
-                        modifier_props[i].drmFormatModifierPlaneCount);
+                    if (first)
+                        hlog(" %d: modifier:%"PRIu64" planes:%d", i,
+                            modifier_props[i].drmFormatModifier,
+                            modifier_props[i].drmFormatModifierPlaneCount);
 #endif
-                modifier_props[modifier_prop_count++] = modifier_props[i];
+                    modifier_props[modifier_prop_count++] = modifier_props[i];
+                }
             }
         }
 
@@ -707,16 +1303,23 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
     VkDevice device = data->device;
 
     VkResult res;
-    res = funcs->CreateImage(device, &img_info, data->ac, &swap->export_image);
+    res = funcs->CreateImage(device, &img_info, data->ac, &slot->image);
     vk_free(data->ac, image_modifiers);
+    if (VK_SUCCESS != res && use_hint) {
+        hlog("Cached modifier %"PRIu64" rejected, querying modifiers", hint_modifier);
+        vk_free(data->ac, modifier_props);
+        params->use_hint = false;
+        params->hint_rejected = true;
+        return vk_shtex_init_vulkan_tex(data, swap, slot, first);
+    }
     if (VK_SUCCESS != res) {
         hlog("Failed to CreateImage %s", result_to_str(res));
-        swap->export_image = VK_NULL_HANDLE;
+        slot->image = VK_NULL_HANDLE;
         return false;
     }
 
     VkImageMemoryRequirementsInfo2 memri = {};
-    memri.image = swap->export_image;
+    memri.image = slot->image;
     memri.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
 
     VkMemoryDedicatedRequirements mdr = {};
@@ -741,7 +1344,7 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
     VkMemoryDedicatedAllocateInfo memory_dedicated_info = {};
     memory_dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
     memory_dedicated_info.pNext = &memory_export_info;
-    memory_dedicated_info.image = swap->export_image;
+    memory_dedicated_info.image = slot->image;
 
     VkMemoryAllocateInfo memi = {};
     memi.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
@@ -750,15 +1353,22 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
 
     bool allocated = false;
     uint32_t mem_req_bits = same_device ? VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    /* host visible VRAM would make the other GPU read across PCIe */
+    uint32_t mem_avoid_bits = 0;
+    if (params->cross_device) {
+        mem_req_bits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+        mem_avoid_bits = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    }
     if (map_host) {
         mem_req_bits = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
     }
     for (uint32_t i = 0; i < pdmp.memoryTypeCount; ++i) {
         if ((memr.memoryRequirements.memoryTypeBits & (1 << i)) &&
                 (pdmp.memoryTypes[i].propertyFlags &
-                 mem_req_bits) == mem_req_bits) {
+                 mem_req_bits) == mem_req_bits &&
+                !(pdmp.memoryTypes[i].propertyFlags & mem_avoid_bits)) {
             memi.memoryTypeIndex = i;
-            res = funcs->AllocateMemory(device, &memi, NULL, &swap->export_mem);
+            res = funcs->AllocateMemory(device, &memi, NULL, &slot->mem);
             allocated = res == VK_SUCCESS;
             if (allocated)
                 break;
@@ -769,10 +1379,11 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
         /* Try again without DEVICE_LOCAL */
         for (uint32_t i = 0; i < pdmp.memoryTypeCount; ++i) {
             if ((memr.memoryRequirements.memoryTypeBits & (1 << i)) &&
-                    (pdmp.memoryTypes[i].propertyFlags &
-                     mem_req_bits) != mem_req_bits) {
+                    ((pdmp.memoryTypes[i].propertyFlags &
+                      mem_req_bits) != mem_req_bits ||
+                     (pdmp.memoryTypes[i].propertyFlags & mem_avoid_bits))) {
                 memi.memoryTypeIndex = i;
-                res = funcs->AllocateMemory(device, &memi, NULL, &swap->export_mem);
+                res = funcs->AllocateMemory(device, &memi, NULL, &slot->mem);
                 allocated = res == VK_SUCCESS;
                 if (allocated)
                     break;
@@ -783,56 +1394,64 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
 
     if (!allocated) {
         hlog("Failed to allocate memory of any type");
-        funcs->DestroyImage(device, swap->export_image, data->ac);
-        swap->export_image = VK_NULL_HANDLE;
+        funcs->DestroyImage(device, slot->image, data->ac);
+        slot->image = VK_NULL_HANDLE;
         return false;
     }
 
     VkBindImageMemoryInfo bimi = {};
     bimi.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
-    bimi.image = swap->export_image;
-    bimi.memory = swap->export_mem;
+    bimi.image = slot->image;
+    bimi.memory = slot->mem;
     bimi.memoryOffset = 0;
     res = funcs->BindImageMemory2KHR(device, 1, &bimi);
     if (VK_SUCCESS != res) {
         hlog("BindImageMemory2KHR failed %s", result_to_str(res));
-        funcs->DestroyImage(device, swap->export_image, data->ac);
-        swap->export_image = VK_NULL_HANDLE;
+        funcs->DestroyImage(device, slot->image, data->ac);
+        slot->image = VK_NULL_HANDLE;
         return false;
     }
 
     int fd = -1;
     VkMemoryGetFdInfoKHR gfdi = {};
     gfdi.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
-    gfdi.memory = swap->export_mem;
+    gfdi.memory = slot->mem;
     gfdi.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
     res = funcs->GetMemoryFdKHR(device, &gfdi, &fd);
     if (VK_SUCCESS != res) {
         hlog("GetMemoryFdKHR failed %s", result_to_str(res));
-        funcs->DestroyImage(device, swap->export_image, data->ac);
-        swap->export_image = VK_NULL_HANDLE;
+        funcs->DestroyImage(device, slot->image, data->ac);
+        slot->image = VK_NULL_HANDLE;
         return false;
     }
 
+    uint64_t modifier = DRM_FORMAT_MOD_INVALID;
     if (!no_modifiers && funcs->GetImageDrmFormatModifierPropertiesEXT) {
         VkImageDrmFormatModifierPropertiesEXT image_mod_props = {};
         image_mod_props.sType = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_PROPERTIES_EXT;
-        res = funcs->GetImageDrmFormatModifierPropertiesEXT(device, swap->export_image, &image_mod_props);
+        res = funcs->GetImageDrmFormatModifierPropertiesEXT(device, slot->image, &image_mod_props);
         if (VK_SUCCESS != res) {
             hlog("GetImageDrmFormatModifierPropertiesEXT failed %s", result_to_str(res));
-            swap->dmabuf_modifier = DRM_FORMAT_MOD_INVALID;
         } else {
-            swap->dmabuf_modifier = image_mod_props.drmFormatModifier;
+            modifier = image_mod_props.drmFormatModifier;
             for (uint32_t i = 0; i < modifier_prop_count; ++i) {
-                if (modifier_props[i].drmFormatModifier == swap->dmabuf_modifier) {
+                if (modifier_props[i].drmFormatModifier == modifier) {
                     num_planes = modifier_props[i].drmFormatModifierPlaneCount;
                     break;
                 }
             }
         }
         vk_free(data->ac, modifier_props);
-    } else {
-        swap->dmabuf_modifier = DRM_FORMAT_MOD_INVALID;
+    }
+
+    if (first) {
+        swap->dmabuf_modifier = modifier;
+    } else if (modifier != swap->dmabuf_modifier) {
+        hlog("Slot got different modifier %"PRIu64, modifier);
+        close(fd);
+        funcs->DestroyImage(device, slot->image, data->ac);
+        slot->image = VK_NULL_HANDLE;
+        return false;
     }
 
     for (int i = 0; i < num_planes; i++) {
@@ -845,16 +1464,16 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
         sbr.mipLevel = 0;
         sbr.arrayLayer = 0;
         VkSubresourceLayout layout;
-        funcs->GetImageSubresourceLayout(device, swap->export_image, &sbr, &layout);
+        funcs->GetImageSubresourceLayout(device, slot->image, &sbr, &layout);
 
-        swap->dmabuf_fds[i] = i == 0 ? fd : os_dupfd_cloexec(fd);
-        swap->dmabuf_strides[i] = layout.rowPitch;
-        swap->dmabuf_offsets[i] = layout.offset;
+        slot->dmabuf_fds[i] = i == 0 ? fd : os_dupfd_cloexec(fd);
+        slot->dmabuf_strides[i] = layout.rowPitch;
+        slot->dmabuf_offsets[i] = layout.offset;
     }
-    swap->dmabuf_nfd = num_planes;
+    slot->dmabuf_nfd = num_planes;
 
 #ifndef NDEBUG
-    hlog("Got planes %d fd %d", swap->dmabuf_nfd, swap->dmabuf_fds[0]);
+    hlog("Got planes %d fd %d", slot->dmabuf_nfd, slot->dmabuf_fds[0]);
     if (swap->dmabuf_modifier != DRM_FORMAT_MOD_INVALID) {
         hlog("Got modifier %"PRIu64, swap->dmabuf_modifier);
     }
@@ -863,132 +1482,1910 @@ static inline bool vk_shtex_init_vulkan_tex(struct vk_data *data,
     return true;
 }
 
-static bool vk_shtex_init(struct vk_data *data, struct vk_swap_data *swap)
+static inline uint32_t vk_format_bpp(VkFormat format)
 {
-    if (!vk_shtex_init_vulkan_tex(data, swap)) {
+    const int i = vk_format_index(format);
+    return i != -1 ? vk_format_table[i].bpp : 4;
+}
+
+/* Slot for the memfd transport: a memfd mapped here and imported as host
+ * memory, with a buffer bound after the header. The GPU copies the frame
+ * straight into pages OBS has mapped too. */
+static bool vk_shtex_init_memfd_tex(struct vk_data *data,
+        struct vk_swap_data *swap, struct vk_export_slot *slot)
+{
+    struct vk_device_funcs *funcs = &data->funcs;
+    struct vk_inst_funcs *ifuncs =
+        get_inst_funcs_by_physical_device(data->phy_device);
+    VkDevice device = data->device;
+
+    const VkDeviceSize alignment = data->host_ptr_alignment > 4096 ?
+        data->host_ptr_alignment : 4096;
+    const uint32_t stride = (swap->export_extent.width *
+            vk_format_bpp(swap->export_format) + 255) & ~255u;
+    const VkDeviceSize image_size = (VkDeviceSize)stride * swap->export_extent.height;
+    const size_t size = (CAPTURE_MEMFD_HEADER_SIZE + image_size + alignment - 1) &
+        ~(alignment - 1);
+
+    int fd = memfd_create("obs-vkcapture", MFD_CLOEXEC);
+    if (fd < 0) {
+        hlog("memfd_create failed: %s", strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, size) != 0) {
+        hlog("Failed to resize memfd: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        hlog("Failed to map memfd: %s", strerror(errno));
+        close(fd);
+        return false;
+    }
+    if ((uintptr_t)map & (alignment - 1)) {
+        hlog("memfd mapping not aligned to %"PRIu64, (uint64_t)alignment);
+        munmap(map, size);
+        close(fd);
         return false;
     }
 
-    data->cur_swap = swap;
+    VkMemoryHostPointerPropertiesEXT host_props = {};
+    host_props.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+    VkResult res = funcs->GetMemoryHostPointerPropertiesEXT(device,
+            VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, map, &host_props);
+    if (res != VK_SUCCESS) {
+        hlog("GetMemoryHostPointerPropertiesEXT failed %s", result_to_str(res));
+        munmap(map, size);
+        close(fd);
+        return false;
+    }
 
-    capture_init_shtex(swap->image_extent.width, swap->image_extent.height,
-        vk_format_to_drm(swap->export_format),
-        swap->dmabuf_strides, swap->dmabuf_offsets, swap->dmabuf_modifier,
-        swap->winid, /*flip*/false, swap->dmabuf_nfd, swap->dmabuf_fds);
+    VkExternalMemoryBufferCreateInfo ext_mem_buffer_info = {};
+    ext_mem_buffer_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+    ext_mem_buffer_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
 
-    hlog("------------------ vulkan capture started ------------------");
-    return true;
-}
+    VkBufferCreateInfo buf_info = {};
+    buf_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buf_info.pNext = &ext_mem_buffer_info;
+    buf_info.size = image_size;
+    buf_info.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buf_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-static void vk_shtex_create_frame_objects(struct vk_data *data,
-        struct vk_queue_data *queue_data,
-        uint32_t image_count)
-{
-    queue_data->frames =
-        vk_alloc(data->ac, image_count * sizeof(struct vk_frame_data),
-                _Alignof(struct vk_frame_data),
+    res = funcs->CreateBuffer(device, &buf_info, data->ac, &slot->buffer);
+    if (res != VK_SUCCESS) {
+        hlog("Failed to CreateBuffer %s", result_to_str(res));
+        slot->buffer = VK_NULL_HANDLE;
+        munmap(map, size);
+        close(fd);
+        return false;
+    }
+
+    VkMemoryRequirements memr;
+    funcs->GetBufferMemoryRequirements(device, slot->buffer, &memr);
+
+    VkPhysicalDeviceMemoryProperties pdmp;
+    ifuncs->GetPhysicalDeviceMemoryProperties(data->phy_device, &pdmp);
+
+    /* OBS reads the pages without any cache maintenance */
+    const uint32_t type_bits = memr.memoryTypeBits & host_props.memoryTypeBits;
+    uint32_t type_index = UINT32_MAX;
+    for (uint32_t i = 0; i < pdmp.memoryTypeCount; ++i) {
+        if ((type_bits & (1 << i)) &&
+                (pdmp.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+            type_index = i;
+            break;
+        }
+    }
+    if (type_index == UINT32_MAX || CAPTURE_MEMFD_HEADER_SIZE % memr.alignment) {
+        hlog("No memory type to import memfd into");
+        funcs->DestroyBuffer(device, slot->buffer, data->ac);
+        slot->buffer = VK_NULL_HANDLE;
+        munmap(map, size);
+        close(fd);
+        return false;
+    }
+
+    VkImportMemoryHostPointerInfoEXT import_info = {};
+    import_info.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+    import_info.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+    import_info.pHostPointer = map;
+
+    VkMemoryAllocateInfo memi = {};
+    memi.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memi.pNext = &import_info;
+    memi.allocationSize = size;
+    memi.memoryTypeIndex = type_index;
+
+    res = funcs->AllocateMemory(device, &memi, NULL, &slot->mem);
+    if (res == VK_SUCCESS) {
+        res = funcs->BindBufferMemory(device, slot->buffer, slot->mem,
+                CAPTURE_MEMFD_HEADER_SIZE);
+    }
+    if (res != VK_SUCCESS) {
+        hlog("Failed to import memfd %s", result_to_str(res));
+        if (slot->mem)
+            funcs->FreeMemory(device, slot->mem, NULL);
+        slot->mem = VK_NULL_HANDLE;
+        funcs->DestroyBuffer(device, slot->buffer, data->ac);
+        slot->buffer = VK_NULL_HANDLE;
+        munmap(map, size);
+        close(fd);
+        return false;
+    }
+
+    slot->header = map;
+    slot->host_size = size;
+    slot->dmabuf_fds[0] = fd;
+    slot->dmabuf_strides[0] = stride;
+    slot->dmabuf_offsets[0] = CAPTURE_MEMFD_HEADER_SIZE;
+    slot->dmabuf_nfd = 1;
+    swap->dmabuf_modifier = DRM_FORMAT_MOD_LINEAR;
+
+#ifndef NDEBUG
+    hlog("Got memfd %d stride %u size %zu", fd, stride, size);
+#endif
+
+    return true;
+}
+
+/* Same size and format as the swapchain image, so the copy out of it uses
+ * the swapchain coordinates. Written on fam_idx and shared with the
+ * transfer queue, which may do the export copy. */
+static bool vk_shtex_init_stage_tex(struct vk_data *data,
+        struct vk_swap_data *swap, struct vk_export_slot *slot, uint32_t fam_idx)
+{
+    struct vk_device_funcs *funcs = &data->funcs;
+    struct vk_inst_funcs *ifuncs =
+        get_inst_funcs_by_physical_device(data->phy_device);
+    VkDevice device = data->device;
+
+    VkImageCreateInfo img_info = {};
+    img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    img_info.imageType = VK_IMAGE_TYPE_2D;
+    img_info.format = swap->format;
+    img_info.extent.width = swap->image_extent.width;
+    img_info.extent.height = swap->image_extent.height;
+    img_info.extent.depth = 1;
+    img_info.mipLevels = 1;
+    img_info.arrayLayers = 1;
+    img_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    img_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    img_info.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    struct vk_queue_data *transfer_data = data->transfer_queue ?
+        get_queue_data(data, data->transfer_queue) : NULL;
+    uint32_t families[2] = {fam_idx, VK_QUEUE_FAMILY_IGNORED};
+    if (transfer_data && fam_idx != VK_QUEUE_FAMILY_IGNORED &&
+            transfer_data->fam_idx != fam_idx) {
+        families[1] = transfer_data->fam_idx;
+        img_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        img_info.queueFamilyIndexCount = 2;
+        img_info.pQueueFamilyIndices = families;
+    }
+
+    VkResult res = funcs->CreateImage(device, &img_info, data->ac, &slot->stage_image);
+    if (res != VK_SUCCESS) {
+        hlog("Failed to CreateImage %s", result_to_str(res));
+        slot->stage_image = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VkImageMemoryRequirementsInfo2 memri = {};
+    memri.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+    memri.image = slot->stage_image;
+
+    VkMemoryRequirements2 memr = {};
+    memr.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+
+    funcs->GetImageMemoryRequirements2KHR(device, &memri, &memr);
+
+    VkPhysicalDeviceMemoryProperties pdmp;
+    ifuncs->GetPhysicalDeviceMemoryProperties(data->phy_device, &pdmp);
+
+    VkMemoryAllocateInfo memi = {};
+    memi.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memi.allocationSize = memr.memoryRequirements.size;
+
+    res = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+    for (uint32_t i = 0; i < pdmp.memoryTypeCount && res != VK_SUCCESS; ++i) {
+        if ((memr.memoryRequirements.memoryTypeBits & (1 << i)) &&
+                (pdmp.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
+            memi.memoryTypeIndex = i;
+            res = funcs->AllocateMemory(device, &memi, NULL, &slot->stage_mem);
+        }
+    }
+
+    VkBindImageMemoryInfo bimi = {};
+    bimi.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
+    bimi.image = slot->stage_image;
+    bimi.memory = slot->stage_mem;
+    if (res == VK_SUCCESS) {
+        res = funcs->BindImageMemory2KHR(device, 1, &bimi);
+    }
+    if (res != VK_SUCCESS) {
+        hlog("Failed to allocate stage image %s", result_to_str(res));
+        if (slot->stage_mem)
+            funcs->FreeMemory(device, slot->stage_mem, NULL);
+        slot->stage_mem = VK_NULL_HANDLE;
+        funcs->DestroyImage(device, slot->stage_image, data->ac);
+        slot->stage_image = VK_NULL_HANDLE;
+        return false;
+    }
+
+    return true;
+}
+
+/* ------------------------------------------------------------------------- */
+/* NV12/P010 conversion                                                     */
+
+struct vk_yuv_push_constants {
+    int32_t width;
+    int32_t height;
+    int32_t srgb;
+    int32_t padding;
+    /* cropped region of the source in normalized coordinates */
+    float src_offset[2];
+    float src_scale[2];
+};
+
+static inline int vk_yuv_pipeline_index(int32_t yuv_format)
+{
+    return yuv_format == DRM_FORMAT_P010 ? 1 : 0;
+}
+
+static VkFormat vk_yuv_plane_format(int32_t yuv_format, int plane)
+{
+    if (yuv_format == DRM_FORMAT_P010) {
+        return plane ? VK_FORMAT_R16G16_UNORM : VK_FORMAT_R16_UNORM;
+    }
+    return plane ? VK_FORMAT_R8G8_UNORM : VK_FORMAT_R8_UNORM;
+}
+
+static bool vk_is_srgb_format(VkFormat format)
+{
+    return format == VK_FORMAT_B8G8R8A8_SRGB || format == VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+static void vk_shtex_destroy_yuv_pipelines(struct vk_data *data)
+{
+    VkDevice device = data->device;
+    struct vk_device_funcs *funcs = &data->funcs;
+
+    for (int i = 0; i < 2; ++i) {
+        if (data->yuv_pipelines[i] != VK_NULL_HANDLE) {
+            funcs->DestroyPipeline(device, data->yuv_pipelines[i], data->ac);
+            data->yuv_pipelines[i] = VK_NULL_HANDLE;
+        }
+    }
+    if (data->yuv_pipeline_layout != VK_NULL_HANDLE) {
+        funcs->DestroyPipelineLayout(device, data->yuv_pipeline_layout, data->ac);
+        data->yuv_pipeline_layout = VK_NULL_HANDLE;
+    }
+    if (data->yuv_set_layout != VK_NULL_HANDLE) {
+        funcs->DestroyDescriptorSetLayout(device, data->yuv_set_layout, data->ac);
+        data->yuv_set_layout = VK_NULL_HANDLE;
+    }
+    if (data->yuv_sampler != VK_NULL_HANDLE) {
+        funcs->DestroySampler(device, data->yuv_sampler, data->ac);
+        data->yuv_sampler = VK_NULL_HANDLE;
+    }
+}
+
+static bool vk_shtex_init_yuv_pipeline(struct vk_data *data, int index)
+{
+#if HAVE_YUV_SHADERS
+    VkDevice device = data->device;
+    struct vk_device_funcs *funcs = &data->funcs;
+
+    VkShaderModuleCreateInfo smci = {};
+    smci.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    smci.codeSize = index ? sizeof(rgb_to_p010_spv) : sizeof(rgb_to_nv12_spv);
+    smci.pCode = index ? rgb_to_p010_spv : rgb_to_nv12_spv;
+
+    VkShaderModule module;
+    VkResult res = funcs->CreateShaderModule(device, &smci, data->ac, &module);
+    if (res != VK_SUCCESS) {
+        hlog("Failed to CreateShaderModule %s", result_to_str(res));
+        return false;
+    }
+
+    VkComputePipelineCreateInfo cpci = {};
+    cpci.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    cpci.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    cpci.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    cpci.stage.module = module;
+    cpci.stage.pName = "main";
+    cpci.layout = data->yuv_pipeline_layout;
+
+    res = funcs->CreateComputePipelines(device, VK_NULL_HANDLE, 1, &cpci,
+            data->ac, &data->yuv_pipelines[index]);
+    funcs->DestroyShaderModule(device, module, data->ac);
+    if (res != VK_SUCCESS) {
+        hlog("Failed to CreateComputePipelines %s", result_to_str(res));
+        data->yuv_pipelines[index] = VK_NULL_HANDLE;
+        return false;
+    }
+    return true;
+#else
+    (void)data;
+    (void)index;
+    return false;
+#endif
+}
+
+static bool vk_shtex_init_yuv_pipelines(struct vk_data *data, int32_t yuv_format)
+{
+    VkDevice device = data->device;
+    struct vk_device_funcs *funcs = &data->funcs;
+    VkResult res;
+
+    if (data->yuv_sampler == VK_NULL_HANDLE) {
+        VkSamplerCreateInfo sci = {};
+        sci.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        sci.magFilter = VK_FILTER_LINEAR;
+        sci.minFilter = VK_FILTER_LINEAR;
+        sci.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        sci.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sci.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        sci.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        res = funcs->CreateSampler(device, &sci, data->ac, &data->yuv_sampler);
+        if (res != VK_SUCCESS) {
+            hlog("Failed to CreateSampler %s", result_to_str(res));
+            data->yuv_sampler = VK_NULL_HANDLE;
+            return false;
+        }
+    }
+
+    if (data->yuv_set_layout == VK_NULL_HANDLE) {
+        VkDescriptorSetLayoutBinding bindings[3] = {};
+        for (int i = 0; i < 3; ++i) {
+            bindings[i].binding = i;
+            bindings[i].descriptorType = i == 0 ?
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER :
+                VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            bindings[i].descriptorCount = 1;
+            bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        }
+
+        VkDescriptorSetLayoutCreateInfo dslci = {};
+        dslci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        dslci.bindingCount = 3;
+        dslci.pBindings = bindings;
+        res = funcs->CreateDescriptorSetLayout(device, &dslci, data->ac,
+                &data->yuv_set_layout);
+        if (res != VK_SUCCESS) {
+            hlog("Failed to CreateDescriptorSetLayout %s", result_to_str(res));
+            data->yuv_set_layout = VK_NULL_HANDLE;
+            return false;
+        }
+    }
+
+    if (data->yuv_pipeline_layout == VK_NULL_HANDLE) {
+        VkPushConstantRange pcr = {};
+        pcr.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        pcr.size = sizeof(struct vk_yuv_push_constants);
+
+        VkPipelineLayoutCreateInfo plci = {};
+        plci.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        plci.setLayoutCount = 1;
+        plci.pSetLayouts = &data->yuv_set_layout;
+        plci.pushConstantRangeCount = 1;
+        plci.pPushConstantRanges = &pcr;
+        res = funcs->CreatePipelineLayout(device, &plci, data->ac,
+                &data->yuv_pipeline_layout);
+        if (res != VK_SUCCESS) {
+            hlog("Failed to CreatePipelineLayout %s", result_to_str(res));
+            data->yuv_pipeline_layout = VK_NULL_HANDLE;
+            return false;
+        }
+    }
+
+    const int index = vk_yuv_pipeline_index(yuv_format);
+    if (data->yuv_pipelines[index] == VK_NULL_HANDLE) {
+        return vk_shtex_init_yuv_pipeline(data, index);
+    }
+    return true;
+}
+
+static bool vk_shtex_init_src_views(struct vk_data *data, struct vk_swap_data *swap)
+{
+    if (swap->src_views) {
+        return true;
+    }
+
+    swap->src_views = vk_alloc(data->ac, swap->image_count * sizeof(VkImageView),
+            _Alignof(VkImageView), VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+    if (!swap->src_views) {
+        return false;
+    }
+    memset(swap->src_views, 0, swap->image_count * sizeof(VkImageView));
+
+    for (uint32_t i = 0; i < swap->image_count; ++i) {
+        VkImageViewCreateInfo ivci = {};
+        ivci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        ivci.image = swap->swap_images[i];
+        ivci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        ivci.format = swap->format;
+        ivci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        ivci.subresourceRange.levelCount = 1;
+        ivci.subresourceRange.layerCount = 1;
+        VkResult res = data->funcs.CreateImageView(data->device, &ivci,
+                data->ac, &swap->src_views[i]);
+        if (res != VK_SUCCESS) {
+            hlog("Failed to CreateImageView %s", result_to_str(res));
+            swap->src_views[i] = VK_NULL_HANDLE;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void vk_shtex_destroy_src_views(struct vk_data *data, struct vk_swap_data *swap)
+{
+    if (!swap->src_views) {
+        return;
+    }
+    for (uint32_t i = 0; i < swap->image_count; ++i) {
+        if (swap->src_views[i] != VK_NULL_HANDLE) {
+            data->funcs.DestroyImageView(data->device, swap->src_views[i], data->ac);
+        }
+    }
+    vk_free(data->ac, swap->src_views);
+    swap->src_views = NULL;
+}
+
+/* Creates one linear storage image with its own exportable allocation */
+static bool vk_shtex_init_yuv_plane(struct vk_data *data, VkFormat format,
+        uint32_t width, uint32_t height, VkImage *image, VkDeviceMemory *mem,
+        int *fd, int *stride, int *offset)
+{
+    struct vk_device_funcs *funcs = &data->funcs;
+    struct vk_inst_funcs *ifuncs =
+        get_inst_funcs_by_physical_device(data->phy_device);
+    VkDevice device = data->device;
+
+    VkExternalMemoryImageCreateInfo ext_mem_image_info = {};
+    ext_mem_image_info.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO;
+    ext_mem_image_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+    VkImageCreateInfo img_info = {};
+    img_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    img_info.pNext = &ext_mem_image_info;
+    img_info.imageType = VK_IMAGE_TYPE_2D;
+    img_info.format = format;
+    img_info.mipLevels = 1;
+    img_info.arrayLayers = 1;
+    img_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    img_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    img_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    img_info.extent.width = width;
+    img_info.extent.height = height;
+    img_info.extent.depth = 1;
+    img_info.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+    img_info.tiling = VK_IMAGE_TILING_LINEAR;
+
+    VkResult res = funcs->CreateImage(device, &img_info, data->ac, image);
+    if (res != VK_SUCCESS) {
+        hlog("Failed to CreateImage %s", result_to_str(res));
+        *image = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VkImageMemoryRequirementsInfo2 memri = {};
+    memri.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2;
+    memri.image = *image;
+
+    VkMemoryRequirements2 memr = {};
+    memr.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+
+    funcs->GetImageMemoryRequirements2KHR(device, &memri, &memr);
+
+    VkPhysicalDeviceMemoryProperties pdmp;
+    ifuncs->GetPhysicalDeviceMemoryProperties(data->phy_device, &pdmp);
+
+    VkExportMemoryAllocateInfo memory_export_info = {};
+    memory_export_info.sType = VK_STRUCTURE_TYPE_EXPORT_MEMORY_ALLOCATE_INFO;
+    memory_export_info.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+
+    VkMemoryDedicatedAllocateInfo memory_dedicated_info = {};
+    memory_dedicated_info.sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO;
+    memory_dedicated_info.pNext = &memory_export_info;
+    memory_dedicated_info.image = *image;
+
+    VkMemoryAllocateInfo memi = {};
+    memi.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memi.pNext = &memory_dedicated_info;
+    memi.allocationSize = memr.memoryRequirements.size;
+
+    /* first pass only DEVICE_LOCAL types, second pass any type */
+    bool allocated = false;
+    for (int pass = 0; pass < 2 && !allocated; ++pass) {
+        for (uint32_t i = 0; i < pdmp.memoryTypeCount; ++i) {
+            const bool local = pdmp.memoryTypes[i].propertyFlags &
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+            if (!(memr.memoryRequirements.memoryTypeBits & (1 << i)) ||
+                    (pass == 0 && !local) || (pass == 1 && local)) {
+                continue;
+            }
+            memi.memoryTypeIndex = i;
+            res = funcs->AllocateMemory(device, &memi, NULL, mem);
+            allocated = res == VK_SUCCESS;
+            if (allocated)
+                break;
+        }
+    }
+    if (!allocated) {
+        hlog("Failed to allocate memory of any type");
+        *mem = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VkBindImageMemoryInfo bimi = {};
+    bimi.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
+    bimi.image = *image;
+    bimi.memory = *mem;
+    res = funcs->BindImageMemory2KHR(device, 1, &bimi);
+    if (res != VK_SUCCESS) {
+        hlog("BindImageMemory2KHR failed %s", result_to_str(res));
+        return false;
+    }
+
+    VkMemoryGetFdInfoKHR gfdi = {};
+    gfdi.sType = VK_STRUCTURE_TYPE_MEMORY_GET_FD_INFO_KHR;
+    gfdi.memory = *mem;
+    gfdi.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT;
+    res = funcs->GetMemoryFdKHR(device, &gfdi, fd);
+    if (res != VK_SUCCESS) {
+        hlog("GetMemoryFdKHR failed %s", result_to_str(res));
+        *fd = -1;
+        return false;
+    }
+
+    VkImageSubresource sbr = {};
+    sbr.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    VkSubresourceLayout layout;
+    funcs->GetImageSubresourceLayout(device, *image, &sbr, &layout);
+    *stride = layout.rowPitch;
+    *offset = layout.offset;
+    return true;
+}
+
+/* Export slot holding a luma and a half resolution chroma plane, each in its
+ * own dma-buf. Cleaned up by vk_shtex_free_slot on failure. */
+static bool vk_shtex_init_yuv_tex(struct vk_data *data,
+        struct vk_swap_data *swap, struct vk_export_slot *slot)
+{
+    struct vk_device_funcs *funcs = &data->funcs;
+    VkDevice device = data->device;
+    VkResult res;
+
+    const uint32_t width = swap->export_extent.width;
+    const uint32_t height = swap->export_extent.height;
+
+    if (!vk_shtex_init_yuv_plane(data, vk_yuv_plane_format(swap->yuv_format, 0),
+                width, height, &slot->image, &slot->mem, &slot->dmabuf_fds[0],
+                &slot->dmabuf_strides[0], &slot->dmabuf_offsets[0]) ||
+            !vk_shtex_init_yuv_plane(data, vk_yuv_plane_format(swap->yuv_format, 1),
+                width / 2, height / 2, &slot->uv_image, &slot->uv_mem,
+                &slot->dmabuf_fds[1], &slot->dmabuf_strides[1],
+                &slot->dmabuf_offsets[1])) {
+        vk_shtex_free_slot(data, slot);
+        return false;
+    }
+    slot->dmabuf_nfd = 2;
+
+    for (int i = 0; i < 2; ++i) {
+        VkImageViewCreateInfo ivci = {};
+        ivci.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        ivci.image = i ? slot->uv_image : slot->image;
+        ivci.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        ivci.format = vk_yuv_plane_format(swap->yuv_format, i);
+        ivci.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        ivci.subresourceRange.levelCount = 1;
+        ivci.subresourceRange.layerCount = 1;
+        res = funcs->CreateImageView(device, &ivci, data->ac, &slot->yuv_views[i]);
+        if (res != VK_SUCCESS) {
+            hlog("Failed to CreateImageView %s", result_to_str(res));
+            slot->yuv_views[i] = VK_NULL_HANDLE;
+            vk_shtex_free_slot(data, slot);
+            return false;
+        }
+    }
+
+    /* one set per swapchain image, only the source view differs */
+    const uint32_t count = swap->image_count;
+
+    VkDescriptorPoolSize pool_sizes[2] = {};
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pool_sizes[0].descriptorCount = count;
+    pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    pool_sizes[1].descriptorCount = count * 2;
+
+    VkDescriptorPoolCreateInfo dpci = {};
+    dpci.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    dpci.maxSets = count;
+    dpci.poolSizeCount = 2;
+    dpci.pPoolSizes = pool_sizes;
+    res = funcs->CreateDescriptorPool(device, &dpci, data->ac, &slot->desc_pool);
+    if (res != VK_SUCCESS) {
+        hlog("Failed to CreateDescriptorPool %s", result_to_str(res));
+        slot->desc_pool = VK_NULL_HANDLE;
+        vk_shtex_free_slot(data, slot);
+        return false;
+    }
+
+    VkDescriptorSetLayout *layouts = vk_alloc(data->ac,
+            count * sizeof(VkDescriptorSetLayout), _Alignof(VkDescriptorSetLayout),
+            VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+    slot->desc_sets = vk_alloc(data->ac, count * sizeof(VkDescriptorSet),
+            _Alignof(VkDescriptorSet), VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+    if (!layouts || !slot->desc_sets) {
+        vk_free(data->ac, layouts);
+        vk_shtex_free_slot(data, slot);
+        return false;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        layouts[i] = data->yuv_set_layout;
+    }
+
+    VkDescriptorSetAllocateInfo dsai = {};
+    dsai.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    dsai.descriptorPool = slot->desc_pool;
+    dsai.descriptorSetCount = count;
+    dsai.pSetLayouts = layouts;
+    res = funcs->AllocateDescriptorSets(device, &dsai, slot->desc_sets);
+    vk_free(data->ac, layouts);
+    if (res != VK_SUCCESS) {
+        hlog("Failed to AllocateDescriptorSets %s", result_to_str(res));
+        vk_shtex_free_slot(data, slot);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        VkDescriptorImageInfo image_infos[3] = {};
+        image_infos[0].sampler = data->yuv_sampler;
+        image_infos[0].imageView = swap->src_views[i];
+        image_infos[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        image_infos[1].imageView = slot->yuv_views[0];
+        image_infos[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        image_infos[2].imageView = slot->yuv_views[1];
+        image_infos[2].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        VkWriteDescriptorSet writes[3] = {};
+        for (int j = 0; j < 3; ++j) {
+            writes[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[j].dstSet = slot->desc_sets[i];
+            writes[j].dstBinding = j;
+            writes[j].descriptorCount = 1;
+            writes[j].descriptorType = j == 0 ?
+                VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER :
+                VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            writes[j].pImageInfo = &image_infos[j];
+        }
+        funcs->UpdateDescriptorSets(device, 3, writes, 0, NULL);
+    }
+
+    swap->dmabuf_modifier = DRM_FORMAT_MOD_LINEAR;
+
+#ifndef NDEBUG
+    hlog("Got planes %d fd %d %d", slot->dmabuf_nfd, slot->dmabuf_fds[0], slot->dmabuf_fds[1]);
+#endif
+
+    return true;
+}
+
+static void vk_shtex_create_frame_objects(struct vk_data *data,
+        struct vk_queue_data *queue_data,
+        uint32_t image_count)
+{
+    queue_data->frames =
+        vk_alloc(data->ac, image_count * sizeof(struct vk_frame_data),
+                _Alignof(struct vk_frame_data),
                 VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
     memset(queue_data->frames, 0, image_count * sizeof(struct vk_frame_data));
     queue_data->frame_index = 0;
     queue_data->frame_count = image_count;
 
-    VkDevice device = data->device;
-    for (uint32_t image_index = 0; image_index < image_count;
-            image_index++) {
-        struct vk_frame_data *frame_data =
-            &queue_data->frames[image_index];
+    VkDevice device = data->device;
+    for (uint32_t image_index = 0; image_index < image_count;
+            image_index++) {
+        struct vk_frame_data *frame_data =
+            &queue_data->frames[image_index];
+
+        VkCommandPoolCreateInfo cpci;
+        cpci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        cpci.pNext = NULL;
+        cpci.flags = 0;
+        cpci.queueFamilyIndex = queue_data->fam_idx;
+
+        VkResult res = data->funcs.CreateCommandPool(
+                device, &cpci, data->ac, &frame_data->cmd_pool);
+#ifdef DEBUG_EXTRA
+        hlog("CreateCommandPool %s", result_to_str(res));
+#endif
+
+        VkCommandBufferAllocateInfo cbai;
+        cbai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        cbai.pNext = NULL;
+        cbai.commandPool = frame_data->cmd_pool;
+        cbai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        cbai.commandBufferCount = 2;
+
+        VkCommandBuffer cmd_buffers[2];
+        res = data->funcs.AllocateCommandBuffers(device, &cbai, cmd_buffers);
+#ifdef DEBUG_EXTRA
+        hlog("AllocateCommandBuffers %s", result_to_str(res));
+#endif
+        GET_LDT(cmd_buffers[0]) = GET_LDT(device);
+        GET_LDT(cmd_buffers[1]) = GET_LDT(device);
+        frame_data->cmd_buffer = cmd_buffers[0];
+        frame_data->stage_cmd_buffer = cmd_buffers[1];
+
+        VkFenceCreateInfo fci = {};
+        fci.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        fci.pNext = NULL;
+        fci.flags = 0;
+        res = data->funcs.CreateFence(device, &fci, data->ac,
+               &frame_data->fence);
+#ifdef DEBUG_EXTRA
+        hlog("CreateFence %s", result_to_str(res));
+#endif
+
+        VkSemaphoreCreateInfo sci = {};
+        sci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        sci.pNext = NULL;
+        sci.flags = 0;
+        res = data->funcs.CreateSemaphore(device, &sci, data->ac, &frame_data->semaphore);
+
+#ifdef DEBUG_EXTRA
+        hlog("CreateSemaphore %s", result_to_str(res));
+#endif
+
+        if (queue_data->timestamp_bits) {
+            VkQueryPoolCreateInfo qpci = {};
+            qpci.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            qpci.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            qpci.queryCount = 2;
+            res = data->funcs.CreateQueryPool(device, &qpci, data->ac, &frame_data->query_pool);
+            if (res != VK_SUCCESS) {
+                hlog("Failed to create timestamp query pool %s", result_to_str(res));
+                frame_data->query_pool = VK_NULL_HANDLE;
+            }
+            frame_data->timestamp_mask = queue_data->timestamp_bits >= 64 ?
+                ~0ull : (1ull << queue_data->timestamp_bits) - 1;
+        }
+
+        if (data->sync_fd_supported) {
+            VkExportSemaphoreCreateInfo esci = {};
+            esci.sType = VK_STRUCTURE_TYPE_EXPORT_SEMAPHORE_CREATE_INFO;
+            esci.pNext = NULL;
+            esci.handleTypes = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+            sci.pNext = &esci;
+            res = data->funcs.CreateSemaphore(device, &sci, data->ac, &frame_data->export_semaphore);
+            if (res != VK_SUCCESS) {
+                hlog("Failed to create exportable semaphore %s", result_to_str(res));
+                frame_data->export_semaphore = VK_NULL_HANDLE;
+            }
+        }
+    }
+}
+
+static void vk_shtex_destroy_fence(struct vk_data *data, bool *cmd_buffer_busy,
+        VkFence *fence)
+{
+    VkDevice device = data->device;
+
+    if (*cmd_buffer_busy) {
+        data->funcs.WaitForFences(device, 1, fence, VK_TRUE, ~0ull);
+        *cmd_buffer_busy = false;
+    }
+
+    data->funcs.DestroyFence(device, *fence, data->ac);
+    *fence = VK_NULL_HANDLE;
+}
+
+static void vk_shtex_destroy_frame_objects(struct vk_data *data,
+        struct vk_queue_data *queue_data)
+{
+    VkDevice device = data->device;
+
+    for (uint32_t frame_idx = 0; frame_idx < queue_data->frame_count;
+            frame_idx++) {
+        struct vk_frame_data *frame_data =
+            &queue_data->frames[frame_idx];
+        bool *cmd_buffer_busy = &frame_data->cmd_buffer_busy;
+        VkFence *fence = &frame_data->fence;
+        vk_shtex_destroy_fence(data, cmd_buffer_busy, fence);
+
+        data->funcs.DestroySemaphore(device, frame_data->semaphore,
+                data->ac);
+        if (frame_data->export_semaphore) {
+            data->funcs.DestroySemaphore(device,
+                    frame_data->export_semaphore, data->ac);
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (frame_data->own_semaphores[i]) {
+                data->funcs.DestroySemaphore(device,
+                        frame_data->own_semaphores[i], data->ac);
+            }
+        }
+        if (frame_data->own_cmd_pool) {
+            data->funcs.DestroyCommandPool(device,
+                    frame_data->own_cmd_pool, data->ac);
+        }
+        if (frame_data->stage_semaphore) {
+            data->funcs.DestroySemaphore(device,
+                    frame_data->stage_semaphore, data->ac);
+        }
+        if (frame_data->export_cmd_pool) {
+            data->funcs.DestroyCommandPool(device,
+                    frame_data->export_cmd_pool, data->ac);
+        }
+        if (frame_data->query_pool) {
+            data->funcs.DestroyQueryPool(device, frame_data->query_pool,
+                    data->ac);
+        }
+        data->funcs.DestroyCommandPool(device, frame_data->cmd_pool,
+                data->ac);
+        frame_data->cmd_pool = VK_NULL_HANDLE;
+    }
+
+    vk_free(data->ac, queue_data->frames);
+    queue_data->frames = NULL;
+    queue_data->frame_count = 0;
+}
+
+/* Undo the NV12/P010 choice of vk_shtex_choose_export, the unscaled copy
+ * needs no scaling support. export_format was picked already. */
+static void vk_shtex_fallback_rgb(struct vk_swap_data *swap)
+{
+    swap->yuv_format = 0;
+    swap->export_extent.width = swap->crop.width;
+    swap->export_extent.height = swap->crop.height;
+}
+
+/* Runs on the init thread, must not call into capture.c */
+static bool vk_shtex_prepare(struct vk_data *data, struct vk_swap_data *swap,
+        struct vk_queue_data *queue_data)
+{
+    hlog("Texture %s %ux%u", vk_format_to_str(swap->format), swap->image_extent.width, swap->image_extent.height);
+
+    /* keep one slot for OBS to read, one finished and one being written,
+     * so neither GPU waits for the other */
+    int slot_target = vkcapture_slots + swap->params.consumers - 1;
+    if (slot_target > CAPTURE_MAX_SLOTS) {
+        slot_target = CAPTURE_MAX_SLOTS;
+    }
+    if (swap->params.consumers > 1) {
+        hlog("Sharing with %d OBS instances", swap->params.consumers);
+    }
+    if (swap->params.cross_device) {
+        hlog("OBS is running on different GPU, sharing linear images in system memory");
+        if (slot_target < CAPTURE_MAX_SLOTS) {
+            slot_target = CAPTURE_MAX_SLOTS;
+        }
+    } else if (swap->params.memfd) {
+        hlog("Copying to memfd slots in system memory");
+    } else if (!swap->params.same_device) {
+        hlog("OBS is running on different GPU");
+    }
+
+    if (swap->yuv_format && (!vk_shtex_init_yuv_pipelines(data, swap->yuv_format) ||
+                !vk_shtex_init_src_views(data, swap))) {
+        hlog("GPU conversion unavailable, sharing %s", vk_format_to_str(swap->format));
+        vk_shtex_fallback_rgb(swap);
+    }
+
+    swap->slot_count = 0;
+    for (int i = 0; i < slot_target; ++i) {
+        if (swap->params.memfd) {
+            if (vk_shtex_init_memfd_tex(data, swap, &swap->slots[i])) {
+                swap->slot_count++;
+                continue;
+            }
+            if (i > 0) {
+                break;
+            }
+            hlog("memfd transport unavailable, exporting dmabufs");
+            swap->params.memfd = false;
+        }
+        bool ok = swap->yuv_format ?
+            vk_shtex_init_yuv_tex(data, swap, &swap->slots[i]) :
+            vk_shtex_init_vulkan_tex(data, swap, &swap->slots[i], i == 0);
+        if (!ok && swap->yuv_format && i == 0) {
+            hlog("GPU conversion unavailable, sharing %s", vk_format_to_str(swap->format));
+            vk_shtex_fallback_rgb(swap);
+            ok = vk_shtex_init_vulkan_tex(data, swap, &swap->slots[i], true);
+        }
+        if (!ok) {
+            break;
+        }
+        swap->slot_count++;
+    }
+
+    if (!swap->slot_count) {
+        return false;
+    }
+
+    if (swap->slot_count < slot_target) {
+        hlog("Only %d of %d export images created", swap->slot_count, slot_target);
+    }
+
+    if (swap->params.stage) {
+        int staged = 0;
+        while (staged < swap->slot_count &&
+                vk_shtex_init_stage_tex(data, swap, &swap->slots[staged],
+                    queue_data ? queue_data->fam_idx : VK_QUEUE_FAMILY_IGNORED)) {
+            staged++;
+        }
+        if (staged == swap->slot_count) {
+            hlog("Staging frames in VRAM, presents only wait for that copy");
+        } else {
+            hlog("Stage images unavailable, presents wait for the whole copy");
+            swap->params.stage = false;
+        }
+    }
+
+    /* frames left over from a previous capture may still be in flight and
+     * are resized on the present thread instead */
+    if (queue_data && queue_data->frame_count == 0) {
+        vk_shtex_create_frame_objects(data, queue_data, swap->image_count);
+    }
+
+    return true;
+}
+
+static void vk_shtex_start(struct vk_data *data, struct vk_swap_data *swap)
+{
+    swap->slot_index = swap->slot_count - 1;
+    swap->latest_slot = -1;
+    swap->latest_seq = 0;
+    swap->frame_seq = 0;
+
+    data->cur_swap = swap;
+
+    for (int i = 0; i < swap->slot_count; ++i) {
+        struct vk_export_slot *slot = &swap->slots[i];
+        slot->damage.x = 0;
+        slot->damage.y = 0;
+        slot->damage.width = swap->export_extent.width;
+        slot->damage.height = swap->export_extent.height;
+        memset(&slot->unreported, 0, sizeof(slot->unreported));
+        /* copies still in flight from an earlier capture of this swapchain
+         * must not be reported with their old seq */
+        slot->seq = 0;
+        if (slot->header) {
+            __atomic_store_n(&slot->header->seq, 0, __ATOMIC_SEQ_CST);
+        }
+        capture_init_shtex(swap->export_extent.width, swap->export_extent.height,
+            &swap->crop,
+            swap->yuv_format ? swap->yuv_format : vk_format_to_drm(swap->export_format),
+            slot->dmabuf_strides, slot->dmabuf_offsets, swap->dmabuf_modifier,
+            swap->winid, /*flip*/false, swap->params.memfd, i, swap->slot_count,
+            slot->dmabuf_nfd, slot->dmabuf_fds);
+    }
+
+    hlog("------------------ vulkan capture started ------------------");
+}
+
+static void *vk_shtex_init_thread(void *arg)
+{
+    struct vk_data *data = arg;
+    const int64_t start = os_time_get_nano();
+    data->init_result = vk_shtex_prepare(data, data->init_swap, data->init_queue);
+    data->init_time = os_time_get_nano() - start;
+    __atomic_store_n(&data->init_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int32_t vk_shtex_choose_yuv(struct vk_data *data, struct vk_swap_data *swap)
+{
+    if (!HAVE_YUV_SHADERS || !capture_allocate_yuv() || !swap->sampled ||
+            capture_allocate_map_host() || capture_allocate_memfd() ||
+            !capture_compare_device_uuid(data->device_uuid)) {
+        return 0;
+    }
+
+    const int32_t yuv_format =
+        swap->format == VK_FORMAT_A2R10G10B10_UNORM_PACK32 ||
+        swap->format == VK_FORMAT_A2B10G10R10_UNORM_PACK32 ?
+        DRM_FORMAT_P010 : DRM_FORMAT_NV12;
+
+    struct vk_inst_funcs *ifuncs =
+        get_inst_funcs_by_physical_device(data->phy_device);
+
+    for (int i = 0; i < 2; ++i) {
+        VkFormatProperties2KHR format_props = {};
+        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+                vk_yuv_plane_format(yuv_format, i), &format_props);
+        if (!(format_props.formatProperties.linearTilingFeatures &
+                    VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+            hlog("Cannot write %s planes, sharing RGB",
+                    vk_format_to_str(vk_yuv_plane_format(yuv_format, i)));
+            return 0;
+        }
+    }
+
+    VkFormatProperties2KHR format_props = {};
+    format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+    ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+            swap->format, &format_props);
+    const VkFormatFeatureFlags features = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT |
+        VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    if ((format_props.formatProperties.optimalTilingFeatures & features) != features) {
+        hlog("Cannot sample %s, sharing RGB", vk_format_to_str(swap->format));
+        return 0;
+    }
+
+    return yuv_format;
+}
+
+static bool vk_shtex_format_usable(struct vk_data *data, int index, bool blit, bool host)
+{
+    const int32_t drm = vk_format_table[index].drm;
+    const uint32_t formats = blit ? data->blit_formats : data->copy_formats;
+    return drm != -1 && (formats & (1u << index)) &&
+        capture_format_supported(drm) &&
+        (!host || capture_format_host_readable(drm));
+}
+
+/* The swapchain format itself when it can be shared, so the frame is a plain
+ * copy, otherwise the first usable format down its fallback chain. */
+static VkFormat vk_shtex_choose_format(struct vk_data *data, VkFormat format, bool host)
+{
+    for (int i = vk_format_index(format); i != -1;
+            i = vk_format_index(vk_format_table[i].fallback)) {
+        if (vk_shtex_format_usable(data, i, vk_format_table[i].vk != format, host)) {
+            return vk_format_table[i].vk;
+        }
+    }
+    /* nothing known to work, let the import ladder find out */
+    return vk_format_to_drm(format) != -1 ? format : VK_FORMAT_B8G8R8A8_UNORM;
+}
+
+static void vk_shtex_choose_export(struct vk_data *data, struct vk_swap_data *swap)
+{
+    if (!data->formats_queried) {
+        vk_query_export_formats(data);
+    }
+    swap->export_format = vk_shtex_choose_format(data, swap->format,
+            capture_allocate_map_host() || capture_allocate_memfd());
+    if (swap->export_format != swap->format) {
+        hlog("Converting to %s", vk_format_to_str(swap->export_format));
+    }
+
+    capture_get_crop(swap->image_extent.width, swap->image_extent.height, &swap->crop);
+    if (swap->crop.width != (int32_t)swap->image_extent.width ||
+            swap->crop.height != (int32_t)swap->image_extent.height) {
+        hlog("Cropping to %dx%d at %d,%d", swap->crop.width, swap->crop.height,
+                swap->crop.x, swap->crop.y);
+    }
+
+    int width, height;
+    capture_get_export_size(swap->crop.width, swap->crop.height, &width, &height);
+
+    swap->yuv_format = vk_shtex_choose_yuv(data, swap);
+    if (swap->yuv_format) {
+        /* chroma is subsampled 2x2, the shader samples with filtering so
+         * scaling comes for free */
+        swap->export_extent.width = width > 2 ? width & ~1 : 2;
+        swap->export_extent.height = height > 2 ? height & ~1 : 2;
+        hlog("Converting to %s %ux%u",
+                swap->yuv_format == DRM_FORMAT_P010 ? "P010" : "NV12",
+                swap->export_extent.width, swap->export_extent.height);
+        return;
+    }
+
+    if (width != swap->crop.width || height != swap->crop.height) {
+        struct vk_inst_funcs *ifuncs =
+            get_inst_funcs_by_physical_device(data->phy_device);
+
+        VkFormatProperties2KHR format_props = {};
+        format_props.sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2;
+        ifuncs->GetPhysicalDeviceFormatProperties2KHR(data->phy_device,
+                swap->format, &format_props);
+
+        const VkFormatFeatureFlags features = VK_FORMAT_FEATURE_BLIT_SRC_BIT |
+            VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+        if ((format_props.formatProperties.optimalTilingFeatures & features) != features) {
+            hlog("Cannot scale %s, exporting at full size", vk_format_to_str(swap->format));
+            width = swap->crop.width;
+            height = swap->crop.height;
+        } else {
+            hlog("Scaling to %dx%d", width, height);
+        }
+    }
+
+    swap->export_extent.width = width;
+    swap->export_extent.height = height;
+}
+
+static inline bool vk_shtex_needs_blit(struct vk_swap_data *swap)
+{
+    return swap->format != swap->export_format ||
+        (int32_t)swap->export_extent.width != swap->crop.width ||
+        (int32_t)swap->export_extent.height != swap->crop.height;
+}
+
+/* Creating the export images can take tens of milliseconds, so it is done
+ * on a helper thread while the game keeps presenting. */
+static void vk_shtex_start_init(struct vk_data *data, struct vk_swap_data *swap,
+        struct vk_queue_data *queue_data)
+{
+    struct vk_export_params *params = &swap->params;
+    params->no_modifiers = capture_allocate_no_modifiers();
+    params->map_host = capture_allocate_map_host();
+    /* the copy into a buffer can neither scale nor convert */
+    params->memfd = capture_allocate_memfd() && data->host_ptr_supported &&
+        !swap->yuv_format && !vk_shtex_needs_blit(swap);
+    params->consumers = capture_get_consumer_count();
+    params->same_device = capture_compare_device_uuid(data->device_uuid);
+    params->cross_device = vkcapture_cross_device && !params->same_device &&
+        capture_device_uuid_known() && !params->map_host && !params->memfd;
+    params->linear = vkcapture_linear || capture_allocate_linear() ||
+        params->cross_device;
+    /* copies into system memory or that scale are slow enough to be worth
+     * a second one, the NV12/P010 conversion samples the swapchain image */
+    params->stage = swap->low_latency && !swap->yuv_format &&
+        (params->memfd || params->cross_device || vk_shtex_needs_blit(swap));
+    params->hint_rejected = false;
+    params->use_hint = capture_get_alloc_hint(vk_format_to_drm(swap->export_format),
+            &params->hint_modifier, &params->hint_planes);
+    params->supported_modifier_count = capture_get_supported_modifiers(
+            vk_format_to_drm(swap->export_format), params->supported_modifiers);
+
+    data->init_swap = swap;
+    data->init_queue = queue_data;
+    data->init_done = 0;
+    data->init_running = true;
+    data->init_joinable = pthread_create(&data->init_thread, NULL,
+            vk_shtex_init_thread, data) == 0;
+    if (!data->init_joinable) {
+        hlog("Failed to create init thread, initializing on present");
+        vk_shtex_init_thread(data);
+    }
+}
+
+/* Tell OBS about the newest slot whose copy has finished, never blocks. */
+static void vk_shtex_update_slots(struct vk_data *data,
+        struct vk_swap_data *swap)
+{
+    int latest = -1;
+
+    for (int i = 0; i < swap->slot_count; ++i) {
+        struct vk_export_slot *slot = &swap->slots[i];
+        struct vk_frame_data *frame_data = slot->frame_data;
+        if (!frame_data)
+            continue;
+        if (frame_data->cmd_buffer_busy &&
+                data->funcs.GetFenceStatus(data->device, frame_data->fence) != VK_SUCCESS)
+            continue;
+        slot->frame_data = NULL;
+        if (slot->header)
+            __atomic_store_n(&slot->header->seq, slot->seq, __ATOMIC_SEQ_CST);
+        capture_publish_slot(i, slot->seq);
+        if (latest == -1 || slot->seq > swap->slots[latest].seq)
+            latest = i;
+    }
+
+    if (latest != -1 && swap->slots[latest].seq > swap->latest_seq) {
+        struct vk_export_slot *slot = &swap->slots[latest];
+        swap->latest_slot = latest;
+        swap->latest_seq = slot->seq;
+        capture_send_frame(latest, swap->latest_seq, -1, &slot->unreported,
+                slot->present_time, capture_clock_ns());
+        memset(&slot->unreported, 0, sizeof(slot->unreported));
+    }
+}
+
+/* Adds what changed in this present to every slot. Without
+ * VkPresentRegionsKHR, or when the copy scales or converts, the whole
+ * image counts as changed. */
+static void vk_shtex_add_damage(struct vk_swap_data *swap,
+        const VkPresentInfoKHR *info, uint32_t idx)
+{
+    struct capture_rect damage = {
+        .width = swap->export_extent.width,
+        .height = swap->export_extent.height,
+    };
+
+    const VkPresentRegionsKHR *regions = NULL;
+    for (const VkBaseInStructure *s = info->pNext; s; s = s->pNext) {
+        if (s->sType == VK_STRUCTURE_TYPE_PRESENT_REGIONS_KHR) {
+            regions = (const VkPresentRegionsKHR *)s;
+            break;
+        }
+    }
+
+    /* zero rectangles means the whole image changed */
+    if (regions && idx < regions->swapchainCount && regions->pRegions &&
+            regions->pRegions[idx].rectangleCount &&
+            !vk_shtex_needs_blit(swap) && !swap->yuv_format) {
+        /* rectangles are in image coordinates, clip them to the crop */
+        const VkPresentRegionKHR *region = &regions->pRegions[idx];
+        const struct capture_rect *crop = &swap->crop;
+        memset(&damage, 0, sizeof(damage));
+        for (uint32_t i = 0; i < region->rectangleCount; ++i) {
+            const VkRectLayerKHR *r = &region->pRectangles[i];
+            const int32_t x0 = r->offset.x > crop->x ? r->offset.x : crop->x;
+            const int32_t y0 = r->offset.y > crop->y ? r->offset.y : crop->y;
+            int32_t x1 = r->offset.x + (int32_t)r->extent.width;
+            int32_t y1 = r->offset.y + (int32_t)r->extent.height;
+            x1 = x1 < crop->x + crop->width ? x1 : crop->x + crop->width;
+            y1 = y1 < crop->y + crop->height ? y1 : crop->y + crop->height;
+            struct capture_rect rect = {
+                .x = x0 - crop->x,
+                .y = y0 - crop->y,
+                .width = x1 - x0,
+                .height = y1 - y0,
+            };
+            capture_rect_union(&damage, &rect);
+        }
+    }
+
+    for (int i = 0; i < swap->slot_count; ++i) {
+        capture_rect_union(&swap->slots[i].damage, &damage);
+    }
+}
+
+static inline bool vk_shtex_slot_reading(const struct vk_swap_data *swap, int index)
+{
+    const struct vk_export_slot *slot = &swap->slots[index];
+    return (slot->header &&
+        __atomic_load_n(&slot->header->reading, __ATOMIC_SEQ_CST)) ||
+        capture_slot_held(index);
+}
+
+/* Invalidates a slot before copying into it, fails if an OBS instance
+ * started reading it in the meantime. */
+static bool vk_shtex_claim_slot(struct vk_swap_data *swap, struct vk_export_slot *slot)
+{
+    uint64_t seq = 0;
+    if (slot->header) {
+        seq = __atomic_exchange_n(&slot->header->seq, 0, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&slot->header->reading, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&slot->header->seq, seq, __ATOMIC_SEQ_CST);
+            return false;
+        }
+    }
+    if (!capture_claim_slot(slot - swap->slots)) {
+        if (slot->header) {
+            __atomic_store_n(&slot->header->seq, seq, __ATOMIC_SEQ_CST);
+        }
+        return false;
+    }
+    return true;
+}
+
+/* Next slot that is neither being written, nor the newest, nor held by
+ * any OBS instance. */
+static struct vk_export_slot *vk_shtex_next_slot(struct vk_swap_data *swap)
+{
+    if (swap->slot_count == 1) {
+        return &swap->slots[0];
+    }
+
+    for (int i = 1; i <= swap->slot_count; ++i) {
+        const int index = (swap->slot_index + i) % swap->slot_count;
+        struct vk_export_slot *slot = &swap->slots[index];
+        if (!slot->frame_data && index != swap->latest_slot &&
+                !vk_shtex_slot_reading(swap, index)) {
+            swap->slot_index = index;
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+static bool vk_shtex_init_ownership(struct vk_data *data,
+        struct vk_frame_data *frame_data, uint32_t present_fam_idx)
+{
+    VkDevice device = data->device;
+    VkResult res;
+
+    if (frame_data->own_cmd_pool && frame_data->own_fam_idx != present_fam_idx) {
+        data->funcs.DestroyCommandPool(device, frame_data->own_cmd_pool, data->ac);
+        frame_data->own_cmd_pool = VK_NULL_HANDLE;
+    }
+
+    if (frame_data->own_cmd_pool) {
+        data->funcs.ResetCommandPool(device, frame_data->own_cmd_pool, 0);
+        return true;
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (frame_data->own_semaphores[i]) {
+            continue;
+        }
+        VkSemaphoreCreateInfo sci = {};
+        sci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        res = data->funcs.CreateSemaphore(device, &sci, data->ac,
+                &frame_data->own_semaphores[i]);
+        if (res != VK_SUCCESS) {
+            hlog("CreateSemaphore failed %s", result_to_str(res));
+            frame_data->own_semaphores[i] = VK_NULL_HANDLE;
+            return false;
+        }
+    }
+
+    VkCommandPoolCreateInfo cpci;
+    cpci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cpci.pNext = NULL;
+    cpci.flags = 0;
+    cpci.queueFamilyIndex = present_fam_idx;
+
+    res = data->funcs.CreateCommandPool(device, &cpci, data->ac,
+            &frame_data->own_cmd_pool);
+    if (res != VK_SUCCESS) {
+        hlog("CreateCommandPool failed %s", result_to_str(res));
+        frame_data->own_cmd_pool = VK_NULL_HANDLE;
+        return false;
+    }
+    frame_data->own_fam_idx = present_fam_idx;
+
+    VkCommandBufferAllocateInfo cbai;
+    cbai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbai.pNext = NULL;
+    cbai.commandPool = frame_data->own_cmd_pool;
+    cbai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbai.commandBufferCount = 2;
+
+    res = data->funcs.AllocateCommandBuffers(device, &cbai,
+            frame_data->own_cmd_buffers);
+    if (res != VK_SUCCESS) {
+        hlog("AllocateCommandBuffers failed %s", result_to_str(res));
+        data->funcs.DestroyCommandPool(device, frame_data->own_cmd_pool, data->ac);
+        frame_data->own_cmd_pool = VK_NULL_HANDLE;
+        return false;
+    }
+    GET_LDT(frame_data->own_cmd_buffers[0]) = GET_LDT(device);
+    GET_LDT(frame_data->own_cmd_buffers[1]) = GET_LDT(device);
+    return true;
+}
+
+static bool vk_shtex_init_export_queue(struct vk_data *data,
+        struct vk_frame_data *frame_data, uint32_t transfer_fam_idx)
+{
+    VkDevice device = data->device;
+    VkResult res;
+
+    if (frame_data->export_cmd_pool) {
+        data->funcs.ResetCommandPool(device, frame_data->export_cmd_pool, 0);
+        return true;
+    }
+
+    if (!frame_data->stage_semaphore) {
+        VkSemaphoreCreateInfo sci = {};
+        sci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+        res = data->funcs.CreateSemaphore(device, &sci, data->ac,
+                &frame_data->stage_semaphore);
+        if (res != VK_SUCCESS) {
+            hlog("CreateSemaphore failed %s", result_to_str(res));
+            frame_data->stage_semaphore = VK_NULL_HANDLE;
+            return false;
+        }
+    }
+
+    VkCommandPoolCreateInfo cpci;
+    cpci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    cpci.pNext = NULL;
+    cpci.flags = 0;
+    cpci.queueFamilyIndex = transfer_fam_idx;
+
+    res = data->funcs.CreateCommandPool(device, &cpci, data->ac,
+            &frame_data->export_cmd_pool);
+    if (res != VK_SUCCESS) {
+        hlog("CreateCommandPool failed %s", result_to_str(res));
+        frame_data->export_cmd_pool = VK_NULL_HANDLE;
+        return false;
+    }
+
+    VkCommandBufferAllocateInfo cbai;
+    cbai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cbai.pNext = NULL;
+    cbai.commandPool = frame_data->export_cmd_pool;
+    cbai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cbai.commandBufferCount = 1;
+
+    res = data->funcs.AllocateCommandBuffers(device, &cbai,
+            &frame_data->export_cmd_buffer);
+    if (res != VK_SUCCESS) {
+        hlog("AllocateCommandBuffers failed %s", result_to_str(res));
+        data->funcs.DestroyCommandPool(device, frame_data->export_cmd_pool, data->ac);
+        frame_data->export_cmd_pool = VK_NULL_HANDLE;
+        return false;
+    }
+    GET_LDT(frame_data->export_cmd_buffer) = GET_LDT(device);
+    return true;
+}
+
+static void vk_shtex_record_ownership(struct vk_device_funcs *funcs,
+        VkCommandBuffer cmd_buffer, const VkImageMemoryBarrier *mb,
+        VkPipelineStageFlags src_stage, VkPipelineStageFlags dst_stage)
+{
+    VkCommandBufferBeginInfo begin_info;
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.pNext = NULL;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    begin_info.pInheritanceInfo = NULL;
+
+    funcs->BeginCommandBuffer(cmd_buffer, &begin_info);
+    funcs->CmdPipelineBarrier(cmd_buffer, src_stage, dst_stage, 0, 0, NULL,
+            0, NULL, 1, mb);
+    funcs->EndCommandBuffer(cmd_buffer);
+}
+
+/* Plain copies of exclusive swapchain images go to the transfer queue,
+ * blits and the NV12/P010 conversion need the graphics queue. So does the
+ * stage copy of staged slots, their export copy goes to the transfer queue
+ * on its own, see vk_shtex_capture. */
+static VkQueue vk_shtex_copy_queue(struct vk_data *data,
+        struct vk_swap_data *swap, VkQueue present_queue,
+        const VkPresentInfoKHR *info)
+{
+    if (data->transfer_queue && swap->exclusive_sharing && !swap->params.stage &&
+            !vk_shtex_needs_blit(swap) && !swap->yuv_format &&
+            info->waitSemaphoreCount <= MAX_PRESENT_SWAP_SEMAPHORE_COUNT &&
+            get_queue_data(data, present_queue)) {
+        return data->transfer_queue;
+    }
+    return data->graphics_queue ? data->graphics_queue : present_queue;
+}
+
+/* Copies what the export copy reads into the slot's stage image, which is
+ * left in the transfer source layout for it */
+static void vk_shtex_record_stage(struct vk_device_funcs *funcs,
+        struct vk_swap_data *swap, struct vk_export_slot *slot,
+        VkCommandBuffer cmd_buffer, VkImage cur_backbuffer,
+        const struct capture_rect *region)
+{
+    VkImageMemoryBarrier mb[2];
+    VkImageMemoryBarrier *src_mb = &mb[0];
+    VkImageMemoryBarrier *dst_mb = &mb[1];
+
+    src_mb->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    src_mb->pNext = NULL;
+    src_mb->srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    src_mb->dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    src_mb->oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    src_mb->newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    src_mb->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    src_mb->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    src_mb->image = cur_backbuffer;
+    src_mb->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    src_mb->subresourceRange.baseMipLevel = 0;
+    src_mb->subresourceRange.levelCount = 1;
+    src_mb->subresourceRange.baseArrayLayer = 0;
+    src_mb->subresourceRange.layerCount = 1;
+
+    *dst_mb = *src_mb;
+    dst_mb->srcAccessMask = 0;
+    dst_mb->dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    dst_mb->oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    dst_mb->newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    dst_mb->image = slot->stage_image;
+
+    funcs->CmdPipelineBarrier(cmd_buffer,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0,
+            NULL, 2, mb);
 
-        VkCommandPoolCreateInfo cpci;
-        cpci.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-        cpci.pNext = NULL;
-        cpci.flags = 0;
-        cpci.queueFamilyIndex = queue_data->fam_idx;
+    /* blits read the whole crop, copies only the damage */
+    const bool blit = vk_shtex_needs_blit(swap);
+    VkImageCopy cpy;
+    cpy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    cpy.srcSubresource.mipLevel = 0;
+    cpy.srcSubresource.baseArrayLayer = 0;
+    cpy.srcSubresource.layerCount = 1;
+    cpy.srcOffset.x = swap->crop.x + (blit ? 0 : region->x);
+    cpy.srcOffset.y = swap->crop.y + (blit ? 0 : region->y);
+    cpy.srcOffset.z = 0;
+    cpy.dstSubresource = cpy.srcSubresource;
+    cpy.dstOffset = cpy.srcOffset;
+    cpy.extent.width = blit ? (uint32_t)swap->crop.width : region->width;
+    cpy.extent.height = blit ? (uint32_t)swap->crop.height : region->height;
+    cpy.extent.depth = 1;
+    funcs->CmdCopyImage(cmd_buffer, cur_backbuffer,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            slot->stage_image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cpy);
 
-        VkResult res = data->funcs.CreateCommandPool(
-                device, &cpci, data->ac, &frame_data->cmd_pool);
-#ifdef DEBUG_EXTRA
-        hlog("CreateCommandPool %s", result_to_str(res));
-#endif
+    src_mb->srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    src_mb->dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    src_mb->oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    src_mb->newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
-        VkCommandBufferAllocateInfo cbai;
-        cbai.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-        cbai.pNext = NULL;
-        cbai.commandPool = frame_data->cmd_pool;
-        cbai.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-        cbai.commandBufferCount = 1;
+    dst_mb->srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    dst_mb->dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    dst_mb->oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    dst_mb->newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
 
-        res = data->funcs.AllocateCommandBuffers(
-                device, &cbai, &frame_data->cmd_buffer);
-#ifdef DEBUG_EXTRA
-        hlog("AllocateCommandBuffers %s", result_to_str(res));
-#endif
-        GET_LDT(frame_data->cmd_buffer) = GET_LDT(device);
+    funcs->CmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT |
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0, 0, NULL, 0, NULL, 2, mb);
+}
 
-        VkFenceCreateInfo fci = {};
-        fci.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-        fci.pNext = NULL;
-        fci.flags = 0;
-        res = data->funcs.CreateFence(device, &fci, data->ac,
-               &frame_data->fence);
-#ifdef DEBUG_EXTRA
-        hlog("CreateFence %s", result_to_str(res));
-#endif
+/* src_layout is what cur_backbuffer is in and returns to, the present
+ * layout for swapchain images */
+static void vk_shtex_record_copy(struct vk_device_funcs *funcs,
+        struct vk_swap_data *swap, struct vk_export_slot *slot,
+        struct vk_frame_data *frame_data, VkCommandBuffer cmd_buffer,
+        VkImage cur_backbuffer, VkImageLayout src_layout, uint32_t fam_idx,
+        uint32_t present_fam_idx, bool ownership, const struct capture_rect *region)
+{
+    VkImageMemoryBarrier mb[2];
+    VkImageMemoryBarrier *src_mb = &mb[0];
+    VkImageMemoryBarrier *dst_mb = &mb[1];
 
-        VkSemaphoreCreateInfo sci = {};
-        sci.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-        sci.pNext = NULL;
-        sci.flags = 0;
-        res = data->funcs.CreateSemaphore(device, &sci, data->ac, &frame_data->semaphore);
+    /* ------------------------------------------------------ */
+    /* transition cur_backbuffer to transfer source state     */
 
-#ifdef DEBUG_EXTRA
-        hlog("CreateSemaphore %s", result_to_str(res));
-#endif
+    src_mb->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    src_mb->pNext = NULL;
+    src_mb->srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    src_mb->dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    src_mb->oldLayout = src_layout;
+    src_mb->newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    src_mb->srcQueueFamilyIndex = ownership ? present_fam_idx : VK_QUEUE_FAMILY_IGNORED;
+    src_mb->dstQueueFamilyIndex = ownership ? fam_idx : VK_QUEUE_FAMILY_IGNORED;
+    src_mb->image = cur_backbuffer;
+    src_mb->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    src_mb->subresourceRange.baseMipLevel = 0;
+    src_mb->subresourceRange.levelCount = 1;
+    src_mb->subresourceRange.baseArrayLayer = 0;
+    src_mb->subresourceRange.layerCount = 1;
+
+    /* ------------------------------------------------------ */
+    /* transition exportedTexture to transfer dest state      */
+
+    dst_mb->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    dst_mb->pNext = NULL;
+    dst_mb->srcAccessMask = 0;
+    dst_mb->dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    dst_mb->oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    dst_mb->newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    dst_mb->srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+    dst_mb->dstQueueFamilyIndex = fam_idx;
+    dst_mb->image = slot->image;
+    dst_mb->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    dst_mb->subresourceRange.baseMipLevel = 0;
+    dst_mb->subresourceRange.levelCount = 1;
+    dst_mb->subresourceRange.baseArrayLayer = 0;
+    dst_mb->subresourceRange.layerCount = 1;
+
+    /* release the swapchain image from the present queue family */
+    if (ownership) {
+        vk_shtex_record_ownership(funcs, frame_data->own_cmd_buffers[0],
+                src_mb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+    }
+
+    funcs->CmdPipelineBarrier(cmd_buffer,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0,
+            NULL, 2, mb);
+
+    /* ------------------------------------------------------ */
+    /* copy cur_backbuffer's content to our interop image     */
+
+    if (vk_shtex_needs_blit(swap)) {
+        VkImageBlit blt;
+        blt.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blt.srcSubresource.mipLevel = 0;
+        blt.srcSubresource.baseArrayLayer = 0;
+        blt.srcSubresource.layerCount = 1;
+        blt.srcOffsets[0].x = swap->crop.x;
+        blt.srcOffsets[0].y = swap->crop.y;
+        blt.srcOffsets[0].z = 0;
+        blt.srcOffsets[1].x = swap->crop.x + swap->crop.width;
+        blt.srcOffsets[1].y = swap->crop.y + swap->crop.height;
+        blt.srcOffsets[1].z = 1;
+        blt.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blt.dstSubresource.mipLevel = 0;
+        blt.dstSubresource.baseArrayLayer = 0;
+        blt.dstSubresource.layerCount = 1;
+        blt.dstOffsets[0].x = 0;
+        blt.dstOffsets[0].y = 0;
+        blt.dstOffsets[0].z = 0;
+        blt.dstOffsets[1].x = swap->export_extent.width;
+        blt.dstOffsets[1].y = swap->export_extent.height;
+        blt.dstOffsets[1].z = 1;
+        funcs->CmdBlitImage(cmd_buffer, cur_backbuffer,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                slot->image,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blt,
+                (int32_t)swap->export_extent.width != swap->crop.width ?
+                VK_FILTER_LINEAR : VK_FILTER_NEAREST);
+    } else {
+        VkImageCopy cpy;
+        cpy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        cpy.srcSubresource.mipLevel = 0;
+        cpy.srcSubresource.baseArrayLayer = 0;
+        cpy.srcSubresource.layerCount = 1;
+        cpy.srcOffset.x = swap->crop.x + region->x;
+        cpy.srcOffset.y = swap->crop.y + region->y;
+        cpy.srcOffset.z = 0;
+        cpy.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        cpy.dstSubresource.mipLevel = 0;
+        cpy.dstSubresource.baseArrayLayer = 0;
+        cpy.dstSubresource.layerCount = 1;
+        cpy.dstOffset.x = region->x;
+        cpy.dstOffset.y = region->y;
+        cpy.dstOffset.z = 0;
+        cpy.extent.width = region->width;
+        cpy.extent.height = region->height;
+        cpy.extent.depth = 1;
+        funcs->CmdCopyImage(cmd_buffer, cur_backbuffer,
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                slot->image,
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cpy);
+    }
+
+    /* ------------------------------------------------------ */
+    /* Restore the swap chain image layout to what it was
+     * before.  This may not be strictly needed, but it is
+     * generally good to restore things to their original
+     * state.  */
+
+    src_mb->srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    src_mb->dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    src_mb->oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    src_mb->newLayout = src_layout;
+    src_mb->srcQueueFamilyIndex = ownership ? fam_idx : VK_QUEUE_FAMILY_IGNORED;
+    src_mb->dstQueueFamilyIndex = ownership ? present_fam_idx : VK_QUEUE_FAMILY_IGNORED;
+
+    dst_mb->srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    dst_mb->dstAccessMask = 0;
+    dst_mb->oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    dst_mb->newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    dst_mb->srcQueueFamilyIndex = fam_idx;
+    dst_mb->dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+
+    funcs->CmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT |
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0, 0, NULL, 0, NULL, 2, mb);
+
+    /* and acquire it back on the present queue family */
+    if (ownership) {
+        vk_shtex_record_ownership(funcs, frame_data->own_cmd_buffers[1],
+                src_mb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
     }
 }
 
-static void vk_shtex_destroy_fence(struct vk_data *data, bool *cmd_buffer_busy,
-        VkFence *fence)
+/* Copies into a memfd slot, rows are laid out with the slot's stride */
+static void vk_shtex_record_buffer_copy(struct vk_device_funcs *funcs,
+        struct vk_swap_data *swap, struct vk_export_slot *slot,
+        struct vk_frame_data *frame_data, VkCommandBuffer cmd_buffer,
+        VkImage cur_backbuffer, VkImageLayout src_layout, uint32_t fam_idx,
+        uint32_t present_fam_idx, bool ownership, const struct capture_rect *region)
 {
-    VkDevice device = data->device;
+    VkImageMemoryBarrier src_mb;
+    src_mb.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    src_mb.pNext = NULL;
+    src_mb.srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    src_mb.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    src_mb.oldLayout = src_layout;
+    src_mb.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    src_mb.srcQueueFamilyIndex = ownership ? present_fam_idx : VK_QUEUE_FAMILY_IGNORED;
+    src_mb.dstQueueFamilyIndex = ownership ? fam_idx : VK_QUEUE_FAMILY_IGNORED;
+    src_mb.image = cur_backbuffer;
+    src_mb.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    src_mb.subresourceRange.baseMipLevel = 0;
+    src_mb.subresourceRange.levelCount = 1;
+    src_mb.subresourceRange.baseArrayLayer = 0;
+    src_mb.subresourceRange.layerCount = 1;
+
+    if (ownership) {
+        vk_shtex_record_ownership(funcs, frame_data->own_cmd_buffers[0],
+                &src_mb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+    }
 
-    if (*cmd_buffer_busy) {
-        data->funcs.WaitForFences(device, 1, fence, VK_TRUE, ~0ull);
-        *cmd_buffer_busy = false;
+    funcs->CmdPipelineBarrier(cmd_buffer,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0,
+            NULL, 1, &src_mb);
+
+    const uint32_t bpp = vk_format_bpp(swap->export_format);
+    VkBufferImageCopy cpy;
+    cpy.bufferOffset = (VkDeviceSize)region->y * slot->dmabuf_strides[0] +
+        (VkDeviceSize)region->x * bpp;
+    cpy.bufferRowLength = slot->dmabuf_strides[0] / bpp;
+    cpy.bufferImageHeight = 0;
+    cpy.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    cpy.imageSubresource.mipLevel = 0;
+    cpy.imageSubresource.baseArrayLayer = 0;
+    cpy.imageSubresource.layerCount = 1;
+    cpy.imageOffset.x = swap->crop.x + region->x;
+    cpy.imageOffset.y = swap->crop.y + region->y;
+    cpy.imageOffset.z = 0;
+    cpy.imageExtent.width = region->width;
+    cpy.imageExtent.height = region->height;
+    cpy.imageExtent.depth = 1;
+    funcs->CmdCopyImageToBuffer(cmd_buffer, cur_backbuffer,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot->buffer, 1, &cpy);
+
+    src_mb.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    src_mb.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    src_mb.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    src_mb.newLayout = src_layout;
+    src_mb.srcQueueFamilyIndex = ownership ? fam_idx : VK_QUEUE_FAMILY_IGNORED;
+    src_mb.dstQueueFamilyIndex = ownership ? present_fam_idx : VK_QUEUE_FAMILY_IGNORED;
+
+    /* make the copy visible to host reads once the fence has signalled */
+    VkBufferMemoryBarrier host_mb;
+    host_mb.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    host_mb.pNext = NULL;
+    host_mb.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    host_mb.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    host_mb.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    host_mb.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    host_mb.buffer = slot->buffer;
+    host_mb.offset = 0;
+    host_mb.size = VK_WHOLE_SIZE;
+
+    funcs->CmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT |
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT |
+            VK_PIPELINE_STAGE_HOST_BIT,
+            0, 0, NULL, 1, &host_mb, 1, &src_mb);
+
+    if (ownership) {
+        vk_shtex_record_ownership(funcs, frame_data->own_cmd_buffers[1],
+                &src_mb, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
     }
+}
 
-    data->funcs.DestroyFence(device, *fence, data->ac);
-    *fence = VK_NULL_HANDLE;
+/* Converts the swapchain image straight into the export planes, must be
+ * recorded for the graphics queue. */
+static void vk_shtex_record_yuv(struct vk_data *data,
+        struct vk_swap_data *swap, struct vk_export_slot *slot,
+        VkCommandBuffer cmd_buffer, uint32_t image_index, uint32_t fam_idx)
+{
+    struct vk_device_funcs *funcs = &data->funcs;
+
+    VkImageMemoryBarrier mb[3];
+    for (int i = 0; i < 3; ++i) {
+        mb[i].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        mb[i].pNext = NULL;
+        mb[i].subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        mb[i].subresourceRange.baseMipLevel = 0;
+        mb[i].subresourceRange.levelCount = 1;
+        mb[i].subresourceRange.baseArrayLayer = 0;
+        mb[i].subresourceRange.layerCount = 1;
+    }
+
+    mb[0].srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    mb[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    mb[0].oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    mb[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    mb[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    mb[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    mb[0].image = swap->swap_images[image_index];
+
+    for (int i = 1; i < 3; ++i) {
+        mb[i].srcAccessMask = 0;
+        mb[i].dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        mb[i].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        mb[i].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        mb[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+        mb[i].dstQueueFamilyIndex = fam_idx;
+        mb[i].image = i == 1 ? slot->image : slot->uv_image;
+    }
+
+    funcs->CmdPipelineBarrier(cmd_buffer,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, NULL, 0,
+            NULL, 3, mb);
+
+    const float image_width = swap->image_extent.width;
+    const float image_height = swap->image_extent.height;
+    const struct vk_yuv_push_constants pc = {
+        .width = swap->export_extent.width,
+        .height = swap->export_extent.height,
+        .srgb = vk_is_srgb_format(swap->format),
+        .src_offset = { swap->crop.x / image_width, swap->crop.y / image_height },
+        .src_scale = { swap->crop.width / image_width, swap->crop.height / image_height },
+    };
+
+    funcs->CmdBindPipeline(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+            data->yuv_pipelines[vk_yuv_pipeline_index(swap->yuv_format)]);
+    funcs->CmdBindDescriptorSets(cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+            data->yuv_pipeline_layout, 0, 1, &slot->desc_sets[image_index],
+            0, NULL);
+    funcs->CmdPushConstants(cmd_buffer, data->yuv_pipeline_layout,
+            VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pc), &pc);
+
+    /* 8x8 invocations per group, each one writes a 2x2 luma block */
+    funcs->CmdDispatch(cmd_buffer, (pc.width / 2 + 7) / 8,
+            (pc.height / 2 + 7) / 8, 1);
+
+    mb[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    mb[0].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
+    mb[0].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    mb[0].newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    for (int i = 1; i < 3; ++i) {
+        mb[i].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        mb[i].dstAccessMask = 0;
+        mb[i].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        mb[i].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        mb[i].srcQueueFamilyIndex = fam_idx;
+        mb[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+    }
+
+    funcs->CmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT |
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+            0, 0, NULL, 0, NULL, 3, mb);
 }
 
-static void vk_shtex_destroy_frame_objects(struct vk_data *data,
-        struct vk_queue_data *queue_data)
+static void vk_shtex_slot_written(struct vk_swap_data *swap,
+        struct vk_export_slot *slot, struct vk_frame_data *frame_data)
 {
-    VkDevice device = data->device;
+    slot->frame_data = frame_data;
+    slot->seq = ++swap->frame_seq;
+    slot->present_time = capture_clock_ns();
+    capture_rect_union(&slot->unreported, &slot->damage);
+    memset(&slot->damage, 0, sizeof(slot->damage));
+}
 
-    for (uint32_t frame_idx = 0; frame_idx < queue_data->frame_count;
-            frame_idx++) {
-        struct vk_frame_data *frame_data =
-            &queue_data->frames[frame_idx];
-        bool *cmd_buffer_busy = &frame_data->cmd_buffer_busy;
-        VkFence *fence = &frame_data->fence;
-        vk_shtex_destroy_fence(data, cmd_buffer_busy, fence);
+/* Signalled together with the fence, exported as a sync_file once the copy
+ * is submitted. Across GPUs the frame is only reported once the copy has
+ * finished, OBS would otherwise stall its GPU waiting for ours. memfd slots
+ * are only marked valid in their header once the fence has signalled. */
+static inline bool vk_shtex_export_sync(const struct vk_data *data,
+        const struct vk_swap_data *swap, const struct vk_frame_data *frame_data)
+{
+    return data->sync_fd_supported &&
+        frame_data->export_semaphore != VK_NULL_HANDLE &&
+        !swap->params.cross_device && !swap->params.memfd;
+}
 
-        data->funcs.DestroySemaphore(device, frame_data->semaphore,
-                data->ac);
-        data->funcs.DestroyCommandPool(device, frame_data->cmd_pool,
-                data->ac);
-        frame_data->cmd_pool = VK_NULL_HANDLE;
+static void vk_shtex_send_sync(struct vk_data *data, struct vk_swap_data *swap,
+        struct vk_export_slot *slot, struct vk_frame_data *frame_data)
+{
+    /* Exporting a sync_file resets the semaphore, so it can be signalled
+     * again by the next copy that uses this frame. */
+    VkSemaphoreGetFdInfoKHR sgfi;
+    sgfi.sType = VK_STRUCTURE_TYPE_SEMAPHORE_GET_FD_INFO_KHR;
+    sgfi.pNext = NULL;
+    sgfi.semaphore = frame_data->export_semaphore;
+    sgfi.handleType = VK_EXTERNAL_SEMAPHORE_HANDLE_TYPE_SYNC_FD_BIT;
+
+    int sync_fd = -1;
+    VkResult res = data->funcs.GetSemaphoreFdKHR(data->device, &sgfi, &sync_fd);
+    if (res != VK_SUCCESS) {
+        hlog("GetSemaphoreFdKHR failed, falling back to fence polling %s",
+                result_to_str(res));
+        data->sync_fd_supported = false;
+        return;
     }
 
-    vk_free(data->ac, queue_data->frames);
-    queue_data->frames = NULL;
-    queue_data->frame_count = 0;
+    /* OBS waits for the copy on the GPU, no need to wait for the fence */
+    const int index = slot - swap->slots;
+    capture_publish_slot(index, slot->seq);
+    swap->latest_slot = index;
+    swap->latest_seq = slot->seq;
+    capture_send_frame(index, slot->seq, sync_fd, &slot->unreported,
+            slot->present_time, 0);
+    memset(&slot->unreported, 0, sizeof(slot->unreported));
+    close(sync_fd);
 }
 
 static void vk_shtex_capture(struct vk_data *data,
         struct vk_device_funcs *funcs,
         struct vk_swap_data *swap, uint32_t idx,
-        VkQueue queue, VkPresentInfoKHR *info)
+        VkQueue queue, VkQueue present_queue, VkPresentInfoKHR *info)
 {
     VkResult res = VK_SUCCESS;
 
@@ -998,10 +3395,6 @@ static void vk_shtex_capture(struct vk_data *data,
     begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     begin_info.pInheritanceInfo = NULL;
 
-    VkImageMemoryBarrier mb[2];
-    VkImageMemoryBarrier *src_mb = &mb[0];
-    VkImageMemoryBarrier *dst_mb = &mb[1];
-
     /* ------------------------------------------------------ */
     /* do image copy                                          */
 
@@ -1011,156 +3404,142 @@ static void vk_shtex_capture(struct vk_data *data,
     struct vk_queue_data *queue_data = get_queue_data(data, queue);
     uint32_t fam_idx = queue_data->fam_idx;
 
+    uint32_t present_fam_idx = VK_QUEUE_FAMILY_IGNORED;
+    if (queue == data->transfer_queue) {
+        present_fam_idx = get_queue_data(data, present_queue)->fam_idx;
+    }
+    const bool ownership = present_fam_idx != VK_QUEUE_FAMILY_IGNORED &&
+        present_fam_idx != fam_idx;
+
     const uint32_t image_count = swap->image_count;
     if (queue_data->frame_count < image_count) {
-        if (queue_data->frame_count > 0)
+        if (queue_data->frame_count > 0) {
+            /* slots may still point at the frames we are about to free */
+            vk_shtex_wait_until_pool_idle(data, queue_data);
+            vk_shtex_update_slots(data, swap);
+            vk_shtex_collect_retired(data, false);
             vk_shtex_destroy_frame_objects(data, queue_data);
+        }
         vk_shtex_create_frame_objects(data, queue_data, image_count);
     }
 
-    const uint32_t frame_index = queue_data->frame_index;
-    struct vk_frame_data *frame_data = &queue_data->frames[frame_index];
-    queue_data->frame_index = (frame_index + 1) % queue_data->frame_count;
-    vk_shtex_clear_fence(data, frame_data);
-
-    VkDevice device = data->device;
-
-    res = funcs->ResetCommandPool(device, frame_data->cmd_pool, 0);
+    vk_shtex_update_slots(data, swap);
 
+    struct vk_export_slot *slot = vk_shtex_next_slot(swap);
+    if (!slot) {
 #ifdef DEBUG_EXTRA
-    hlog("ResetCommandPool %s", result_to_str(res));
+        hlog("All export slots busy, skipping frame");
 #endif
+        return;
+    }
 
-    const VkCommandBuffer cmd_buffer = frame_data->cmd_buffer;
-    res = funcs->BeginCommandBuffer(cmd_buffer, &begin_info);
-
-#ifdef DEBUG_EXTRA
-    hlog("BeginCommandBuffer %s", result_to_str(res));
-#endif
+    /* nothing changed since this slot was written, it already holds the
+     * current frame and so does every newer slot */
+    if (capture_rect_empty(&slot->damage)) {
+        return;
+    }
 
-    /* ------------------------------------------------------ */
-    /* transition cur_backbuffer to transfer source state     */
+    if (!vk_shtex_claim_slot(swap, slot)) {
+        return;
+    }
 
-    src_mb->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    src_mb->pNext = NULL;
-    src_mb->srcAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-    src_mb->dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    src_mb->oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-    src_mb->newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    src_mb->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    src_mb->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    src_mb->image = cur_backbuffer;
-    src_mb->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    src_mb->subresourceRange.baseMipLevel = 0;
-    src_mb->subresourceRange.levelCount = 1;
-    src_mb->subresourceRange.baseArrayLayer = 0;
-    src_mb->subresourceRange.layerCount = 1;
+    const uint32_t frame_index = queue_data->frame_index;
+    struct vk_frame_data *frame_data = &queue_data->frames[frame_index];
+    queue_data->frame_index = (frame_index + 1) % queue_data->frame_count;
+    vk_shtex_clear_fence(data, frame_data);
 
-    /* ------------------------------------------------------ */
-    /* transition exportedTexture to transfer dest state      */
+    /* the frame we just waited for may have finished a slot */
+    vk_shtex_update_slots(data, swap);
 
-    dst_mb->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    dst_mb->pNext = NULL;
-    dst_mb->srcAccessMask = 0;
-    dst_mb->dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    dst_mb->oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-    dst_mb->newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    dst_mb->srcQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
-    dst_mb->dstQueueFamilyIndex = fam_idx;
-    dst_mb->image = swap->export_image;
-    dst_mb->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    dst_mb->subresourceRange.baseMipLevel = 0;
-    dst_mb->subresourceRange.levelCount = 1;
-    dst_mb->subresourceRange.baseArrayLayer = 0;
-    dst_mb->subresourceRange.layerCount = 1;
+    if (ownership && !vk_shtex_init_ownership(data, frame_data, present_fam_idx)) {
+        hlog("Disabling transfer queue");
+        data->transfer_queue = VK_NULL_HANDLE;
+        return;
+    }
 
-    funcs->CmdPipelineBarrier(cmd_buffer,
-            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0,
-            NULL, 2, mb);
+    VkDevice device = data->device;
 
-    /* ------------------------------------------------------ */
-    /* copy cur_backbuffer's content to our interop image     */
+    res = funcs->ResetCommandPool(device, frame_data->cmd_pool, 0);
 
-    if (swap->format != swap->export_format) {
-        VkImageBlit blt;
-        blt.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        blt.srcSubresource.mipLevel = 0;
-        blt.srcSubresource.baseArrayLayer = 0;
-        blt.srcSubresource.layerCount = 1;
-        blt.srcOffsets[0].x = 0;
-        blt.srcOffsets[0].y = 0;
-        blt.srcOffsets[0].z = 0;
-        blt.srcOffsets[1].x = swap->image_extent.width;
-        blt.srcOffsets[1].y = swap->image_extent.height;
-        blt.srcOffsets[1].z = 1;
-        blt.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        blt.dstSubresource.mipLevel = 0;
-        blt.dstSubresource.baseArrayLayer = 0;
-        blt.dstSubresource.layerCount = 1;
-        blt.dstOffsets[0].x = 0;
-        blt.dstOffsets[0].y = 0;
-        blt.dstOffsets[0].z = 0;
-        blt.dstOffsets[1].x = swap->image_extent.width;
-        blt.dstOffsets[1].y = swap->image_extent.height;
-        blt.dstOffsets[1].z = 1;
-        funcs->CmdBlitImage(cmd_buffer, cur_backbuffer,
-                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                swap->export_image,
-                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blt,
-                VK_FILTER_NEAREST);
-    } else {
-        VkImageCopy cpy;
-        cpy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        cpy.srcSubresource.mipLevel = 0;
-        cpy.srcSubresource.baseArrayLayer = 0;
-        cpy.srcSubresource.layerCount = 1;
-        cpy.srcOffset.x = 0;
-        cpy.srcOffset.y = 0;
-        cpy.srcOffset.z = 0;
-        cpy.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        cpy.dstSubresource.mipLevel = 0;
-        cpy.dstSubresource.baseArrayLayer = 0;
-        cpy.dstSubresource.layerCount = 1;
-        cpy.dstOffset.x = 0;
-        cpy.dstOffset.y = 0;
-        cpy.dstOffset.z = 0;
-        cpy.extent.width = swap->image_extent.width;
-        cpy.extent.height = swap->image_extent.height;
-        cpy.extent.depth = 1;
-        funcs->CmdCopyImage(cmd_buffer, cur_backbuffer,
-                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-                swap->export_image,
-                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cpy);
+#ifdef DEBUG_EXTRA
+    hlog("ResetCommandPool %s", result_to_str(res));
+#endif
+
+    /* staged slots take a quick copy the present waits for, the export
+     * copy reads it afterwards. That goes to the transfer queue if it can,
+     * so neither this present nor the next copy waits for it. */
+    const bool staged = slot->stage_image != VK_NULL_HANDLE;
+    struct vk_queue_data *export_queue_data = staged && data->transfer_queue &&
+        !vk_shtex_needs_blit(swap) ? get_queue_data(data, data->transfer_queue) : NULL;
+    if (export_queue_data &&
+            !vk_shtex_init_export_queue(data, frame_data, export_queue_data->fam_idx)) {
+        hlog("Disabling transfer queue");
+        data->transfer_queue = VK_NULL_HANDLE;
+        export_queue_data = NULL;
     }
+    const bool export_transfer = export_queue_data != NULL;
+    const uint32_t export_fam_idx = export_transfer ? export_queue_data->fam_idx : fam_idx;
+    const VkCommandBuffer stage_cmd_buffer = frame_data->stage_cmd_buffer;
+    const VkCommandBuffer cmd_buffer = export_transfer ?
+        frame_data->export_cmd_buffer : frame_data->cmd_buffer;
+    const VkCommandBuffer first_cmd_buffer = staged ? stage_cmd_buffer : cmd_buffer;
+    /* not every transfer queue has timestamps, the copy time is then only
+     * the stage copy */
+    const VkCommandBuffer last_cmd_buffer = export_transfer &&
+        !export_queue_data->timestamp_bits ? stage_cmd_buffer : cmd_buffer;
+    res = funcs->BeginCommandBuffer(first_cmd_buffer, &begin_info);
 
-    /* ------------------------------------------------------ */
-    /* Restore the swap chain image layout to what it was
-     * before.  This may not be strictly needed, but it is
-     * generally good to restore things to their original
-     * state.  */
+#ifdef DEBUG_EXTRA
+    hlog("BeginCommandBuffer %s", result_to_str(res));
+#endif
 
-    src_mb->srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-    src_mb->dstAccessMask = VK_ACCESS_MEMORY_READ_BIT;
-    src_mb->oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    src_mb->newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    if (frame_data->query_pool) {
+        funcs->CmdResetQueryPool(first_cmd_buffer, frame_data->query_pool, 0, 2);
+        funcs->CmdWriteTimestamp(first_cmd_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                frame_data->query_pool, 0);
+    }
 
-    dst_mb->srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    dst_mb->dstAccessMask = 0;
-    dst_mb->oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    dst_mb->newLayout = VK_IMAGE_LAYOUT_GENERAL;
-    dst_mb->srcQueueFamilyIndex = fam_idx;
-    dst_mb->dstQueueFamilyIndex = VK_QUEUE_FAMILY_EXTERNAL;
+    VkImage src_image = cur_backbuffer;
+    VkImageLayout src_layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    if (staged) {
+        vk_shtex_record_stage(funcs, swap, slot, stage_cmd_buffer,
+                cur_backbuffer, &slot->damage);
+        if (frame_data->query_pool && last_cmd_buffer == stage_cmd_buffer) {
+            funcs->CmdWriteTimestamp(stage_cmd_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                    frame_data->query_pool, 1);
+            frame_data->timestamps_written = true;
+        }
+        funcs->EndCommandBuffer(stage_cmd_buffer);
+        funcs->BeginCommandBuffer(cmd_buffer, &begin_info);
+        src_image = slot->stage_image;
+        src_layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    }
 
-    funcs->CmdPipelineBarrier(cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
-            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT |
-            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
-            0, 0, NULL, 0, NULL, 2, mb);
+    if (swap->yuv_format) {
+        vk_shtex_record_yuv(data, swap, slot, cmd_buffer, image_index, fam_idx);
+    } else if (slot->buffer) {
+        vk_shtex_record_buffer_copy(funcs, swap, slot, frame_data, cmd_buffer,
+                src_image, src_layout, export_fam_idx, present_fam_idx, ownership,
+                &slot->damage);
+    } else {
+        vk_shtex_record_copy(funcs, swap, slot, frame_data, cmd_buffer,
+                src_image, src_layout, export_fam_idx, present_fam_idx, ownership,
+                &slot->damage);
+    }
+
+    if (frame_data->query_pool && last_cmd_buffer == cmd_buffer) {
+        funcs->CmdWriteTimestamp(cmd_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                frame_data->query_pool, 1);
+        frame_data->timestamps_written = true;
+    }
 
     funcs->EndCommandBuffer(cmd_buffer);
 
     /* ------------------------------------------------------ */
 
+    VkSemaphore signal_semaphores[2];
+    uint32_t signal_semaphore_count = 0;
+
     VkSubmitInfo submit_info;
     submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submit_info.pNext = NULL;
@@ -1172,26 +3551,136 @@ static void vk_shtex_capture(struct vk_data *data,
     submit_info.signalSemaphoreCount = 0;
     submit_info.pSignalSemaphores = NULL;
 
-    if (info->waitSemaphoreCount <= MAX_PRESENT_SWAP_SEMAPHORE_COUNT) {
-        submit_info.waitSemaphoreCount = info->waitSemaphoreCount;
-        submit_info.pWaitSemaphores = info->pWaitSemaphores;
+    VkSubmitInfo stage_info = submit_info;
+    stage_info.pCommandBuffers = &stage_cmd_buffer;
+    const VkSemaphore stage_signal_semaphores[2] = {
+        frame_data->semaphore,
+        frame_data->stage_semaphore,
+    };
+
+    const VkFence fence = frame_data->fence;
+
+    if (ownership) {
+        /* present queue: wait for the game, release the image */
+        VkSubmitInfo release_info = submit_info;
+        release_info.waitSemaphoreCount = info->waitSemaphoreCount;
+        release_info.pWaitSemaphores = info->pWaitSemaphores;
+        release_info.pWaitDstStageMask = semaphore_dst_stage_masks;
+        release_info.pCommandBuffers = &frame_data->own_cmd_buffers[0];
+        release_info.signalSemaphoreCount = 1;
+        release_info.pSignalSemaphores = &frame_data->own_semaphores[0];
+
+        res = funcs->QueueSubmit(present_queue, 1, &release_info, VK_NULL_HANDLE);
+        if (res != VK_SUCCESS) {
+            hlog("QueueSubmit release failed %s", result_to_str(res));
+            return;
+        }
+
+        /* transfer queue: copy, then hand the image back */
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores = &frame_data->own_semaphores[0];
         submit_info.pWaitDstStageMask = semaphore_dst_stage_masks;
-        submit_info.signalSemaphoreCount = 1;
-        submit_info.pSignalSemaphores = &frame_data->semaphore;
+        signal_semaphores[signal_semaphore_count++] = frame_data->own_semaphores[1];
+    } else if (info->waitSemaphoreCount <= MAX_PRESENT_SWAP_SEMAPHORE_COUNT) {
+        VkSubmitInfo *gate_info = staged ? &stage_info : &submit_info;
+        gate_info->waitSemaphoreCount = info->waitSemaphoreCount;
+        gate_info->pWaitSemaphores = info->pWaitSemaphores;
+        gate_info->pWaitDstStageMask = swap->yuv_format ?
+            semaphore_compute_stage_masks : semaphore_dst_stage_masks;
+        if (staged) {
+            stage_info.signalSemaphoreCount = export_transfer ? 2 : 1;
+            stage_info.pSignalSemaphores = stage_signal_semaphores;
+        } else {
+            signal_semaphores[signal_semaphore_count++] = frame_data->semaphore;
+        }
 
         info->waitSemaphoreCount = 1;
         info->pWaitSemaphores = &frame_data->semaphore;
     }
 
-    const VkFence fence = frame_data->fence;
-    res = funcs->QueueSubmit(queue, 1, &submit_info, fence);
+    const bool export_sync = vk_shtex_export_sync(data, swap, frame_data);
+    if (export_sync) {
+        signal_semaphores[signal_semaphore_count++] = frame_data->export_semaphore;
+    }
+
+    if (signal_semaphore_count) {
+        submit_info.signalSemaphoreCount = signal_semaphore_count;
+        submit_info.pSignalSemaphores = signal_semaphores;
+    }
+
+    if (export_transfer && stage_info.signalSemaphoreCount) {
+        res = funcs->QueueSubmit(queue, 1, &stage_info, VK_NULL_HANDLE);
+        if (res != VK_SUCCESS) {
+            hlog("QueueSubmit stage failed %s", result_to_str(res));
+            return;
+        }
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores = &frame_data->stage_semaphore;
+        submit_info.pWaitDstStageMask = semaphore_dst_stage_masks;
+        res = funcs->QueueSubmit(data->transfer_queue, 1, &submit_info, fence);
+        if (res != VK_SUCCESS) {
+            /* the fence still has to cover the stage copy, and the
+             * semaphore must not stay signalled */
+            VkSubmitInfo consume_info = submit_info;
+            consume_info.commandBufferCount = 0;
+            consume_info.signalSemaphoreCount = 0;
+            if (funcs->QueueSubmit(queue, 1, &consume_info, fence) == VK_SUCCESS) {
+                frame_data->cmd_buffer_busy = true;
+            }
+        }
+    } else if (staged) {
+        /* same queue, the export copy runs after the stage copy without
+         * holding up the present, but the next copy waits for it */
+        const VkSubmitInfo submits[2] = {stage_info, submit_info};
+        res = funcs->QueueSubmit(queue, 2, submits, fence);
+    } else {
+        res = funcs->QueueSubmit(queue, 1, &submit_info,
+                ownership ? VK_NULL_HANDLE : fence);
+    }
 
 #ifdef DEBUG_EXTRA
     hlog("QueueSubmit %s", result_to_str(res));
 #endif
 
-    if (res == VK_SUCCESS)
+    if (ownership) {
+        /* present queue: acquire the image, the fence covers all three
+         * submissions. If the copy failed only the release semaphore has
+         * to be consumed. */
+        const bool copied = res == VK_SUCCESS;
+        VkSubmitInfo acquire_info;
+        acquire_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        acquire_info.pNext = NULL;
+        acquire_info.waitSemaphoreCount = 1;
+        acquire_info.pWaitSemaphores = &frame_data->own_semaphores[copied ? 1 : 0];
+        acquire_info.pWaitDstStageMask = semaphore_dst_stage_masks;
+        acquire_info.commandBufferCount = copied ? 1 : 0;
+        acquire_info.pCommandBuffers = &frame_data->own_cmd_buffers[1];
+        acquire_info.signalSemaphoreCount = 1;
+        acquire_info.pSignalSemaphores = &frame_data->semaphore;
+
+        VkResult acquire_res = funcs->QueueSubmit(present_queue, 1, &acquire_info, fence);
+        if (acquire_res != VK_SUCCESS) {
+            hlog("QueueSubmit acquire failed %s", result_to_str(acquire_res));
+            info->waitSemaphoreCount = 1;
+            info->pWaitSemaphores = acquire_info.pWaitSemaphores;
+            return;
+        }
+
         frame_data->cmd_buffer_busy = true;
+        info->waitSemaphoreCount = 1;
+        info->pWaitSemaphores = &frame_data->semaphore;
+    }
+
+    if (res != VK_SUCCESS) {
+        return;
+    }
+
+    frame_data->cmd_buffer_busy = true;
+    vk_shtex_slot_written(swap, slot, frame_data);
+
+    if (export_sync) {
+        vk_shtex_send_sync(data, swap, slot, frame_data);
+    }
 }
 
 static inline bool valid_rect(struct vk_swap_data *swap)
@@ -1200,34 +3689,152 @@ static inline bool valid_rect(struct vk_swap_data *swap)
         (swap->image_extent.width > 1 || swap->image_extent.height > 1);
 }
 
-static void vk_capture(struct vk_data *data, VkQueue queue,
+/* how often the target is picked again, and after how long without a
+ * present a swapchain stops being a candidate */
+#define SWAP_SELECT_NS 250000000
+#define SWAP_IDLE_NS 1000000000
+#define MAX_PRESENT_SWAPCHAIN_COUNT 16
+
+static inline bool vk_swap_candidate(struct vk_swap_data *swap, int64_t now)
+{
+    return valid_rect(swap) && now - swap->last_present < SWAP_IDLE_NS;
+}
+
+static bool vk_swap_preferred(const struct vk_swap_data *swap,
+        const struct vk_swap_data *other, int policy, uint32_t winid)
+{
+    if (winid && (swap->winid == winid) != (other->winid == winid)) {
+        return swap->winid == winid;
+    }
+    if (policy == CAPTURE_SWAPCHAIN_RECENT) {
+        return swap->serial > other->serial;
+    }
+    return (uint64_t)swap->image_extent.width * swap->image_extent.height >
+        (uint64_t)other->image_extent.width * other->image_extent.height;
+}
+
+/* Picks the swapchain to capture among all recently presented ones, not
+ * just those in this present, so apps alternating between windows keep
+ * capturing the same one. The current one is kept unless another is
+ * strictly preferred. Returns it if it is presented now, with its index
+ * in info->pSwapchains. */
+static struct vk_swap_data *vk_shtex_select_swap(struct vk_data *data,
+        const VkPresentInfoKHR *info, uint32_t *idx)
+{
+    const int64_t now = os_time_get_nano();
+
+    struct vk_swap_data *presented[MAX_PRESENT_SWAPCHAIN_COUNT];
+    const uint32_t count = info->swapchainCount < MAX_PRESENT_SWAPCHAIN_COUNT ?
+        info->swapchainCount : MAX_PRESENT_SWAPCHAIN_COUNT;
+    for (uint32_t i = 0; i < count; ++i) {
+        presented[i] = get_swap_data(data, info->pSwapchains[i]);
+        if (presented[i]) {
+            presented[i]->last_present = now;
+        }
+    }
+
+    if (count == 1 && !data->target_swap) {
+        data->target_swap = presented[0];
+        data->select_time = now;
+    } else if (now - data->select_time >= SWAP_SELECT_NS) {
+        int policy = capture_get_swapchain_policy();
+        if (!policy) {
+            policy = vkcapture_swapchain_policy;
+        }
+        const uint32_t winid = capture_get_winid();
+
+        struct vk_swap_data *target = data->cur_swap &&
+            vk_swap_candidate(data->cur_swap, now) ? data->cur_swap : NULL;
+        struct vk_swap_data *swap = swap_walk_begin(data);
+        while (swap) {
+            if (vk_swap_candidate(swap, now) &&
+                    (!target || vk_swap_preferred(swap, target, policy, winid))) {
+                target = swap;
+            }
+            swap = swap_walk_next(data, swap);
+        }
+        swap_walk_end(data);
+
+        if (target != data->target_swap && target) {
+            hlog("Capturing swapchain %ux%u winid 0x%" PRIx64,
+                    target->image_extent.width, target->image_extent.height,
+                    target->winid);
+        }
+        data->target_swap = target;
+        data->select_time = now;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (presented[i] && presented[i] == data->target_swap) {
+            *idx = i;
+            return presented[i];
+        }
+    }
+    return NULL;
+}
+
+/* Returns true if a copy was submitted */
+static bool vk_capture(struct vk_data *data, VkQueue queue,
         VkPresentInfoKHR *info)
 {
-    // Use first swapchain ??
-    struct vk_swap_data *swap = get_swap_data(data, info->pSwapchains[0]);
+    uint32_t idx = 0;
+    struct vk_swap_data *swap = vk_shtex_select_swap(data, info, &idx);
 
     capture_update_socket();
 
+    if (data->retired || data->init_abandoned) {
+        vk_shtex_collect_retired(data, false);
+    }
+
     if (capture_should_stop()) {
         vk_shtex_free(data);
     }
 
-    if (capture_should_init()) {
-        if (valid_rect(swap) && !vk_shtex_init(data, swap)) {
-            vk_shtex_free(data);
-            data->valid = false;
-            hlog("vk_shtex_init failed");
+    if (data->init_running) {
+        /* abandoned ones are collected with the retired slots */
+        if (!data->init_abandoned &&
+                __atomic_load_n(&data->init_done, __ATOMIC_ACQUIRE)) {
+            struct vk_swap_data *init_swap = data->init_swap;
+            const bool ok = vk_shtex_wait_init(data);
+            if (ok && (capture_should_init() || capture_ready())) {
+                vk_shtex_start(data, init_swap);
+                capture_stats_init(data->init_time);
+            } else {
+                vk_shtex_free(data);
+                if (!ok) {
+                    data->valid = false;
+                    hlog("vk_shtex_init failed");
+                }
+            }
+        }
+    } else if (swap && swap != data->cur_swap && valid_rect(swap)) {
+        if (capture_ready() && swap->slot_count) {
+            /* switching back, its export images are still there */
+            vk_shtex_start(data, swap);
+        } else if (capture_should_init() || capture_ready()) {
+            /* the current swapchain keeps being captured until this is done */
+            vk_shtex_choose_export(data, swap);
+            vk_shtex_start_init(data, swap, get_queue_data(data,
+                        vk_shtex_copy_queue(data, swap, queue, info)));
         }
     }
 
-    if (capture_ready()) {
-        if (swap != data->cur_swap) {
-            vk_shtex_free(data);
-            return;
+    if (capture_ready() && swap && swap == data->cur_swap) {
+        vk_shtex_add_damage(swap, info, idx);
+
+        if (capture_should_skip_frame()) {
+            /* still report copies that finished since the last present */
+            vk_shtex_update_slots(data, swap);
+            return false;
         }
 
-        vk_shtex_capture(data, &data->funcs, swap, 0, queue, info);
+        const uint64_t frame_seq = swap->frame_seq;
+        vk_shtex_capture(data, &data->funcs, swap, idx,
+                vk_shtex_copy_queue(data, swap, queue, info), queue, info);
+        return swap->frame_seq != frame_seq;
     }
+
+    return false;
 }
 
 static VkResult VKAPI_CALL OBS_QueuePresentKHR(VkQueue queue,
@@ -1238,8 +3845,16 @@ static VkResult VKAPI_CALL OBS_QueuePresentKHR(VkQueue queue,
     struct vk_data *const data = get_device_data_by_queue(queue);
     struct vk_device_funcs *const funcs = &data->funcs;
 
-    if (data->valid) {
-        vk_capture(data, data->graphics_queue ? data->graphics_queue : queue, &api);
+    /* nothing to tear down either, the last capture is fully freed */
+    const bool dormant = !data->cur_swap && !data->init_running &&
+        !data->retired && capture_dormant();
+
+    if (data->valid && !dormant) {
+        const int64_t start = os_time_get_nano();
+        const bool copied = vk_capture(data, queue, &api);
+        if (capture_ready()) {
+            capture_stats_present(os_time_get_nano() - start, copied);
+        }
     }
 
     return funcs->QueuePresentKHR(queue, &api);
@@ -1365,6 +3980,7 @@ static VkResult VKAPI_CALL OBS_CreateInstance(const VkInstanceCreateInfo *info,
     GETADDR_IF_SUPPORTED(CreateWaylandSurfaceKHR);
 #endif
     GETADDR_IF_SUPPORTED(DestroySurfaceKHR);
+    GETADDR_IF_SUPPORTED(GetPhysicalDeviceSurfaceCapabilitiesKHR);
 #undef GETADDR
 
     valid = valid && funcs_found;
@@ -1386,17 +4002,88 @@ static void VKAPI_CALL OBS_DestroyInstance(VkInstance instance,
     struct vk_inst_funcs *ifuncs = get_inst_funcs(instance);
     PFN_vkDestroyInstance destroy_instance = ifuncs->DestroyInstance;
 
+    struct vk_inst_data *idata = get_inst_data(instance);
+    if (idata->valid)
+        free_obj_list(&idata->surfaces);
+
     remove_free_inst_data(instance, ac);
 
     destroy_instance(instance, ac);
 }
 
+static bool vk_device_extension_supported(struct vk_inst_funcs *ifuncs,
+        VkPhysicalDevice phy_device, const char *name)
+{
+    uint32_t count = 0;
+    if (!ifuncs->EnumerateDeviceExtensionProperties ||
+            ifuncs->EnumerateDeviceExtensionProperties(phy_device, NULL,
+                &count, NULL) != VK_SUCCESS) {
+        return false;
+    }
+
+    VkExtensionProperties *extensions =
+        malloc(sizeof(VkExtensionProperties) * count);
+    bool found = false;
+    if (ifuncs->EnumerateDeviceExtensionProperties(phy_device, NULL, &count,
+                extensions) == VK_SUCCESS) {
+        for (uint32_t i = 0; i < count && !found; i++) {
+            found = !strcmp(name, extensions[i].extensionName);
+        }
+    }
+    free(extensions);
+    return found;
+}
+
 static inline bool is_device_link_info(VkLayerDeviceCreateInfo *lici)
 {
     return lici->sType == VK_STRUCTURE_TYPE_LOADER_DEVICE_CREATE_INFO &&
         lici->function == VK_LAYER_LINK_INFO;
 }
 
+/* Picks a queue family without graphics that has a queue left over after the
+ * application's requests, dedicated transfer families are preferred over
+ * async compute ones. */
+static uint32_t vk_find_transfer_family(const VkQueueFamilyProperties *props,
+        uint32_t count, const VkDeviceCreateInfo *info, uint32_t *queue_index)
+{
+    uint32_t best = VK_QUEUE_FAMILY_IGNORED;
+    int best_score = 0;
+
+    for (uint32_t fam = 0; fam < count; ++fam) {
+        const VkQueueFlags flags = props[fam].queueFlags;
+        if ((flags & VK_QUEUE_GRAPHICS_BIT) ||
+                !(flags & (VK_QUEUE_TRANSFER_BIT | VK_QUEUE_COMPUTE_BIT))) {
+            continue;
+        }
+
+        uint32_t requested = 0;
+        bool usable = true;
+        for (uint32_t q = 0; q < info->queueCreateInfoCount; ++q) {
+            const VkDeviceQueueCreateInfo *qi = &info->pQueueCreateInfos[q];
+            if (qi->queueFamilyIndex != fam) {
+                continue;
+            }
+            /* protected or otherwise special queues, leave them alone */
+            if (qi->flags || qi->pNext) {
+                usable = false;
+            }
+            requested += qi->queueCount;
+        }
+        if (!usable || requested >= props[fam].queueCount) {
+            continue;
+        }
+
+        const int score = (flags & VK_QUEUE_COMPUTE_BIT) ? 1 : 2;
+        if (score > best_score) {
+            best = fam;
+            best_score = score;
+            *queue_index = requested;
+        }
+    }
+
+    return best;
+}
+
 static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
         const VkDeviceCreateInfo *info,
         const VkAllocationCallbacks *ac,
@@ -1411,7 +4098,14 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
     struct vk_inst_funcs *ifuncs = &idata->funcs;
     struct vk_data *data = NULL;
 
-    const char *req_extensions[] = {
+    const bool sync_fd_supported =
+        vk_device_extension_supported(ifuncs, phy_device,
+                VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME);
+    const bool host_ptr_supported =
+        vk_device_extension_supported(ifuncs, phy_device,
+                VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+
+    const char *req_extensions[13] = {
         VK_KHR_BIND_MEMORY_2_EXTENSION_NAME,
         VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME,
         VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME,
@@ -1423,7 +4117,14 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
         VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME,
         VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME,
     };
-    static uint32_t req_extensions_count = 10;
+    uint32_t req_extensions_count = 10;
+    if (sync_fd_supported) {
+        req_extensions[req_extensions_count++] = VK_KHR_EXTERNAL_SEMAPHORE_EXTENSION_NAME;
+        req_extensions[req_extensions_count++] = VK_KHR_EXTERNAL_SEMAPHORE_FD_EXTENSION_NAME;
+    }
+    if (host_ptr_supported) {
+        req_extensions[req_extensions_count++] = VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME;
+    }
 
     int new_count = info->enabledExtensionCount + req_extensions_count;
     const char **exts = (const char**)malloc(sizeof(char*) * new_count);
@@ -1470,6 +4171,61 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
 
     init_obj_list(&data->queues);
     data->graphics_queue = VK_NULL_HANDLE;
+    data->transfer_queue = VK_NULL_HANDLE;
+
+    uint32_t queue_family_property_count = 0;
+    ifuncs->GetPhysicalDeviceQueueFamilyProperties(
+            phy_device, &queue_family_property_count, NULL);
+    VkQueueFamilyProperties *queue_family_properties = (VkQueueFamilyProperties*)malloc(
+            sizeof(VkQueueFamilyProperties) * queue_family_property_count);
+    ifuncs->GetPhysicalDeviceQueueFamilyProperties(
+            phy_device, &queue_family_property_count,
+            queue_family_properties);
+
+    /* -------------------------------------------------------- */
+    /* reserve an extra queue for the capture copy              */
+
+    const uint32_t app_queue_info_count = info->queueCreateInfoCount;
+    const VkDeviceQueueCreateInfo *app_queue_infos = info->pQueueCreateInfos;
+    VkDeviceQueueCreateInfo *queue_infos = NULL;
+    float *queue_priorities = NULL;
+
+    uint32_t transfer_index = 0;
+    const uint32_t transfer_fam = vkcapture_transfer_queue ?
+        vk_find_transfer_family(queue_family_properties,
+                queue_family_property_count, info, &transfer_index) :
+        VK_QUEUE_FAMILY_IGNORED;
+
+    if (transfer_fam != VK_QUEUE_FAMILY_IGNORED) {
+        queue_infos = (VkDeviceQueueCreateInfo*)malloc(
+                sizeof(VkDeviceQueueCreateInfo) * (app_queue_info_count + 1));
+        queue_priorities = (float*)malloc(sizeof(float) * (transfer_index + 1));
+        memcpy(queue_infos, app_queue_infos,
+                sizeof(VkDeviceQueueCreateInfo) * app_queue_info_count);
+
+        uint32_t queue_info_count = app_queue_info_count;
+        VkDeviceQueueCreateInfo *transfer_info = NULL;
+        for (uint32_t q = 0; q < app_queue_info_count; ++q) {
+            if (queue_infos[q].queueFamilyIndex == transfer_fam) {
+                transfer_info = &queue_infos[q];
+                memcpy(queue_priorities, transfer_info->pQueuePriorities,
+                        sizeof(float) * transfer_index);
+            }
+        }
+        if (!transfer_info) {
+            transfer_info = &queue_infos[queue_info_count++];
+            transfer_info->sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+            transfer_info->pNext = NULL;
+            transfer_info->flags = 0;
+            transfer_info->queueFamilyIndex = transfer_fam;
+        }
+        queue_priorities[transfer_index] = 1.0f;
+        transfer_info->queueCount = transfer_index + 1;
+        transfer_info->pQueuePriorities = queue_priorities;
+
+        i->queueCreateInfoCount = queue_info_count;
+        i->pQueueCreateInfos = queue_infos;
+    }
 
     /* -------------------------------------------------------- */
     /* create device and initialize hook data                   */
@@ -1481,7 +4237,15 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
 #ifndef NDEBUG
     hlog("CreateDevice %s", result_to_str(ret));
 #endif
+
+    i->queueCreateInfoCount = app_queue_info_count;
+    i->pQueueCreateInfos = app_queue_infos;
+    free(queue_infos);
+    free(queue_priorities);
+
     if (ret != VK_SUCCESS) {
+        free(queue_family_properties);
+        free_obj_list(&data->queues);
         vk_free(ac, data);
         return ret;
     }
@@ -1534,11 +4298,42 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
     GETADDR(CreateFence);
     GETADDR(DestroyFence);
     GETADDR(WaitForFences);
+    GETADDR(GetFenceStatus);
     GETADDR(ResetFences);
     GETADDR(GetImageSubresourceLayout);
     GETADDR(GetMemoryFdKHR);
     GETADDR(CreateSemaphore);
     GETADDR(DestroySemaphore);
+    GETADDR(CreateImageView);
+    GETADDR(DestroyImageView);
+    GETADDR(CreateSampler);
+    GETADDR(DestroySampler);
+    GETADDR(CreateDescriptorSetLayout);
+    GETADDR(DestroyDescriptorSetLayout);
+    GETADDR(CreatePipelineLayout);
+    GETADDR(DestroyPipelineLayout);
+    GETADDR(CreateShaderModule);
+    GETADDR(DestroyShaderModule);
+    GETADDR(CreateComputePipelines);
+    GETADDR(DestroyPipeline);
+    GETADDR(CreateDescriptorPool);
+    GETADDR(DestroyDescriptorPool);
+    GETADDR(AllocateDescriptorSets);
+    GETADDR(UpdateDescriptorSets);
+    GETADDR(CmdBindPipeline);
+    GETADDR(CmdBindDescriptorSets);
+    GETADDR(CmdPushConstants);
+    GETADDR(CmdDispatch);
+    GETADDR(CreateQueryPool);
+    GETADDR(DestroyQueryPool);
+    GETADDR(CmdResetQueryPool);
+    GETADDR(CmdWriteTimestamp);
+    GETADDR(GetQueryPoolResults);
+    GETADDR(CreateBuffer);
+    GETADDR(DestroyBuffer);
+    GETADDR(GetBufferMemoryRequirements);
+    GETADDR(BindBufferMemory);
+    GETADDR(CmdCopyImageToBuffer);
 
     dfuncs->GetImageDrmFormatModifierPropertiesEXT = (PFN_vkGetImageDrmFormatModifierPropertiesEXT)
         gdpa(device, "vkGetImageDrmFormatModifierPropertiesEXT");
@@ -1546,6 +4341,21 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
         hlog("DRM format modifier support not available");
     }
 
+    if (sync_fd_supported) {
+        dfuncs->GetSemaphoreFdKHR = (PFN_vkGetSemaphoreFdKHR)
+            gdpa(device, "vkGetSemaphoreFdKHR");
+    }
+    data->sync_fd_supported = sync_fd_supported && dfuncs->GetSemaphoreFdKHR;
+    if (!data->sync_fd_supported) {
+        hlog("Sync file export not available");
+    }
+
+    if (host_ptr_supported) {
+        dfuncs->GetMemoryHostPointerPropertiesEXT = (PFN_vkGetMemoryHostPointerPropertiesEXT)
+            gdpa(device, "vkGetMemoryHostPointerPropertiesEXT");
+    }
+    data->host_ptr_supported = host_ptr_supported && dfuncs->GetMemoryHostPointerPropertiesEXT;
+
 #undef GETADDR
 
     if (!funcs_found) {
@@ -1607,15 +4417,6 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
         data->ac = &data->ac_storage;
     }
 
-    uint32_t queue_family_property_count = 0;
-    ifuncs->GetPhysicalDeviceQueueFamilyProperties(
-            phy_device, &queue_family_property_count, NULL);
-    VkQueueFamilyProperties *queue_family_properties = (VkQueueFamilyProperties*)malloc(
-            sizeof(VkQueueFamilyProperties) * queue_family_property_count);
-    ifuncs->GetPhysicalDeviceQueueFamilyProperties(
-            phy_device, &queue_family_property_count,
-            queue_family_properties);
-
     for (uint32_t info_index = 0, info_count = info->queueCreateInfoCount;
             info_index < info_count; ++info_index) {
         const VkDeviceQueueCreateInfo *queue_info =
@@ -1638,24 +4439,46 @@ static VkResult VKAPI_CALL OBS_CreateDevice(VkPhysicalDevice phy_device,
                  .queueFlags &
                  (VK_QUEUE_GRAPHICS_BIT)) != 0;
             add_queue_data(data, queue, family_index,
-                    supports_transfer, supports_graphics, ac);
+                    supports_transfer, supports_graphics,
+                    queue_family_properties[family_index].timestampValidBits, ac);
         }
     }
 
+    if (transfer_fam != VK_QUEUE_FAMILY_IGNORED) {
+        VkQueue queue;
+        data->funcs.GetDeviceQueue(device, transfer_fam, transfer_index, &queue);
+        /* the loader only sets up queues handed out to the application */
+        GET_LDT(queue) = GET_LDT(device);
+        add_queue_data(data, queue, transfer_fam, true, false,
+                queue_family_properties[transfer_fam].timestampValidBits, ac);
+        data->transfer_queue = queue;
+        hlog("Copying on queue family %u", transfer_fam);
+    }
+
     free(queue_family_properties);
 
     init_obj_list(&data->swaps);
     data->cur_swap = NULL;
+    data->target_swap = NULL;
+    data->select_time = 0;
+    data->swap_serial = 0;
+
+    VkPhysicalDeviceExternalMemoryHostPropertiesEXT propsHost = {};
+    propsHost.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
 
     VkPhysicalDeviceIDProperties propsID = {};
     propsID.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    propsID.pNext = host_ptr_supported ? &propsHost : NULL;
 
     VkPhysicalDeviceProperties2 props = {};
     props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
     props.pNext = &propsID;
     ifuncs->GetPhysicalDeviceProperties2KHR(phy_device, &props);
+    data->timestamp_period = props.properties.limits.timestampPeriod;
+    data->host_ptr_alignment = propsHost.minImportedHostPointerAlignment;
 
     memcpy(data->device_uuid, propsID.deviceUUID, 16);
+    capture_set_device_info(data->device_uuid, props.properties.driverVersion);
 
     data->valid = true;
 
@@ -1671,20 +4494,30 @@ static void VKAPI_CALL OBS_DestroyDevice(VkDevice device,
 
     struct vk_data *data = remove_device_data(device);
 
+    vk_shtex_wait_init(data);
+
     if (data->valid) {
+        vk_shtex_collect_retired(data, true);
+
         struct vk_queue_data *queue_data = queue_walk_begin(data);
 
         while (queue_data) {
             vk_shtex_destroy_frame_objects(data, queue_data);
 
-            queue_data = queue_walk_next(queue_data);
+            queue_data = queue_walk_next(data, queue_data);
         }
 
         queue_walk_end(data);
 
         remove_free_queue_all(data, ac);
+
+        vk_shtex_destroy_yuv_pipelines(data);
+
+        free_obj_list(&data->swaps);
     }
 
+    free_obj_list(&data->queues);
+
     PFN_vkDestroyDevice destroy_device = data->funcs.DestroyDevice;
 
     vk_free(ac, data);
@@ -1701,15 +4534,36 @@ OBS_CreateSwapchainKHR(VkDevice device, const VkSwapchainCreateInfoKHR *cinfo,
     if (!data->valid)
         return funcs->CreateSwapchainKHR(device, cinfo, ac, p_sc);
 
+    /* only what the surface allows, a failed create retires oldSwapchain
+     * so there is no trying again without */
+    struct vk_inst_funcs *ifuncs = &data->inst_data->funcs;
+    VkSurfaceCapabilitiesKHR caps;
+    VkImageUsageFlags supported = 0;
+    if (ifuncs->GetPhysicalDeviceSurfaceCapabilitiesKHR &&
+            ifuncs->GetPhysicalDeviceSurfaceCapabilitiesKHR(data->phy_device,
+                cinfo->surface, &caps) == VK_SUCCESS) {
+        supported = caps.supportedUsageFlags;
+    }
+
     VkSwapchainCreateInfoKHR info = *cinfo;
-    info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    info.imageUsage |= supported & VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    /* sampled by the NV12/P010 conversion, which OBS may ask for only
+     * after the swapchain is created */
+    if (HAVE_YUV_SHADERS) {
+        info.imageUsage |= supported & VK_IMAGE_USAGE_SAMPLED_BIT;
+    }
+    const bool sampled = info.imageUsage & VK_IMAGE_USAGE_SAMPLED_BIT;
+
     VkResult res = funcs->CreateSwapchainKHR(device, &info, ac, p_sc);
 #ifndef NDEBUG
     hlog("CreateSwapchainKHR %s", result_to_str(res));
 #endif
     if (res != VK_SUCCESS) {
-        /* try again with original imageUsage flags */
-        return funcs->CreateSwapchainKHR(device, cinfo, ac, p_sc);
+        return res;
+    }
+    if (!(info.imageUsage & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)) {
+        hlog("Swapchain images cannot be copied from, not capturing them");
+        return res;
     }
 
     VkSwapchainKHR sc = *p_sc;
@@ -1721,7 +4575,6 @@ OBS_CreateSwapchainKHR(VkDevice device, const VkSwapchainCreateInfoKHR *cinfo,
     if ((res == VK_SUCCESS) && (count > 0)) {
         struct vk_swap_data *swap_data = alloc_swap_data(ac);
         if (swap_data) {
-            init_swap_data(swap_data, data, sc);
             swap_data->swap_images = vk_alloc(
                     ac, count * sizeof(VkImage), _Alignof(VkImage),
                     VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
@@ -1731,14 +4584,34 @@ OBS_CreateSwapchainKHR(VkDevice device, const VkSwapchainCreateInfoKHR *cinfo,
             hlog("GetSwapchainImagesKHR %s", result_to_str(res));
 #endif
             swap_data->image_extent = cinfo->imageExtent;
+            swap_data->export_extent = cinfo->imageExtent;
             swap_data->format = cinfo->imageFormat;
             swap_data->winid = find_surf_winid(data->inst_data, cinfo->surface);
-            swap_data->export_image = VK_NULL_HANDLE;
-            swap_data->export_mem = VK_NULL_HANDLE;
             swap_data->image_count = count;
-            swap_data->dmabuf_nfd = 0;
-            memset(swap_data->dmabuf_fds, -1, sizeof(swap_data->dmabuf_fds));
+            swap_data->exclusive_sharing =
+                cinfo->imageSharingMode == VK_SHARING_MODE_EXCLUSIVE;
+            swap_data->low_latency = vkcapture_low_latency &&
+                (cinfo->presentMode == VK_PRESENT_MODE_MAILBOX_KHR ||
+                 cinfo->presentMode == VK_PRESENT_MODE_IMMEDIATE_KHR);
+            swap_data->yuv_format = 0;
+            swap_data->sampled = sampled;
+            swap_data->src_views = NULL;
+            memset(swap_data->slots, 0, sizeof(swap_data->slots));
+            for (int i = 0; i < CAPTURE_MAX_SLOTS; ++i) {
+                memset(swap_data->slots[i].dmabuf_fds, -1,
+                        sizeof(swap_data->slots[i].dmabuf_fds));
+            }
+            swap_data->slot_count = 0;
+            swap_data->slot_index = 0;
+            swap_data->latest_slot = -1;
+            swap_data->latest_seq = 0;
+            swap_data->frame_seq = 0;
             swap_data->captured = false;
+            swap_data->serial = ++data->swap_serial;
+            swap_data->last_present = 0;
+            /* other presents walk the list, add it once it is set up */
+            init_swap_data(swap_data, data, sc);
+            data->select_time = 0;
         }
     }
 
@@ -1761,10 +4634,28 @@ static void VKAPI_CALL OBS_DestroySwapchainKHR(VkDevice device,
     if ((sc != VK_NULL_HANDLE) && data->valid) {
         struct vk_swap_data *swap = get_swap_data(data, sc);
         if (swap) {
-            if (data->cur_swap == swap) {
+            if (data->init_running && data->init_swap == swap) {
+                /* the init thread is still writing to it */
+                vk_shtex_wait_init(data);
+                vk_shtex_free(data);
+            } else if (data->cur_swap == swap) {
                 vk_shtex_free(data);
+            } else {
+                /* kept around in case capture switched back to it */
+                for (int i = 0; i < CAPTURE_MAX_SLOTS; ++i) {
+                    vk_shtex_retire_slot(data, &swap->slots[i]);
+                }
+                swap->slot_count = 0;
+            }
+            if (data->target_swap == swap) {
+                data->target_swap = NULL;
+                data->select_time = 0;
             }
 
+            /* retired copies may still read from this swapchain's images */
+            vk_shtex_collect_retired(data, true);
+
+            vk_shtex_destroy_src_views(data, swap);
             vk_free(ac, swap->swap_images);
 
             remove_free_swap_data(data, sc, ac);
@@ -1933,8 +4824,40 @@ VKAPI_ATTR VkResult VKAPI_CALL OBS_Negotiate(VkNegotiateLayerInterface *nli)
         vulkan_seen = true;
         vkcapture_linear = getenv("OBS_VKCAPTURE_LINEAR");
 
+        const char *transfer_queue = getenv("OBS_VKCAPTURE_TRANSFER_QUEUE");
+        if (transfer_queue) {
+            vkcapture_transfer_queue = atoi(transfer_queue) != 0;
+        }
+
+        vkcapture_low_latency = getenv("OBS_VKCAPTURE_LOW_LATENCY");
+
+        const char *cross_device = getenv("OBS_VKCAPTURE_CROSS_DEVICE");
+        if (cross_device) {
+            vkcapture_cross_device = atoi(cross_device) != 0;
+        }
+
+        const char *swapchain = getenv("OBS_VKCAPTURE_SWAPCHAIN");
+        if (swapchain) {
+            if (!strcmp(swapchain, "recent")) {
+                vkcapture_swapchain_policy = CAPTURE_SWAPCHAIN_RECENT;
+            } else if (strcmp(swapchain, "largest")) {
+                hlog("Unknown OBS_VKCAPTURE_SWAPCHAIN %s, using largest", swapchain);
+            }
+        }
+
+        const char *slots = getenv("OBS_VKCAPTURE_BUFFERS");
+        if (slots) {
+            vkcapture_slots = atoi(slots);
+            if (vkcapture_slots < 1) {
+                vkcapture_slots = 1;
+            } else if (vkcapture_slots > CAPTURE_MAX_SLOTS) {
+                vkcapture_slots = CAPTURE_MAX_SLOTS;
+            }
+        }
+
         for (int i = 0; i < MAX_PRESENT_SWAP_SEMAPHORE_COUNT; i++) {
             semaphore_dst_stage_masks[i] = VK_PIPELINE_STAGE_TRANSFER_BIT;
+            semaphore_compute_stage_masks[i] = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
         }
     }
 
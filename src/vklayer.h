@@ -105,6 +105,7 @@ struct vk_inst_funcs {
     DEF_FUNC(CreateWaylandSurfaceKHR);
 #endif
     DEF_FUNC(DestroySurfaceKHR);
+    DEF_FUNC(GetPhysicalDeviceSurfaceCapabilitiesKHR);
 };
 
 struct vk_device_funcs {
@@ -134,12 +135,45 @@ struct vk_device_funcs {
     DEF_FUNC(CreateFence);
     DEF_FUNC(DestroyFence);
     DEF_FUNC(WaitForFences);
+    DEF_FUNC(GetFenceStatus);
     DEF_FUNC(ResetFences);
     DEF_FUNC(GetImageSubresourceLayout);
     DEF_FUNC(GetMemoryFdKHR);
     DEF_FUNC(GetImageDrmFormatModifierPropertiesEXT);
     DEF_FUNC(CreateSemaphore);
     DEF_FUNC(DestroySemaphore);
+    DEF_FUNC(GetSemaphoreFdKHR);
+    DEF_FUNC(CreateImageView);
+    DEF_FUNC(DestroyImageView);
+    DEF_FUNC(CreateSampler);
+    DEF_FUNC(DestroySampler);
+    DEF_FUNC(CreateDescriptorSetLayout);
+    DEF_FUNC(DestroyDescriptorSetLayout);
+    DEF_FUNC(CreatePipelineLayout);
+    DEF_FUNC(DestroyPipelineLayout);
+    DEF_FUNC(CreateShaderModule);
+    DEF_FUNC(DestroyShaderModule);
+    DEF_FUNC(CreateComputePipelines);
+    DEF_FUNC(DestroyPipeline);
+    DEF_FUNC(CreateDescriptorPool);
+    DEF_FUNC(DestroyDescriptorPool);
+    DEF_FUNC(AllocateDescriptorSets);
+    DEF_FUNC(UpdateDescriptorSets);
+    DEF_FUNC(CmdBindPipeline);
+    DEF_FUNC(CmdBindDescriptorSets);
+    DEF_FUNC(CmdPushConstants);
+    DEF_FUNC(CmdDispatch);
+    DEF_FUNC(CreateQueryPool);
+    DEF_FUNC(DestroyQueryPool);
+    DEF_FUNC(CmdResetQueryPool);
+    DEF_FUNC(CmdWriteTimestamp);
+    DEF_FUNC(GetQueryPoolResults);
+    DEF_FUNC(CreateBuffer);
+    DEF_FUNC(DestroyBuffer);
+    DEF_FUNC(GetBufferMemoryRequirements);
+    DEF_FUNC(BindBufferMemory);
+    DEF_FUNC(CmdCopyImageToBuffer);
+    DEF_FUNC(GetMemoryHostPointerPropertiesEXT);
 };
 
 #undef DEF_FUNC
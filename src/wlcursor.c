@@ -18,6 +18,7 @@ with this program. If not, see <https://www.gnu.org/licenses/>
 
 #include "wlcursor.h"
 #include "capture.h"
+#include "texture-utils.h"
 
 #include <sys/mman.h>
 #include <fcntl.h>
@@ -39,6 +40,7 @@ struct output_data {
     int32_t hotspot_x;
     int32_t hotspot_y;
     bool damaged;
+    struct capture_rect damage;
     bool have_cursor;
     gs_texture_t *tex;
 };
@@ -64,6 +66,7 @@ static void output_data_reset(struct output_data *data)
         data->tex = NULL;
     }
     data->damaged = false;
+    memset(&data->damage, 0, sizeof(data->damage));
     data->have_cursor = false;
 }
 
@@ -171,10 +174,19 @@ static void session_handle_init_done(void *data_,
             EXT_SCREENCOPY_SESSION_V1_OPTIONS_ON_DAMAGE);
 }
 
-static void session_handle_damage(void *data,
+static void session_handle_damage(void *data_,
         struct ext_screencopy_session_v1 *session,
         uint32_t x, uint32_t y, uint32_t width, uint32_t height)
 {
+    struct output_data *data = data_;
+
+    const struct capture_rect rect = {
+        .x = x,
+        .y = y,
+        .width = width,
+        .height = height,
+    };
+    capture_rect_union(&data->damage, &rect);
 }
 
 static void session_handle_cursor_info(void *data_,
@@ -226,9 +238,11 @@ static void session_handle_ready(void *data_,
     struct output_data *data = data_;
 
     if (data->damaged) {
-        gs_texture_set_image(data->tex, data->buffer_data,
-                data->buffer_stride, false);
+        /* without damage events the whole buffer is uploaded */
+        texture_set_image_rect(data->tex, data->buffer_data,
+                data->buffer_stride, &data->damage);
     }
+    memset(&data->damage, 0, sizeof(data->damage));
 
     ext_screencopy_session_v1_attach_cursor_buffer(session,
             data->buffer, NULL,
@@ -82,10 +82,9 @@ void xcb_xcursor_update(xcb_xcursor_t *data,
     if (!data->tex || data->last_serial != xc->cursor_serial)
         xcb_xcursor_create(data, xc);
 
-    data->x = xc->x - data->x_org;
-    data->y = xc->y - data->y_org;
-    data->x_render = data->x - xc->xhot;
-    data->y_render = data->y - xc->yhot;
+    data->x_hot = xc->xhot;
+    data->y_hot = xc->yhot;
+    xcb_xcursor_move(data, xc->x, xc->y);
 }
 
 void xcb_xcursor_render(xcb_xcursor_t *data)
@@ -125,3 +124,11 @@ void xcb_xcursor_offset(xcb_xcursor_t *data, const int x_org, const int y_org)
     data->x_org = x_org;
     data->y_org = y_org;
 }
+
+void xcb_xcursor_move(xcb_xcursor_t *data, const int x, const int y)
+{
+    data->x = x - data->x_org;
+    data->y = y - data->y_org;
+    data->x_render = data->x - data->x_hot;
+    data->y_render = data->y - data->y_hot;
+}
@@ -34,6 +34,8 @@ typedef struct {
     int y;
     int x_org;
     int y_org;
+    int x_hot;
+    int y_hot;
     float x_render;
     float y_render;
 } xcb_xcursor_t;
@@ -74,6 +76,12 @@ void xcb_xcursor_render(xcb_xcursor_t *data);
  */
 void xcb_xcursor_offset(xcb_xcursor_t *data, const int x_org, const int y_org);
 
+/**
+ * Move the cursor to a position on the root window, for when the position
+ * is known without a new cursor image
+ */
+void xcb_xcursor_move(xcb_xcursor_t *data, const int x, const int y);
+
 #ifdef __cplusplus
 }
 #endif